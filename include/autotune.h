@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "power.h"
+
+// meter response to a power step: gain after dead time
+typedef struct {
+  float gain;
+  float dead_time;
+  float damping;
+  int samples;
+} autotune_model_t;
+
+bool autotune_init();
+
+void autotune_step(power_state_t direction, float power);
+void autotune_meter_update(float total_power);
+
+// tuned damping if enough steps were fitted, configured damping otherwise
+float autotune_get_damping(power_state_t direction);
+const autotune_model_t* autotune_get_model(power_state_t direction);
+float autotune_get_meter_interval();
+void autotune_reset();
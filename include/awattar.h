@@ -15,6 +15,8 @@ bool awattar_init();
 
 void awattar_set_update_callback(awattar_update_callback cb, void *cb_arg);
 
+// changes whenever new prices arrive
+int awattar_get_updates();
 int awattar_get_entries_count();
 awattar_pricing_t* awattar_get_entries();
 awattar_pricing_t* awattar_get_entry(time_t time);
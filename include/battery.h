@@ -29,6 +29,11 @@ battery_state_t battery_get_state();
 void battery_set_state(battery_state_t state);
 
 int battery_get_soc();
+// energy in Wh from empty to full at the nominal voltage
+float battery_get_capacity_wh();
 int battery_reset_soc();
+// cached reading of the instrument, polled every battery.sample_interval
 float battery_read_voltage();
 float battery_read_current();
+// uptime of the cached reading, 0 if none
+double battery_get_sample_time();
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * Module initialisation in dependency order. Modules the control loop
+ * needs run at once, hardware probes it can do without are deferred to
+ * their own event loop slices after it went live.
+ */
+
+typedef enum {
+  boot_now = 0,
+  boot_deferred = 1,
+} boot_mode_t;
+
+typedef bool (*boot_init_t)();
+
+// deps are space separated module names, a deferred dependency of a module run now is run now too
+bool boot_add(const char *name, boot_init_t init, boot_mode_t mode, const char *deps);
+
+// runs the modules due now, schedules the deferred ones
+void boot_run();
+
+// true once all modules due now ran
+bool boot_is_live();
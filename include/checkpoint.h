@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "battery.h"
+#include "energy.h"
+#include "power.h"
+
+/*
+ * Control and battery state kept in RTC memory and flash so a reboot
+ * resumes where it stopped instead of settling from scratch.
+ */
+
+typedef struct {
+  battery_state_t battery_state;
+  int soc;
+  int steps_in;          // position of the stepping in drivers
+  float feedback_gain;
+  float capacity_in;     // Ah since the last power.reset_capacity
+  float capacity_out;
+  energy_totals_t energy[3];
+} checkpoint_state_t;
+
+// loads the newest valid checkpoint, before the modules restoring from it
+bool checkpoint_init();
+
+// state restored at boot, NULL if there was none
+const checkpoint_state_t *checkpoint_get();
+// restored from RTC memory, the hardware was not powered down since
+bool checkpoint_is_warm();
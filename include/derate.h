@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "power.h"
+
+bool derate_init();
+
+// share of the configured max power allowed at the current temperature, 0..1
+float derate_get_factor(power_state_t direction);
+// configured max power scaled by the derating factor, not below min
+int derate_get_max(power_state_t direction, int min, int max);
+// hottest valid temperature feeding the curve, -1 if none
+float derate_get_temperature(power_state_t direction);
@@ -4,4 +4,8 @@
 
 bool ds18xxx_init();
 
-float ds18xxx_get_temperature();
\ No newline at end of file
+// highest temperature of all sensors, 0 if none could be read
+float ds18xxx_get_temperature();
+int ds18xxx_get_count();
+// ROM id as hex string and temperature of sensor i, false if not read
+bool ds18xxx_get_sensor(int i, const char **id, float *temperature);
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "frozen.h"
+
+/*
+ * Energy ledger integrated from measured battery V x I. Energy is priced
+ * with the aWATTar slot it flowed in and kept per day, month and lifetime.
+ */
+
+typedef enum {
+  energy_day = 0,
+  energy_month = 1,
+  energy_lifetime = 2,
+} energy_period_t;
+
+typedef struct {
+  int key;              // year * 1000 + day of year, year * 100 + month, 0
+  double charged;       // Wh DC into the battery
+  double discharged;    // Wh DC out of the battery
+  double loss;          // Wh lost in the inverter
+  double self_consumed; // Wh AC out used in the house
+  double exported;      // Wh AC out fed to the grid
+  double cost;          // EUR paid for charged energy
+  double value;         // EUR of grid energy replaced by self consumption
+} energy_totals_t;
+
+bool energy_init();
+
+const energy_totals_t *energy_get_totals(energy_period_t period);
+// AC out per DC charged, 0 before anything was charged, -1 if charging ran unmeasured
+float energy_get_efficiency(energy_period_t period);
+
+// prints all periods as json with the %M conversion
+int energy_print_json(struct json_out *out, va_list *ap);
@@ -4,5 +4,7 @@
 
 
 bool fan_init();
+// sets all fans to a fixed speed in %, a negative speed resumes temperature control
 void fan_set_speeds(int s);
-void fan_set_speed(int fan, int s);
\ No newline at end of file
+void fan_set_speed(int fan, int s);
+int fan_get_rpm(int fan);
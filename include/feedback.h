@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+
+bool feedback_init();
+
+// true if a measurement is fresh enough to track the delivered power out
+bool feedback_available();
+
+// records power as the new target, returns the command corrected by the learned gain
+float feedback_command(float power);
+
+void feedback_meter_update(float total_power);
+
+float feedback_get_power_out();
+float feedback_get_gain();
+// requested minus delivered power out
+float feedback_get_tracking_error();
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Cloud APIs reached through the LAN gateway in tools/gateway when
+ * gateway.enable is set, plain HTTP to the gateway instead of TLS.
+ */
+
+// writes the url to fetch upstream with, the gateway's if it serves it, returns its length like snprintf
+int gateway_url(char *url, size_t size, const char *upstream);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mgos_mongoose.h"
+
+bool heap_init();
+
+size_t heap_get_free();
+// largest block a single allocation can get, the free heap where unknown
+size_t heap_get_largest_block();
+
+// books heap taken by a module, e.g. the drop of free heap during its init
+void heap_account(const char *module, long bytes);
+
+// allocates the receive buffer of a connection once and caps it at limit bytes
+void heap_bound_reply(struct mg_connection *nc, size_t size, size_t limit);
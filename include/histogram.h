@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "mgos_prometheus_metrics.h"
+
+#define HISTOGRAM_BUCKETS 16
+
+/*
+ * Fixed bucket histogram, printed as cumulative bucket counters with sum
+ * and count plus quantiles interpolated within the buckets.
+ */
+typedef struct {
+  const double *bounds;   // upper bounds, ascending
+  int num_bounds;
+  int counts[HISTOGRAM_BUCKETS + 1];
+  int count;
+  double sum;
+  double max;
+} histogram_t;
+
+void histogram_init(histogram_t *h, const double *bounds, int num_bounds);
+void histogram_observe(histogram_t *h, double value);
+double histogram_quantile(const histogram_t *h, double q);
+
+// <name>_bucket, <name>_sum, <name>_count and <name>{quantile=} for 0.5, 0.9 and 0.99, labels without braces
+void histogram_print(struct mg_connection *nc, const char *name, const char *descr,
+                     const char *labels, const histogram_t *h);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * Scheduler for the shared global I2C bus. Transactions are queued by
+ * priority and run in short slices of the event loop, the control path
+ * runs synchronously ahead of everything queued.
+ */
+
+typedef enum {
+  i2cbus_priority_control = 0,
+  i2cbus_priority_protection = 1,
+  i2cbus_priority_telemetry = 2,
+  i2cbus_priority_metrics = 3,
+} i2cbus_priority_t;
+
+// a transaction, false on bus errors to be retried
+typedef bool (*i2cbus_fn_t)(void *arg);
+typedef void (*i2cbus_done_t)(bool ok, void *arg);
+
+bool i2cbus_init();
+
+// registers a device for error accounting, returns its id or -1
+int i2cbus_add_device(const char *name, int addr);
+
+// runs fn at once with retries, for the control path
+bool i2cbus_run(int device, i2cbus_fn_t fn, void *arg);
+// queues fn, done is called when it ran, false if the queue is full
+bool i2cbus_submit(int device, i2cbus_priority_t priority, i2cbus_fn_t fn, i2cbus_done_t done, void *arg);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * Timestamps along the control pipeline from the meter sample to the
+ * confirmed actuator change. Marking a stage clears the later ones, the
+ * time since the previous stage of the same cycle goes into a histogram.
+ */
+
+typedef enum {
+  latency_sample = 0,     // meter measured
+  latency_request = 1,    // meter request sent
+  latency_reply = 2,      // meter reply parsed
+  latency_optimize = 3,   // power_optimize entered
+  latency_command = 4,    // driver commanded
+  latency_confirm = 5,    // driver confirmed
+} latency_stage_t;
+
+bool latency_init();
+
+// marks a stage now
+void latency_mark(latency_stage_t stage);
+// marks a stage at a wall clock time in s
+void latency_mark_at(latency_stage_t stage, double time);
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "frozen.h"
+
+/*
+ * Household load learned per hour of the week from the meter. The load
+ * is what the house draws net of solar: total power plus power out minus
+ * power in. Each hour's average updates its bin's exponentially weighted
+ * mean and variance, the bins are kept in loadmodel.json.
+ */
+
+#define LOADMODEL_BINS (7 * 24)
+
+bool loadmodel_init();
+
+void loadmodel_meter_update(float total_power);
+
+// mean load in W of the hour of week of t, false until any bin is learned
+bool loadmodel_get_power(time_t t, float *power, float *sigma);
+// load in Wh between start and end, false until any bin is learned
+bool loadmodel_expect(time_t start, time_t end, float *energy, float *sigma);
+// expected load plus loadmodel.reserve_sigmas deviations in Wh, -1 until learned
+float loadmodel_get_reserve(time_t start, time_t end);
+
+int loadmodel_print_json(struct json_out *out, va_list *ap);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "frozen.h"
+
+/*
+ * Inverter loss by AC output power: DC in = AC out * (1 + loss). Learned
+ * from the soyosource DC reading and the meter response to power steps.
+ */
+
+#define LOSSTABLE_POINTS 11
+#define LOSSTABLE_STEP 100.0f  // W between points
+
+bool losstable_init();
+
+// loss interpolated at an AC power
+float losstable_get(float ac);
+float losstable_ac_to_dc(float ac);
+float losstable_dc_to_ac(float dc);
+
+// a new AC power was commanded to the inverter
+void losstable_command(float ac);
+void losstable_meter_update(float total_power);
+// true if the inverter commands pass the table and it learns from the meter
+bool losstable_learning();
+
+void losstable_reset();
+// prints the table as json with the %M conversion
+int losstable_print_json(struct json_out *out, va_list *ap);
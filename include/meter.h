@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * Sources of the total power at the grid connection. A source registers
+ * with its priority, lower preferred, the interval it is expected to report
+ * at and the maximum age of a reading. Readings of the active source are
+ * passed on, the others are tracked to fail over to. A source fails when a
+ * reading is outdated or it misses meter.periods expected readings, the
+ * next healthy one takes over. Without any the control loop is turned off.
+ */
+
+#define METER_SOURCES 4
+
+typedef enum {
+  meter_accepted = 0,
+  meter_stale = 1,
+  meter_out_of_order = 2,
+  meter_results = 3
+} meter_result_t;
+
+typedef void (*meter_update_callback)(double time, float power, void *cb_arg);
+
+bool meter_init();
+
+// interval and max_age in s, max_age 0 to accept any, returns the source id or -1
+int meter_add_source(const char *name, int priority, float interval, float max_age);
+// a reading sampled at the wall clock time, power in W positive import
+meter_result_t meter_update(int source, double time, float power);
+
+void meter_set_update_callback(meter_update_callback cb, void *cb_arg);
+
+// the source readings are taken from, -1 if none is healthy
+int meter_get_active();
+const char *meter_get_name(int source);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "frozen.h"
+
+/*
+ * Overnight grid charging. When the solar forecast for the next day will
+ * not bring the battery to battery.soc_max, the shortfall is bought in
+ * the cheapest aWATTar slots before sunrise. During a slot the power in
+ * target is set to the planned power and the optimizer draws it from the
+ * grid. Plans again when the forecast or the prices change.
+ */
+
+typedef struct {
+  time_t start;
+  time_t end;     // before the slot's end if the shortfall is covered early
+  int power;      // W in
+  float price;    // EUR/kWh
+} planner_slot_t;
+
+bool planner_init();
+
+// plans again on the next check
+void planner_invalidate(const char *reason);
+
+int planner_get_slots_count();
+const planner_slot_t *planner_get_slots();
+
+int planner_print_json(struct json_out *out, va_list *ap);
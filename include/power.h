@@ -19,8 +19,6 @@ typedef enum  {
     power_change_at_max = 99 
 } power_change_state_t;
 
-typedef power_change_state_t (*power_change_impl)(float *power);
-
 typedef enum {
     power_change_dummy = 0,
     power_change_pwm = 1,
@@ -45,11 +43,21 @@ power_change_state_t power_in_change(float *power);
 power_change_state_t power_out_change(float* power);
 
 void power_set_total_power(float power);
+float power_get_total_power();
+
+// actual power as reported by the in and out drivers
+float power_get_power_in();
+float power_get_power_out();
 
 float power_optimize(float power);
+// reduces the actual power in direction to the derated max if above, whatever the meter reads
+void power_apply_derating(power_state_t direction);
 float power_optimize2(float power);
 
 void power_reset_capacity();
+// Ah charged and discharged since the last reset
+float power_get_capacity_in();
+float power_get_capacity_out();
 
 void power_set_optimize_enabled(bool enabled);
 bool power_get_optimize_enabled();
@@ -65,6 +73,10 @@ bool power_get_out_enabled();
 void power_set_in_target(int target);
 int power_get_in_target();
 
+// holds power in at power in W while optimizing whatever the meter reads, -1 to release
+void power_set_in_hold(int power);
+int power_get_in_hold();
+
 // 0 if none
 double power_get_last_power_change();
 
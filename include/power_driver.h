@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "power.h"
+
+#define POWER_DRIVER_MAX 16
+
+typedef enum {
+    power_driver_cap_in = 1 << 0,         // can drive power in (charger)
+    power_driver_cap_out = 1 << 1,        // can drive power out (inverter)
+    power_driver_cap_readback = 1 << 2,   // get_actual reports a measured value, not the last target
+    power_driver_cap_async = 1 << 3,      // set_target may complete later through the callback
+    power_driver_cap_switch = 1 << 4      // on/off only, target is ignored by the hardware
+} power_driver_cap_t;
+
+// result and actual power after an asynchronous set_target finished
+typedef void (*power_driver_done_cb)(power_change_state_t result, float actual, void *cb_arg);
+
+typedef struct {
+    power_change_driver_t type;
+    const char *name;
+    int caps;
+    // direction is power_in or power_out
+    bool (*init)(power_state_t direction);
+    // power_change_unknown if pending, cb is called on completion then
+    power_change_state_t (*set_target)(power_state_t direction, float target, power_driver_done_cb cb, void *cb_arg);
+    float (*get_actual)(power_state_t direction);
+    void (*get_limits)(power_state_t direction, float *min, float *max);
+} power_driver_t;
+
+bool power_driver_init();
+
+// position of the stepping in drivers
+int power_driver_get_steps_in();
+// true if the in driver keeps a step position
+bool power_driver_is_stepping_in();
+// true if the step position was restored from a checkpoint it is known to be valid for
+bool power_driver_steps_restored();
+
+bool power_driver_register(const power_driver_t *driver);
+const power_driver_t* power_driver_get(power_change_driver_t type);
+
+static inline bool power_driver_has_cap(const power_driver_t *driver, power_driver_cap_t cap) {
+    return driver != NULL && (driver->caps & cap) != 0;
+}
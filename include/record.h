@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mgos_crontab.h"
+
+/*
+ * Trace of control inputs, one event per line:
+ *   <uptime s> <time s> <type> <key> <len>:<data>
+ * data is raw, len bytes long and may contain newlines.
+ */
+typedef enum {
+  record_boot = 'B',
+  record_event = 'E',         // key: mgos event, e.g. ip_acquired
+  record_http = 'H',          // key: url, data: reply body
+  record_mqtt = 'Q',          // key: topic, data: message
+  record_rpc = 'R',           // key: method, data: args
+  record_rpc_result = 'r',    // key: method called, data: result or !error
+  record_crontab = 'C',       // key: action, data: payload
+  record_uart = 'U',          // key: uart number, data: bytes received
+  record_sensor = 'S',        // key: sensor, data: value read
+  record_decision = 'D'       // key: state, in or out, data: decision
+} record_type_t;
+
+typedef void (*record_listener_t)(double uptime, double time, record_type_t type,
+                                  const char *key, const char *data, size_t len, void *arg);
+
+bool record_init();
+bool record_enabled();
+
+// buffered, dropped once record.buffer_max is reached until the next flush
+void record_data(record_type_t type, const char *key, const void *data, size_t len);
+void record_printf(record_type_t type, const char *key, const char *fmt, ...);
+// writes the buffer to record.file, every record.flush_interval
+void record_flush();
+
+// called for every event, also if recording to flash is disabled
+void record_set_listener(record_listener_t cb, void *arg);
+
+// registers a crontab handler that records each fired job
+void record_crontab_register_handler(struct mg_str action, mgos_crontab_cb cb, void *userdata);
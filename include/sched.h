@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * Periodic control tasks on a fixed millisecond grid. Due times advance
+ * by the period from the start, not from the last run, so jitter does not
+ * accumulate. Phase offsets spread tasks with the same period.
+ */
+
+typedef enum {
+  sched_priority_control = 0,
+  sched_priority_telemetry = 1,
+  sched_priority_background = 2,
+} sched_priority_t;
+
+typedef void (*sched_fn_t)(void *arg);
+
+bool sched_init();
+
+// runs fn every period_ms starting phase_ms after the first period, returns the task id or -1
+int sched_add(const char *name, int period_ms, int phase_ms, sched_priority_t priority,
+              int budget_ms, sched_fn_t fn, void *arg);
@@ -2,6 +2,18 @@
 
 #include <stdbool.h>
 
+/*
+ * Diverts the export surplus to loads behind Shelly relays. Loads are
+ * configured in shelly, shelly1 .. shelly3 with their nominal power and
+ * priority, lower first. Relays are switched with the Gen2 HTTP RPC,
+ * their state is taken from the replies and a periodic status poll.
+ */
+
+#define SHELLY_LOADS 4
+
 void shelly_init();
 
-bool shelly_set_state(const char* destination, int id, bool state);
+// requests the relay state, tracked once the reply arrives
+bool shelly_set_state(int load, bool state);
+// true if the last reply reported the relay on
+bool shelly_get_state(int load);
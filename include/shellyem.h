@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * Grid meter read from a Shelly Gen2 EM or 3EM on the LAN. The status is
+ * polled over HTTP on a kept connection, a reading is stamped halfway
+ * through its request and passed to the meter layer. Power in W, positive
+ * import.
+ */
+
+typedef enum {
+  shellyem_phase_a = 0,
+  shellyem_phase_b = 1,
+  shellyem_phase_c = 2,
+  shellyem_phase_total = 3,
+} shellyem_phase_t;
+
+bool shellyem_init();
+
+// W of the last reading
+float shellyem_get_power(shellyem_phase_t phase);
+// 0 if none
+double shellyem_get_last_update();
@@ -15,3 +15,7 @@ void soyosource_request_status();
 
 float soyosource_get_last_voltage();
 float soyosource_get_last_current();
+// inverter temperature in C, -1 if none received
+float soyosource_get_last_temperature();
+// uptime of last status received, 0 if none
+double soyosource_get_last_update();
@@ -1,43 +1,103 @@
 #include "adc.h"
 
+#include "record.h"
+#include "i2cbus.h"
+#include "sched.h"
+
 #include "mgos_adc.h"
 #include "mgos_ads1x1x.h"
 #include "mgos_prometheus_metrics.h"
 
+#define ADC_CHANNELS 4
+
 static struct mgos_ads1x1x *ads1115 = NULL;
+static int device = -1;
+
+// last raw values read, single ended and differential to the next channel
+static int16_t last_single[ADC_CHANNELS];
+static int16_t last_diff[ADC_CHANNELS];
+
+struct adc_read {
+  int channel;
+  bool diff;
+  int16_t raw;
+};
+
+static struct adc_read telemetry[3];
+// the queued job reads into telemetry, it is not refilled before it ran
+static bool telemetry_pending = false;
+
+static bool adc_read_fn(void *arg) {
+  struct adc_read *r = (struct adc_read *) arg;
+  if(r->diff) {
+    return mgos_ads1x1x_read_diff(ads1115, r->channel, r->channel + 1, &r->raw);
+  }
+  return mgos_ads1x1x_read(ads1115, r->channel, &r->raw);
+}
 
-static void adc_cb(void *data) {
-  struct mgos_ads1x1x *d = (struct mgos_ads1x1x *)data;
-  int16_t res[4];
+static void adc_store(const struct adc_read *r) {
+  char key[24];
+  if(r->diff) {
+    snprintf(key, sizeof(key), "ads1115.%d-%d", r->channel, r->channel + 1);
+    last_diff[r->channel % ADC_CHANNELS] = r->raw;
+  } else {
+    snprintf(key, sizeof(key), "ads1115.%d", r->channel);
+    last_single[r->channel % ADC_CHANNELS] = r->raw;
+  }
+  record_printf(record_sensor, key, "%d", r->raw);
+}
+
+static bool adc_telemetry_fn(void *arg) {
+  for(int i = 0; i < 3; i++) {
+    if(!adc_read_fn(&telemetry[i])) {
+      return false;
+    }
+  }
+  (void) arg;
+  return true;
+}
 
-  if (!d) {
-    LOG(LL_ERROR, ("ADC device not available"));
+static void adc_telemetry_done(bool ok, void *arg) {
+  telemetry_pending = false;
+  if(!ok) {
+    LOG(LL_ERROR, ("Could not read device"));
     return;
   }
-  for(int i=0; i<4; i++) {
-    if (!mgos_ads1x1x_read(d, i, &res[i])) {
-      LOG(LL_ERROR, ("Could not read device"));
-      return;
-    }
+  for(int i = 0; i < 3; i++) {
+    adc_store(&telemetry[i]);
+  }
+  LOG(LL_INFO, ("in={%6d} out={%6d} voltage={%6d}", telemetry[0].raw, telemetry[1].raw, telemetry[2].raw));
+  (void) arg;
+}
+
+static void adc_cb(void *data) {
+  if(telemetry_pending) {
+    LOG(LL_WARN, ("Previous ADC read still queued, skipping"));
+    return;
   }
-  LOG(LL_INFO, ("chan={%6d, %6d, %6d, %6d}", res[0], res[1], res[2], res[3]));
+  telemetry[0] = (struct adc_read) { mgos_sys_config_get_adc_in_current_channel(), false, 0 };
+  telemetry[1] = (struct adc_read) { mgos_sys_config_get_adc_out_current_channel(), false, 0 };
+  telemetry[2] = (struct adc_read) { mgos_sys_config_get_adc_voltage_channel(), true, 0 };
+  telemetry_pending = i2cbus_submit(device, i2cbus_priority_telemetry, adc_telemetry_fn, adc_telemetry_done, NULL);
+  (void) data;
 }
 
+// values of the last reads, the bus is not touched while scraping
 static void adc_metrics(struct mg_connection *nc, void *data) {    
     int channel = mgos_sys_config_get_adc_in_current_channel();
-    float result = adc_read_power_in_current();
+    float result = last_single[channel % ADC_CHANNELS] * mgos_sys_config_get_adc_in_current_factor();
     mgos_prometheus_metrics_printf(
         nc, GAUGE, "power_in_current", "Current in (Amperes)",
         "{type=\"ads1115\", unit=\"0\", chan=\"%d\"} %f", channel, result);
 
     channel = mgos_sys_config_get_adc_out_current_channel();
-    result = adc_read_power_out_current();
+    result = last_single[channel % ADC_CHANNELS] * mgos_sys_config_get_adc_out_current_factor();
     mgos_prometheus_metrics_printf(
         nc, GAUGE, "power_out_current", "Current out (Amperes)",
-        "{type=\"ads1115\", unit=\"0\", chan=\"%d\"} %f", result);
+        "{type=\"ads1115\", unit=\"0\", chan=\"%d\"} %f", channel, result);
 
     channel = mgos_sys_config_get_adc_voltage_channel();
-    result = adc_read_battery_voltage();
+    result = last_diff[channel % ADC_CHANNELS] * mgos_sys_config_get_adc_voltage_factor();
     mgos_prometheus_metrics_printf(
         nc, GAUGE, "battery_voltage", "Battery Voltage (Volts)",
         "{type=\"ads1115\", unit=\"0\", chan=\"%d\"} %f", channel, result);
@@ -45,32 +105,28 @@ static void adc_metrics(struct mg_connection *nc, void *data) {
   (void) data;
 }
 
-static int16_t adc_read_channels(int channel) {
-    int16_t raw;
+// reads on the control path, ahead of queued transactions
+static int16_t adc_read(int channel, bool diff) {
+    struct adc_read r = { channel, diff, 0 };
 
     if (!ads1115) {
         LOG(LL_ERROR, ("ADC device not available"));
         return 0;
     }
-    if (!mgos_ads1x1x_read_diff(ads1115, channel, channel+1, &raw)) {
+    if (!i2cbus_run(device, adc_read_fn, &r)) {
         LOG(LL_ERROR, ("Could not read device"));
         return 0;
     }
-    return raw;
+    adc_store(&r);
+    return r.raw;
 }
 
-static int16_t adc_read_channel(int channel) {
-    int16_t raw;
+static int16_t adc_read_channels(int channel) {
+    return adc_read(channel, true);
+}
 
-    if (!ads1115) {
-        LOG(LL_ERROR, ("ADC device not available"));
-        return 0;
-    }
-    if (!mgos_ads1x1x_read(ads1115, channel, &raw)) {
-        LOG(LL_ERROR, ("Could not read device"));
-        return 0;
-    }
-    return raw;
+static int16_t adc_read_channel(int channel) {
+    return adc_read(channel, false);
 }
 
 bool adc_init() {
@@ -79,11 +135,12 @@ bool adc_init() {
     LOG(LL_ERROR, ("Could not create ADS1115"));
     return false;
   }
+  device = i2cbus_add_device("ads1115", 0x48);
   LOG(LL_INFO, ("Setup ADS1115"));
   mgos_ads1x1x_set_fsr(ads1115, MGOS_ADS1X1X_FSR_2048);
   //mgos_ads1x1x_set_dr(ads1115, MGOS_ADS1X1X_SPS_MIN);
 
-  mgos_set_timer(1e4 /* ms */, MGOS_TIMER_REPEAT, adc_cb, ads1115);
+  sched_add("adc", 10000, 1500, sched_priority_telemetry, 20, adc_cb, ads1115);
 
   mgos_prometheus_metrics_add_handler(adc_metrics, ads1115);
 
@@ -1,13 +1,21 @@
 #include "appleweather.h"
 
+#include "gateway.h"
+
+#include "record.h"
+#include "sched.h"
+
 #include "mgos.h"
 #include "mgos_location.h"
 #include "mgos_crontab.h"
 
-#define DAY_ARRAY_SIZE 1
+// today and tomorrow
+#define DAY_ARRAY_SIZE 2
+#define URL_MAX 192
+#define APPLEWEATHER_INTERVAL (3 * 3600 * 1000)
 
 static const char *urlf = "https://weatherkit.apple.com/api/v1/weather/%.4f,%.4f?dataSets=forecastHourly";
-static char *url = NULL;
+static char url[URL_MAX];
 
 static appleweather_update_callback callback = NULL;
 static void *callback_arg;
@@ -59,6 +67,7 @@ static void appleweather_response_handler(struct mg_connection *nc, int ev, void
     case MG_EV_HTTP_REPLY:
       nc->flags |= MG_F_CLOSE_IMMEDIATELY;
       //LOG(LL_INFO,("Response: %.*s", hm->body.len, hm->body.p));
+      record_data(record_http, url, hm->body.p, hm->body.len);
       if (1 != json_scanf(hm->body.p, hm->body.len, "{ daily: {data: %M } }", &scan_array)) {
         LOG(LL_ERROR, ("failed to parse json response\n"));
         break;
@@ -101,20 +110,22 @@ bool appleweather_init() {
     return false;
   }
 
-  int len = strlen(urlf)+14;
-  url = malloc((len+1)*sizeof(char));
-  int n = snprintf(url, len, urlf, location.lat, location.lon);
-  if(n < 0 || n >= len) {
+  char upstream[URL_MAX];
+  int n = snprintf(upstream, sizeof(upstream), urlf, location.lat, location.lon);
+  if(n >= 0 && n < (int) sizeof(upstream)) {
+    n = gateway_url(url, sizeof(url), upstream);
+  }
+  if(n < 0 || n >= (int) sizeof(url)) {
     LOG(LL_ERROR, ("Cannot create Apple weather url"));
     return false;
   }
 
   LOG(LL_INFO, ("url %s", url));
 
-  mgos_crontab_register_handler(mg_mk_str("appleweather"), appleweather_crontab_handler, NULL);
+  record_crontab_register_handler(mg_mk_str("appleweather"), appleweather_crontab_handler, NULL);
 
-  //mgos_set_timer(30000 /* ms */, 0, appleweather_request_handler, NULL);
-  //mgos_event_add_handler(MGOS_NET_EV_IP_ACQUIRED, got_ip_handler, NULL);
+  sched_add("appleweather", APPLEWEATHER_INTERVAL, 1000, sched_priority_background, 10, appleweather_request_handler, NULL);
+  mgos_event_add_handler(MGOS_NET_EV_IP_ACQUIRED, got_ip_handler, NULL);
 
   return true;
 }
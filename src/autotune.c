@@ -0,0 +1,216 @@
+#include "autotune.h"
+
+#include "math.h"
+
+#include "mgos.h"
+#include "mgos_prometheus_metrics.h"
+
+#define AUTOTUNE_FILE "autotune.json"
+#define AUTOTUNE_FMT "{in: {gain: %f, dead_time: %f, damping: %f, samples: %d}, " \
+                     "out: {gain: %f, dead_time: %f, damping: %f, samples: %d}}"
+// give up waiting for a response after s
+#define OBSERVE_MAX 90.0
+#define LEARN_RATE 0.2f
+// normalized response counted as arrived
+#define RESPONSE_THRESHOLD 0.5f
+
+static autotune_model_t models[2];
+
+static struct {
+  power_state_t direction;
+  float power;
+  float meter_before;
+  double time;
+  float dead_time;  // 0 until the response arrived
+  bool active;
+} step;
+
+static float last_total_power = 0;
+static double last_meter_update = 0;
+static float meter_interval = 0;
+static int steps_aborted = 0;
+static bool dirty = false;
+static double last_save = 0;
+
+static inline autotune_model_t* autotune_model(power_state_t direction) {
+  return &models[(direction == power_out) ? 1 : 0];
+}
+
+static void autotune_metrics(struct mg_connection *nc, void *data) {
+  const char *names[2] = { "in", "out" };
+  for(int i = 0; i < 2; i++) {
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "autotune_gain", "Fitted meter response per power step",
+        "{direction=\"%s\"} %f", names[i], models[i].gain);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "autotune_dead_time", "Fitted dead time until the meter responds in s",
+        "{direction=\"%s\"} %f", names[i], models[i].dead_time);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "autotune_damping", "Tuned damping",
+        "{direction=\"%s\"} %f", names[i], models[i].damping);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "autotune_samples", "Fitted power steps",
+        "{direction=\"%s\"} %d", names[i], models[i].samples);
+  }
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "autotune_steps_aborted", "Power steps superposed by another step",
+      "%d", steps_aborted);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "autotune_meter_interval", "Average interval of meter readings in s",
+      "%f", meter_interval);
+
+  (void) data;
+}
+
+static void autotune_clear() {
+  models[0] = (autotune_model_t) { .gain = 1.0, .dead_time = 0, .damping = mgos_sys_config_get_power_in_damping(), .samples = 0 };
+  models[1] = (autotune_model_t) { .gain = 1.0, .dead_time = 0, .damping = mgos_sys_config_get_power_out_damping(), .samples = 0 };
+  step.active = false;
+}
+
+static void autotune_save() {
+  if(json_fprintf(AUTOTUNE_FILE, AUTOTUNE_FMT,
+      models[0].gain, models[0].dead_time, models[0].damping, models[0].samples,
+      models[1].gain, models[1].dead_time, models[1].damping, models[1].samples) < 0) {
+    LOG(LL_ERROR, ("Failed to save %s", AUTOTUNE_FILE));
+    return;
+  }
+  dirty = false;
+  last_save = mgos_uptime();
+}
+
+static void autotune_load() {
+  char *content = json_fread(AUTOTUNE_FILE);
+  if(content == NULL) {
+    LOG(LL_INFO, ("No %s, starting untuned", AUTOTUNE_FILE));
+    return;
+  }
+  if(json_scanf(content, strlen(content), AUTOTUNE_FMT,
+      &models[0].gain, &models[0].dead_time, &models[0].damping, &models[0].samples,
+      &models[1].gain, &models[1].dead_time, &models[1].damping, &models[1].samples) != 8) {
+    LOG(LL_WARN, ("Invalid %s, starting untuned", AUTOTUNE_FILE));
+    autotune_clear();
+  }
+  free(content);
+  LOG(LL_INFO, ("Loaded model in: %.2f/%.1fs, out: %.2f/%.1fs",
+    models[0].gain, models[0].dead_time, models[1].gain, models[1].dead_time));
+}
+
+static void autotune_update_damping(autotune_model_t *m) {
+  float damping = mgos_sys_config_get_autotune_response() / fmaxf(m->gain, 0.1f);
+  // responses arriving later than the pending window get corrected twice
+  float window = (mgos_sys_config_get_power_pending_count() + 1) * meter_interval;
+  if(window > 0 && m->dead_time > window) {
+    damping *= window / m->dead_time;
+  }
+  float min = mgos_sys_config_get_autotune_damping_min();
+  float max = mgos_sys_config_get_autotune_damping_max();
+  m->damping = fminf(max, fmaxf(min, damping));
+}
+
+static void autotune_fit(float gain, float dead_time) {
+  autotune_model_t *m = autotune_model(step.direction);
+  float rate = (m->samples == 0) ? 1.0f : LEARN_RATE;
+  m->gain += rate * (gain - m->gain);
+  m->dead_time += rate * (dead_time - m->dead_time);
+  m->samples++;
+  autotune_update_damping(m);
+  step.active = false;
+  dirty = true;
+
+  LOG(LL_INFO, ("Step %.0fW: gain %.2f dead time %.1fs, model %.2f/%.1fs damping %.2f",
+    step.power, gain, dead_time, m->gain, m->dead_time, m->damping));
+
+  if(mgos_uptime() - last_save > mgos_sys_config_get_autotune_save_interval()) {
+    autotune_save();
+  }
+}
+
+static void autotune_reboot_handler(int ev, void *ev_data, void *userdata) {
+  // fits since the last save
+  if(dirty) {
+    autotune_save();
+  }
+
+  (void) ev;
+  (void) ev_data;
+  (void) userdata;
+}
+
+bool autotune_init() {
+  autotune_clear();
+  autotune_load();
+  mgos_event_add_handler(MGOS_EVENT_REBOOT, autotune_reboot_handler, NULL);
+  mgos_prometheus_metrics_add_handler(autotune_metrics, NULL);
+  return true;
+}
+
+void autotune_step(power_state_t direction, float power) {
+  if(!mgos_sys_config_get_autotune_enable()) {
+    return;
+  }
+  if(power == 0) {
+    // nothing changed, the step observed goes on
+    return;
+  }
+  if(step.active) {
+    steps_aborted++;
+    step.active = false;
+  }
+  if(fabsf(power) < mgos_sys_config_get_autotune_step_min() || last_meter_update == 0) {
+    return;
+  }
+  step.direction = direction;
+  step.power = power;
+  step.meter_before = last_total_power;
+  step.time = mgos_uptime();
+  step.dead_time = 0;
+  step.active = true;
+}
+
+void autotune_meter_update(float total_power) {
+  double now = mgos_uptime();
+  if(last_meter_update > 0) {
+    float interval = now - last_meter_update;
+    meter_interval = (meter_interval == 0) ? interval : meter_interval + 0.1f * (interval - meter_interval);
+  }
+  last_meter_update = now;
+  last_total_power = total_power;
+
+  if(!step.active) {
+    return;
+  }
+  float elapsed = now - step.time;
+  // more power in shows as more total power, more power out as less
+  float sign = (step.direction == power_in) ? 1.0f : -1.0f;
+  float response = (total_power - step.meter_before) * sign / step.power;
+  if(step.dead_time > 0) {
+    // one more reading after the response arrived to let it settle
+    autotune_fit(response, step.dead_time);
+  } else if(response >= RESPONSE_THRESHOLD) {
+    step.dead_time = elapsed;
+  } else if(elapsed > OBSERVE_MAX) {
+    autotune_fit(response, elapsed);
+  }
+}
+
+float autotune_get_damping(power_state_t direction) {
+  const autotune_model_t *m = autotune_model(direction);
+  if(mgos_sys_config_get_autotune_enable() && m->samples >= mgos_sys_config_get_autotune_samples_min()) {
+    return m->damping;
+  }
+  return (direction == power_out) ? mgos_sys_config_get_power_out_damping() : mgos_sys_config_get_power_in_damping();
+}
+
+const autotune_model_t* autotune_get_model(power_state_t direction) {
+  return autotune_model(direction);
+}
+
+float autotune_get_meter_interval() {
+  return meter_interval;
+}
+
+void autotune_reset() {
+  autotune_clear();
+  autotune_save();
+}
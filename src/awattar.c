@@ -1,82 +1,221 @@
 #include "awattar.h"
 
+#include "gateway.h"
+#include "heap.h"
+#include "record.h"
+#include "sched.h"
+
 #include "mgos_crontab.h"
 #include "mgos_prometheus_metrics.h"
 
 #define PRICE_ARRAY_SIZE 24
+// headers and a day of hourly prices
+#define REPLY_SIZE 4096
+#define REPLY_LIMIT 8192
+
+#define URL_MAX 128
+#define AWATTAR_FILE "awattar.json"
+#define AWATTAR_INTERVAL 60000
+// s until a request without reply counts as failed
+#define REQUEST_TIMEOUT 60.0
+// wall clock considered set
+#define TIME_VALID 1000000000
 
-static const char *url = "https://api.awattar.de/v1/marketdata";
+static const char *upstream = "https://api.awattar.de/v1/marketdata";
+static char url[URL_MAX];
 
 static awattar_update_callback callback = NULL;
 static void *callback_arg;
 
 static awattar_pricing_t entries[PRICE_ARRAY_SIZE];
+// a reply is parsed aside, a broken one keeps the prices
+static awattar_pricing_t parsed[PRICE_ARRAY_SIZE];
 static int entries_count = 0;
+static int64_t fetched = 0;   // wall clock of the prices, 0 if unknown
+static int updates = 0;       // prices loaded or received
+
+// at most one request in flight, failures back off on a single timer
+static bool in_flight = false;
+static struct mg_connection *connection = NULL;   // of the request in flight
+static double request_start = 0;
+static mgos_timer_id retry_timer = MGOS_INVALID_TIMER_ID;
 static int retry_counter = 0;
+static int request_count = 0;
+static int failure_count = 0;
+
+static void awattar_refresh(const char *reason);
 
-static void awattar_request_handler(void *data);
-static void awattar_response_handler(struct mg_connection *nc, int ev, void *ev_data, void *ud);
-static void retry_request();
+static double awattar_coverage() {
+  time_t now = time(NULL);
+  if(entries_count == 0 || now < TIME_VALID) {
+    return 0;
+  }
+  return MAX(0, (double) entries[entries_count - 1].end - now);
+}
 
 static void awattar_metrics(struct mg_connection *nc, void *data) {
-    mgos_prometheus_metrics_printf(
-        nc, GAUGE, "awattar_retries", "Number of request retries until successful",
-        "%d", retry_counter
-    );
-    (void) data;
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "awattar_retries", "Number of request retries until successful",
+      "%d", retry_counter);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "awattar_requests", "Requests sent",
+      "%d", request_count);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "awattar_failures", "Requests failed",
+      "%d", failure_count);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "awattar_in_flight", "Request waiting for a reply",
+      "%d", in_flight);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "awattar_prices", "Number of hourly prices known",
+      "%d", entries_count);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "awattar_coverage", "Time ahead covered by prices in s",
+      "%f", awattar_coverage());
+
+  (void) data;
 }
 
-static void retry_request() {
-  mgos_set_timer(60000 * retry_counter /* ms */, 0, awattar_request_handler, NULL);
+static int awattar_print_json(struct json_out *out, va_list *ap) {
+  int64_t valid_until = (entries_count > 0) ? (int64_t) entries[entries_count - 1].end : 0;
+  int len = json_printf(out, "{fetched: %lld, valid_until: %lld, entries: [", fetched, valid_until);
+  for(int i = 0; i < entries_count; i++) {
+    len += json_printf(out, (i > 0) ? ", {start: %lld, end: %lld, price: %f}" : "{start: %lld, end: %lld, price: %f}",
+                       (int64_t) entries[i].start, (int64_t) entries[i].end, entries[i].price);
+  }
+  len += json_printf(out, "]}");
+  (void) ap;
+  return len;
+}
+
+static void awattar_save() {
+  if(json_fprintf(AWATTAR_FILE, "%M", awattar_print_json) < 0) {
+    LOG(LL_ERROR, ("Failed to save %s", AWATTAR_FILE));
+  }
+}
+
+// prices that ended are dropped, later by the check task if the clock is not set yet
+static void awattar_load() {
+  char *content = json_fread(AWATTAR_FILE);
+  if(content == NULL) {
+    LOG(LL_INFO, ("No %s, waiting for prices", AWATTAR_FILE));
+    return;
+  }
+  int len = strlen(content);
+  int64_t valid_until = 0;
+  json_scanf(content, len, "{fetched: %lld, valid_until: %lld}", &fetched, &valid_until);
+  time_t now = time(NULL);
+  if(now > TIME_VALID && valid_until <= now) {
+    LOG(LL_INFO, ("Prices in %s expired", AWATTAR_FILE));
+    free(content);
+    return;
+  }
+  struct json_token t;
+  int n = 0;
+  for(int i = 0; n < PRICE_ARRAY_SIZE && json_scanf_array_elem(content, len, ".entries", i, &t) > 0; i++) {
+    int64_t start = 0, end = 0;
+    float price = 0;
+    if(json_scanf(t.ptr, t.len, "{start: %lld, end: %lld, price: %f}", &start, &end, &price) != 3) {
+      continue;
+    }
+    if(now > TIME_VALID && end <= now) {
+      continue;
+    }
+    entries[n].start = start;
+    entries[n].end = end;
+    entries[n].price = price;
+    n++;
+  }
+  entries_count = n;
+  updates++;
+  free(content);
+  LOG(LL_INFO, ("Loaded %d prices until %lld", entries_count, (long long) valid_until));
+}
+
+static void awattar_retry_cb(void *arg) {
+  retry_timer = MGOS_INVALID_TIMER_ID;
+  awattar_refresh("retry");
+
+  (void) arg;
+}
+
+// doubles from awattar.retry_min up to awattar.retry_max, less up to half at random
+static void awattar_failed(const char *reason) {
+  in_flight = false;
+  failure_count++;
+  double delay = mgos_sys_config_get_awattar_retry_min();
+  for(int i = 0; i < retry_counter && delay < mgos_sys_config_get_awattar_retry_max(); i++) {
+    delay *= 2;
+  }
+  delay = MIN(delay, mgos_sys_config_get_awattar_retry_max());
+  delay *= 0.5 + 0.5 * ((double) rand() / RAND_MAX);
   retry_counter++;
+  LOG(LL_WARN, ("Price request failed: %s, retry %d in %.0fs", reason, retry_counter, delay));
+  if(retry_timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(retry_timer);
+  }
+  retry_timer = mgos_set_timer((int) (delay * 1000), 0, awattar_retry_cb, NULL);
 }
 
 static void scan_array(const char *str, int len, void *user_data) {
     struct json_token t;
+    int *count = (int *) user_data;
     int i;
     float price;
     int64_t start, end;
-//    char time[32];
 
     for (i = 0; i<PRICE_ARRAY_SIZE && json_scanf_array_elem(str, len, "", i, &t) > 0; i++) {
       json_scanf(t.ptr, t.len, "{start_timestamp: %lld, end_timestamp: %lld, marketprice: %f", &start, &end, &price);
-      entries[i].start = start / 1e3;
-      entries[i].end = end / 1e3;
-      entries[i].price = price / 1e3;
-      entries_count = i;
-      // mgos_strftime(time, 32, "%x %X", entries[i].start);
-      // LOG(LL_INFO,("%s[%.0fmin]: %.4f", time, (entries[i].end - entries[i].start)/60.0, entries[i].price));
+      parsed[i].start = start / 1e3;
+      parsed[i].end = end / 1e3;
+      parsed[i].price = price / 1e3;
     }
-
-    (void) user_data;
+    *count = i;
 }
 
 static void awattar_response_handler(struct mg_connection *nc, int ev, void *ev_data, void *ud) {
   struct http_message *hm = (struct http_message *) ev_data;
+  if(nc != connection) {
+    // a request given up on, closing
+    return;
+  }
   switch (ev) {
     case MG_EV_CONNECT:
       if (*(int *) ev_data != 0) {
         LOG(LL_ERROR, ("connect() failed[%d]: %s\n", (*(int *) ev_data), url));
-        retry_request();
+        break;
       }
+      heap_bound_reply(nc, REPLY_SIZE, REPLY_LIMIT);
       break;
-    case MG_EV_HTTP_REPLY:
-      //nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+    case MG_EV_HTTP_REPLY: {
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
       // LOG(LL_INFO,("Response: %.*s", hm->body.len, hm->body.p));
-      if (1 != json_scanf(hm->body.p, hm->body.len, "{ data: %M }", &scan_array)) {
+      record_data(record_http, url, hm->body.p, hm->body.len);
+      int count = 0;
+      if (1 != json_scanf(hm->body.p, hm->body.len, "{ data: %M }", &scan_array, &count) || count == 0) {
         LOG(LL_ERROR, ("failed to parse json response\n"));
-        retry_request();
+        awattar_failed("invalid reply");
         break;
-      } 
+      }
       LOG(LL_INFO, ("Successfully parsed market data\n"));
+      memcpy(entries, parsed, count * sizeof(parsed[0]));
+      entries_count = count;
+      updates++;
+      fetched = (time(NULL) > TIME_VALID) ? time(NULL) : 0;
+      in_flight = false;
       retry_counter = 0;
+      awattar_save();
       if(callback != NULL) {
         callback(entries, entries_count, callback_arg);
       }
-      mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
       break;
+    }
     case MG_EV_CLOSE:
       LOG(LL_DEBUG, ("Server closed connection"));
+      connection = NULL;
+      if(in_flight) {
+        awattar_failed("closed");
+      }
       break;
     default:
       break;
@@ -85,42 +224,96 @@ static void awattar_response_handler(struct mg_connection *nc, int ev, void *ev_
   (void) ud;
 }
 
+static void awattar_refresh(const char *reason) {
+  if(in_flight || retry_timer != MGOS_INVALID_TIMER_ID) {
+    LOG(LL_DEBUG, ("Price request on %s skipped, %s", reason, in_flight ? "in flight" : "backing off"));
+    return;
+  }
+  LOG(LL_INFO, ("Server send request on %s\n", reason));
+  in_flight = true;
+  request_start = mgos_uptime();
+  request_count++;
+  connection = mg_connect_http(mgos_get_mgr(), awattar_response_handler, NULL, url, NULL, NULL);
+  if(connection == NULL) {
+    awattar_failed("connect");
+  }
+}
+
+// prices are in order, the ones that ended go once the clock is set
+static void awattar_prune() {
+  time_t now = time(NULL);
+  int n = 0;
+  while(now > TIME_VALID && n < entries_count && entries[n].end <= now) {
+    n++;
+  }
+  if(n > 0) {
+    memmove(entries, entries + n, (entries_count - n) * sizeof(entries[0]));
+    entries_count -= n;
+    LOG(LL_DEBUG, ("Dropped %d expired prices", n));
+  }
+}
+
+// times out a lost request, drops expired prices and refreshes when they run short
+static void awattar_check_cb(void *arg) {
+  if(in_flight && mgos_uptime() - request_start > REQUEST_TIMEOUT) {
+    awattar_failed("timeout");
+    if(connection != NULL) {
+      // its late close must not fail the next request
+      connection->flags |= MG_F_CLOSE_IMMEDIATELY;
+      connection = NULL;
+    }
+    return;
+  }
+  awattar_prune();
+  if(time(NULL) > TIME_VALID && awattar_coverage() < mgos_sys_config_get_awattar_coverage_min()) {
+    awattar_refresh("coverage");
+  }
+
+  (void) arg;
+}
+
 static void got_ip_handler(int ev, void *evd, void *data) {
   if (ev != MGOS_NET_EV_IP_ACQUIRED) {
     return;
   }
-  awattar_request_handler(data);
+  awattar_refresh("ip acquired");
 
   (void) evd;
-}
-
-static void awattar_request_handler(void *data) {
-  LOG(LL_INFO, ("Server send request\n"));
-  mg_connect_http(mgos_get_mgr(), awattar_response_handler, data, url, NULL, NULL);
+  (void) data;
 }
 
 static void awattar_crontab_handler(struct mg_str action,
                       struct mg_str payload, void *userdata) {
   LOG(LL_DEBUG, ("%.*s crontab job fired!", action.len, action.p));
-  awattar_request_handler(NULL);
+  awattar_refresh("crontab");
 
-  (void) payload;  
+  (void) payload;
   (void) userdata;
 }
 
 bool awattar_init() {
-  mgos_crontab_register_handler(mg_mk_str("awattar"), awattar_crontab_handler, NULL);
+  gateway_url(url, sizeof(url), upstream);
+  awattar_load();
+  record_crontab_register_handler(mg_mk_str("awattar"), awattar_crontab_handler, NULL);
   mgos_prometheus_metrics_add_handler(awattar_metrics, NULL);
+  sched_add("awattar", AWATTAR_INTERVAL, 650, sched_priority_background, 10, awattar_check_cb, NULL);
 
-  //mgos_set_timer(60000 /* ms */, 0, awattar_request_handler, NULL);
   mgos_event_add_handler(MGOS_NET_EV_IP_ACQUIRED, got_ip_handler, NULL);
 
   return true;
 }
 
+// called right away with prices loaded at boot
 void awattar_set_update_callback(awattar_update_callback cb, void *cb_arg) {
   callback = cb;
   callback_arg = cb_arg;
+  if(callback != NULL && entries_count > 0) {
+    callback(entries, entries_count, callback_arg);
+  }
+}
+
+int awattar_get_updates() {
+  return updates;
 }
 
 int awattar_get_entries_count() {
@@ -140,7 +333,6 @@ awattar_pricing_t* awattar_get_entry(time_t time) {
     }
     ptr++;
   }
-  retry_request();
   return NULL;
 }
 
@@ -148,7 +340,6 @@ awattar_pricing_t* awattar_get_entry(time_t time) {
 awattar_pricing_t* awattar_get_best_entry(time_t after) {
   int entries_count = awattar_get_entries_count();
   if(entries_count == 0) {
-    retry_request();
     return NULL;
   }
   awattar_pricing_t *ptr = awattar_get_entries();
@@ -1,15 +1,55 @@
 #include "battery.h"
+#include "checkpoint.h"
 
+#include "record.h"
+#include "power.h"
+#include "i2cbus.h"
+#include "sched.h"
+
+#include "mgos_gpio.h"
+#include "mgos_i2c.h"
 #include "mgos_ina219.h"
 #include "mgos_prometheus_metrics.h"
 #include "soyosource.h"
 
+#define INA219_ADDR 0x40
+#define INA219_REG_CONFIG 0x00
+#define INA219_ADC_MASK 0x07FF     // bus adc, shunt adc and mode bits
+#define INA219_ADC_12BIT 0x3
+#define INA219_ADC_AVERAGE 0x8     // or'ed with log2 of the number of samples
+#define INA219_MODE_CONTINUOUS 0x7 // shunt and bus continuous
+#define INA219_CONVERSION_US 532   // per 12 bit sample
 
 static struct mgos_ina219 *ina219 = NULL;
+static int ina219_device = -1;
 static battery_state_t state = battery_idle;
 static int soc = 0;
 static double last_state_change = 0;
 
+// last reading of the instrument, polled on one schedule for all consumers
+static struct {
+  float voltage;
+  float current;
+  double time;              // uptime of the reading, 0 if none
+  float recorded_voltage;   // last values recorded, unchanged ones are skipped
+  float recorded_current;
+  double soyo_update;       // soyosource status the reading came from
+  int failing;              // consecutive failed reads
+} sample = { -1.0, -1.0, 0, 0, 0, 0, 0 };
+
+// read by a queued bus transaction
+static struct {
+  float voltage;
+  float current;
+} ina219_reading;
+
+// fast protection path, independent of the watchdog crontab
+static struct {
+  int over;             // consecutive samples above max while charging
+  int under;            // consecutive samples below min while discharging
+  int trips;
+} protect;
+
 // cell voltage in mV, normal temp, 0.5C, 0% - 100%
 static const int soc_table_discharge[] = { 3100, 3120, 3160, 3190, 3200, 3210, 3220, 3240, 3260, 3270, 3340 };
 //static int soc_charge[] =    { 3120, 3325, 3375, 3400, 3415, 3425, 3440, 3445, 3450, 3455, 3470 };
@@ -40,20 +80,49 @@ static void battery_metrics_ina219(struct mg_connection *nc, void *data) {
     (void) data;
 }
 
-static void battery_cb_ina219(void *data) {
-  struct mgos_ina219 *d = (struct mgos_ina219 *) data;
-  if (!d) {
-    LOG(LL_ERROR, ("ina219 device not available"));
-    return;
-  }
-  float bus, shunt, current, res;
+static void battery_metrics_sample(struct mg_connection *nc, void *data) {
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "battery_protect_trips", "Power cut by the fast battery protection",
+        "%d", protect.trips);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "battery_sample_age", "Age of the cached battery reading in s",
+        "%f", sample.time > 0 ? mgos_uptime() - sample.time : -1.0);
 
-  mgos_ina219_get_bus_voltage(d, &bus);
-  mgos_ina219_get_shunt_resistance(d, &res);
-  mgos_ina219_get_shunt_voltage(d, &shunt);
-  mgos_ina219_get_current(d, &current);
+    (void) data;
+}
+
+static void battery_cb_ina219(void *data) {
+  float res = mgos_sys_config_get_battery_ina219_shunt_resistance();
   LOG(LL_INFO, ("ina219: Vbus=%.3f V Vshunt=%.0f uV Rshunt=%.3f Ohm Ishunt=%.1f mA",
-    bus, shunt*1e6, res, current*1e3));
+    sample.voltage, sample.current*res*1e6, res, sample.current*1e3));
+
+  (void) data;
+}
+
+/*
+ * Continuous conversion of bus and shunt voltage, each result averaged in
+ * hardware over ina219_averaging samples of 532us. Polls then read the
+ * latest averaged result without waiting for a conversion.
+ */
+static bool battery_ina219_configure(void *arg) {
+  int samples = mgos_sys_config_get_battery_ina219_averaging();
+  int adc = INA219_ADC_12BIT;
+  int n = 1;
+  for(int bits = 1; bits <= 7 && (1 << bits) <= samples; bits++) {
+    adc = INA219_ADC_AVERAGE | bits;
+    n = 1 << bits;
+  }
+  int cfg = mgos_i2c_read_reg_w(mgos_i2c_get_global(), INA219_ADDR, INA219_REG_CONFIG);
+  if(cfg < 0) {
+    return false;
+  }
+  cfg = (cfg & ~INA219_ADC_MASK) | (adc << 7) | (adc << 3) | INA219_MODE_CONTINUOUS;
+  if(!mgos_i2c_write_reg_w(mgos_i2c_get_global(), INA219_ADDR, INA219_REG_CONFIG, cfg)) {
+    return false;
+  }
+  LOG(LL_INFO, ("INA219 averaging %d samples, %.1fms per result", n, n * INA219_CONVERSION_US / 1000.0));
+  (void) arg;
+  return true;
 }
 
 static int battery_calculate_soc() {
@@ -87,6 +156,153 @@ static int battery_calculate_soc() {
 }
 
 
+static void battery_protect_trip(const char *source, power_state_t power_state, float voltage) {
+  int num_cells = mgos_sys_config_get_battery_num_cells();
+  bool full = (power_state == power_in);
+  float limit = (full ? mgos_sys_config_get_battery_cell_voltage_max()
+                      : mgos_sys_config_get_battery_cell_voltage_min()) * num_cells;
+  float power = full ? power_get_power_in() : power_get_power_out();
+
+  power_set_state(power_off);
+  battery_set_state(full ? battery_full : battery_empty);
+  protect.trips++;
+  protect.over = 0;
+  protect.under = 0;
+  record_printf(record_decision, "trip", "%s %d %.3f %.3f %.1f", source, power_state, voltage, limit, power);
+  LOG(LL_WARN, ("Battery protection (%s): %.3fV beyond %.3fV at %.1fW, power %s cut",
+                source, voltage, limit, power, full ? "in" : "out"));
+}
+
+static bool battery_ina219_read_fn(void *arg) {
+  (void) arg;
+  return mgos_ina219_get_bus_voltage(ina219, &ina219_reading.voltage) &&
+         mgos_ina219_get_current(ina219, &ina219_reading.current);
+}
+
+static void battery_store(float voltage, float current) {
+  sample.voltage = voltage;
+  sample.current = current;
+  sample.time = mgos_uptime();
+}
+
+// stores a finished INA219 read, false if it failed
+static bool battery_ina219_store(bool ok) {
+  if(!ok) {
+    if(sample.failing++ == 0) {
+      LOG(LL_ERROR, ("Could not read from INA219"));
+    }
+    return false;
+  }
+  sample.failing = 0;
+  if(ina219_reading.voltage != sample.recorded_voltage) {
+    record_printf(record_sensor, "ina219.bus_voltage", "%f", ina219_reading.voltage);
+    sample.recorded_voltage = ina219_reading.voltage;
+  }
+  if(ina219_reading.current != sample.recorded_current) {
+    record_printf(record_sensor, "ina219.current", "%f", ina219_reading.current);
+    sample.recorded_current = ina219_reading.current;
+  }
+  battery_store(ina219_reading.voltage, ina219_reading.current);
+  return true;
+}
+
+// takes a new soyosource status into the cached sample, false if there is none
+static bool battery_soyosource_store() {
+  if(soyosource_get_last_update() == sample.soyo_update) {
+    return false;
+  }
+  sample.soyo_update = soyosource_get_last_update();
+  battery_store(soyosource_get_last_voltage(), soyosource_get_last_current());
+  return true;
+}
+
+/*
+ * Compares every sample with the cell voltage limits of the current power
+ * direction. A few consecutive samples beyond a limit are required so a
+ * single glitch on the bus does not cut power.
+ */
+static void battery_protect_check(float voltage) {
+  int samples = mgos_sys_config_get_battery_protect_samples();
+  if(samples <= 0 || voltage <= 0) {
+    return;
+  }
+  int num_cells = mgos_sys_config_get_battery_num_cells();
+  float max = mgos_sys_config_get_battery_cell_voltage_max() * num_cells;
+  float min = mgos_sys_config_get_battery_cell_voltage_min() * num_cells;
+  power_state_t power_state = power_get_state();
+  protect.over = (power_state == power_in && voltage > max) ? protect.over + 1 : 0;
+  protect.under = (power_state == power_out && voltage < min) ? protect.under + 1 : 0;
+  if(protect.over >= samples || protect.under >= samples) {
+    battery_protect_trip("sample", power_state, voltage);
+  }
+}
+
+static void battery_ina219_done(bool ok, void *arg) {
+  if(battery_ina219_store(ok)) {
+    battery_protect_check(sample.voltage);
+  }
+
+  (void) arg;
+}
+
+static void battery_poll_cb(void *arg) {
+  switch (mgos_sys_config_get_battery_instrument()) {
+  case 1:
+    i2cbus_submit(ina219_device, i2cbus_priority_protection, battery_ina219_read_fn, battery_ina219_done, NULL);
+    break;
+  case 2:
+    if(battery_soyosource_store()) {
+      battery_protect_check(sample.voltage);
+    }
+    break;
+  default:
+    break;
+  }
+
+  (void) arg;
+}
+
+// an external comparator pulls the pin low when a limit is crossed
+static void battery_protect_pin_cb(int pin, void *arg) {
+  power_state_t power_state = power_get_state();
+  if(power_state == power_in || power_state == power_out) {
+    battery_protect_trip("pin", power_state, sample.voltage);
+  }
+
+  (void) pin;
+  (void) arg;
+}
+
+static void battery_sample_init() {
+  int interval = MAX(10, mgos_sys_config_get_battery_sample_interval());
+  int pin = mgos_sys_config_get_battery_protect_pin();
+  if(mgos_sys_config_get_battery_instrument() == 1) {
+    // first reading right away for the initial state of charge
+    battery_ina219_store(i2cbus_run(ina219_device, battery_ina219_read_fn, NULL));
+  } else {
+    battery_soyosource_store();
+  }
+  sched_add("battery.sample", interval, 0, sched_priority_control, 5, battery_poll_cb, NULL);
+  LOG(LL_INFO, ("Battery sampling every %dms", interval));
+  int samples = mgos_sys_config_get_battery_protect_samples();
+  if(mgos_sys_config_get_battery_instrument() == 2 && samples > 0 && pin < 0) {
+    // a new voltage only comes with each soyosource status
+    LOG(LL_WARN, ("Battery protection on soyosource status, a cutoff takes %d x %.1fs, "
+                  "use the ina219 or battery.protect_pin for fast protection",
+                  samples, mgos_sys_config_get_soyosource_status_interval() / 1000.0));
+  }
+  if(pin >= 0) {
+    mgos_gpio_setup_input(pin, MGOS_GPIO_PULL_UP);
+    if(mgos_gpio_set_int_handler(pin, MGOS_GPIO_INT_EDGE_NEG, battery_protect_pin_cb, NULL)) {
+      mgos_gpio_enable_int(pin);
+      LOG(LL_INFO, ("Battery protection comparator on pin %d", pin));
+    } else {
+      LOG(LL_ERROR, ("Could not set battery protection interrupt on pin %d", pin));
+    }
+  }
+  mgos_prometheus_metrics_add_handler(battery_metrics_sample, NULL);
+}
+
 battery_state_t battery_init() {
   if(!mgos_sys_config_get_battery_enabled()) {
     LOG(LL_WARN, ("Battery management disabled"));
@@ -100,7 +316,7 @@ battery_state_t battery_init() {
     return state;
     break;
   case 1:
-    if (!(ina219 = mgos_ina219_create(mgos_i2c_get_global(), 0x40))) {
+    if (!(ina219 = mgos_ina219_create(mgos_i2c_get_global(), INA219_ADDR))) {
       LOG(LL_ERROR, ("Could not create INA219"));
       battery_set_state(battery_invalid);
       return state;
@@ -110,7 +326,11 @@ battery_state_t battery_init() {
       battery_set_state(battery_invalid);
       return state;
     }
-    mgos_set_timer(1e4 /* ms */, MGOS_TIMER_REPEAT, battery_cb_ina219, ina219);
+    ina219_device = i2cbus_add_device("ina219", INA219_ADDR);
+    if(!i2cbus_run(ina219_device, battery_ina219_configure, NULL)) {
+      LOG(LL_WARN, ("Could not configure INA219 averaging"));
+    }
+    sched_add("battery.log", 10000, 2500, sched_priority_background, 5, battery_cb_ina219, ina219);
     mgos_prometheus_metrics_add_handler(battery_metrics_ina219, ina219);
     LOG(LL_INFO, ("Setup INA219"));
     break;
@@ -129,7 +349,18 @@ battery_state_t battery_init() {
   }
 
   battery_set_state(battery_idle);
+  battery_sample_init();
   soc = battery_calculate_soc();
+
+  // a single voltage reading is off until the next settle interval
+  const checkpoint_state_t *checkpoint = checkpoint_get();
+  if(checkpoint != NULL && battery_state_is_valid(checkpoint->battery_state)) {
+    soc = checkpoint->soc;
+    if(checkpoint->battery_state == battery_full || checkpoint->battery_state == battery_empty) {
+      battery_set_state(checkpoint->battery_state);
+    }
+    LOG(LL_INFO, ("Restored soc %d%% (measured %d%%), state %d", soc, battery_calculate_soc(), state));
+  }
   return state;
 }
 
@@ -166,6 +397,12 @@ int battery_get_soc() {
   return soc;
 }
 
+float battery_get_capacity_wh() {
+  float voltage = mgos_sys_config_get_battery_num_cells() *
+      (mgos_sys_config_get_battery_cell_voltage_min() + mgos_sys_config_get_battery_cell_voltage_max()) / 2.0;
+  return mgos_sys_config_get_battery_capacity() * voltage;
+}
+
 int battery_reset_soc() {
   soc = battery_calculate_soc();
   if(state == battery_empty || state == battery_full) {
@@ -183,9 +420,7 @@ float battery_read_voltage() {
     LOG(LL_ERROR, ("Could not read bus voltage, instrument disabled"));
     break;
   case 1:
-    if(!mgos_ina219_get_bus_voltage(ina219, &result)) {
-      LOG(LL_ERROR, ("Could not read bus voltage from INA219"));
-    }
+    result = sample.voltage;
     break;
   case 2:
     result = soyosource_get_last_voltage();
@@ -204,9 +439,7 @@ float battery_read_current() {
     LOG(LL_ERROR, ("Could not read current, battery instrument disabled"));
     break;
   case 1:
-    if(!  mgos_ina219_get_current(ina219, &result)) {
-      LOG(LL_ERROR, ("Could not read current from INA219"));
-    }
+    result = sample.current;
     break;
   case 2:
     result = soyosource_get_last_current();
@@ -217,3 +450,7 @@ float battery_read_current() {
   }
   return result;
 }
+
+double battery_get_sample_time() {
+  return sample.time;
+}
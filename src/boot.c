@@ -0,0 +1,141 @@
+#include "boot.h"
+
+#include "heap.h"
+
+#include "mgos.h"
+#include "mgos_timers.h"
+#include "mgos_prometheus_metrics.h"
+
+#define BOOT_MODULES 32
+
+typedef enum {
+  boot_pending = 0,
+  boot_running = 1,
+  boot_done = 2,
+} boot_state_t;
+
+static struct boot_module {
+  const char *name;
+  boot_init_t init;
+  boot_mode_t mode;
+  const char *deps;
+  boot_state_t state;
+  bool ok;
+  double seconds;   // time spent in init
+  double uptime;    // when init finished
+} modules[BOOT_MODULES];
+static int module_count = 0;
+static bool live = false;
+static double live_uptime = 0;
+static double done_uptime = 0;
+
+static void boot_metrics(struct mg_connection *nc, void *data) {
+  for(int i = 0; i < module_count; i++) {
+    struct boot_module *m = &modules[i];
+    if(m->state != boot_done) {
+      continue;
+    }
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "boot_init_seconds", "Time spent initialising a module in s",
+        "{module=\"%s\",deferred=\"%d\"} %f", m->name, m->mode == boot_deferred, m->seconds);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "boot_init_uptime", "Uptime a module was ready at in s",
+        "{module=\"%s\"} %f", m->name, m->uptime);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "boot_init_ok", "Module initialised and enabled",
+        "{module=\"%s\"} %d", m->name, m->ok);
+  }
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "boot_live_uptime", "Uptime the control loop went live at in s",
+      "%f", live_uptime);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "boot_done_uptime", "Uptime all modules were initialised at in s, 0 while pending",
+      "%f", done_uptime);
+
+  (void) data;
+}
+
+static struct boot_module *boot_find(const char *name, size_t len) {
+  for(int i = 0; i < module_count; i++) {
+    if(strlen(modules[i].name) == len && strncmp(modules[i].name, name, len) == 0) {
+      return &modules[i];
+    }
+  }
+  return NULL;
+}
+
+static void boot_init_module(struct boot_module *m) {
+  if(m->state == boot_done) {
+    return;
+  }
+  if(m->state == boot_running) {
+    LOG(LL_ERROR, ("Circular boot dependency on %s", m->name));
+    return;
+  }
+  m->state = boot_running;
+  const char *p = m->deps;
+  while(p != NULL && *p != '\0') {
+    size_t len = strcspn(p, " ");
+    if(len > 0) {
+      struct boot_module *dep = boot_find(p, len);
+      if(dep == NULL) {
+        LOG(LL_ERROR, ("Unknown boot dependency %.*s of %s", (int) len, p, m->name));
+      } else {
+        boot_init_module(dep);
+      }
+    }
+    p += len + strspn(p + len, " ");
+  }
+
+  int64_t start = mgos_uptime_micros();
+  size_t heap = heap_get_free();
+  m->ok = m->init();
+  m->seconds = (mgos_uptime_micros() - start) / 1e6;
+  heap_account(m->name, (long) heap - (long) heap_get_free());
+  m->uptime = mgos_uptime();
+  m->state = boot_done;
+  LOG(m->ok ? LL_INFO : LL_WARN, ("Init %s %s in %.3fs", m->name, m->ok ? "done" : "failed", m->seconds));
+}
+
+// one deferred module per event loop slice
+static void boot_deferred_cb(void *arg) {
+  for(int i = 0; i < module_count; i++) {
+    if(modules[i].state == boot_pending) {
+      boot_init_module(&modules[i]);
+      mgos_set_timer(0, 0, boot_deferred_cb, NULL);
+      return;
+    }
+  }
+  done_uptime = mgos_uptime();
+  LOG(LL_INFO, ("All modules up after %.3fs", done_uptime));
+
+  (void) arg;
+}
+
+bool boot_add(const char *name, boot_init_t init, boot_mode_t mode, const char *deps) {
+  if(module_count == BOOT_MODULES) {
+    LOG(LL_ERROR, ("Too many modules, cannot add %s", name));
+    return false;
+  }
+  modules[module_count++] = (struct boot_module) {
+    .name = name, .init = init, .mode = mode, .deps = deps, .state = boot_pending
+  };
+  return true;
+}
+
+void boot_run() {
+  for(int i = 0; i < module_count; i++) {
+    if(modules[i].mode == boot_now) {
+      boot_init_module(&modules[i]);
+    }
+  }
+  live = true;
+  live_uptime = mgos_uptime();
+  LOG(LL_INFO, ("Control loop live after %.3fs", live_uptime));
+  mgos_prometheus_metrics_add_handler(boot_metrics, NULL);
+  mgos_set_timer(0, 0, boot_deferred_cb, NULL);
+}
+
+bool boot_is_live() {
+  return live;
+}
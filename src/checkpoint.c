@@ -0,0 +1,245 @@
+#include "checkpoint.h"
+
+#include "feedback.h"
+#include "power_driver.h"
+#include "sched.h"
+
+#include "mgos.h"
+#include "mgos_timers.h"
+#include "mgos_prometheus_metrics.h"
+
+#if CS_PLATFORM == CS_P_ESP32
+#include "esp_attr.h"
+#elif CS_PLATFORM == CS_P_ESP8266
+#include "user_interface.h"
+#endif
+
+#define CHECKPOINT_FILE "checkpoint.bin"
+#define CHECKPOINT_TMP "checkpoint.tmp"
+#define CHECKPOINT_MAGIC 0x43504b54
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_INTERVAL 1000
+// min s between flash writes on a battery or power state change
+#define FLASH_MIN_INTERVAL 10.0
+// wall clock considered set
+#define TIME_VALID 1000000000
+// first 4 byte block of the ESP8266 RTC user memory, 512 bytes from there
+#define RTC_USER_BLOCK 64
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;
+  uint32_t sequence;
+  int64_t time;          // wall clock when written, 0 if unset
+  checkpoint_state_t state;
+  uint32_t crc;
+} checkpoint_t;
+
+#if CS_PLATFORM == CS_P_ESP32
+// survives soft resets and OTA reboots, not power loss
+static RTC_NOINIT_ATTR checkpoint_t rtc;
+#else
+// a copy of the RTC user memory on the ESP8266, on the host nothing survives
+static checkpoint_t rtc;
+#endif
+
+static checkpoint_t restored;
+static bool restored_valid = false;
+static bool restored_warm = false;
+static checkpoint_state_t flashed;
+static double last_flash = 0;
+static uint32_t sequence = 0;
+static int flash_writes = 0;
+static int rtc_writes = 0;
+static const char *restored_from = "none";
+
+static void checkpoint_metrics(struct mg_connection *nc, void *data) {
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "checkpoint_flash_writes", "Checkpoints written to flash",
+      "%d", flash_writes);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "checkpoint_rtc_writes", "Checkpoints written to RTC memory",
+      "%d", rtc_writes);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "checkpoint_restored", "State restored at boot",
+      "{source=\"%s\"} %d", restored_from, restored_valid);
+
+  (void) data;
+}
+
+static uint32_t checkpoint_crc(const checkpoint_t *c) {
+  const uint8_t *p = (const uint8_t *) c;
+  uint32_t crc = 0xFFFFFFFF;
+  for(size_t i = 0; i < offsetof(checkpoint_t, crc); i++) {
+    crc ^= p[i];
+    for(int b = 0; b < 8; b++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static bool checkpoint_valid(const checkpoint_t *c) {
+  if(c->magic != CHECKPOINT_MAGIC || c->version != CHECKPOINT_VERSION ||
+     c->size != sizeof(checkpoint_t) || c->crc != checkpoint_crc(c)) {
+    return false;
+  }
+  // without a set clock the age is unknown, a warm restart keeps it
+  time_t now = time(NULL);
+  int max_age = mgos_sys_config_get_checkpoint_max_age();
+  if(max_age > 0 && now > TIME_VALID && c->time > TIME_VALID && now - c->time > max_age) {
+    LOG(LL_INFO, ("Checkpoint %u too old: %llds", c->sequence, (long long) (now - c->time)));
+    return false;
+  }
+  return true;
+}
+
+static bool checkpoint_read_flash(checkpoint_t *c) {
+  FILE *fp = fopen(CHECKPOINT_FILE, "rb");
+  if(fp == NULL) {
+    return false;
+  }
+  bool ok = fread(c, sizeof(*c), 1, fp) == 1;
+  fclose(fp);
+  return ok;
+}
+
+// written aside and renamed, a reset while writing keeps the previous one
+static void checkpoint_write_flash(const checkpoint_t *c) {
+  FILE *fp = fopen(CHECKPOINT_TMP, "wb");
+  if(fp == NULL) {
+    LOG(LL_ERROR, ("Failed to open %s", CHECKPOINT_TMP));
+    return;
+  }
+  bool ok = fwrite(c, sizeof(*c), 1, fp) == 1;
+  fclose(fp);
+  if(!ok || rename(CHECKPOINT_TMP, CHECKPOINT_FILE) != 0) {
+    LOG(LL_ERROR, ("Failed to save %s", CHECKPOINT_FILE));
+    return;
+  }
+  flashed = c->state;
+  last_flash = mgos_uptime();
+  flash_writes++;
+}
+
+// the ESP8266 RTC memory is not mapped, it is read and written in blocks
+static void checkpoint_rtc_load() {
+#if CS_PLATFORM == CS_P_ESP8266
+  if(!system_rtc_mem_read(RTC_USER_BLOCK, &rtc, sizeof(rtc))) {
+    memset(&rtc, 0, sizeof(rtc));
+  }
+#endif
+}
+
+static void checkpoint_rtc_store() {
+#if CS_PLATFORM == CS_P_ESP8266
+  if(!system_rtc_mem_write(RTC_USER_BLOCK, &rtc, sizeof(rtc))) {
+    LOG(LL_ERROR, ("Failed to write RTC memory"));
+  }
+#endif
+}
+
+static void checkpoint_collect(checkpoint_state_t *s) {
+  memset(s, 0, sizeof(*s));
+  s->battery_state = battery_get_state();
+  if(s->battery_state != battery_disabled) {
+    s->soc = battery_get_soc();
+  }
+  s->steps_in = power_driver_get_steps_in();
+  s->feedback_gain = feedback_get_gain();
+  s->capacity_in = power_get_capacity_in();
+  s->capacity_out = power_get_capacity_out();
+  for(int i = 0; i < 3; i++) {
+    s->energy[i] = *energy_get_totals(i);
+  }
+}
+
+/*
+ * RTC memory is updated on every change, flash at most every
+ * checkpoint.flash_interval, sooner if the battery state or the step
+ * position changed.
+ */
+static void checkpoint_timer_cb(void *arg) {
+  checkpoint_state_t s;
+  checkpoint_collect(&s);
+  if(memcmp(&s, &rtc.state, sizeof(s)) == 0 && rtc.magic == CHECKPOINT_MAGIC) {
+    return;
+  }
+  rtc.magic = CHECKPOINT_MAGIC;
+  rtc.version = CHECKPOINT_VERSION;
+  rtc.size = sizeof(checkpoint_t);
+  rtc.sequence = ++sequence;
+  rtc.time = (time(NULL) > TIME_VALID) ? time(NULL) : 0;
+  rtc.state = s;
+  rtc.crc = checkpoint_crc(&rtc);
+  checkpoint_rtc_store();
+  rtc_writes++;
+
+  double since = mgos_uptime() - last_flash;
+  // only a step position is lost with the hardware state, a pwm duty follows every regulation
+  bool urgent = s.battery_state != flashed.battery_state ||
+                (power_driver_is_stepping_in() && s.steps_in != flashed.steps_in);
+  if(since >= mgos_sys_config_get_checkpoint_flash_interval() || (urgent && since >= FLASH_MIN_INTERVAL)) {
+    checkpoint_write_flash(&rtc);
+  }
+
+  (void) arg;
+}
+
+static void checkpoint_reboot_handler(int ev, void *ev_data, void *userdata) {
+  // the RTC copy survives the reboot, flash covers a failed one
+  if(rtc.magic == CHECKPOINT_MAGIC && memcmp(&rtc.state, &flashed, sizeof(flashed)) != 0) {
+    checkpoint_write_flash(&rtc);
+  }
+
+  (void) ev;
+  (void) ev_data;
+  (void) userdata;
+}
+
+bool checkpoint_init() {
+  if(!mgos_sys_config_get_checkpoint_enable()) {
+    memset(&rtc, 0, sizeof(rtc));
+    checkpoint_rtc_store();
+    return false;
+  }
+  checkpoint_rtc_load();
+  checkpoint_t flash;
+  bool rtc_ok = checkpoint_valid(&rtc);
+  bool flash_ok = checkpoint_read_flash(&flash) && checkpoint_valid(&flash);
+  if(rtc_ok && (!flash_ok || rtc.sequence >= flash.sequence)) {
+    restored = rtc;
+    restored_from = "rtc";
+    restored_warm = true;
+  } else if(flash_ok) {
+    restored = flash;
+    restored_from = "flash";
+  }
+  restored_valid = rtc_ok || flash_ok;
+  if(restored_valid) {
+    sequence = restored.sequence;
+    flashed = flash_ok ? flash.state : restored.state;
+    LOG(LL_INFO, ("Restored checkpoint %u from %s: soc %d, battery %d, steps %d",
+      restored.sequence, restored_from, restored.state.soc, restored.state.battery_state,
+      restored.state.steps_in));
+  } else {
+    memset(&flashed, 0, sizeof(flashed));
+    LOG(LL_INFO, ("No checkpoint, starting cold"));
+  }
+  memset(&rtc, 0, sizeof(rtc));
+  last_flash = mgos_uptime();
+
+  sched_add("checkpoint", CHECKPOINT_INTERVAL, 800, sched_priority_background, 50, checkpoint_timer_cb, NULL);
+  mgos_event_add_handler(MGOS_EVENT_REBOOT, checkpoint_reboot_handler, NULL);
+  mgos_prometheus_metrics_add_handler(checkpoint_metrics, NULL);
+  return restored_valid;
+}
+
+const checkpoint_state_t *checkpoint_get() {
+  return restored_valid ? &restored.state : NULL;
+}
+
+bool checkpoint_is_warm() {
+  return restored_valid && restored_warm;
+}
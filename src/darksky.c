@@ -1,13 +1,16 @@
 #include "darksky.h"
 
+#include "record.h"
+
 #include "mgos.h"
 #include "mgos_location.h"
 #include "mgos_crontab.h"
 
 #define DAY_ARRAY_SIZE 1
+#define URL_MAX 192
 
 static const char *urlf = "https://api.darksky.net/forecast/%s/%.4f,%.4f?exclude=currently,hourly,alerts,flags&units=si";
-static char *url = NULL;
+static char url[URL_MAX];
 
 static darksky_update_callback callback = NULL;
 static void *callback_arg;
@@ -101,17 +104,15 @@ bool darksky_init() {
     return false;
   }
 
-  int len = strlen(urlf)+strlen(config->key)+14;
-  url = malloc((len+1)*sizeof(char));
-  int n = snprintf(url, len, urlf, config->key, location.lat, location.lon);
-  if(n < 0 || n >= len) {
+  int n = snprintf(url, sizeof(url), urlf, config->key, location.lat, location.lon);
+  if(n < 0 || n >= (int) sizeof(url)) {
     LOG(LL_ERROR, ("Cannot create Darksky url"));
     return false;
   }
 
   LOG(LL_INFO, ("url %s", url));
 
-  mgos_crontab_register_handler(mg_mk_str("darksky"), darksky_crontab_handler, NULL);
+  record_crontab_register_handler(mg_mk_str("darksky"), darksky_crontab_handler, NULL);
 
   //mgos_set_timer(30000 /* ms */, 0, darksky_request_handler, NULL);
   //mgos_event_add_handler(MGOS_NET_EV_IP_ACQUIRED, got_ip_handler, NULL);
@@ -0,0 +1,164 @@
+#include "derate.h"
+
+#include "ds18xxx.h"
+#include "sched.h"
+#include "soyosource.h"
+
+#include "mgos.h"
+#include "mgos_prometheus_metrics.h"
+
+#define DERATE_INTERVAL 1000
+// ignore inverter temperatures older than s
+#define SOYO_TEMPERATURE_AGE 60.0
+
+static struct {
+  float factor;
+  float temperature;
+  bool sensed;    // a temperature was read before
+  int events;     // times derating started
+} derate[2];
+
+static double last_update = 0;
+
+static inline int derate_index(power_state_t direction) {
+  return (direction == power_out) ? 1 : 0;
+}
+
+static void derate_metrics(struct mg_connection *nc, void *data) {
+  const char *names[2] = { "in", "out" };
+  float power[2] = { power_get_power_in(), power_get_power_out() };
+  int min[2] = { mgos_sys_config_get_power_in_min(), mgos_sys_config_get_power_out_min() };
+  int max[2] = { mgos_sys_config_get_power_in_max(), mgos_sys_config_get_power_out_max() };
+  for(int i = 0; i < 2; i++) {
+    power_state_t direction = (i == 1) ? power_out : power_in;
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "derate_factor", "Share of max power allowed by temperature",
+        "{direction=\"%s\"} %f", names[i], derate[i].factor);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "derate_temperature", "Temperature feeding the derating curve in Celcius",
+        "{direction=\"%s\"} %f", names[i], derate[i].temperature);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "derate_active", "Max power reduced by temperature",
+        "{direction=\"%s\"} %d", names[i], derate[i].factor < 1.0f);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "derate_headroom", "Power left until the derated max in W",
+        "{direction=\"%s\"} %f", names[i], derate_get_max(direction, min[i], max[i]) - power[i]);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "derate_events", "Times derating started",
+        "{direction=\"%s\"} %d", names[i], derate[i].events);
+  }
+  (void) data;
+}
+
+static float derate_hottest(float a, float b) {
+  return (a > b) ? a : b;
+}
+
+static float derate_read_temperature(power_state_t direction) {
+  float t = -1;
+  int count = ds18xxx_get_count();
+  for(int i = 0; i < count; i++) {
+    float v;
+    if(ds18xxx_get_sensor(i, NULL, &v)) {
+      t = derate_hottest(t, v);
+    }
+  }
+  double soyo_update = soyosource_get_last_update();
+  if(direction == power_out && soyo_update > 0 &&
+     mgos_uptime() - soyo_update < SOYO_TEMPERATURE_AGE) {
+    t = derate_hottest(t, soyosource_get_last_temperature());
+  }
+  return t;
+}
+
+/*
+ * Linear from full power at start to min_factor at end. The factor drops
+ * at once when heating up and recovers by recover per second when cooling
+ * down, so power is handed back smoothly without oscillating at start.
+ */
+static float derate_curve(float t, float start, float end) {
+  float min_factor = mgos_sys_config_get_derate_min_factor();
+  if(t < 0 || t <= start) {
+    return 1.0;
+  }
+  if(t >= end || end <= start) {
+    return min_factor;
+  }
+  return 1.0 - (1.0 - min_factor) * (t - start) / (end - start);
+}
+
+static void derate_update(power_state_t direction, float start, float end, double dt) {
+  int i = derate_index(direction);
+  derate[i].temperature = derate_read_temperature(direction);
+  float target = derate_curve(derate[i].temperature, start, end);
+  float factor = derate[i].factor;
+  if(derate[i].temperature >= 0) {
+    derate[i].sensed = true;
+  } else if(derate[i].sensed) {
+    // the sensors stopped reporting, the temperature is unknown
+    target = mgos_sys_config_get_derate_min_factor();
+    if(factor > target) {
+      LOG(LL_ERROR, ("Temperature lost, derating power %s to min", direction == power_out ? "out" : "in"));
+    }
+  }
+  if(target < factor) {
+    if(factor >= 1.0f) {
+      derate[i].events++;
+      if(derate[i].temperature >= 0) {
+        LOG(LL_WARN, ("Derating power %s at %.1fC", direction == power_out ? "out" : "in",
+                      derate[i].temperature));
+      }
+    }
+    factor = target;
+  } else {
+    factor = MIN(target, factor + mgos_sys_config_get_derate_recover() * dt);
+  }
+  derate[i].factor = factor;
+  if(factor < 1.0f) {
+    // the optimizer applies the derated max on changes only
+    power_apply_derating(direction);
+  }
+}
+
+static void derate_timer_cb(void *arg) {
+  double now = mgos_uptime();
+  double dt = now - last_update;
+  last_update = now;
+  derate_update(power_in, mgos_sys_config_get_derate_in_start(),
+                mgos_sys_config_get_derate_in_end(), dt);
+  derate_update(power_out, mgos_sys_config_get_derate_out_start(),
+                mgos_sys_config_get_derate_out_end(), dt);
+  (void) arg;
+}
+
+bool derate_init() {
+  for(int i = 0; i < 2; i++) {
+    derate[i].factor = 1.0;
+    derate[i].temperature = -1;
+    derate[i].sensed = false;
+    derate[i].events = 0;
+  }
+  if(!mgos_sys_config_get_derate_enable()) {
+    LOG(LL_INFO, ("Thermal derating disabled"));
+    return false;
+  }
+  last_update = mgos_uptime();
+  sched_add("derate", DERATE_INTERVAL, 400, sched_priority_control, 5, derate_timer_cb, NULL);
+  mgos_prometheus_metrics_add_handler(derate_metrics, NULL);
+  return true;
+}
+
+float derate_get_factor(power_state_t direction) {
+  return derate[derate_index(direction)].factor;
+}
+
+int derate_get_max(power_state_t direction, int min, int max) {
+  if(max <= min) {
+    return max;
+  }
+  return MAX(min, (int) (max * derate_get_factor(direction)));
+}
+
+float derate_get_temperature(power_state_t direction) {
+  return derate[derate_index(direction)].temperature;
+}
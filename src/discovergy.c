@@ -1,19 +1,32 @@
 
 #include "discovergy.h"
+#include "gateway.h"
+#include "heap.h"
+#include "latency.h"
+#include "meter.h"
+#include "record.h"
+#include "sched.h"
 
 #include "mgos.h"
 #include "mgos_mongoose.h"
 #include "mgos_prometheus_metrics.h"
-#include "mgos_crontab.h"
 
-static discovergy_update_callback callback = NULL;
-static void *callback_arg;
+#define URL_MAX 128
+#define AUTH_MAX 160
+#define REQUEST_MAX 384
+// headers and a single reading
+#define REPLY_SIZE 1024
+#define REPLY_LIMIT 2048
 
 static const char *urlf = "https://api.discovergy.com/public/v1/last_reading?fields=power&meterId=%s";
 
-static char *url = NULL;
-static char *auth;
+// fixed for the uptime, the connection is kept and its request resent
+static char url[URL_MAX];
+static char auth[AUTH_MAX];
+static char request[REQUEST_MAX];
+static size_t request_len = 0;
 
+static int source = -1;
 static int last_power = 0;
 static double last_update = 0;
 static double last_lag = 0;
@@ -22,7 +35,6 @@ static double last_request_start = 0;
 static int connection_count = 0;
 static int connection_failed_count = 0;
 
-static struct mbuf request;
 static struct mg_connection *connection = NULL;
 
 static void discovergy_metrics(struct mg_connection *nc, void *data) {
@@ -58,8 +70,10 @@ static void discovergy_response_handler(struct mg_connection *nc, int ev, void *
       }
       //mg_set_timer(nc, 0);  // Clear connect timer
       connection_count++;
-      if(request.len == 0) {
-        mbuf_append(&request, nc->send_mbuf.buf, nc->send_mbuf.len);
+      heap_bound_reply(nc, REPLY_SIZE, REPLY_LIMIT);
+      if(request_len == 0 && nc->send_mbuf.len <= sizeof(request)) {
+        memcpy(request, nc->send_mbuf.buf, nc->send_mbuf.len);
+        request_len = nc->send_mbuf.len;
         LOG(LL_INFO, ("Stored request (%db):/n%.*s", (int) nc->send_mbuf.len, (int) nc->send_mbuf.len, nc->send_mbuf.buf));      break;
       }
       LOG(LL_INFO, ("Message(%db): %.*s", (int) nc->send_mbuf.len, (int) nc->send_mbuf.len, nc->send_mbuf.buf));      break;
@@ -74,6 +88,7 @@ static void discovergy_response_handler(struct mg_connection *nc, int ev, void *
       //nc->flags |= MG_F_CLOSE_IMMEDIATELY;
       //nc->flags |= MG_F_SEND_AND_CLOSE;
       last_response_time = mgos_uptime() - last_request_start;
+      record_data(record_http, url, hm->body.p, hm->body.len);
       //LOG(LL_DEBUG, ("Response received %.2lfs", last_response_time));
       //LOG(LL_INFO,("Response: %.*s", hm->message.len, hm->message.p));
       uint64_t u;
@@ -81,13 +96,10 @@ static void discovergy_response_handler(struct mg_connection *nc, int ev, void *
         float power = last_power / 1000.0;
         last_update = (double) u / 1000.0;
         last_lag = mg_time() - last_update;
-        if(callback != NULL) {
-          callback(last_update, power, callback_arg);
-        } else { 
-          char time[32];
-          mgos_strftime(time, 32, "%x %X", (time_t) last_update);
-          LOG(LL_INFO, ("%s[%lld]: %.2f", time, u, power));
-        }
+        latency_mark_at(latency_sample, last_update);
+        latency_mark_at(latency_request, mg_time() - (mgos_uptime() - last_request_start));
+        latency_mark(latency_reply);
+        meter_update(source, last_update, power);
       } else {
         LOG(LL_ERROR, ("failed to parse json response"));
       }
@@ -113,19 +125,14 @@ static void discovergy_request_handler(void *data) {
   if(!connection) {
     connection = mg_connect_http(mgos_get_mgr(), discovergy_response_handler, data, url, auth, NULL);
     //mg_set_timer(connection, mg_time() + mgos_sys_config_get_discovergy_connection_timeout());
-  } else if(request.len > 0) {
-    mg_send(connection, request.buf, request.len);
+  } else if(request_len > 0) {
+    mg_send(connection, request, request_len);
   } else {
     LOG(LL_INFO, ("connection but no request!"));
     connection = NULL;
   }
 }
 
-static void discovergy_crontab_handler(struct mg_str action,
-                      struct mg_str payload, void *userdata) {
-  LOG(LL_DEBUG, ("%.*s crontab job fired!", action.len, action.p));
-  discovergy_request_handler(userdata);
-}
 
 bool discovergy_init() {
 
@@ -142,34 +149,40 @@ bool discovergy_init() {
   struct mbuf buf;
   mbuf_init(&buf, 0);
   mg_basic_auth_header(mg_mk_str(config->user), mg_mk_str(config->password), &buf);
-  auth = malloc(sizeof(char) * buf.len+1);
-  strncpy(auth, buf.buf, buf.len);
+  if(buf.len >= sizeof(auth)) {
+    LOG(LL_ERROR, ("Discovergy credentials too long"));
+    mbuf_free(&buf);
+    return false;
+  }
+  memcpy(auth, buf.buf, buf.len);
   auth[buf.len] = '\0';
   mbuf_free(&buf);
   LOG(LL_INFO, ("auth %s", auth));
 
-  int len = strlen(urlf)+strlen(config->meter_id);
-  url = malloc((len+1)*sizeof(char));
-  int n = snprintf(url, len, urlf, config->meter_id);
-  if(n < 0 || n >= len) {
+  char upstream[URL_MAX];
+  int n = snprintf(upstream, sizeof(upstream), urlf, config->meter_id);
+  if(n >= 0 && n < (int) sizeof(upstream)) {
+    n = gateway_url(url, sizeof(url), upstream);
+  }
+  if(n < 0 || n >= (int) sizeof(url)) {
     LOG(LL_ERROR, ("Cannot create Discovergy url"));
     return false;
   }
 
   LOG(LL_INFO, ("url %s", url));
-  mbuf_init(&request, 250);
 
+  source = meter_add_source("discovergy", config->priority, config->interval / 1000.0,
+                            mgos_sys_config_get_power_max_lag());
+  if(source < 0) {
+    return false;
+  }
   mgos_prometheus_metrics_add_handler(discovergy_metrics, NULL);
-  mgos_crontab_register_handler(mg_mk_str("discovergy"), discovergy_crontab_handler, NULL);
+  sched_add("discovergy", mgos_sys_config_get_discovergy_interval(), 0, sched_priority_control, 20,
+            discovergy_request_handler, NULL);
 
   return true;
 }
 
-void discovery_set_update_callback(discovergy_update_callback cb, void *cb_arg) {
-  callback = cb;
-  callback_arg = cb_arg;
-}
-
 double discovery_get_last_update() {
   return last_update;
 }
\ No newline at end of file
@@ -1,10 +1,12 @@
 #include "ds18xxx.h"
 
+#include "record.h"
+#include "sched.h"
+
 #include "mgos.h"
 #include "mgos_onewire.h"
 #include "mgos_prometheus_metrics.h"
 #include "mgos_timers.h"
-#include "mgos_crontab.h"
 
 
 /* Model IDs */
@@ -15,94 +17,187 @@
 #define DS28EA00MODEL 0x42
 
 #define CONVERT_T 0x44
+#define WRITE_SCRATCHPAD 0x4E
 #define READ_SCRATCHPAD 0xBE
 #define CONVERSION_TIME 750
+// 85C, read when no conversion took place since power-up
+#define POWER_ON_VALUE 0x0550
+#define DS18S20_POWER_ON_VALUE 0x00AA
+// failed reads in a row until the last temperature is dropped
+#define MAX_FAILED_READS 3
+
+#define DS18XXX_MAX 8
+#define SLICE_INTERVAL 10 // ms between reading two sensors
 
 
-struct ds18xxx_rom {
-  uint64_t family : 8;
-  uint64_t serial : 48;
-  uint64_t crc : 8;
-};
 struct __attribute__ ((__packed__)) ds18xxx_scratchpad {
   int16_t temperature;
   uint8_t th;
   uint8_t tl;
-  union {
-    uint8_t rsvd_1 : 5;
-    uint8_t resolution : 2;
-    uint8_t rsvd_0 : 1;
-    uint8_t val;
-  } cfg;
+  uint8_t cfg; // resolution in bits 5 and 6
   uint8_t rfu;
   uint8_t count_remain;
   uint8_t count_per_c;
   uint8_t crc;
 };
 
-static struct ds18xxx_rom rom;
+static struct ds18xxx_sensor {
+  uint8_t rom[8];
+  char id[17];
+  float temperature;
+  bool valid;
+  bool converted;       // read a conversion since power-up
+  int failed;           // reads in a row
+  int errors;
+} sensors[DS18XXX_MAX];
+
+static int num_sensors = 0;
 static struct mgos_onewire *onewire = NULL;
 static int conversion_time = CONVERSION_TIME;
-static float current_temperature = 0.0;
+static int reading = -1; // sensor read in the current cycle, -1 while idle
+static int conversions = 0;
 
 static void ds18xxx_metrics(struct mg_connection *nc, void *data) {
   mgos_prometheus_metrics_printf(
-        nc, GAUGE, "ds18xxx_temperature", "Current temperature in Celcius",
-        "%f", current_temperature);
+        nc, GAUGE, "ds18xxx_sensors", "Number of sensors found on the bus",
+        "%d", num_sensors);
+  mgos_prometheus_metrics_printf(
+        nc, COUNTER, "ds18xxx_conversions", "Temperature conversions started",
+        "%d", conversions);
+  for(int i = 0; i < num_sensors; i++) {
+    if(sensors[i].valid) {
+      mgos_prometheus_metrics_printf(
+            nc, GAUGE, "ds18xxx_temperature", "Current temperature in Celcius",
+            "{rom=\"%s\"} %f", sensors[i].id, sensors[i].temperature);
+    }
+    mgos_prometheus_metrics_printf(
+          nc, COUNTER, "ds18xxx_errors", "Failed sensor reads",
+          "{rom=\"%s\"} %d", sensors[i].id, sensors[i].errors);
+  }
   (void) data;
 }
 
-static void ds18xxx_temperature_cb(void *userdata) {
+static bool ds18xxx_read(struct ds18xxx_sensor *s) {
   static struct ds18xxx_scratchpad result;
-  struct mgos_onewire *ow = (struct mgos_onewire*) userdata;
-  if (!mgos_onewire_reset(ow)) {
+  if (!mgos_onewire_reset(onewire)) {
     LOG(LL_ERROR, ("ds18xxx: Bus reset failed"));
-    return;
+    return false;
   }
-  mgos_onewire_select(ow, (uint8_t *) &rom);
-  mgos_onewire_write(ow, READ_SCRATCHPAD);
-  mgos_onewire_read_bytes(ow, (uint8_t *) &result, sizeof(result));
+  mgos_onewire_select(onewire, s->rom);
+  mgos_onewire_write(onewire, READ_SCRATCHPAD);
+  mgos_onewire_read_bytes(onewire, (uint8_t *) &result, sizeof(result));
+  record_data(record_sensor, "onewire", &result, sizeof(result));
   uint8_t crc = mgos_onewire_crc8((uint8_t *) &result, sizeof(result) - 1);
   if (crc != result.crc) {
-    LOG(LL_ERROR, ("ds18xxx: Invalid scratchpad CRC: %#02x vs %#02x", crc, result.crc));
-    return;
+    LOG(LL_ERROR, ("ds18xxx %s: Invalid scratchpad CRC: %#02x vs %#02x", s->id, crc, result.crc));
+    return false;
+  }
+  // later it is a genuine 85C
+  int16_t power_on = (s->rom[0] == DS18S20MODEL) ? DS18S20_POWER_ON_VALUE : POWER_ON_VALUE;
+  if (!s->converted && result.temperature == power_on) {
+    LOG(LL_WARN, ("ds18xxx %s: No conversion took place", s->id));
+    return false;
   }
+  s->converted = true;
 
-  if (rom.family == DS18S20MODEL) {
-    current_temperature = ((int16_t)(result.temperature & 0xFFFE) / 2.0) - 0.25 +
+  if (s->rom[0] == DS18S20MODEL) {
+    s->temperature = ((int16_t)(result.temperature & 0xFFFE) / 2.0) - 0.25 +
               ((float) (result.count_per_c - result.count_remain) / result.count_per_c);
   } else {
-    current_temperature = result.temperature * 0.0625f;
+    s->temperature = result.temperature * 0.0625f;
   }
+  return true;
+}
 
-  switch (result.cfg.resolution) {
-    case 0:
-      conversion_time = 94;
-    case 1:
-      conversion_time = 188;
-    case 2:
-      conversion_time = 375;
-    default:
-      conversion_time = 750;
+/*
+ * Reads one sensor per timer slice, each takes ~10ms of bus time with
+ * interrupts disabled for single bits only.
+ */
+static void ds18xxx_slice_cb(void *userdata) {
+  if(reading < 0 || reading >= num_sensors) {
+    reading = -1;
+    return;
+  }
+  struct ds18xxx_sensor *s = &sensors[reading];
+  if(ds18xxx_read(s)) {
+    s->valid = true;
+    s->failed = 0;
+  } else {
+    // the last temperature stands for a few reads
+    s->errors++;
+    if(++s->failed >= MAX_FAILED_READS) {
+      s->valid = false;
+    }
+  }
+  reading++;
+  if(reading < num_sensors) {
+    mgos_set_timer(SLICE_INTERVAL, 0, ds18xxx_slice_cb, userdata);
+  } else {
+    reading = -1;
   }
-
 }
 
+// one CONVERT_T to all sensors with skip ROM, they convert in parallel
 static void ds18xxx_update_cb(void *userdata) {
-  struct mgos_onewire *ow = (struct mgos_onewire*) userdata;
-  if (!mgos_onewire_reset(ow)) {
+  if(reading >= 0) {
+    LOG(LL_WARN, ("ds18xxx: Previous conversion still being read"));
+    return;
+  }
+  if (!mgos_onewire_reset(onewire)) {
+    LOG(LL_ERROR, ("ds18xxx: Bus reset failed"));
+    return;
+  }
+  mgos_onewire_skip(onewire);
+  mgos_onewire_write(onewire, CONVERT_T);
+  conversions++;
+  reading = 0;
+  mgos_set_timer(conversion_time, 0, ds18xxx_slice_cb, userdata);
+}
+
+/*
+ * Sets the resolution of all sensors with a configuration register, each
+ * bit less halves the conversion time. The DS18S20 always takes 750ms.
+ */
+static void ds18xxx_set_resolution(int bits) {
+  bits = MAX(9, MIN(12, bits));
+  conversion_time = CONVERSION_TIME >> (12 - bits);
+  for(int i = 0; i < num_sensors; i++) {
+    if(sensors[i].rom[0] == DS18S20MODEL) {
+      conversion_time = CONVERSION_TIME;
+    }
+  }
+  if (!mgos_onewire_reset(onewire)) {
     LOG(LL_ERROR, ("ds18xxx: Bus reset failed"));
     return;
   }
-  mgos_onewire_select(ow, (uint8_t *) &rom);
-  mgos_onewire_write(ow, CONVERT_T);
-  mgos_set_timer(conversion_time, 0, ds18xxx_temperature_cb, userdata);
+  mgos_onewire_skip(onewire);
+  mgos_onewire_write(onewire, WRITE_SCRATCHPAD);
+  mgos_onewire_write(onewire, 0); // th
+  mgos_onewire_write(onewire, 0); // tl
+  mgos_onewire_write(onewire, ((bits - 9) << 5) | 0x1F);
+  LOG(LL_INFO, ("ds18xxx: %d bit resolution, %dms conversion", bits, conversion_time));
 }
 
-static void ds18xxx_crontab_handler(struct mg_str action,
-                      struct mg_str payload, void *userdata) {
-  LOG(LL_DEBUG, ("%.*s crontab job fired!", action.len, action.p));
-  ds18xxx_update_cb(userdata);
+static void ds18xxx_search() {
+  uint8_t rom[8];
+  num_sensors = 0;
+  mgos_onewire_search_clean(onewire);
+  while(num_sensors < DS18XXX_MAX && mgos_onewire_next(onewire, rom, 0)) {
+    if(mgos_onewire_crc8(rom, 7) != rom[7]) {
+      LOG(LL_ERROR, ("ds18xxx: Invalid ROM CRC"));
+      continue;
+    }
+    struct ds18xxx_sensor *s = &sensors[num_sensors++];
+    memcpy(s->rom, rom, sizeof(rom));
+    for(int i = 0; i < 8; i++) {
+      sprintf(s->id + 2 * i, "%02x", rom[i]);
+    }
+    s->valid = false;
+    s->converted = false;
+    s->failed = 0;
+    s->errors = 0;
+    LOG(LL_INFO, ("Found device %s (family %#02x)", s->id, rom[0]));
+  }
 }
 
 bool ds18xxx_init() {
@@ -110,22 +205,50 @@ bool ds18xxx_init() {
   if(pin == -1) {
     LOG(LL_INFO, ("One wire disabled."));
     return false;
-  } 
+  }
   LOG(LL_INFO, ("One wire pin %d.", pin));
   onewire = mgos_onewire_create(pin);
-  if(mgos_onewire_next(onewire, (uint8_t *) &rom, 0)) {
-    uint8_t family = rom.family;
-    LOG(LL_INFO, ("Found device (family %u)", family));
-  } else {
+  if(onewire == NULL) {
+    LOG(LL_ERROR, ("Couldn't create onewire on pin %d", pin));
+    return false;
+  }
+  ds18xxx_search();
+  if(num_sensors == 0) {
     LOG(LL_ERROR, ("Couldn't find onewire device"));
     return false;
   }
-  mgos_crontab_register_handler(mg_mk_str("ds18xxx.temperature"), ds18xxx_crontab_handler, onewire);
+  ds18xxx_set_resolution(mgos_sys_config_get_onewire_resolution());
+  sched_add("ds18xxx", mgos_sys_config_get_onewire_interval(), 700, sched_priority_telemetry, 10, ds18xxx_update_cb, NULL);
   mgos_prometheus_metrics_add_handler(ds18xxx_metrics, NULL);
   return true;
 }
 
-
+// the hottest sensor, 0 if none could be read
 float ds18xxx_get_temperature() {
-  return current_temperature;
-}
\ No newline at end of file
+  float t = 0.0;
+  bool found = false;
+  for(int i = 0; i < num_sensors; i++) {
+    if(sensors[i].valid && (!found || sensors[i].temperature > t)) {
+      t = sensors[i].temperature;
+      found = true;
+    }
+  }
+  return t;
+}
+
+int ds18xxx_get_count() {
+  return num_sensors;
+}
+
+bool ds18xxx_get_sensor(int i, const char **id, float *temperature) {
+  if(i < 0 || i >= num_sensors || !sensors[i].valid) {
+    return false;
+  }
+  if(id != NULL) {
+    *id = sensors[i].id;
+  }
+  if(temperature != NULL) {
+    *temperature = sensors[i].temperature;
+  }
+  return true;
+}
@@ -0,0 +1,265 @@
+#include "energy.h"
+
+#include "math.h"
+
+#include "adc.h"
+#include "awattar.h"
+#include "battery.h"
+#include "checkpoint.h"
+#include "losstable.h"
+#include "power.h"
+#include "sched.h"
+#include "soyosource.h"
+
+#include "mgos.h"
+#include "mgos_timers.h"
+#include "mgos_prometheus_metrics.h"
+
+#define ENERGY_FILE "energy.json"
+#define TOTALS_FMT "{key: %d, charged: %lf, discharged: %lf, loss: %lf, self_consumed: %lf, " \
+                   "exported: %lf, cost: %lf, value: %lf}"
+#define TOTALS_SCAN(t) &(t).key, &(t).charged, &(t).discharged, &(t).loss, &(t).self_consumed, \
+                       &(t).exported, &(t).cost, &(t).value
+#define TOTALS_PRINT(t) (t).key, (t).charged, (t).discharged, (t).loss, (t).self_consumed, \
+                        (t).exported, (t).cost, (t).value
+#define ENERGY_FMT "{day: " TOTALS_FMT ", month: " TOTALS_FMT ", lifetime: " TOTALS_FMT "}"
+#define ENERGY_PERIODS 3
+// max age of a measurement in s
+#define SAMPLE_MAX_AGE 5.0
+#define SOYO_MAX_AGE 10.0
+// longer gaps are not integrated
+#define GAP_MAX 60.0
+// wall clock considered set
+#define TIME_VALID 1000000000
+
+typedef enum {
+  energy_source_none = 0,
+  energy_source_ina219 = 1,
+  energy_source_ads1115 = 2,
+  energy_source_soyosource = 3,
+} energy_source_t;
+
+static const char *period_names[ENERGY_PERIODS] = { "day", "month", "lifetime" };
+
+static energy_totals_t totals[ENERGY_PERIODS];
+static energy_source_t source = energy_source_none;
+static double last_update = 0;
+static double last_save = 0;
+static float last_price = -1;
+// charging ran while only the discharge side was measured, the ledger misses it
+static bool charge_missed = false;
+
+static void energy_metrics(struct mg_connection *nc, void *data) {
+  for(int i = 0; i < ENERGY_PERIODS; i++) {
+    const energy_totals_t *t = &totals[i];
+    const char *p = period_names[i];
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "energy_charged", "Energy charged into the battery in Wh",
+        "{period=\"%s\"} %f", p, t->charged);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "energy_discharged", "Energy discharged from the battery in Wh",
+        "{period=\"%s\"} %f", p, t->discharged);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "energy_loss", "Energy lost in the inverter in Wh",
+        "{period=\"%s\"} %f", p, t->loss);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "energy_self_consumed", "Energy out used in the house in Wh",
+        "{period=\"%s\"} %f", p, t->self_consumed);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "energy_exported", "Energy out fed to the grid in Wh",
+        "{period=\"%s\"} %f", p, t->exported);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "energy_cost", "Price paid for charged energy in EUR",
+        "{period=\"%s\"} %f", p, t->cost);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "energy_value", "Price of grid energy replaced in EUR",
+        "{period=\"%s\"} %f", p, t->value);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "energy_savings", "Value minus cost in EUR",
+        "{period=\"%s\"} %f", p, t->value - t->cost);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "energy_efficiency", "Round trip efficiency, AC out per DC charged, -1 if charging is not measured",
+        "{period=\"%s\"} %f", p, energy_get_efficiency(i));
+  }
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "energy_source", "Measurement integrated, 0: none, 1: ina219, 2: ads1115, 3: soyosource",
+      "%d", source);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "energy_charge_measured", "Charging was measured whenever it ran since boot",
+      "%d", !charge_missed);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "energy_price", "Price of the current slot in EUR/kWh, -1 if unknown",
+      "%f", last_price);
+
+  (void) data;
+}
+
+int energy_print_json(struct json_out *out, va_list *ap) {
+  (void) ap;
+  return json_printf(out, ENERGY_FMT,
+      TOTALS_PRINT(totals[energy_day]), TOTALS_PRINT(totals[energy_month]),
+      TOTALS_PRINT(totals[energy_lifetime]));
+}
+
+static void energy_save() {
+  if(json_fprintf(ENERGY_FILE, "%M", energy_print_json) < 0) {
+    LOG(LL_ERROR, ("Failed to save %s", ENERGY_FILE));
+    return;
+  }
+  last_save = mgos_uptime();
+}
+
+static void energy_load() {
+  char *content = json_fread(ENERGY_FILE);
+  if(content == NULL) {
+    LOG(LL_INFO, ("No %s, starting empty ledger", ENERGY_FILE));
+    return;
+  }
+  if(json_scanf(content, strlen(content), ENERGY_FMT,
+      TOTALS_SCAN(totals[energy_day]), TOTALS_SCAN(totals[energy_month]),
+      TOTALS_SCAN(totals[energy_lifetime])) != 3 * 8) {
+    LOG(LL_WARN, ("Invalid %s, starting empty ledger", ENERGY_FILE));
+    memset(totals, 0, sizeof(totals));
+  }
+  free(content);
+  LOG(LL_INFO, ("Loaded ledger, lifetime %.0fWh in, %.0fWh out",
+    totals[energy_lifetime].charged, totals[energy_lifetime].discharged));
+}
+
+// the awattar slot without requesting missing prices, false if none
+static bool energy_get_price(time_t now, float *price) {
+  awattar_pricing_t *entries = awattar_get_entries();
+  int count = awattar_get_entries_count();
+  for(int i = 0; i < count; i++) {
+    if(entries[i].start <= now && entries[i].end > now) {
+      *price = entries[i].price;
+      return true;
+    }
+  }
+  return false;
+}
+
+// measured DC power, positive out of the battery
+static energy_source_t energy_read_dc(float *dc) {
+  double now = mgos_uptime();
+  double sample = battery_get_sample_time();
+  if(mgos_sys_config_get_battery_instrument() == 1 && sample > 0 && now - sample < SAMPLE_MAX_AGE) {
+    *dc = battery_read_voltage() * battery_read_current();
+    return energy_source_ina219;
+  }
+  if(adc_available()) {
+    *dc = adc_get_power_out() - adc_get_power_in();
+    return energy_source_ads1115;
+  }
+  double soyo = soyosource_get_last_update();
+  if(soyosource_get_enabled() && soyo > 0 && now - soyo < SOYO_MAX_AGE) {
+    // discharge only, charging is not measured
+    *dc = soyosource_get_last_voltage() * soyosource_get_last_current();
+    return energy_source_soyosource;
+  }
+  return energy_source_none;
+}
+
+// starts a new day or month, the ended one is saved right away
+static void energy_rollover(time_t now) {
+  struct tm tm;
+  localtime_r(&now, &tm);
+  int keys[2] = { (tm.tm_year + 1900) * 1000 + tm.tm_yday, (tm.tm_year + 1900) * 100 + tm.tm_mon + 1 };
+  bool changed = false;
+  for(int i = 0; i < 2; i++) {
+    if(totals[i].key != keys[i]) {
+      if(totals[i].key != 0) {
+        LOG(LL_INFO, ("Ledger %s %d: %.0fWh in, %.0fWh out, savings %.2f EUR", period_names[i], totals[i].key,
+          totals[i].charged, totals[i].discharged, totals[i].value - totals[i].cost));
+        changed = true;
+      }
+      memset(&totals[i], 0, sizeof(totals[i]));
+      totals[i].key = keys[i];
+    }
+  }
+  if(changed) {
+    energy_save();
+  }
+}
+
+static void energy_add(energy_totals_t *t, float dc, float ac, float exported, float price, double hours) {
+  if(dc >= 0) {
+    t->discharged += dc * hours;
+    t->loss += (dc - ac) * hours;
+    t->exported += exported * hours;
+    t->self_consumed += (ac - exported) * hours;
+    t->value += (ac - exported) * hours / 1000.0 * price;
+  } else {
+    t->charged -= dc * hours;
+    t->cost -= dc * hours / 1000.0 * price;
+  }
+}
+
+static void energy_update_cb(void *arg) {
+  double now = mgos_uptime();
+  double hours = (now - last_update) / 3600.0;
+  last_update = now;
+
+  float dc = 0;
+  source = energy_read_dc(&dc);
+  if(source == energy_source_none || hours * 3600.0 > GAP_MAX) {
+    return;
+  }
+  if(source == energy_source_soyosource && power_get_state() == power_in && !charge_missed) {
+    LOG(LL_WARN, ("Charging not measured by soyosource, ledger incomplete"));
+    charge_missed = true;
+  }
+  float ac = (dc > 0) ? losstable_dc_to_ac(dc) : 0;
+  // negative total power at the meter is fed to the grid
+  float exported = fminf(ac, fmaxf(0, -power_get_total_power()));
+
+  time_t t = time(NULL);
+  float price = 0;
+  last_price = energy_get_price(t, &price) ? price : -1;
+  if(t > TIME_VALID) {
+    energy_rollover(t);
+    energy_add(&totals[energy_day], dc, ac, exported, price, hours);
+    energy_add(&totals[energy_month], dc, ac, exported, price, hours);
+  }
+  energy_add(&totals[energy_lifetime], dc, ac, exported, price, hours);
+
+  if(now - last_save > mgos_sys_config_get_energy_save_interval()) {
+    energy_save();
+  }
+
+  (void) arg;
+}
+
+bool energy_init() {
+  memset(totals, 0, sizeof(totals));
+  if(!mgos_sys_config_get_energy_enable()) {
+    return false;
+  }
+  energy_load();
+  // the checkpoint is written more often, newer if it counted more
+  const checkpoint_state_t *checkpoint = checkpoint_get();
+  if(checkpoint != NULL) {
+    const energy_totals_t *c = &checkpoint->energy[energy_lifetime];
+    const energy_totals_t *f = &totals[energy_lifetime];
+    if(c->charged + c->discharged > f->charged + f->discharged) {
+      memcpy(totals, checkpoint->energy, sizeof(totals));
+    }
+  }
+  last_update = mgos_uptime();
+  last_save = last_update;
+  sched_add("energy", mgos_sys_config_get_energy_interval(), 600, sched_priority_background, 10, energy_update_cb, NULL);
+  mgos_prometheus_metrics_add_handler(energy_metrics, NULL);
+  return true;
+}
+
+const energy_totals_t *energy_get_totals(energy_period_t period) {
+  return &totals[period];
+}
+
+float energy_get_efficiency(energy_period_t period) {
+  const energy_totals_t *t = &totals[period];
+  if(charge_missed) {
+    return -1;
+  }
+  return (t->charged > 0) ? (t->discharged - t->loss) / t->charged : 0;
+}
@@ -1,23 +1,48 @@
 #include "fan.h"
+#include "ds18xxx.h"
+#include "sched.h"
 
 #include "mgos.h"
 #include "mgos_pwm.h"
 #include "mgos_prometheus_metrics.h"
 
-#define FAN_NUM 1
+#if CS_PLATFORM == CS_P_ESP32
+#include "driver/pcnt.h"
+#endif
+
+#define FAN_NUM 3
 #define FAN_PWM_FREQ 25000
 #define TIMER_INTERVAL 1000
+#define FAN_SPEED_MAX 100
+#define FAN_DEBOUNCE_US 1000 // shortest pulse accepted, 6000 rpm at 2 pulses are 5ms
+#define FAN_SPINUP_TIME 3.0  // seconds after turning on before checking rpm
+#define FAN_STALL_TIME 5.0   // seconds below stall_rpm before the fan counts as stalled
+#define PCNT_FILTER 1023     // APB clock cycles, ~12.8us glitch filter
 
 static struct fan {
   const struct mgos_config_fan *config;
   int index;
   int rpm;
   float pwm;
-  int count; // ISR context
+  int speed;
+  int manual;     // speed set by rpc, -1 for closed loop control
+  float integral; // integral part of the controller in %
+  bool running;
+  double started; // uptime the fan was turned on
+  double slow;    // seconds below stall_rpm
+  bool stalled;
+  int stalls;
+  uint32_t last_pulses;
+  double last_read;
+  volatile uint32_t pulses; // written in ISR context only
+  volatile int64_t last_edge;
 } fan[FAN_NUM];
 
 static void fan_metrics(struct mg_connection *nc, void *data) {
   for(int i = 0; i < FAN_NUM; i++) {
+    if(!fan[i].config->enable) {
+      continue;
+    }
     mgos_prometheus_metrics_printf(
         nc, GAUGE, "fan_rpm", "Fan rpm",
         "{unit=\"%d\"} %d", i, fan[i].rpm);
@@ -25,68 +50,240 @@ static void fan_metrics(struct mg_connection *nc, void *data) {
       nc, GAUGE, "fan_pwm", "Fan pwm",
       "{unit=\"%d\"} %f", i, fan[i].pwm);
     mgos_prometheus_metrics_printf(
-        nc, GAUGE, "fan_count", "Fan count",
-        "{unit=\"%d\"} %d", i, fan[i].count);
+        nc, COUNTER, "fan_pulses", "Tachometer pulses counted",
+        "{unit=\"%d\"} %u", i, fan[i].last_pulses);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "fan_stalled", "Fan does not turn although driven",
+        "{unit=\"%d\"} %d", i, fan[i].stalled);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "fan_stalls", "Number of detected fan stalls",
+        "{unit=\"%d\"} %d", i, fan[i].stalls);
  }
+ (void) data;
 }
 
 static const struct mgos_config_fan * fan_get_config(int fan) {
   switch (fan) {
   case 0:
     return mgos_sys_config_get_fan();
-  // case 1:
-  //   return mgos_sys_config_get_fan1();
-  // case 2:
-  //   return mgos_sys_config_get_fan2();
+  case 1:
+    return mgos_sys_config_get_fan1();
+  case 2:
+    return mgos_sys_config_get_fan2();
   default:
     return NULL;
   }
 }
 
-static void rpm_handler(void *arg) {
-  for(int i = 0; i < FAN_NUM; i++) {
-//    mgos_gpio_disable_int(fan[i].config->rpm_pin);
-    fan[i].rpm = fan[i].count * 30000 / TIMER_INTERVAL;
-    fan[i].count = 0;
-//    mgos_gpio_enable_int(fan[i].config->rpm_pin);
+#if CS_PLATFORM == CS_P_ESP32
+
+/*
+ * The PCNT peripheral counts the tachometer edges in hardware, one unit per
+ * fan. Its glitch filter replaces the debouncing done in software otherwise.
+ */
+static bool fan_counter_init(struct fan *f) {
+  pcnt_unit_t unit = PCNT_UNIT_0 + f->index;
+  pcnt_config_t cfg = {
+    .pulse_gpio_num = f->config->rpm_pin,
+    .ctrl_gpio_num = PCNT_PIN_NOT_USED,
+    .channel = PCNT_CHANNEL_0,
+    .unit = unit,
+    .pos_mode = PCNT_COUNT_DIS,
+    .neg_mode = PCNT_COUNT_INC,
+    .lctrl_mode = PCNT_MODE_KEEP,
+    .hctrl_mode = PCNT_MODE_KEEP,
+    .counter_h_lim = INT16_MAX,
+    .counter_l_lim = 0,
+  };
+  if(pcnt_unit_config(&cfg) != ESP_OK) {
+    return false;
   }
+  mgos_gpio_set_pull(f->config->rpm_pin, MGOS_GPIO_PULL_UP);
+  pcnt_set_filter_value(unit, PCNT_FILTER);
+  pcnt_filter_enable(unit);
+  pcnt_counter_pause(unit);
+  pcnt_counter_clear(unit);
+  pcnt_counter_resume(unit);
+  return true;
 }
 
-IRAM void counter_isr(int pin, void *arg) {
+static uint32_t fan_counter_read(struct fan *f) {
+  int16_t count = 0;
+  pcnt_get_counter_value(PCNT_UNIT_0 + f->index, &count);
+  pcnt_counter_clear(PCNT_UNIT_0 + f->index);
+  f->pulses += count;
+  return f->pulses;
+}
+
+#else
+
+/*
+ * Without a pulse counter every falling edge raises an interrupt. Edges
+ * closer than FAN_DEBOUNCE_US are ringing of the open collector output.
+ * The counter is only written here and read as a whole word elsewhere.
+ */
+static IRAM void counter_isr(int pin, void *arg) {
   struct fan *fan = (struct fan *) arg;
-  fan->count++;
+  int64_t now = mgos_uptime_micros();
+  if(now - fan->last_edge >= FAN_DEBOUNCE_US) {
+    fan->pulses++;
+    fan->last_edge = now;
+  }
   mgos_gpio_clear_int(pin);
 }
 
+static bool fan_counter_init(struct fan *f) {
+  mgos_gpio_set_mode(f->config->rpm_pin, MGOS_GPIO_MODE_INPUT);
+  mgos_gpio_setup_input(f->config->rpm_pin, MGOS_GPIO_PULL_UP);
+  if(!mgos_gpio_set_int_handler_isr(f->config->rpm_pin, MGOS_GPIO_INT_EDGE_NEG,
+                                    counter_isr, (void *) f)) {
+    return false;
+  }
+  return mgos_gpio_enable_int(f->config->rpm_pin);
+}
+
+static uint32_t fan_counter_read(struct fan *f) {
+  return f->pulses;
+}
+
+#endif
+
+static void fan_apply(struct fan *f, int s) {
+  s = MAX(0, MIN(FAN_SPEED_MAX, s));
+  if(s == f->speed) {
+    return;
+  }
+  float pwm = s / 100.0;
+  if(!mgos_pwm_set(f->config->pwm_pin, FAN_PWM_FREQ, pwm)) {
+    LOG(LL_ERROR, ("Failed to set pwm for fan %d [%d] to %d%%", f->index, f->config->pwm_pin, s));
+    return;
+  }
+  if(f->speed <= 0 && s > 0) {
+    f->started = mgos_uptime();
+    f->slow = 0;
+  }
+  f->pwm = pwm;
+  f->speed = s;
+}
+
+static void fan_update_rpm(struct fan *f) {
+  double now = mgos_uptime();
+  uint32_t pulses = fan_counter_read(f);
+  double dt = now - f->last_read;
+  if(dt > 0 && f->config->pulses > 0) {
+    f->rpm = (int) ((uint32_t) (pulses - f->last_pulses) * 60.0 / f->config->pulses / dt);
+  }
+  f->last_pulses = pulses;
+  f->last_read = now;
+}
+
+/*
+ * A driven fan below stall_rpm after spinning up is blocked or broken. It
+ * gets full speed to break loose until it turns again.
+ */
+static void fan_check_stall(struct fan *f, double dt) {
+  if(f->config->rpm_pin < 0 || f->config->stall_rpm <= 0 || f->speed <= 0 ||
+     mgos_uptime() - f->started < FAN_SPINUP_TIME) {
+    f->slow = 0;
+    return;
+  }
+  if(f->rpm >= f->config->stall_rpm) {
+    if(f->stalled) {
+      LOG(LL_INFO, ("fan %d turns again at %d rpm", f->index, f->rpm));
+    }
+    f->stalled = false;
+    f->slow = 0;
+    return;
+  }
+  f->slow += dt;
+  if(!f->stalled && f->slow >= FAN_STALL_TIME) {
+    LOG(LL_ERROR, ("fan %d stalled: %d rpm at %d%%", f->index, f->rpm, f->speed));
+    f->stalled = true;
+    f->stalls++;
+  }
+}
+
+/*
+ * PI controller holding temp_target. The fan starts at the target and stops
+ * hysteresis below it, in between it runs at least at speed_min. The
+ * integral is limited to the output range so it does not wind up while the
+ * fan is off or at full speed.
+ */
+static int fan_control(struct fan *f, float temp, double dt) {
+  const struct mgos_config_fan *c = f->config;
+  if(temp == 0) {
+    f->integral = 0;
+    return FAN_SPEED_MAX;
+  }
+  float error = temp - c->temp_target;
+  if(temp >= c->temp_max) {
+    f->running = true;
+    return FAN_SPEED_MAX;
+  }
+  if(error <= -c->hysteresis || (!f->running && error < 0)) {
+    f->running = false;
+    f->integral = 0;
+    return 0;
+  }
+  f->running = true;
+  f->integral = MAX(0, MIN(FAN_SPEED_MAX, f->integral + c->ki * error * dt));
+  int speed = (int) (c->kp * error + f->integral);
+  return MAX(c->speed_min, MIN(FAN_SPEED_MAX, speed));
+}
+
+static void fan_timer_cb(void *arg) {
+  float temp = ds18xxx_get_temperature();
+  static bool warned = false;
+  if(temp == 0 && !warned) {
+    LOG(LL_WARN, ("Temperature is 0. Sensor failed?"));
+  }
+  warned = (temp == 0);
+  for(int i = 0; i < FAN_NUM; i++) {
+    struct fan *f = &fan[i];
+    if(!f->config->enable) {
+      continue;
+    }
+    double dt = mgos_uptime() - f->last_read;
+    if(f->config->rpm_pin >= 0) {
+      fan_update_rpm(f);
+    } else {
+      f->last_read = mgos_uptime();
+    }
+    fan_check_stall(f, dt);
+    int speed = f->manual >= 0 ? f->manual : fan_control(f, temp, dt);
+    fan_apply(f, f->stalled ? FAN_SPEED_MAX : speed);
+  }
+  (void) arg;
+}
+
 bool fan_init() {
   mgos_prometheus_metrics_add_handler(fan_metrics, NULL);
   for(int i = 0; i < FAN_NUM; i++) {
     fan[i].index = i;
     fan[i].pwm = 0.0;
-    fan[i].count = 0;
+    fan[i].speed = -1;
+    fan[i].manual = -1;
+    fan[i].pulses = 0;
+    fan[i].last_read = mgos_uptime();
     fan[i].config = fan_get_config(i);
     if(fan[i].config->enable) {
       mgos_gpio_set_mode(fan[i].config->pwm_pin, MGOS_GPIO_MODE_OUTPUT_OD);
-      if(!mgos_pwm_set(fan[i].config->pwm_pin, FAN_PWM_FREQ, fan[i].pwm)) {
-        LOG(LL_ERROR, ("Failed to set pwm for fan %d [%d]", i, fan[i].config->pwm_pin));
+      fan_apply(&fan[i], 0);
+      if(fan[i].config->rpm_pin >= 0 && !fan_counter_init(&fan[i])) {
+        LOG(LL_ERROR, ("Failed to set up rpm counter for fan %d [%d]", i, fan[i].config->rpm_pin));
       }
-      mgos_gpio_set_mode(fan[i].config->rpm_pin, MGOS_GPIO_MODE_INPUT);
-      mgos_gpio_setup_input(fan[i].config->rpm_pin, MGOS_GPIO_PULL_UP);
-      if(!mgos_gpio_set_int_handler_isr(fan[i].config->rpm_pin, MGOS_GPIO_INT_EDGE_NEG,
-                                   counter_isr, (void *) &(fan[i]))) {
-        LOG(LL_ERROR, ("Failed to set rpm interrupt for fan %d [%d]", i, fan[i].config->rpm_pin));
-      }
-      mgos_gpio_enable_int(fan[i].config->rpm_pin);
     }
   }
-  mgos_set_timer(TIMER_INTERVAL, MGOS_TIMER_REPEAT, rpm_handler, NULL);
+  sched_add("fan", TIMER_INTERVAL, 300, sched_priority_background, 5, fan_timer_cb, NULL);
 
   return true;
 }
 
 void fan_set_speeds(int s) {
   for(int i = 0; i < FAN_NUM; i++) {
-    fan_set_speed(i, s);
+    if(fan[i].config->enable) {
+      fan_set_speed(i, s);
+    }
   }
 }
 
@@ -100,10 +297,15 @@ void fan_set_speed(int i, int s) {
     return;
   }
 
-  float pwm = s / 100.0;
-  if(mgos_pwm_set(fan[i].config->pwm_pin, FAN_PWM_FREQ, pwm)) {
-    fan[i].pwm = pwm;
-  } else {
-    LOG(LL_ERROR, ("Failed to set pwm for fan %d [%d] to %d%%", i, fan[i].config->pwm_pin, s));
-  } 
-}
\ No newline at end of file
+  fan[i].manual = s < 0 ? -1 : MIN(FAN_SPEED_MAX, s);
+  if(fan[i].manual >= 0) {
+    fan_apply(&fan[i], fan[i].manual);
+  }
+}
+
+int fan_get_rpm(int i) {
+  if(i >= FAN_NUM || i < 0) {
+    return -1;
+  }
+  return fan[i].rpm;
+}
@@ -0,0 +1,186 @@
+#include "feedback.h"
+
+#include "math.h"
+
+#include "adc.h"
+#include "checkpoint.h"
+#include "losstable.h"
+#include "sched.h"
+#include "soyosource.h"
+
+#include "mgos.h"
+#include "mgos_timers.h"
+#include "mgos_prometheus_metrics.h"
+
+#define GAIN_MIN 0.5f
+#define GAIN_MAX 1.5f
+// weight of one observation for the gain
+#define GAIN_LEARN_RATE 0.05f
+#define METER_LEARN_RATE 0.02f
+// only learn the gain once the output settled after a command
+#define SETTLE_TIME 5.0
+
+// requested delivered power and the command sent for it
+static float target = 0;
+static float commanded = 0;
+static double last_command = 0;
+static float delivered = 0;
+static double last_measurement = 0;
+static float gain = 1.0;
+
+static float soyo_power = -1;
+static float adc_power = -1;
+
+static struct {
+  float delta;
+  float meter_before;
+  double time;
+} step;
+static float last_total_power = 0;
+static int meter_samples = 0;
+
+static void feedback_metrics(struct mg_connection *nc, void *data) {
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "feedback_power_out", "Delivered power out in W",
+      "%f", delivered);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "feedback_power_out_target", "Requested power out in W",
+      "%f", target);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "feedback_power_out_commanded", "Commanded power out in W",
+      "%f", commanded);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "feedback_tracking_error", "Requested minus delivered power out in W",
+      "%f", feedback_get_tracking_error());
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "feedback_gain", "Delivered per commanded power out",
+      "%f", gain);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "feedback_source_power", "Power out by measurement source in W",
+      "{source=\"soyosource\"} %f", soyo_power);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "feedback_source_power", "Power out by measurement source in W",
+      "{source=\"ads1115\"} %f", adc_power);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "feedback_meter_samples", "Power out steps learned from the meter response",
+      "%d", meter_samples);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "feedback_available", "Delivered power out is measured",
+      "%d", feedback_available());
+
+  (void) data;
+}
+
+static void feedback_learn_gain(float observed, float rate) {
+  if(!isfinite(observed)) {
+    return;
+  }
+  observed = fminf(GAIN_MAX, fmaxf(GAIN_MIN, observed));
+  gain += rate * (observed - gain);
+}
+
+static void feedback_timer_cb(void *arg) {
+  double now = mgos_uptime();
+  double max_age = mgos_sys_config_get_feedback_max_age();
+  float soyo_weight = mgos_sys_config_get_feedback_soyo_weight();
+  float adc_weight = mgos_sys_config_get_feedback_adc_weight();
+  float sum = 0, weight = 0;
+
+  soyo_power = -1;
+  double soyo_update = soyosource_get_last_update();
+  if(soyo_weight > 0 && soyosource_get_enabled() && soyo_update > 0 && (now - soyo_update) < max_age) {
+    soyo_power = soyosource_get_power_out();
+    sum += soyo_weight * soyo_power;
+    weight += soyo_weight;
+  }
+
+  adc_power = -1;
+  if(adc_weight > 0 && adc_available()) {
+    // DC side, same loss model as the soyosource reading
+    adc_power = losstable_dc_to_ac(adc_get_power_out());
+    sum += adc_weight * adc_power;
+    weight += adc_weight;
+  }
+
+  if(weight == 0) {
+    return;
+  }
+  float measured = sum / weight;
+  float filter = mgos_sys_config_get_feedback_filter();
+  delivered += filter * (measured - delivered);
+  last_measurement = now;
+
+  if(commanded > 0 && (now - last_command) > SETTLE_TIME) {
+    feedback_learn_gain(delivered / commanded, GAIN_LEARN_RATE);
+  }
+
+  (void) arg;
+}
+
+bool feedback_init() {
+  if(!mgos_sys_config_get_feedback_enable()) {
+    LOG(LL_INFO, ("Power out feedback disabled"));
+    return false;
+  }
+  memset(&step, 0, sizeof(step));
+  const checkpoint_state_t *checkpoint = checkpoint_get();
+  if(checkpoint != NULL && isfinite(checkpoint->feedback_gain)) {
+    gain = fminf(GAIN_MAX, fmaxf(GAIN_MIN, checkpoint->feedback_gain));
+  }
+  sched_add("feedback", mgos_sys_config_get_feedback_interval(), 200, sched_priority_control, 5, feedback_timer_cb, NULL);
+  mgos_prometheus_metrics_add_handler(feedback_metrics, NULL);
+  return true;
+}
+
+bool feedback_available() {
+  return last_measurement > 0
+    && (mgos_uptime() - last_measurement) < mgos_sys_config_get_feedback_max_age();
+}
+
+float feedback_command(float power) {
+  float command = (power > 0) ? power / gain : 0;
+  float delta = command - commanded;
+  // predict, corrected by the next measurements
+  delivered = (power > 0) ? fmaxf(0, delivered + (power - target)) : 0;
+  target = power;
+  commanded = command;
+  last_command = mgos_uptime();
+
+  step.delta = 0;
+  if(fabsf(delta) >= mgos_sys_config_get_feedback_step_min()) {
+    step.delta = delta;
+    step.meter_before = last_total_power;
+    step.time = last_command;
+  }
+  return command;
+}
+
+void feedback_meter_update(float total_power) {
+  last_total_power = total_power;
+  if(!mgos_sys_config_get_feedback_enable() || step.delta == 0 || (mgos_uptime() - step.time) < mgos_sys_config_get_feedback_meter_delay()) {
+    return;
+  }
+  if(losstable_learning()) {
+    // the loss table learns from this response, a gain on top corrects the loss twice
+    step.delta = 0;
+    return;
+  }
+  // more power out shows as less total power at the meter
+  float response = step.meter_before - total_power;
+  feedback_learn_gain(response / step.delta, METER_LEARN_RATE);
+  meter_samples++;
+  LOG(LL_INFO, ("Meter response %.2fW for step %.2fW, gain %.3f", response, step.delta, gain));
+  step.delta = 0;
+}
+
+float feedback_get_power_out() {
+  return feedback_available() ? delivered : target;
+}
+
+float feedback_get_gain() {
+  return gain;
+}
+
+float feedback_get_tracking_error() {
+  return target - feedback_get_power_out();
+}
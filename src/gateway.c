@@ -0,0 +1,30 @@
+#include "gateway.h"
+
+#include "mgos.h"
+
+// keep in sync with the routes of tools/gateway/gateway.c
+static const struct {
+  const char *name;
+  const char *upstream;
+} routes[] = {
+  { "discovergy", "https://api.discovergy.com/public/v1" },
+  { "awattar", "https://api.awattar.de/v1" },
+  { "weatherkit", "https://weatherkit.apple.com/api/v1" },
+};
+
+int gateway_url(char *url, size_t size, const char *upstream) {
+  const char *base = mgos_sys_config_get_gateway_url();
+  if(mgos_sys_config_get_gateway_enable() && base != NULL && base[0] != '\0') {
+    int len = strlen(base);
+    if(base[len - 1] == '/') {
+      len--;
+    }
+    for(size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+      size_t n = strlen(routes[i].upstream);
+      if(strncmp(upstream, routes[i].upstream, n) == 0) {
+        return snprintf(url, size, "%.*s/%s%s", len, base, routes[i].name, upstream + n);
+      }
+    }
+  }
+  return snprintf(url, size, "%s", upstream);
+}
@@ -0,0 +1,125 @@
+#include "heap.h"
+
+#include "sched.h"
+
+#include "mgos.h"
+#include "mgos_prometheus_metrics.h"
+
+#if CS_PLATFORM == CS_P_ESP32
+#include "esp_heap_caps.h"
+#elif CS_PLATFORM == CS_P_ESP8266
+#include "umm_malloc.h"
+// umm_malloc allocates in blocks of 8 bytes
+#define UMM_BLOCK_BYTES 8
+#endif
+
+#define HEAP_MODULES 32
+#define HEAP_INTERVAL 1000
+
+static struct {
+  const char *name;
+  long bytes;
+} modules[HEAP_MODULES];
+static int module_count = 0;
+
+static size_t largest_min = 0;
+static int block_low_count = 0;
+static bool block_low = false;
+
+static void heap_metrics(struct mg_connection *nc, void *data) {
+  size_t free = heap_get_free();
+  size_t largest = heap_get_largest_block();
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "heap_size", "Heap size in bytes",
+      "%lu", (unsigned long) mgos_get_heap_size());
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "heap_free", "Free heap in bytes",
+      "%lu", (unsigned long) free);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "heap_free_min", "Lowest free heap since boot in bytes",
+      "%lu", (unsigned long) mgos_get_min_free_heap_size());
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "heap_largest_block", "Largest free block in bytes",
+      "%lu", (unsigned long) largest);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "heap_largest_block_min", "Smallest largest free block sampled in bytes",
+      "%lu", (unsigned long) largest_min);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "heap_fragmentation", "Share of free heap not in the largest block",
+      "%f", (free > 0) ? 1.0 - (double) largest / free : 0.0);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "heap_block_low", "Times the largest free block fell below heap.block_min",
+      "%d", block_low_count);
+  for(int i = 0; i < module_count; i++) {
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "heap_module_bytes", "Heap taken by a module in bytes",
+        "{module=\"%s\"} %ld", modules[i].name, modules[i].bytes);
+  }
+
+  (void) data;
+}
+
+// the SDK tracks the free low-water, the largest block is sampled
+static void heap_sample_cb(void *arg) {
+  size_t free = heap_get_free();
+  size_t largest = heap_get_largest_block();
+  if(largest_min == 0 || largest < largest_min) {
+    largest_min = largest;
+  }
+  bool low = largest > 0 && largest < (size_t) mgos_sys_config_get_heap_block_min();
+  if(low && !block_low) {
+    block_low_count++;
+    LOG(LL_WARN, ("Largest free block %lu of %lu bytes free", (unsigned long) largest, (unsigned long) free));
+  }
+  block_low = low;
+
+  (void) arg;
+}
+
+bool heap_init() {
+  mgos_prometheus_metrics_add_handler(heap_metrics, NULL);
+  sched_add("heap", HEAP_INTERVAL, 950, sched_priority_background, 5, heap_sample_cb, NULL);
+  return true;
+}
+
+size_t heap_get_free() {
+  return mgos_get_free_heap_size();
+}
+
+size_t heap_get_largest_block() {
+#if CS_PLATFORM == CS_P_ESP32
+  return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#elif CS_PLATFORM == CS_P_ESP8266
+  // walks the heap, fine at the sample interval
+  umm_info(NULL, 0);
+  return (size_t) ummHeapInfo.maxFreeContiguousBlocks * UMM_BLOCK_BYTES;
+#else
+  return mgos_get_free_heap_size();
+#endif
+}
+
+void heap_account(const char *module, long bytes) {
+  for(int i = 0; i < module_count; i++) {
+    if(strcmp(modules[i].name, module) == 0) {
+      modules[i].bytes += bytes;
+      return;
+    }
+  }
+  if(module_count == HEAP_MODULES) {
+    return;
+  }
+  modules[module_count].name = module;
+  modules[module_count].bytes = bytes;
+  module_count++;
+}
+
+/*
+ * Sized once instead of grown by appends, the buffer is released with the
+ * connection. A reply beyond the limit stalls until the connection times out.
+ */
+void heap_bound_reply(struct mg_connection *nc, size_t size, size_t limit) {
+  if(nc->recv_mbuf.size < size) {
+    mbuf_resize(&nc->recv_mbuf, size);
+  }
+  nc->recv_mbuf_limit = limit;
+}
@@ -0,0 +1,69 @@
+#include "histogram.h"
+
+#include "mgos.h"
+
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+void histogram_init(histogram_t *h, const double *bounds, int num_bounds) {
+  memset(h, 0, sizeof(*h));
+  h->bounds = bounds;
+  h->num_bounds = MIN(num_bounds, HISTOGRAM_BUCKETS);
+}
+
+void histogram_observe(histogram_t *h, double value) {
+  int b = 0;
+  while(b < h->num_bounds && value > h->bounds[b]) {
+    b++;
+  }
+  h->counts[b]++;
+  h->count++;
+  h->sum += value;
+  h->max = MAX(h->max, value);
+}
+
+// linear within the bucket holding the rank, the last one ends at the max seen
+double histogram_quantile(const histogram_t *h, double q) {
+  if(h->count == 0) {
+    return 0;
+  }
+  double rank = q * h->count;
+  int cumulative = 0;
+  for(int b = 0; b <= h->num_bounds; b++) {
+    if(h->counts[b] == 0 || cumulative + h->counts[b] < rank) {
+      cumulative += h->counts[b];
+      continue;
+    }
+    double lower = (b > 0) ? h->bounds[b - 1] : 0;
+    double upper = (b < h->num_bounds) ? h->bounds[b] : h->max;
+    upper = MIN(upper, h->max);
+    lower = MIN(lower, upper);
+    return lower + (upper - lower) * (rank - cumulative) / h->counts[b];
+  }
+  return h->max;
+}
+
+void histogram_print(struct mg_connection *nc, const char *name, const char *descr,
+                     const char *labels, const histogram_t *h) {
+  char metric[64];
+  const char *sep = (labels[0] != '\0') ? "," : "";
+  int cumulative = 0;
+  snprintf(metric, sizeof(metric), "%s_bucket", name);
+  for(int b = 0; b <= h->num_bounds; b++) {
+    cumulative += h->counts[b];
+    if(b < h->num_bounds) {
+      mgos_prometheus_metrics_printf(nc, COUNTER, metric, descr,
+          "{%s%sle=\"%g\"} %d", labels, sep, h->bounds[b], cumulative);
+    } else {
+      mgos_prometheus_metrics_printf(nc, COUNTER, metric, descr,
+          "{%s%sle=\"+Inf\"} %d", labels, sep, cumulative);
+    }
+  }
+  snprintf(metric, sizeof(metric), "%s_sum", name);
+  mgos_prometheus_metrics_printf(nc, COUNTER, metric, descr, "{%s} %f", labels, h->sum);
+  snprintf(metric, sizeof(metric), "%s_count", name);
+  mgos_prometheus_metrics_printf(nc, COUNTER, metric, descr, "{%s} %d", labels, h->count);
+  for(size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+    mgos_prometheus_metrics_printf(nc, GAUGE, name, descr,
+        "{%s%squantile=\"%g\"} %f", labels, sep, quantiles[i], histogram_quantile(h, quantiles[i]));
+  }
+}
@@ -0,0 +1,195 @@
+#include "i2cbus.h"
+
+#include "mgos.h"
+#include "mgos_prometheus_metrics.h"
+
+#define I2CBUS_DEVICES 8
+#define I2CBUS_QUEUE 16
+#define I2CBUS_PRIORITIES 4
+// bus time per event loop slice before yielding
+#define I2CBUS_SLICE_US 5000
+
+static const char *priority_names[I2CBUS_PRIORITIES] = { "control", "protection", "telemetry", "metrics" };
+
+static struct i2cbus_device {
+  const char *name;
+  int addr;
+  int transactions;
+  int errors;
+  int retries;
+} devices[I2CBUS_DEVICES];
+static int device_count = 0;
+
+static struct i2cbus_job {
+  int device;
+  i2cbus_priority_t priority;
+  i2cbus_fn_t fn;
+  i2cbus_done_t done;
+  void *arg;
+  int64_t submitted;
+} queue[I2CBUS_QUEUE];
+static int queue_len = 0;
+static bool scheduled = false;
+static int last_device = -1;
+static int dropped = 0;
+
+static struct {
+  int64_t busy_us;
+  int64_t since;
+  double latency_sum[I2CBUS_PRIORITIES];
+  double latency_max[I2CBUS_PRIORITIES];
+  int latency_count[I2CBUS_PRIORITIES];
+} stats;
+
+static void i2cbus_metrics(struct mg_connection *nc, void *data) {
+  int64_t now = mgos_uptime_micros();
+  for(int i = 0; i < device_count; i++) {
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "i2cbus_transactions", "I2C transactions per device",
+        "{device=\"%s\"} %d", devices[i].name, devices[i].transactions);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "i2cbus_errors", "Failed I2C transactions after retries",
+        "{device=\"%s\"} %d", devices[i].name, devices[i].errors);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "i2cbus_retries", "Retried I2C transactions",
+        "{device=\"%s\"} %d", devices[i].name, devices[i].retries);
+  }
+  for(int p = 0; p < I2CBUS_PRIORITIES; p++) {
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "i2cbus_queue_latency_avg", "Average wait in the queue since the last scrape in s",
+        "{priority=\"%s\"} %f", priority_names[p],
+        stats.latency_count[p] > 0 ? stats.latency_sum[p] / stats.latency_count[p] : 0.0);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "i2cbus_queue_latency_max", "Longest wait in the queue since the last scrape in s",
+        "{priority=\"%s\"} %f", priority_names[p], stats.latency_max[p]);
+    stats.latency_sum[p] = 0;
+    stats.latency_max[p] = 0;
+    stats.latency_count[p] = 0;
+  }
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "i2cbus_utilization", "Share of time the bus was busy since the last scrape",
+      "%f", now > stats.since ? (double) stats.busy_us / (now - stats.since) : 0.0);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "i2cbus_queue_length", "Queued I2C transactions",
+      "%d", queue_len);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "i2cbus_dropped", "Transactions dropped on a full queue",
+      "%d", dropped);
+  stats.busy_us = 0;
+  stats.since = now;
+
+  (void) data;
+}
+
+static bool i2cbus_execute(int device, i2cbus_fn_t fn, void *arg) {
+  struct i2cbus_device *d = &devices[device];
+  int retries = mgos_sys_config_get_i2cbus_retries();
+  int64_t start = mgos_uptime_micros();
+  bool ok = false;
+  for(int i = 0; i <= retries && !ok; i++) {
+    if(i > 0) {
+      d->retries++;
+    }
+    d->transactions++;
+    ok = fn(arg);
+  }
+  if(!ok) {
+    d->errors++;
+  }
+  stats.busy_us += mgos_uptime_micros() - start;
+  last_device = device;
+  return ok;
+}
+
+/*
+ * Next job: highest priority first, then the device just accessed to batch
+ * back-to-back reads, then in order of submission.
+ */
+static int i2cbus_next() {
+  int next = -1;
+  for(int i = 0; i < queue_len; i++) {
+    if(next == -1 || queue[i].priority < queue[next].priority ||
+       (queue[i].priority == queue[next].priority &&
+        queue[i].device == last_device && queue[next].device != last_device)) {
+      next = i;
+    }
+  }
+  return next;
+}
+
+static void i2cbus_slice_cb(void *arg) {
+  int64_t start = mgos_uptime_micros();
+  scheduled = false;
+  while(queue_len > 0 && mgos_uptime_micros() - start < I2CBUS_SLICE_US) {
+    int next = i2cbus_next();
+    struct i2cbus_job job = queue[next];
+    memmove(&queue[next], &queue[next + 1], (queue_len - next - 1) * sizeof(queue[0]));
+    queue_len--;
+
+    double latency = (mgos_uptime_micros() - job.submitted) / 1e6;
+    stats.latency_sum[job.priority] += latency;
+    stats.latency_max[job.priority] = MAX(stats.latency_max[job.priority], latency);
+    stats.latency_count[job.priority]++;
+
+    bool ok = i2cbus_execute(job.device, job.fn, job.arg);
+    if(job.done != NULL) {
+      job.done(ok, job.arg);
+    }
+  }
+  if(queue_len > 0 && !scheduled) {
+    // yield to the event loop, continue in the next slice
+    scheduled = true;
+    mgos_set_timer(0, 0, i2cbus_slice_cb, NULL);
+  }
+
+  (void) arg;
+}
+
+bool i2cbus_init() {
+  stats.since = mgos_uptime_micros();
+  mgos_prometheus_metrics_add_handler(i2cbus_metrics, NULL);
+  return true;
+}
+
+int i2cbus_add_device(const char *name, int addr) {
+  if(device_count == I2CBUS_DEVICES) {
+    LOG(LL_ERROR, ("Too many i2c devices, cannot add %s", name));
+    return -1;
+  }
+  struct i2cbus_device *d = &devices[device_count];
+  memset(d, 0, sizeof(*d));
+  d->name = name;
+  d->addr = addr;
+  return device_count++;
+}
+
+bool i2cbus_run(int device, i2cbus_fn_t fn, void *arg) {
+  if(device < 0 || device >= device_count) {
+    return false;
+  }
+  stats.latency_count[i2cbus_priority_control]++;
+  return i2cbus_execute(device, fn, arg);
+}
+
+bool i2cbus_submit(int device, i2cbus_priority_t priority, i2cbus_fn_t fn, i2cbus_done_t done, void *arg) {
+  if(device < 0 || device >= device_count) {
+    return false;
+  }
+  if(queue_len == I2CBUS_QUEUE) {
+    dropped++;
+    LOG(LL_WARN, ("i2c queue full, dropping %s transaction", devices[device].name));
+    return false;
+  }
+  struct i2cbus_job *job = &queue[queue_len++];
+  job->device = device;
+  job->priority = priority;
+  job->fn = fn;
+  job->done = done;
+  job->arg = arg;
+  job->submitted = mgos_uptime_micros();
+  if(!scheduled) {
+    scheduled = true;
+    mgos_set_timer(0, 0, i2cbus_slice_cb, NULL);
+  }
+  return true;
+}
@@ -0,0 +1,61 @@
+#include "latency.h"
+
+#include "histogram.h"
+
+#include "mgos.h"
+#include "mgos_prometheus_metrics.h"
+
+#define LATENCY_STAGES 6
+
+static const char *stage_names[LATENCY_STAGES] = {
+  "sample", "request", "reply", "optimize", "command", "confirm"
+};
+static const double buckets[] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30 };
+
+static double stages[LATENCY_STAGES];
+// [i] from stage i - 1 to i, [0] from sample to confirm
+static histogram_t histograms[LATENCY_STAGES];
+
+static void latency_metrics(struct mg_connection *nc, void *data) {
+  char labels[48];
+  for(int i = 0; i < LATENCY_STAGES; i++) {
+    if(i == 0) {
+      snprintf(labels, sizeof(labels), "from=\"sample\",to=\"confirm\"");
+    } else {
+      snprintf(labels, sizeof(labels), "from=\"%s\",to=\"%s\"", stage_names[i - 1], stage_names[i]);
+    }
+    histogram_print(nc, "latency_seconds", "Time between control pipeline stages in s", labels, &histograms[i]);
+  }
+
+  (void) data;
+}
+
+bool latency_init() {
+  for(int i = 0; i < LATENCY_STAGES; i++) {
+    stages[i] = 0;
+    histogram_init(&histograms[i], buckets, sizeof(buckets) / sizeof(buckets[0]));
+  }
+  mgos_prometheus_metrics_add_handler(latency_metrics, NULL);
+  return true;
+}
+
+void latency_mark(latency_stage_t stage) {
+  latency_mark_at(stage, mg_time());
+}
+
+void latency_mark_at(latency_stage_t stage, double time) {
+  if(stage < 0 || stage >= LATENCY_STAGES) {
+    return;
+  }
+  stages[stage] = time;
+  for(int i = stage + 1; i < LATENCY_STAGES; i++) {
+    stages[i] = 0;
+  }
+  // the meter may sample after the request started
+  if(stage > 0 && stages[stage - 1] > 0) {
+    histogram_observe(&histograms[stage], MAX(0, time - stages[stage - 1]));
+  }
+  if(stage == latency_confirm && stages[latency_sample] > 0) {
+    histogram_observe(&histograms[0], MAX(0, time - stages[latency_sample]));
+  }
+}
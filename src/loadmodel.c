@@ -0,0 +1,217 @@
+#include "loadmodel.h"
+
+#include "math.h"
+
+#include "feedback.h"
+#include "power.h"
+
+#include "mgos.h"
+#include "mgos_prometheus_metrics.h"
+
+#define LOADMODEL_FILE "loadmodel.json"
+// longer gaps between meter readings are not integrated
+#define GAP_MAX 60.0
+// s of an hour the meter has to cover to learn from it
+#define COVERAGE_MIN 1800.0
+// wall clock considered set
+#define TIME_VALID 1000000000
+
+typedef struct {
+  float mean;     // W
+  float var;      // W²
+  int count;      // hours learned, saturates
+} loadmodel_bin_t;
+
+static loadmodel_bin_t bins[LOADMODEL_BINS];
+static int bins_learned = 0;
+
+// the hour being integrated
+static int current_bin = -1;
+static double energy = 0;     // Ws
+static double covered = 0;    // s
+static double last_update = 0;    // wall clock with sub second resolution
+static float last_load = 0;
+static int hours_learned = 0;
+static int hours_skipped = 0;
+
+static int loadmodel_bin(time_t t) {
+  struct tm tm;
+  localtime_r(&t, &tm);
+  return tm.tm_wday * 24 + tm.tm_hour;
+}
+
+static void loadmodel_metrics(struct mg_connection *nc, void *data) {
+  float power = 0, sigma = 0;
+  bool learned = loadmodel_get_power(time(NULL), &power, &sigma);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "loadmodel_bins", "Hours of the week learned",
+      "%d", bins_learned);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "loadmodel_hours", "Hours learned from the meter",
+      "{result=\"learned\"} %d", hours_learned);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "loadmodel_hours", "Hours learned from the meter",
+      "{result=\"skipped\"} %d", hours_skipped);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "loadmodel_load", "Household load of the last meter reading in W",
+      "%f", last_load);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "loadmodel_expected", "Expected household load this hour in W, -1 if unknown",
+      "%f", learned ? power : -1.0);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "loadmodel_sigma", "Deviation of the household load this hour in W",
+      "%f", sigma);
+
+  (void) data;
+}
+
+int loadmodel_print_json(struct json_out *out, va_list *ap) {
+  int len = json_printf(out, "{bins: [");
+  for(int i = 0; i < LOADMODEL_BINS; i++) {
+    len += json_printf(out, (i > 0) ? ", [%.1f, %.1f, %d]" : "[%.1f, %.1f, %d]",
+                       bins[i].mean, bins[i].var, bins[i].count);
+  }
+  len += json_printf(out, "]}");
+  (void) ap;
+  return len;
+}
+
+static void loadmodel_save() {
+  if(json_fprintf(LOADMODEL_FILE, "%M", loadmodel_print_json) < 0) {
+    LOG(LL_ERROR, ("Failed to save %s", LOADMODEL_FILE));
+  }
+}
+
+static void loadmodel_load() {
+  char *content = json_fread(LOADMODEL_FILE);
+  if(content == NULL) {
+    LOG(LL_INFO, ("No %s, learning the load from scratch", LOADMODEL_FILE));
+    return;
+  }
+  int len = strlen(content);
+  struct json_token t;
+  for(int i = 0; i < LOADMODEL_BINS && json_scanf_array_elem(content, len, ".bins", i, &t) > 0; i++) {
+    struct json_token v;
+    float values[3] = { 0, 0, 0 };
+    for(int j = 0; j < 3 && json_scanf_array_elem(t.ptr, t.len, "", j, &v) > 0; j++) {
+      values[j] = strtof(v.ptr, NULL);
+    }
+    bins[i].mean = values[0];
+    bins[i].var = values[1];
+    bins[i].count = (int) values[2];
+    if(bins[i].count > 0) {
+      bins_learned++;
+    }
+  }
+  free(content);
+  LOG(LL_INFO, ("Loaded load model, %d hours of the week learned", bins_learned));
+}
+
+// West's weighted update, the weight starts at 1/n to settle the first hours fast
+static void loadmodel_learn(int bin, float load) {
+  loadmodel_bin_t *b = &bins[bin];
+  if(b->count == 0) {
+    bins_learned++;
+  }
+  float alpha = fmaxf(mgos_sys_config_get_loadmodel_alpha(), 1.0 / (b->count + 1));
+  float diff = load - b->mean;
+  float incr = alpha * diff;
+  b->mean += incr;
+  b->var = (1.0 - alpha) * (b->var + diff * incr);
+  if(b->count < 1000) {
+    b->count++;
+  }
+  hours_learned++;
+  LOG(LL_INFO, ("Load of hour %d: %.0fW, learned %.0fW +- %.0fW after %d",
+                bin, load, b->mean, sqrtf(b->var), b->count));
+}
+
+void loadmodel_meter_update(float total_power) {
+  // readings come faster than a second, time() would drop those in the same second
+  double now = mg_time();
+  if(now < TIME_VALID) {
+    return;
+  }
+  float out = feedback_available() ? feedback_get_power_out() : power_get_power_out();
+  float load = total_power + out - power_get_power_in();
+  int bin = loadmodel_bin((time_t) now);
+  if(bin != current_bin) {
+    if(current_bin >= 0 && covered >= COVERAGE_MIN) {
+      loadmodel_learn(current_bin, energy / covered);
+      loadmodel_save();
+    } else if(current_bin >= 0) {
+      hours_skipped++;
+    }
+    current_bin = bin;
+    energy = 0;
+    covered = 0;
+  } else if(last_update > 0 && now > last_update && now - last_update <= GAP_MAX) {
+    // the previous reading held until now
+    double dt = now - last_update;
+    energy += last_load * dt;
+    covered += dt;
+  }
+  last_update = now;
+  last_load = load;
+}
+
+bool loadmodel_get_power(time_t t, float *power, float *sigma) {
+  if(bins_learned == 0) {
+    *power = 0;
+    *sigma = 0;
+    return false;
+  }
+  loadmodel_bin_t *b = &bins[loadmodel_bin(t)];
+  if(b->count > 0) {
+    *power = b->mean;
+    *sigma = sqrtf(b->var);
+    return true;
+  }
+  // an hour not seen yet, the average of those learned
+  float mean = 0, var = 0;
+  for(int i = 0; i < LOADMODEL_BINS; i++) {
+    if(bins[i].count > 0) {
+      mean += bins[i].mean;
+      var += bins[i].var;
+    }
+  }
+  *power = mean / bins_learned;
+  *sigma = sqrtf(var / bins_learned);
+  return true;
+}
+
+bool loadmodel_expect(time_t start, time_t end, float *energy_wh, float *sigma) {
+  *energy_wh = 0;
+  *sigma = 0;
+  if(bins_learned == 0) {
+    return false;
+  }
+  float var = 0;
+  time_t t = start;
+  while(t < end) {
+    time_t next = MIN(end, t - t % 3600 + 3600);
+    float power, deviation;
+    loadmodel_get_power(t, &power, &deviation);
+    float hours = (next - t) / 3600.0;
+    *energy_wh += power * hours;
+    // hours independent
+    var += deviation * deviation * hours * hours;
+    t = next;
+  }
+  *sigma = sqrtf(var);
+  return true;
+}
+
+float loadmodel_get_reserve(time_t start, time_t end) {
+  float expected, sigma;
+  if(!loadmodel_expect(start, end, &expected, &sigma)) {
+    return -1;
+  }
+  return MAX(0, expected + mgos_sys_config_get_loadmodel_reserve_sigmas() * sigma);
+}
+
+bool loadmodel_init() {
+  loadmodel_load();
+  mgos_prometheus_metrics_add_handler(loadmodel_metrics, NULL);
+  return true;
+}
@@ -0,0 +1,219 @@
+#include "losstable.h"
+
+#include "math.h"
+
+#include "soyosource.h"
+
+#include "mgos.h"
+#include "mgos_prometheus_metrics.h"
+
+#define LOSSTABLE_FILE "losstable.json"
+#define LEARN_RATE 0.2f
+#define LOSS_MIN 0.0f
+#define LOSS_MAX 0.5f
+// smallest AC power a loss is learned at
+#define AC_MIN 50.0f
+// max age of the soyosource DC reading in s
+#define DC_MAX_AGE 10.0
+// give up on a step without a fresh DC reading after s
+#define STEP_TIMEOUT 60.0
+
+static float loss[LOSSTABLE_POINTS];
+static int samples[LOSSTABLE_POINTS];
+static double last_save = 0;
+static int steps_learned = 0;
+static int steps_aborted = 0;
+
+static float last_ac = 0;
+static bool commanded = false;
+static float last_total_power = 0;
+static double last_meter_update = 0;
+
+static struct {
+  bool active;
+  float ac_before;     // AC power estimated before the step
+  float meter_before;
+  double time;
+} step;
+
+static void losstable_metrics(struct mg_connection *nc, void *data) {
+  for(int i = 0; i < LOSSTABLE_POINTS; i++) {
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "losstable_loss", "Learned inverter loss by AC power",
+        "{power=\"%.0f\"} %f", i * LOSSTABLE_STEP, loss[i]);
+  }
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "losstable_steps_learned", "Power steps the inverter loss was learned from",
+      "%d", steps_learned);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "losstable_steps_aborted", "Power steps superposed by another command or without DC reading",
+      "%d", steps_aborted);
+
+  (void) data;
+}
+
+int losstable_print_json(struct json_out *out, va_list *ap) {
+  int len = json_printf(out, "{step: %f, loss: [", LOSSTABLE_STEP);
+  for(int i = 0; i < LOSSTABLE_POINTS; i++) {
+    len += json_printf(out, (i > 0) ? ", %f" : "%f", loss[i]);
+  }
+  len += json_printf(out, "], samples: [");
+  for(int i = 0; i < LOSSTABLE_POINTS; i++) {
+    len += json_printf(out, (i > 0) ? ", %d" : "%d", samples[i]);
+  }
+  len += json_printf(out, "]}");
+  (void) ap;
+  return len;
+}
+
+static void losstable_clear() {
+  for(int i = 0; i < LOSSTABLE_POINTS; i++) {
+    loss[i] = mgos_sys_config_get_soyosource_loss();
+    samples[i] = 0;
+  }
+  step.active = false;
+}
+
+static void losstable_save() {
+  if(json_fprintf(LOSSTABLE_FILE, "%M", losstable_print_json) < 0) {
+    LOG(LL_ERROR, ("Failed to save %s", LOSSTABLE_FILE));
+    return;
+  }
+  last_save = mgos_uptime();
+}
+
+static void losstable_load() {
+  char *content = json_fread(LOSSTABLE_FILE);
+  if(content == NULL) {
+    LOG(LL_INFO, ("No %s, starting with loss %.2f", LOSSTABLE_FILE, mgos_sys_config_get_soyosource_loss()));
+    return;
+  }
+  int len = strlen(content);
+  for(int i = 0; i < LOSSTABLE_POINTS; i++) {
+    struct json_token l, s;
+    if(json_scanf_array_elem(content, len, ".loss", i, &l) < 0 ||
+       json_scanf_array_elem(content, len, ".samples", i, &s) < 0) {
+      LOG(LL_WARN, ("Invalid %s, starting with loss %.2f", LOSSTABLE_FILE, mgos_sys_config_get_soyosource_loss()));
+      losstable_clear();
+      break;
+    }
+    loss[i] = fminf(LOSS_MAX, fmaxf(LOSS_MIN, strtof(l.ptr, NULL)));
+    samples[i] = strtol(s.ptr, NULL, 10);
+  }
+  free(content);
+}
+
+static bool losstable_dc(float *dc) {
+  double update = soyosource_get_last_update();
+  if(update <= 0 || mgos_uptime() - update > DC_MAX_AGE) {
+    return false;
+  }
+  *dc = soyosource_get_last_voltage() * soyosource_get_last_current();
+  return true;
+}
+
+// spreads an observed loss over the two points around the AC power
+static void losstable_learn(float ac, float observed) {
+  observed = fminf(LOSS_MAX, fmaxf(LOSS_MIN, observed));
+  float x = fminf(ac / LOSSTABLE_STEP, LOSSTABLE_POINTS - 1);
+  int i = MIN((int) x, LOSSTABLE_POINTS - 2);
+  float w = x - i;
+  loss[i] += LEARN_RATE * (1.0f - w) * (observed - loss[i]);
+  loss[i + 1] += LEARN_RATE * w * (observed - loss[i + 1]);
+  samples[(w < 0.5f) ? i : i + 1]++;
+  steps_learned++;
+  LOG(LL_INFO, ("Inverter loss %.3f at %.0fW, table %.3f/%.3f", observed, ac, loss[i], loss[i + 1]));
+
+  if(mgos_uptime() - last_save > mgos_sys_config_get_soyosource_loss_save_interval()) {
+    losstable_save();
+  }
+}
+
+bool losstable_init() {
+  losstable_clear();
+  losstable_load();
+  mgos_prometheus_metrics_add_handler(losstable_metrics, NULL);
+  return true;
+}
+
+float losstable_get(float ac) {
+  float x = fmaxf(0, fminf(ac / LOSSTABLE_STEP, LOSSTABLE_POINTS - 1));
+  int i = MIN((int) x, LOSSTABLE_POINTS - 2);
+  float w = x - i;
+  return loss[i] + w * (loss[i + 1] - loss[i]);
+}
+
+float losstable_ac_to_dc(float ac) {
+  return ac * (1.0f + losstable_get(ac));
+}
+
+// the loss depends on the AC power looked for, a few iterations converge
+float losstable_dc_to_ac(float dc) {
+  float ac = dc / (1.0f + losstable_get(dc));
+  for(int i = 0; i < 3; i++) {
+    ac = dc / (1.0f + losstable_get(ac));
+  }
+  return ac;
+}
+
+/*
+ * A step starts from a known AC power: off, or estimated from the DC
+ * reading with the current table. The meter response to the step gives the
+ * AC power after it, the next DC reading the loss at that power.
+ */
+void losstable_command(float ac) {
+  float delta = ac - last_ac;
+  float dc;
+  if(step.active) {
+    steps_aborted++;
+    step.active = false;
+  }
+  if(mgos_sys_config_get_soyosource_loss_learn() && last_meter_update > 0 &&
+     fabsf(delta) >= mgos_sys_config_get_feedback_step_min()) {
+    if(last_ac <= 0) {
+      step.ac_before = 0;
+      step.active = true;
+    } else if(losstable_dc(&dc)) {
+      step.ac_before = losstable_dc_to_ac(dc);
+      step.active = true;
+    }
+    step.meter_before = last_total_power;
+    step.time = mgos_uptime();
+  }
+  last_ac = ac;
+  commanded = true;
+}
+
+void losstable_meter_update(float total_power) {
+  double now = mgos_uptime();
+  float dc;
+  last_total_power = total_power;
+  last_meter_update = now;
+  if(!step.active || (now - step.time) < mgos_sys_config_get_feedback_meter_delay()) {
+    return;
+  }
+  if(soyosource_get_last_update() < step.time) {
+    // wait for a DC reading after the step
+    if(now - step.time > STEP_TIMEOUT) {
+      steps_aborted++;
+      step.active = false;
+    }
+    return;
+  }
+  step.active = false;
+  // more power out shows as less total power at the meter
+  float ac = step.ac_before + (step.meter_before - total_power);
+  if(ac < AC_MIN || !losstable_dc(&dc)) {
+    return;
+  }
+  losstable_learn(ac, dc / ac - 1.0f);
+}
+
+bool losstable_learning() {
+  return commanded && mgos_sys_config_get_soyosource_loss_learn();
+}
+
+void losstable_reset() {
+  losstable_clear();
+  losstable_save();
+}
@@ -28,27 +28,85 @@
 #include "discovergy.h"
 #include "awattar.h"
 #include "darksky.h"
+#include "appleweather.h"
 #include "shelly.h"
+#include "shellyem.h"
+#include "meter.h"
 #include "soyosource.h"
 #include "ds18xxx.h"
 #include "fan.h"
+#include "derate.h"
+#include "energy.h"
+#include "i2cbus.h"
+#include "feedback.h"
+#include "autotune.h"
+#include "checkpoint.h"
+#include "losstable.h"
+#include "record.h"
+#include "boot.h"
+#include "sched.h"
+#include "latency.h"
+#include "heap.h"
+#include "planner.h"
+#include "loadmodel.h"
 
 
-enum mgos_app_init_result mgos_app_init(void) {
-  
-  ds18xxx_init();
-  fan_init();
-  adc_init();
+static bool boot_soyosource() {
   soyosource_init();
-  battery_init();
+  return soyosource_get_enabled();
+}
+
+static bool boot_battery() {
+  return battery_init() != battery_invalid;
+}
+
+static bool boot_power() {
   power_init();
+  return true;
+}
+
+static bool boot_rpc() {
   rpc_init();
-  mqtt_init();
-  discovergy_init();
-  awattar_init();
-  //darksky_init();
+  return true;
+}
+
+static bool boot_shelly() {
   shelly_init();
-  watchdog_init();
+  return true;
+}
+
+enum mgos_app_init_result mgos_app_init(void) {
+  // power and the meter sources first, probes the control loop can do without later
+  boot_add("sched", sched_init, boot_now, "");
+  boot_add("heap", heap_init, boot_now, "sched");
+  boot_add("record", record_init, boot_now, "");
+  boot_add("latency", latency_init, boot_now, "");
+  boot_add("checkpoint", checkpoint_init, boot_now, "record");
+  boot_add("i2cbus", i2cbus_init, boot_now, "");
+  boot_add("losstable", losstable_init, boot_now, "");
+  boot_add("soyosource", boot_soyosource, boot_now, "losstable");
+  boot_add("battery", boot_battery, boot_now, "checkpoint i2cbus soyosource");
+  boot_add("feedback", feedback_init, boot_now, "checkpoint");
+  boot_add("autotune", autotune_init, boot_now, "");
+  boot_add("derate", derate_init, boot_now, "");
+  boot_add("loadmodel", loadmodel_init, boot_now, "");
+  boot_add("power", boot_power, boot_now, "checkpoint battery soyosource feedback autotune derate losstable loadmodel");
+  boot_add("rpc", boot_rpc, boot_now, "power");
+  boot_add("meter", meter_init, boot_now, "power");
+  boot_add("mqtt", mqtt_init, boot_now, "power meter");
+  boot_add("discovergy", discovergy_init, boot_now, "power meter");
+  boot_add("shellyem", shellyem_init, boot_now, "power meter");
+  boot_add("shelly", boot_shelly, boot_now, "power");
+  boot_add("awattar", awattar_init, boot_now, "");
+  //boot_add("darksky", darksky_init, boot_now, "");
+  boot_add("appleweather", appleweather_init, boot_now, "");
+  boot_add("watchdog", watchdog_init, boot_now, "power meter awattar");
+  boot_add("planner", planner_init, boot_now, "power battery loadmodel awattar appleweather");
+  boot_add("ds18xxx", ds18xxx_init, boot_deferred, "");
+  boot_add("fan", fan_init, boot_deferred, "ds18xxx");
+  boot_add("adc", adc_init, boot_deferred, "i2cbus");
+  boot_add("energy", energy_init, boot_deferred, "checkpoint battery losstable awattar");
+  boot_run();
 
   //power_run_test();
 
@@ -0,0 +1,195 @@
+#include "meter.h"
+
+#include "power.h"
+#include "record.h"
+#include "sched.h"
+
+#include "mgos.h"
+#include "mgos_prometheus_metrics.h"
+
+// ms between health checks of the sources
+#define METER_INTERVAL 1000
+
+typedef struct {
+  const char *name;
+  int priority;
+  float interval;       // s between readings expected
+  float max_age;        // s a reading is usable, 0 for any
+  double time;          // wall clock of the last accepted sample, 0 if none
+  double received;      // uptime it arrived
+  float power;
+  bool healthy;
+  bool stale;           // the last reading was outdated
+  bool failed;          // failed before, has to recover to take over again
+  int good;             // accepted readings in a row
+  int readings[meter_results];
+  int failovers;        // times the source failed while active
+} meter_source_t;
+
+static const char *result_names[meter_results] = { "accepted", "stale", "out_of_order" };
+
+static meter_source_t sources[METER_SOURCES];
+static int source_count = 0;
+static int active = -1;
+static bool selected = false;
+
+static meter_update_callback callback = NULL;
+static void *callback_arg;
+
+static void meter_metrics(struct mg_connection *nc, void *data) {
+  double now = mg_time();
+  for(int i = 0; i < source_count; i++) {
+    meter_source_t *s = &sources[i];
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "meter_age", "Age of the last reading in s, -1 if none",
+        "{source=\"%s\"} %f", s->name, (s->time > 0) ? now - s->time : -1.0);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "meter_healthy", "Source reporting fresh readings at its rate",
+        "{source=\"%s\"} %d", s->name, s->healthy);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "meter_active", "Source the total power is taken from",
+        "{source=\"%s\"} %d", s->name, i == active);
+    for(int j = 0; j < meter_results; j++) {
+      mgos_prometheus_metrics_printf(
+          nc, COUNTER, "meter_readings", "Readings received",
+          "{source=\"%s\",result=\"%s\"} %d", s->name, result_names[j], s->readings[j]);
+    }
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "meter_failovers", "Times the source failed while active",
+        "{source=\"%s\"} %d", s->name, s->failovers);
+  }
+
+  (void) data;
+}
+
+static bool meter_fresh(const meter_source_t *s, double now) {
+  if(s->received == 0 || s->stale) {
+    return false;
+  }
+  if(s->max_age > 0 && mg_time() - s->time > s->max_age) {
+    return false;
+  }
+  return now - s->received <= s->interval * mgos_sys_config_get_meter_periods();
+}
+
+static bool meter_better(int i, int best) {
+  if(best < 0 || sources[i].priority < sources[best].priority) {
+    return true;
+  }
+  return sources[i].priority == sources[best].priority && sources[i].time > sources[best].time;
+}
+
+// the preferred healthy source, the freshest of equal priority
+static void meter_select(double now) {
+  int best = -1;
+  for(int i = 0; i < source_count; i++) {
+    meter_source_t *s = &sources[i];
+    if(!meter_fresh(s, now)) {
+      if(s->healthy) {
+        LOG(LL_WARN, ("Meter %s failed, last reading %.1fs ago", s->name, mg_time() - s->time));
+        s->healthy = false;
+        s->failed = true;
+        if(i == active) {
+          s->failovers++;
+        }
+      }
+      s->good = 0;
+      continue;
+    }
+    if(!s->healthy) {
+      // a source that failed before has to prove itself while another one is running
+      if(s->failed && active >= 0 && s->good < mgos_sys_config_get_meter_recover()) {
+        continue;
+      }
+      if(s->failed) {
+        LOG(LL_INFO, ("Meter %s recovered", s->name));
+      }
+      s->healthy = true;
+    }
+    if(meter_better(i, best)) {
+      best = i;
+    }
+  }
+  if(best == active) {
+    return;
+  }
+  if(best < 0) {
+    LOG(LL_WARN, ("No meter reporting, power off"));
+    power_set_state(power_off);
+    record_printf(record_decision, "meter", "none");
+  } else {
+    LOG(LL_INFO, ("Meter %s active, priority %d", sources[best].name, sources[best].priority));
+    if(selected) {
+      record_printf(record_decision, "meter", "%s", sources[best].name);
+    }
+  }
+  active = best;
+  selected = true;
+}
+
+static void meter_check_cb(void *arg) {
+  meter_select(mgos_uptime());
+  (void) arg;
+}
+
+int meter_add_source(const char *name, int priority, float interval, float max_age) {
+  if(source_count >= METER_SOURCES) {
+    LOG(LL_ERROR, ("No meter source left for %s", name));
+    return -1;
+  }
+  meter_source_t *s = &sources[source_count];
+  s->name = name;
+  s->priority = priority;
+  s->interval = interval;
+  s->max_age = max_age;
+  LOG(LL_INFO, ("Meter %s: priority %d, every %.1fs, max age %.1fs", name, priority, interval, max_age));
+  return source_count++;
+}
+
+meter_result_t meter_update(int source, double time, float power) {
+  if(source < 0 || source >= source_count) {
+    return meter_stale;
+  }
+  meter_source_t *s = &sources[source];
+  double now = mgos_uptime();
+  meter_result_t result = meter_accepted;
+  if(s->max_age > 0 && mg_time() - time > s->max_age) {
+    LOG(LL_WARN, ("Meter %s outdated: %f", s->name, mg_time() - time));
+    result = meter_stale;
+    s->stale = true;
+    s->good = 0;
+  } else if(time <= s->time) {
+    result = meter_out_of_order;
+  } else {
+    s->time = time;
+    s->received = now;
+    s->stale = false;
+    s->power = power;
+    s->good++;
+  }
+  s->readings[result]++;
+  meter_select(now);
+  if(result == meter_accepted && source == active && callback != NULL) {
+    callback(time, power, callback_arg);
+  }
+  return result;
+}
+
+void meter_set_update_callback(meter_update_callback cb, void *cb_arg) {
+  callback = cb;
+  callback_arg = cb_arg;
+}
+
+int meter_get_active() {
+  return active;
+}
+
+const char *meter_get_name(int source) {
+  return (source >= 0 && source < source_count) ? sources[source].name : "none";
+}
+
+bool meter_init() {
+  mgos_prometheus_metrics_add_handler(meter_metrics, NULL);
+  sched_add("meter", METER_INTERVAL, 50, sched_priority_control, 5, meter_check_cb, NULL);
+  return true;
+}
@@ -1,8 +1,102 @@
 #include "mqtt.h"
 #include "power.h"
+#include "battery.h"
+#include "latency.h"
+#include "meter.h"
+#include "record.h"
+#include "sched.h"
+
+#include "math.h"
+#include "ctype.h"
+#include "limits.h"
 
 #include "mgos.h"
 #include "mgos_mqtt.h"
+#include "mgos_prometheus_metrics.h"
+
+// larger timestamps are in ms
+#define TIME_MS 100000000000.0
+
+typedef enum {
+  message_accepted = 0,
+  message_stale = 1,
+  message_out_of_order = 2,
+  message_invalid = 3,
+  message_results = 4
+} message_result_t;
+
+typedef struct {
+  int state;
+  int battery_state;
+  int soc;
+  float total_power;
+  float power_in;
+  float power_out;
+  float voltage;
+  bool optimize;
+  bool out_enabled;
+} mqtt_state_t;
+
+static const char *result_names[message_results] = { "accepted", "stale", "out_of_order", "invalid" };
+static int messages[message_results];
+static int source = -1;
+static float last_lag = 0;
+
+static mqtt_state_t published;
+static double last_publish = 0;
+static bool publish_now = true;
+static int publish_count = 0;
+static int publish_failed = 0;
+static int command_count = 0;
+
+static void mqtt_metrics(struct mg_connection *nc, void *data) {
+  for(int i = 0; i < message_results; i++) {
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "mqtt_power_messages", "Total power messages received",
+        "{result=\"%s\"} %d", result_names[i], messages[i]);
+  }
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "mqtt_power_lag", "Age of the last total power message in s",
+      "%f", last_lag);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "mqtt_state_published", "State messages published",
+      "{result=\"ok\"} %d", publish_count);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "mqtt_state_published", "State messages published",
+      "{result=\"failed\"} %d", publish_failed);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "mqtt_commands", "Commands received",
+      "%d", command_count);
+
+  (void) data;
+}
+
+/*
+ * Either a plain number in W measured on arrival or
+ * {"power": W, "time": s or ms since the epoch}.
+ */
+static message_result_t mqtt_parse_power(const char *msg, int msg_len, float *power, double *time) {
+  int i = 0;
+  while(i < msg_len && isspace((unsigned char) msg[i])) {
+    i++;
+  }
+  *time = mg_time();
+  if(i < msg_len && msg[i] == '{') {
+    double t = 0;
+    if(json_scanf(msg, msg_len, "{power: %f, time: %lf}", power, &t) < 1) {
+      return message_invalid;
+    }
+    if(t > 0) {
+      *time = (t > TIME_MS) ? t / 1000.0 : t;
+    }
+    return message_accepted;
+  }
+  char value[32];
+  char *end;
+  snprintf(value, sizeof(value), "%.*s", msg_len, msg);
+  *power = strtof(value, &end);
+  return (end == value || isnan(*power)) ? message_invalid : message_accepted;
+}
 
 static void topic_total_power_handler(struct mg_connection *nc, const char *topic,
                               int topic_len, const char *msg, int msg_len,
@@ -12,21 +106,174 @@ static void topic_total_power_handler(struct mg_connection *nc, const char *topi
     return;
   }
 
-  float power = strtof(msg, NULL);
-  power_set_total_power(power);
+  record_data(record_mqtt, mgos_sys_config_get_power_total_power_topic(), msg, msg_len);
+  float power = 0;
+  double time = 0;
+  message_result_t result = mqtt_parse_power(msg, msg_len, &power, &time);
+  if(result == message_accepted) {
+    last_lag = mg_time() - time;
+    latency_mark_at(latency_sample, time);
+    switch(meter_update(source, time, power)) {
+      case meter_stale:
+        result = message_stale;
+        break;
+      case meter_out_of_order:
+        result = message_out_of_order;
+        break;
+      default:
+        break;
+    }
+  }
+  messages[result]++;
+
+  switch(result) {
+    case message_accepted:
+    case message_stale:
+      // the meter layer passes it on or fails the source
+      break;
+    case message_out_of_order:
+      LOG(LL_DEBUG, ("MQTT power out of order: %.*s", msg_len, msg));
+      break;
+    default:
+      LOG(LL_WARN, ("Invalid MQTT power: %.*s", msg_len, msg));
+      break;
+  }
 
+  (void) nc;
   (void) topic_len;
   (void) ud;
 }
 
-bool mqtt_init() {
+/*
+ * {"state": -1..1, "optimize": bool, "out_enabled": bool,
+ *  "in_target": W, "target_min": W, "target_max": W}, all optional.
+ */
+static void topic_command_handler(struct mg_connection *nc, const char *topic,
+                              int topic_len, const char *msg, int msg_len,
+                              void *ud) {
+  record_data(record_mqtt, mgos_sys_config_get_mqtt_bridge_command_topic(), msg, msg_len);
+  int state = power_invalid;
+  int in_target = INT_MIN;
+  bool optimize = power_get_optimize_enabled();
+  bool out_enabled = power_get_out_enabled();
+  int min = power_get_optimize_target_min();
+  int max = power_get_optimize_target_max();
+  int count = json_scanf(msg, msg_len, "{state: %d, optimize: %B, out_enabled: %B, in_target: %d, target_min: %d, target_max: %d}",
+                         &state, &optimize, &out_enabled, &in_target, &min, &max);
+  if(count < 1) {
+    LOG(LL_WARN, ("Invalid MQTT command: %.*s", msg_len, msg));
+    return;
+  }
+  LOG(LL_INFO, ("MQTT command: %.*s", msg_len, msg));
+  command_count++;
+
+  power_set_optimize_enabled(optimize);
+  power_set_out_enabled(out_enabled);
+  power_set_optimize_target_min(min);
+  power_set_optimize_target_max(max);
+  if(in_target != INT_MIN) {
+    power_set_in_target(in_target);
+  }
+  if(power_state_is_valid(state)) {
+    if(state == power_out) {
+      power_set_out_enabled(true);
+    }
+    power_set_state(state);
+  }
+  // answered with the next state message
+  publish_now = true;
 
+  (void) nc;
+  (void) topic;
+  (void) topic_len;
+  (void) ud;
+}
+
+static void mqtt_collect(mqtt_state_t *s) {
+  memset(s, 0, sizeof(*s));
+  s->state = power_get_state();
+  s->battery_state = battery_get_state();
+  s->total_power = power_get_total_power();
+  s->power_in = power_get_power_in();
+  s->power_out = power_get_power_out();
+  if(s->battery_state != battery_disabled) {
+    s->soc = battery_get_soc();
+    s->voltage = battery_read_voltage();
+  }
+  s->optimize = power_get_optimize_enabled();
+  s->out_enabled = power_get_out_enabled();
+}
+
+static bool mqtt_changed(const mqtt_state_t *a, const mqtt_state_t *b) {
+  float deadband = mgos_sys_config_get_mqtt_bridge_deadband();
+  return a->state != b->state || a->battery_state != b->battery_state || a->soc != b->soc
+    || a->optimize != b->optimize || a->out_enabled != b->out_enabled
+    || fabsf(a->total_power - b->total_power) > deadband
+    || fabsf(a->power_in - b->power_in) > deadband
+    || fabsf(a->power_out - b->power_out) > deadband
+    || fabsf(a->voltage - b->voltage) > 0.1f;
+}
+
+/*
+ * Collects the state every mqtt_bridge.interval and publishes it as one
+ * message if it changed beyond the deadband or the heartbeat is due.
+ */
+static void mqtt_state_cb(void *arg) {
+  if(!mgos_mqtt_global_is_connected()) {
+    return;
+  }
+  mqtt_state_t s;
+  mqtt_collect(&s);
+  double now = mgos_uptime();
+  int heartbeat = mgos_sys_config_get_mqtt_bridge_heartbeat();
+  bool due = publish_now || (heartbeat > 0 && now - last_publish >= heartbeat);
+  if(!due && !mqtt_changed(&s, &published)) {
+    return;
+  }
+  bool ok = mgos_mqtt_pubf(mgos_sys_config_get_mqtt_bridge_state_topic(),
+      mgos_sys_config_get_mqtt_bridge_qos(), mgos_sys_config_get_mqtt_bridge_retain(),
+      "{time: %.3f, state: %d, battery_state: %d, soc: %d, total_power: %.1f, power_in: %.1f, "
+      "power_out: %.1f, voltage: %.2f, optimize: %B, out_enabled: %B}",
+      mg_time(), s.state, s.battery_state, s.soc, s.total_power, s.power_in,
+      s.power_out, s.voltage, s.optimize, s.out_enabled);
+  if(!ok) {
+    publish_failed++;
+    return;
+  }
+  published = s;
+  last_publish = now;
+  publish_now = false;
+  publish_count++;
+
+  (void) arg;
+}
+
+bool mqtt_init() {
   const char* total_power_topic = mgos_sys_config_get_power_total_power_topic();
-  if(total_power_topic == NULL || strlen(total_power_topic) > 0) {
-    LOG(LL_INFO, ("no topic configured to receive total power values"));
-    return false;
-  } 
-  mgos_mqtt_sub(total_power_topic, topic_total_power_handler, NULL);
+  const char* state_topic = mgos_sys_config_get_mqtt_bridge_state_topic();
+  const char* command_topic = mgos_sys_config_get_mqtt_bridge_command_topic();
+  bool active = false;
 
-  return true;
-}
\ No newline at end of file
+  if(total_power_topic == NULL || strlen(total_power_topic) == 0) {
+    LOG(LL_INFO, ("no topic configured to receive total power values"));
+  } else {
+    source = meter_add_source("mqtt", mgos_sys_config_get_mqtt_bridge_meter_priority(),
+                              mgos_sys_config_get_mqtt_bridge_meter_interval() / 1000.0,
+                              mgos_sys_config_get_power_max_lag());
+    mgos_mqtt_sub(total_power_topic, topic_total_power_handler, NULL);
+    active = true;
+  }
+  if(command_topic != NULL && strlen(command_topic) > 0) {
+    mgos_mqtt_sub(command_topic, topic_command_handler, NULL);
+    active = true;
+  }
+  if(state_topic != NULL && strlen(state_topic) > 0) {
+    sched_add("mqtt.state", mgos_sys_config_get_mqtt_bridge_interval(), 900, sched_priority_telemetry, 10,
+              mqtt_state_cb, NULL);
+    active = true;
+  }
+  if(active) {
+    mgos_prometheus_metrics_add_handler(mqtt_metrics, NULL);
+  }
+  return active;
+}
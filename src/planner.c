@@ -0,0 +1,309 @@
+#include "planner.h"
+
+#include "math.h"
+
+#include "appleweather.h"
+#include "awattar.h"
+#include "battery.h"
+#include "loadmodel.h"
+#include "power.h"
+#include "record.h"
+#include "sched.h"
+
+#include "mgos.h"
+#include "mgos_prometheus_metrics.h"
+
+#define PLANNER_SLOTS 24
+#define PLANNER_DAYS 2
+#define PLANNER_INTERVAL 10000
+// s between plans until the first slot starts, the state of charge moves during the day
+#define PLANNER_REPLAN 3600
+// wall clock considered set
+#define TIME_VALID 1000000000
+
+// kWh/m² per month, 1 kW/m² yields the peak power
+static const float monthly_radiation[] = { 30, 45, 80, 125, 160, 165, 165, 140, 95, 60, 30, 25 };
+static const float performance_ratio = 0.75;
+
+static appleweather_day_forecast_t days[PLANNER_DAYS];
+static int days_count = 0;
+
+static planner_slot_t slots[PLANNER_SLOTS];
+static int slots_count = 0;
+
+static int estimated_yield = 0;   // Wh left for the battery on the planned day
+static float shortfall = 0;       // Wh the battery misses at sunrise
+static float grid_energy = 0;     // Wh bought for the shortfall
+static float cost = 0;            // EUR
+static time_t planned_at = 0;
+static time_t sunrise = 0;
+static int plans = 0;
+static bool dirty = true;
+static int price_updates = -1;
+
+// power in is held at the slot power while a slot runs
+static bool charging = false;
+
+static void planner_metrics(struct mg_connection *nc, void *data) {
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "estimated_yield", "Estimated solar yield left for the battery on the planned day in Wh",
+      "%d", estimated_yield);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "planner_shortfall", "Energy the battery misses at sunrise in Wh",
+      "%f", shortfall);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "planner_grid_energy", "Energy planned to charge from the grid in Wh",
+      "%f", grid_energy);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "planner_cost", "Planned cost of grid charging in EUR",
+      "%f", cost);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "planner_slots", "Number of planned charge slots",
+      "%d", slots_count);
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "planner_charging", "Power in target of the running slot in W, 0 if none",
+      "%d", charging ? power_get_in_hold() : 0);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "planner_plans", "Number of plans made",
+      "%d", plans);
+
+  (void) data;
+}
+
+// solar energy in Wh the household load leaves for the battery
+static int planner_estimate_yield(const appleweather_day_forecast_t *day) {
+  int peak = mgos_sys_config_get_solar_peak_power();
+  struct tm t;
+  localtime_r(&day->time, &t);
+  float daylight = (day->sunset - day->sunrise) / 3600.0;
+  // Kasten and Czeplak
+  float clouds = 1.0 - 0.75 * powf(fmaxf(0, fminf(1, day->clouds)), 3.4);
+  float pv = peak * monthly_radiation[t.tm_mon] / 30.0 * performance_ratio * clouds;
+  float load = loadmodel_get_reserve(day->sunrise, day->sunset);
+  if(load < 0) {
+    load = mgos_sys_config_get_planner_base_load() * daylight;
+  }
+  return (int) (pv - load);
+}
+
+// the day of the next sunrise
+static const appleweather_day_forecast_t *planner_next_day(time_t now) {
+  for(int i = 0; i < days_count; i++) {
+    if(days[i].sunrise > now) {
+      return &days[i];
+    }
+  }
+  return NULL;
+}
+
+static void planner_sort(planner_slot_t *s, int n, bool by_price) {
+  for(int i = 1; i < n; i++) {
+    planner_slot_t x = s[i];
+    int j = i - 1;
+    while(j >= 0 && (by_price ? s[j].price > x.price : s[j].start > x.start)) {
+      s[j + 1] = s[j];
+      j--;
+    }
+    s[j + 1] = x;
+  }
+}
+
+static void planner_plan(const char *reason) {
+  time_t now = time(NULL);
+  dirty = false;
+  planned_at = now;
+  slots_count = 0;
+  shortfall = 0;
+  grid_energy = 0;
+  cost = 0;
+
+  if(now < TIME_VALID) {
+    LOG(LL_INFO, ("No plan on %s, time not set", reason));
+    return;
+  }
+  const appleweather_day_forecast_t *day = planner_next_day(now);
+  if(day == NULL) {
+    LOG(LL_INFO, ("No plan on %s, no forecast for the next day", reason));
+    return;
+  }
+  int in_min = mgos_sys_config_get_power_in_min();
+  int in_max = mgos_sys_config_get_power_in_max();
+  if(in_max <= in_min) {
+    LOG(LL_WARN, ("No plan on %s, power in limits disabled", reason));
+    return;
+  }
+  sunrise = day->sunrise;
+  estimated_yield = planner_estimate_yield(day);
+
+  float capacity = battery_get_capacity_wh();
+  int soc = battery_get_soc();
+  // the house draws from the battery until sunrise
+  float night = loadmodel_get_reserve(now, sunrise);
+  float soc_sunrise = (night > 0) ? MAX(mgos_sys_config_get_battery_soc_min(), soc - night / capacity * 100.0) : soc;
+  float missing = capacity * (mgos_sys_config_get_battery_soc_max() - soc_sunrise) / 100.0;
+  shortfall = missing - MAX(0, estimated_yield);
+  LOG(LL_INFO, ("Plan on %s: soc %d%%, %.0f%% at sunrise, missing %.0fWh, yield %dWh, shortfall %.0fWh",
+                reason, soc, soc_sunrise, missing, estimated_yield, shortfall));
+  if(shortfall <= 0) {
+    shortfall = 0;
+    record_printf(record_decision, "plan", "%d %.0f", 0, 0.0);
+    plans++;
+    return;
+  }
+
+  // the price slots left before sunrise, cheapest first
+  planner_slot_t candidates[PLANNER_SLOTS];
+  int n = 0;
+  awattar_pricing_t *prices = awattar_get_entries();
+  for(int i = 0; i < awattar_get_entries_count() && n < PLANNER_SLOTS; i++) {
+    if(prices[i].end <= now || prices[i].start >= sunrise) {
+      continue;
+    }
+    candidates[n].start = MAX(prices[i].start, now);
+    candidates[n].end = MIN(prices[i].end, sunrise);
+    candidates[n].price = prices[i].price;
+    candidates[n].power = 0;
+    n++;
+  }
+  planner_sort(candidates, n, true);
+
+  float remaining = shortfall / mgos_sys_config_get_planner_efficiency();
+  for(int i = 0; i < n && remaining > 0; i++) {
+    planner_slot_t *s = &candidates[i];
+    float hours = (s->end - s->start) / 3600.0;
+    if(hours <= 0) {
+      continue;
+    }
+    float power = MIN(in_max, remaining / hours);
+    if(power < in_min) {
+      // the charger's min power, for less time
+      power = in_min;
+      hours = remaining / power;
+      s->end = s->start + (time_t) ceil(hours * 3600);
+    }
+    s->power = (int) ceil(power);
+    remaining -= s->power * hours;
+    grid_energy += s->power * hours;
+    cost += s->power * hours / 1000.0 * s->price;
+    slots[slots_count++] = *s;
+  }
+  planner_sort(slots, slots_count, false);
+  plans++;
+  record_printf(record_decision, "plan", "%d %.0f", slots_count, grid_energy);
+
+  if(remaining > 0) {
+    LOG(LL_WARN, ("Night too short for the shortfall, %.0fWh left", remaining));
+  }
+  for(int i = 0; i < slots_count; i++) {
+    LOG(LL_INFO, ("Charge slot %lld-%lld: %dW at %.4f",
+                  (long long) slots[i].start, (long long) slots[i].end, slots[i].power, slots[i].price));
+  }
+}
+
+static const planner_slot_t *planner_current_slot(time_t now) {
+  for(int i = 0; i < slots_count; i++) {
+    if(slots[i].start <= now && now < slots[i].end) {
+      return &slots[i];
+    }
+  }
+  return NULL;
+}
+
+// the optimizer holds power in at the slot power, the household load comes from the grid on top
+static void planner_start(int power) {
+  if(!charging) {
+    charging = true;
+    LOG(LL_INFO, ("Grid charging started at %dW", power));
+  }
+  if(power_get_in_hold() != power) {
+    power_set_in_hold(power);
+    record_printf(record_decision, "charge", "%d", power);
+  }
+}
+
+static void planner_stop() {
+  if(!charging) {
+    return;
+  }
+  charging = false;
+  power_set_in_hold(-1);
+  record_printf(record_decision, "charge", "%d", 0);
+  LOG(LL_INFO, ("Grid charging stopped"));
+}
+
+static void planner_check_cb(void *arg) {
+  if(!mgos_sys_config_get_planner_enable()) {
+    planner_stop();
+    return;
+  }
+  time_t now = time(NULL);
+  int updates = awattar_get_updates();
+  if(updates != price_updates) {
+    price_updates = updates;
+    planner_invalidate("prices");
+  }
+  // the state of charge lags behind while charging, a started plan runs until sunrise
+  bool started = slots_count > 0 && now >= slots[0].start && now < sunrise;
+  if(!started && now - planned_at >= PLANNER_REPLAN) {
+    planner_invalidate("interval");
+  }
+  if(dirty) {
+    planner_plan(started ? "update while charging" : "update");
+  }
+
+  const planner_slot_t *slot = planner_current_slot(now);
+  if(slot != NULL && battery_get_state() == battery_full) {
+    LOG(LL_INFO, ("Battery full, dropping the charge plan"));
+    slots_count = 0;
+    slot = NULL;
+  }
+  if(slot != NULL) {
+    planner_start(slot->power);
+  } else {
+    planner_stop();
+  }
+
+  (void) arg;
+}
+
+static void planner_forecast_handler(appleweather_day_forecast_t *entries, int length, void *cb_arg) {
+  days_count = MIN(length, PLANNER_DAYS);
+  memcpy(days, entries, days_count * sizeof(days[0]));
+  planner_invalidate("forecast");
+
+  (void) cb_arg;
+}
+
+bool planner_init() {
+  appleweather_set_update_callback(planner_forecast_handler, NULL);
+  mgos_prometheus_metrics_add_handler(planner_metrics, NULL);
+  sched_add("planner", PLANNER_INTERVAL, 350, sched_priority_background, 10, planner_check_cb, NULL);
+  return true;
+}
+
+void planner_invalidate(const char *reason) {
+  LOG(LL_DEBUG, ("Plan invalid on %s", reason));
+  dirty = true;
+}
+
+int planner_get_slots_count() {
+  return slots_count;
+}
+
+const planner_slot_t *planner_get_slots() {
+  return slots;
+}
+
+int planner_print_json(struct json_out *out, va_list *ap) {
+  int len = json_printf(out, "{enable: %B, planned_at: %lld, sunrise: %lld, yield: %d, shortfall: %f, "
+                        "grid_energy: %f, cost: %f, slots: [",
+                        mgos_sys_config_get_planner_enable(), (int64_t) planned_at, (int64_t) sunrise,
+                        estimated_yield, shortfall, grid_energy, cost);
+  for(int i = 0; i < slots_count; i++) {
+    len += json_printf(out, (i > 0) ? ", {start: %lld, end: %lld, power: %d, price: %f}" : "{start: %lld, end: %lld, power: %d, price: %f}",
+                       (int64_t) slots[i].start, (int64_t) slots[i].end, slots[i].power, slots[i].price);
+  }
+  len += json_printf(out, "]}");
+  (void) ap;
+  return len;
+}
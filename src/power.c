@@ -1,28 +1,32 @@
 #include "power.h"
+#include "power_driver.h"
 
 #include "math.h"
+#include "float.h"
 #include "limits.h"
 #include "mongoose.h"
 
 #include "adc.h"
 #include "battery.h"
 #include "soyosource.h"
+#include "feedback.h"
+#include "autotune.h"
+#include "checkpoint.h"
+#include "losstable.h"
+#include "derate.h"
+#include "latency.h"
+#include "loadmodel.h"
+#include "record.h"
 
 #include "mgos.h"
 #include "mgos_gpio.h"
 #include "mgos_rpc.h"
 #include "mgos_prometheus_metrics.h"
 #include "mgos_crontab.h"
-#include "mgos_pwm.h"
-#include "mgos_crontab.h"
 
 
-#define PWM_FREQ 25000
+#define POWER_DRIVER_TIMEOUT 10.0
 
-static int current_power_in = 0;
-static int current_power_out = 0;
-static int current_steps_in = 0;
-static int requested_steps_in = 0;
 static float total_power = 0.0;
 static float capacity_in = 0.0;
 static float capacity_out = 0.0;
@@ -31,6 +35,8 @@ static bool power_optimize_enabled = false;
 static bool power_out_enabled = true;
 static float last_p_in_lsb = 0.0;
 static int power_in_target = -1;
+// power in held regardless of the meter, -1 if none
+static int power_in_hold = -1;
 static int optimize_target_min = 0;
 static int optimize_target_max = 0;
 
@@ -38,8 +44,11 @@ static int optimize_target_max = 0;
 static double battery_voltage = 0.0;
 
 
-static power_change_impl in_impl = NULL;
-static power_change_impl out_impl = NULL;
+static const power_driver_t *in_driver = NULL;
+static const power_driver_t *out_driver = NULL;
+// uptime of pending asynchronous change, 0 if none
+static double in_pending_since = 0;
+static double out_pending_since = 0;
 
 static double last_power_change = 0;
 
@@ -55,16 +64,16 @@ static void power_metrics(struct mg_connection *nc, void *data) {
         "%d", power_get_state());
     mgos_prometheus_metrics_printf(
         nc, GAUGE, "current_power_in", "State of current power in",
-        "%d", current_power_in);
+        "%f", power_get_power_in());
     mgos_prometheus_metrics_printf(
         nc, GAUGE, "current_power_out", "State of current power out",
-        "%d", current_power_out);
+        "%f", power_get_power_out());
     mgos_prometheus_metrics_printf(
-        nc, GAUGE, "requested_steps_in", "Requesgted change of poti for input power",
-        "%d", requested_steps_in);
+        nc, GAUGE, "power_in_change_pending", "Asynchronous power in change pending",
+        "%d", in_pending_since > 0);
     mgos_prometheus_metrics_printf(
-        nc, GAUGE, "current_steps_in", "State of poti for input power",
-        "%d", current_steps_in);
+        nc, GAUGE, "power_out_change_pending", "Asynchronous power out change pending",
+        "%d", out_pending_since > 0);
     mgos_prometheus_metrics_printf(
         nc, GAUGE, "current_total_power", "State of current total power reported through mqtt",
         "%f", total_power);
@@ -92,11 +101,11 @@ static power_state_t power_update_capacity() {
   switch (state) {
   case power_in:
     //capacity_in += adc_read_power_in_current() * hours;
-    capacity_in += current_power_in / battery_voltage * hours;
+    capacity_in += power_get_power_in() / battery_voltage * hours;
     break;
   case power_out:
     //capacity_out += adc_get_power_out() * hours;
-    capacity_out += current_power_out / battery_voltage * hours;
+    capacity_out += power_get_power_out() / battery_voltage * hours;
     break;
   default:
     break;
@@ -113,174 +122,6 @@ static void power_reset_capacity_crontab_handler(struct mg_str action,
   (void) userdata;
 }
 
-static power_change_state_t power_in_change_mcp4021(float* power) {
-  int ud = mgos_sys_config_get_power_in_power_ud_pin();
-  int cs = mgos_sys_config_get_power_in_power_cs_pin();
-  int s = (int) fabs(*power);
-  // TODO: max/min limits
-  // DW NOTE: timings only rough
-  bool udstart = (*power > 0);
-  mgos_gpio_write(ud, udstart);
-  mgos_usleep(2);
-  mgos_gpio_write(cs, false);
-  mgos_usleep(2);
-  while(s > 0) {
-      mgos_gpio_write(ud, !udstart);
-      mgos_usleep(2);
-      mgos_gpio_write(ud, udstart);
-      mgos_usleep(2);
-      s--;
-  }
-  mgos_usleep(2);
-  mgos_gpio_write(cs, true);
-  
-  return power_change_ok;
-}
-
-static power_change_state_t power_in_change_max5389(float* power) {
-  float p_in_lsb = mgos_sys_config_get_power_in_lsb();
-  int steps = (int) (*power / p_in_lsb);
-  int ud = mgos_sys_config_get_power_in_power_ud_pin();
-  int dir = mgos_sys_config_get_power_in_power_cs_pin();
-  int s = (int) fabs(steps);
-  // asuming CS is enabled
-  // DW TODO: min/max limits
-  // DW NOTE: timings only rough
-  bool udstart = (steps < 0);
-  mgos_gpio_write(dir, udstart);
-  mgos_usleep(1);
-  while(s > 0) {
-      mgos_gpio_write(ud, true);
-      mgos_usleep(1);
-      mgos_gpio_write(ud, false);
-      mgos_usleep(1);
-      s--;
-  }
-
-  return power_change_ok;
-}
-
-static power_change_state_t power_in_change_dummy(float* power) {
-  if(total_power > power_get_optimize_target_max()) {
-    return power_change_at_min;
-  } else if(total_power > power_get_optimize_target_min()) {
-    return power_change_at_max;
-  }
-  return power_change_no_change;
-}
-
-static power_change_state_t power_in_set_pwm(float duty) {
-  int pin = mgos_sys_config_get_power_in_power_ud_pin();
-  power_change_state_t result = power_change_invalid;
-  if(duty == 0) {
-    mgos_pwm_set(pin, 0, 0); // can fail if no pwm has been started
-    mgos_gpio_write(pin, false);
-    result = power_change_at_min;
-  } else if(duty == 1.0) {
-    mgos_pwm_set(pin, 0, 0); // can fail if no pwm has been started
-    mgos_gpio_write(pin, true);
-    result = power_change_at_max;
-  } else {
-    // inverted
-    if(!mgos_pwm_set(pin, PWM_FREQ, 1.0 - duty)) {
-      LOG(LL_ERROR, ("Updating PWM to %f failed", duty));
-      return power_change_failed;
-    }
-    result = power_change_ok;
-  }
-  return result;
-}
-
-static power_change_state_t power_in_change_pwm(float* power) {
-  if(*power == 0) {
-    return power_change_no_change;
-  } 
-  int max_power = mgos_sys_config_get_power_in_max();
-  //int min_power = mgos_sys_config_get_power_in_min();
-  if(max_power == 0) {
-    LOG(LL_ERROR, ("MAX Power setting required for PWM"));
-    return power_change_invalid;
-  }
-  float damping = mgos_sys_config_get_power_in_damping();
-  float duty = (float) (current_power_in + *power * damping) / max_power;
-  duty = fmin(1.0, fmax( 0.0, duty));
-
-  power_change_state_t result = power_in_set_pwm(duty);
-  
-  current_steps_in = duty * 100;
-  float new_power_in = duty * max_power;
-
-  LOG(LL_INFO, ("Updating PWM to %f [New: %.2fW, Previous: %dW, Asked: %.2f]", duty, new_power_in, current_power_in, *power));
-
-  *power = new_power_in - current_power_in;
-  return result;
-}
-
-static power_change_state_t power_in_change_drv8825(float* power) {
-  float p_in_lsb = mgos_sys_config_get_power_in_lsb();
-  int steps = (int) *power / p_in_lsb;
-  int max_steps = mgos_sys_config_get_power_steps();
-  int ud = mgos_sys_config_get_power_in_power_ud_pin();
-  int dir = mgos_sys_config_get_power_in_power_cs_pin();
-  int delay = mgos_sys_config_get_power_stepper_delay();
-  int s = abs(steps);
-  // asuming CS is enabled
-  // DW NOTE: timings only rough
-  bool udstart = (steps > 0);
-  requested_steps_in = steps;
-  if(steps < 0 && current_steps_in == 0) {
-    return power_change_at_min;
-  } else if(steps > 0 && current_steps_in == max_steps) {
-    return power_change_at_max;
-  } else if(current_steps_in + steps < 0) {
-    steps = -current_steps_in;
-    LOG(LL_WARN, ("At min step after stepping %d", steps));
-  } else if(current_steps_in + steps > max_steps) {
-    steps = max_steps - current_steps_in;
-    LOG(LL_WARN, ("At max step after stepping %d", steps));
-  }
-
-  mgos_gpio_write(dir, udstart);
-  mgos_usleep(100);
-  while(s > 0 /* TODO && current_power_in < mgos_sys_config_get_power_steps() && current_power_in >= 0 */) {
-      mgos_gpio_write(ud, false);
-      mgos_usleep(delay);
-      mgos_gpio_write(ud, true);
-      mgos_usleep(delay);
-      s--;
-      current_power_in += (steps > 0) ? 1 : -1;
-  }
-  current_steps_in += steps;
-  return power_change_ok;
-}
-
-
-static void power_in_change_rpc_cb(struct mg_rpc *c, void *cb_arg,
-                               struct mg_rpc_frame_info *fi,
-                               struct mg_str result, int error_code,
-                               struct mg_str error_msg) {
-  if(error_code) {
-    LOG(LL_ERROR, ("power_in_change_rpc_cb error: %d %.*s", error_code, error_msg.len, error_msg.p)); 
-    return;
-  } 
-
-  LOG(LL_INFO, ("power_in_change_rpc_cb: %.*s", result.len, result.p));  
-}
-
-static power_change_state_t power_in_change_rpc(float* power) {
-  struct mg_rpc *c = mgos_rpc_get_global();
-  struct mg_rpc_call_opts opts = {
-    .dst = mg_mk_str(mgos_sys_config_get_power_in_slave()) 
-  };
-  if(!mg_rpc_callf(c, mg_mk_str("Power.InChange"), power_in_change_rpc_cb, NULL, &opts,
-             "{power: %d}", power)) {
-    LOG(LL_ERROR, ("power_in_change_rpc: calling %.*s failed.", opts.dst.len, opts.dst.p));  
-    return power_change_failed;                          
-  }
-  LOG(LL_ERROR, ("power_in_change_rpc: called."));  
-  return power_change_unknown;
-}
-
 static power_change_state_t apply_in_limits(float* power) {
   int min = mgos_sys_config_get_power_in_min();
   int max = mgos_sys_config_get_power_in_max();
@@ -289,26 +130,35 @@ static power_change_state_t apply_in_limits(float* power) {
   if(max <= min) {
     return power_change_ok;
   }
+  int derated = derate_get_max(power_in, min, max);
 
   // if(power < (min - max)) {
   //   // better switch off
   //   return 0;
   // }
 
-  if(power_in_target >= 0) {
-    if(current_power_in + *power > power_in_target) {
-      *power = power_in_target - current_power_in;
-      LOG(LL_INFO, ("Correcting power in to %f to power in target %d", *power,  power_in_target));
+  float current_power_in = power_get_power_in();
+  if(derated < max && current_power_in > derated && *power > derated - current_power_in) {
+    *power = derated - current_power_in;
+    LOG(LL_INFO, ("Power in above derated max %d, current: %.2f", derated, current_power_in));
+    return power_change_ok;
+  }
+  max = derated;
+  int target = (power_in_hold >= 0) ? power_in_hold : power_in_target;
+  if(target >= 0) {
+    if(current_power_in + *power > target) {
+      *power = target - current_power_in;
+      LOG(LL_INFO, ("Correcting power in to %f to power in target %d", *power,  target));
     } else {
-      LOG(LL_INFO, ("Power in target %d not reached %d", power_in_target, current_power_in));
+      LOG(LL_INFO, ("Power in target %d not reached %.2f", target, current_power_in));
     }
   }
 
   if(current_power_in <= min && *power < 0) {
-    LOG(LL_INFO, ("Power in at Min, current: %d, asked: %.2f", current_power_in, *power));
+    LOG(LL_INFO, ("Power in at Min, current: %.2f, asked: %.2f", current_power_in, *power));
     return power_change_at_min;
   } else if(current_power_in >= max && *power > 0) {
-    LOG(LL_INFO, ("Power in at Max, current: %d, asked: %.2f", current_power_in, *power));
+    LOG(LL_INFO, ("Power in at Max, current: %.2f, asked: %.2f", current_power_in, *power));
     return power_change_at_max;
   }
 
@@ -335,115 +185,158 @@ static power_change_state_t apply_out_limits(float* power) {
     LOG(LL_INFO, ("Out limits disabled"));
     return power_change_ok;
   }
+  float derated = derate_get_max(power_out, min, max);
 
   // if(power < (min - max)) {
   //   // better switch off
   //   return 0;
   // }
+  float current_power_out = power_get_power_out();
+  if(derated < max && current_power_out > derated && *power > derated - current_power_out) {
+    *power = derated - current_power_out;
+    LOG(LL_INFO, ("Power out above derated max %.0f, current: %.2f", derated, current_power_out));
+    return power_change_ok;
+  }
+  max = derated;
   if(current_power_out <= min && *power < 0) {
-    LOG(LL_INFO, ("Power out at Min, current: %d, asked: %.2f", current_power_out, *power));
+    LOG(LL_INFO, ("Power out at Min, current: %.2f, asked: %.2f", current_power_out, *power));
     return power_change_at_min;
   } else if(current_power_out >= max && *power > 0) {
-    LOG(LL_INFO, ("Power out at Max, current: %d, asked: %.2f", current_power_out, *power));
+    LOG(LL_INFO, ("Power out at Max, current: %.2f, asked: %.2f", current_power_out, *power));
     return power_change_at_max;
   } 
 
-  float power_out = (float) current_power_out; // TODO: adc_get_power_out();
+  float power_out = current_power_out;
   if(power_out + *power < min) {
     *power = min - power_out;
   } else if(power_out + *power > max) {
     *power = max - power_out;
   }
 
-   LOG(LL_INFO, ("current_power_out: %d, changing by: %.2f", current_power_out, *power));
+   LOG(LL_INFO, ("current_power_out: %.2f, changing by: %.2f", current_power_out, *power));
  
   return power_change_ok;
 }
 
 
-static power_change_state_t power_out_change_soyosource(float* power) {
-  soyosource_set_enabled(true);
-  //current_power_out = soyosource_get_power_out(); // not up to date, when serial reading is slow
-  if(*power == 0) {
-    return power_change_no_change;
-  } 
-  
-  int max_power = mgos_sys_config_get_power_out_max();
-  int min_power = mgos_sys_config_get_power_out_min();
-  float damping = mgos_sys_config_get_power_out_damping();
-  if(current_power_out <= min_power && *power < 0) {
-    LOG(LL_INFO, ("Out power at minimum %d [requested: %f] - switching off", current_power_out , *power));
-    *power = 0;
-    soyosource_set_power_out(0);
-    return power_change_at_min;
+static const power_driver_t* power_setup_driver(int type, power_state_t direction) {
+  const char *name = (direction == power_in) ? "in" : "out";
+  power_driver_cap_t cap = (direction == power_in) ? power_driver_cap_in : power_driver_cap_out;
+  const power_driver_t *driver = power_driver_get(type);
+  if(driver == NULL) {
+    LOG(LL_ERROR, ("Unknown power change driver %d, using dummy driver", type));
+  } else if(!power_driver_has_cap(driver, cap)) {
+    LOG(LL_ERROR, ("Power change driver %s cannot change power %s, using dummy driver", driver->name, name));
+    driver = NULL;
+  } else if(driver->init != NULL && !driver->init(direction)) {
+    LOG(LL_ERROR, ("Failed to init power change driver %s, using dummy driver", driver->name));
+    driver = NULL;
   }
+  if(driver == NULL) {
+    driver = power_driver_get(power_change_dummy);
+    driver->init(direction);
+  }
+  LOG(LL_INFO, ("Power %s driver: %s", name, driver->name));
+  return driver;
+}
 
-  power_change_state_t result = power_change_ok;
-  int p = (*power > 0) ? (*power * damping) : *power;
-  int new_power_out = MIN(max_power, MAX( min_power, current_power_out + p));
-  
-  soyosource_set_power_out(new_power_out);
-  *power = new_power_out - current_power_out;
-  LOG(LL_INFO, ("Changed out power from %d to %d [requested: %.2f]", current_power_out, new_power_out, *power));
-
-  return result;
+static void power_driver_done(power_change_state_t result, float actual, void *cb_arg) {
+  double *pending_since = (double *) cb_arg;
+  LOG(LL_INFO, ("Power change done after %.2fs: %d, actual %.2f", mgos_uptime() - *pending_since, result, actual));
+  *pending_since = 0;
+  if(result != power_change_no_change) {
+    last_power_change = mg_time();
+    latency_mark(latency_confirm);
+  }
 }
 
-static power_change_state_t power_enable_tps2121(float* power) {
-  // TODO: ????
-  int ud = mgos_sys_config_get_power_in_power_ud_pin();
-  power_state_t state = power_get_state();
-  power_change_state_t result = power_change_invalid;
-  switch (state) {
-  case power_out:
-    mgos_gpio_write(ud, true);
-    result = power_change_at_max;
-    break;
-  case power_in:
-    mgos_gpio_write(ud, false);
-    result = power_change_at_min;
-    break;
-  default:
-    result = power_change_no_change;
+static bool power_driver_pending(double *pending_since) {
+  if(*pending_since == 0) {
+    return false;
+  }
+  if(mgos_uptime() - *pending_since > POWER_DRIVER_TIMEOUT) {
+    LOG(LL_WARN, ("Power change not confirmed after %.0fs, giving up", POWER_DRIVER_TIMEOUT));
+    *pending_since = 0;
+    return false;
+  }
+  return true;
+}
+
+// changes the driver's actual power by power, reports the resulting change in power
+static power_change_state_t power_driver_change(const power_driver_t *driver, power_state_t direction,
+                                                float *power, float damping, double *pending_since) {
+  float min, max;
+  float actual = driver->get_actual(direction);
+  driver->get_limits(direction, &min, &max);
+  float target = fminf(max, fmaxf(min, actual + *power * damping));
+
+  *pending_since = mgos_uptime();
+  latency_mark(latency_command);
+  power_change_state_t result = driver->set_target(direction, target, power_driver_done, pending_since);
+  record_printf(record_decision, (direction == power_out) ? "out" : "in", "%.3f %.3f %d",
+                target, driver->get_actual(direction), result);
+  if(result == power_change_unknown) {
+    // commanded, confirmed through power_driver_done
+    *power = target - actual;
+    autotune_step(direction, *power);
+    return result;
+  }
+  *pending_since = 0;
+  *power = driver->get_actual(direction) - actual;
+  if(result != power_change_no_change) {
+    last_power_change = mg_time();
+  }
+  if(result != power_change_invalid && result != power_change_failed) {
+    autotune_step(direction, *power);
+    if(result != power_change_no_change) {
+      latency_mark(latency_confirm);
+    }
   }
-  LOG(LL_INFO, ("Power state: %d, change state: %d, power: %.2f", state, result, *power));
   return result;
 }
 
-static power_change_impl power_get_change_impl(power_change_driver_t type) {
-  power_change_impl impl = NULL;
-  switch (type) {
-  case power_change_dummy:
-    impl = power_in_change_dummy;
-    break;
-  case power_change_pwm:
-    impl = power_in_change_pwm;
-    break;
-  case power_change_mcp4021:
-    impl = power_in_change_mcp4021;
-    break;
-  case power_change_max5389:
-    impl = power_in_change_max5389;
-    break;
-  case power_change_drv8825:
-    impl = power_in_change_drv8825;
-    break;
-  case power_change_rpc:
-    impl = power_in_change_rpc;
-    break;
-  case power_change_soyosource:
-    impl = power_out_change_soyosource;
-    break;
-  case power_change_tps2121:
-    impl = power_enable_tps2121;
-    break;
+void power_apply_derating(power_state_t direction) {
+  const power_driver_t *driver = (direction == power_out) ? out_driver : in_driver;
+  double *pending_since = (direction == power_out) ? &out_pending_since : &in_pending_since;
+  if(driver == NULL || power_get_state() != direction) {
+    return;
+  }
+  int min = (direction == power_out) ? mgos_sys_config_get_power_out_min() : mgos_sys_config_get_power_in_min();
+  int max = (direction == power_out) ? mgos_sys_config_get_power_out_max() : mgos_sys_config_get_power_in_max();
+  float derated;
+  if(max > min) {
+    derated = derate_get_max(direction, min, max);
+  } else {
+    // limits disabled, scale the driver's range
+    float driver_min, driver_max;
+    driver->get_limits(direction, &driver_min, &driver_max);
+    if(driver_max == FLT_MAX) {
+      return;
+    }
+    derated = fmaxf(driver_min, driver_max * derate_get_factor(direction));
+  }
+  float actual = driver->get_actual(direction);
+  if(actual <= derated || power_driver_pending(pending_since)) {
+    return;
+  }
+  float power = derated - actual;
+  LOG(LL_WARN, ("Power %s %.2f above derated max %.0f, reducing", (direction == power_out) ? "out" : "in",
+                actual, derated));
+  power_driver_change(driver, direction, &power, 1.0, pending_since);
+}
 
-  default:
-    LOG(LL_ERROR, ("Unknown power change driver %d, using dummy driver", type));
-    impl = power_in_change_dummy;
-    break;
+static void power_driver_stop(const power_driver_t *driver, power_state_t direction, double *pending_since) {
+  // a measured 0 may be stale or not measured yet, only the last target is known to be off
+  if(driver == NULL || (!power_driver_has_cap(driver, power_driver_cap_readback) && driver->get_actual(direction) == 0)) {
+    return;
+  }
+  *pending_since = mgos_uptime();
+  power_change_state_t result = driver->set_target(direction, 0, power_driver_done, pending_since);
+  record_printf(record_decision, (direction == power_out) ? "out" : "in", "%.3f %.3f %d",
+                0.0, driver->get_actual(direction), result);
+  if(result != power_change_unknown) {
+    *pending_since = 0;
   }
-  return impl;
 }
 
 static void power_get_status() {
@@ -456,15 +349,6 @@ static void power_get_status() {
 void power_init() {
     power_pending.size = mgos_sys_config_get_power_pending_count();
 
-    int in_driver = mgos_sys_config_get_power_in_change_driver();
-    int out_driver = mgos_sys_config_get_power_out_change_driver();
-    in_impl = power_get_change_impl(in_driver);
-    out_impl = power_get_change_impl(out_driver);
-
-    if(in_driver == power_change_pwm) {
-      power_in_set_pwm(0);
-    }
-
     last_p_in_lsb = mgos_sys_config_get_power_in_lsb();
 
     int in = mgos_sys_config_get_power_in_pin();
@@ -489,19 +373,31 @@ void power_init() {
       mgos_gpio_setup_input(status, MGOS_GPIO_PULL_UP);
     }
 
+    power_driver_init();
+    in_driver = power_setup_driver(mgos_sys_config_get_power_in_change_driver(), power_in);
+    out_driver = power_setup_driver(mgos_sys_config_get_power_out_change_driver(), power_out);
+
     optimize_target_min = mgos_sys_config_get_power_optimize_target_min();
     optimize_target_max = mgos_sys_config_get_power_optimize_target_max();
 
     mgos_prometheus_metrics_add_handler(power_metrics, NULL);
 
-    capacity_in = 0.0;
-    capacity_out = 0.0;
+    const checkpoint_state_t *checkpoint = checkpoint_get();
+    capacity_in = (checkpoint != NULL && isfinite(checkpoint->capacity_in)) ? checkpoint->capacity_in : 0.0;
+    capacity_out = (checkpoint != NULL && isfinite(checkpoint->capacity_out)) ? checkpoint->capacity_out : 0.0;
     last_capacity_update = mgos_uptime();
-    current_steps_in = mgos_sys_config_get_power_steps() / 2; // TODO: arbitrary start
     battery_voltage = mgos_sys_config_get_battery_num_cells() * (mgos_sys_config_get_battery_cell_voltage_min() + mgos_sys_config_get_battery_cell_voltage_max()) / 2.0;
 
-    mgos_crontab_register_handler(mg_mk_str("power.reset_capacity"), power_reset_capacity_crontab_handler, NULL);
-    power_set_state(power_off);
+    record_crontab_register_handler(mg_mk_str("power.reset_capacity"), power_reset_capacity_crontab_handler, NULL);
+    if(power_driver_steps_restored() && power_driver_get_steps_in() > 0) {
+      // relays off only, the next power in resumes at the restored position
+      LOG(LL_INFO, ("Keeping restored step %d", power_driver_get_steps_in()));
+      mgos_gpio_write(in, !false);
+      mgos_gpio_write(out, false);
+      record_printf(record_decision, "state", "%d", power_get_state());
+    } else {
+      power_set_state(power_off);
+    }
 }
 
 
@@ -542,11 +438,8 @@ void power_set_state(power_state_t state) {
       if(battery_state == battery_charging || battery_state == battery_discharging) {
         battery_set_state(battery_idle);
       }
-      current_power_out = 0;
-      current_power_in = 0;
-      if(soyosource_get_out_enabled()) {
-        soyosource_set_power_out(0);
-      }
+      power_driver_stop(in_driver, power_in, &in_pending_since);
+      power_driver_stop(out_driver, power_out, &out_pending_since);
       break;
     case power_in:
       if(battery_state == battery_full || battery_state == battery_invalid) {
@@ -574,6 +467,7 @@ void power_set_state(power_state_t state) {
       LOG(LL_ERROR, ("Invalid power state %d", state));
       break;
   }
+  record_printf(record_decision, "state", "%d", power_get_state());
 }
 
 power_change_state_t power_in_change(float* power) {
@@ -581,18 +475,24 @@ power_change_state_t power_in_change(float* power) {
     LOG(LL_INFO, ("Cannot change power in, not in state power_in"));
     return power_change_invalid;
   }
+  if(power_driver_pending(&in_pending_since)) {
+    LOG(LL_INFO, ("Cannot change power in, previous change pending"));
+    *power = 0;
+    return power_change_failed;
+  }
   power_update_capacity();
   power_change_state_t result = apply_in_limits(power);
 
   if(result != power_change_ok) { 
     return result; 
   }
-
-  result = in_impl(power);
-  if(result != 0) {
-    last_power_change = mg_time();
+  if(*power == 0 && !power_driver_has_cap(in_driver, power_driver_cap_switch)) {
+    return power_change_no_change;
   }
 
+  result = power_driver_change(in_driver, power_in, power,
+                               autotune_get_damping(power_in), &in_pending_since);
+
   // result = power_in_change_pwm(power);
 
   // const char* slave = mgos_sys_config_get_power_in_slave();
@@ -610,27 +510,50 @@ power_change_state_t power_out_change(float* power) {
     LOG(LL_INFO, ("Cannot change power out, not in state power_out"));
     return power_change_invalid;
   }
+  if(power_driver_pending(&out_pending_since)) {
+    LOG(LL_INFO, ("Cannot change power out, previous change pending"));
+    *power = 0;
+    return power_change_failed;
+  }
   power_update_capacity();
   power_change_state_t result = apply_out_limits(power);
 
   if(result != power_change_ok) { 
     return result; 
   }
-
-  result = out_impl(power);
-  if(result != 0) {
-    last_power_change = mg_time();
+  if(*power == 0 && !power_driver_has_cap(out_driver, power_driver_cap_switch)) {
+    return power_change_no_change;
   }
+
+  // reduce power out without damping to avoid feeding the grid from the battery
+  float damping = (*power > 0) ? autotune_get_damping(power_out) : 1.0;
+  result = power_driver_change(out_driver, power_out, power, damping, &out_pending_since);
   return result;
 }
 
 void power_set_total_power(float power) {
   total_power = power;
+  feedback_meter_update(power);
+  autotune_meter_update(power);
+  losstable_meter_update(power);
+  loadmodel_meter_update(power);
   if(power_get_optimize_enabled()) {
     power_optimize(total_power);
   }
 }
 
+float power_get_total_power() {
+  return total_power;
+}
+
+float power_get_power_in() {
+  return (in_driver != NULL) ? in_driver->get_actual(power_in) : 0;
+}
+
+float power_get_power_out() {
+  return (out_driver != NULL) ? out_driver->get_actual(power_out) : 0;
+}
+
 void power_set_optimize_enabled(bool enabled) {
   power_optimize_enabled = enabled;
 }
@@ -639,7 +562,30 @@ bool power_get_optimize_enabled() {
   return power_optimize_enabled;
 }
 
+// drives power in to the held power, the household load is drawn from the grid on top
+static float power_optimize_hold(power_state_t state) {
+  if(state == power_out) {
+    power_set_state(power_off);
+  }
+  if(power_get_state() != power_in) {
+    power_set_state(power_in);
+  }
+  if(power_get_state() != power_in) {
+    return 0;
+  }
+  float p = power_in_hold - power_get_power_in();
+  if(fabsf(p) < mgos_sys_config_get_power_in_lsb()) {
+    return 0;
+  }
+  LOG(LL_INFO, ("Holding power in at %d, current: %.2f", power_in_hold, power_get_power_in()));
+  if(power_in_change(&p) != power_change_ok) {
+    return 0;
+  }
+  return p;
+}
+
 float power_optimize(float power) {
+  latency_mark(latency_optimize);
   power_state_t state = power_update_capacity();
   int target_min = power_get_optimize_target_min();
   int target_max = power_get_optimize_target_max();
@@ -659,20 +605,18 @@ float power_optimize(float power) {
 
   i = power_pending.next;
   float p = pending - target_mid;
-  switch (state) {
+  if(power_in_hold >= 0) {
+    p = power_optimize_hold(state);
+  } else switch (state) {
     case power_off:
       if(pending < target_min && pending < (target_mid - in_min) ) {
         p = -p;
         power_set_state(power_in);
-        if(power_in_change(&p) !=  power_change_at_min) {
-          current_power_in = (int) p;
-        }
+        power_in_change(&p);
       }
       else if(pending > mgos_sys_config_get_power_out_on()) {
         power_set_state(power_out);
-        if(power_out_change(&p) !=  power_change_at_min) {
-          current_power_out = (int) p;
-        }
+        power_out_change(&p);
       } else {
         p = 0;
       }
@@ -683,8 +627,6 @@ float power_optimize(float power) {
         p = -p;
         if(power_in_change(&p) ==  power_change_at_min) {
           power_set_state(power_off);
-        } else {
-          current_power_in += (int) p;
         }
       } else {
         //current_power_in -= (int) power; // optimize to 0
@@ -711,13 +653,11 @@ float power_optimize(float power) {
         //if(adc_get_power_in() < mgos_sys_config_get_power_in_min() ) {
         if(power_out_change(&p) ==  power_change_at_min) {
           power_set_state(power_off);
-        } else {
-          current_power_out += (int) p;
         }
       } else {
         p = 0;
       }
-      if(current_power_out <= mgos_sys_config_get_power_out_off()) {
+      if(power_get_state() == power_out && power_get_power_out() <= mgos_sys_config_get_power_out_off()) {
         power_set_state(power_off); 
         p = 0;
       } 
@@ -730,7 +670,7 @@ float power_optimize(float power) {
   if(power_pending.size > 0) {
     power_pending.items[i++] = p;
     power_pending.next = i % power_pending.size; 
-    LOG(LL_INFO, ("p: %.2f\tcurrent_power_out %d\tpending %.2f", p, current_power_out, pending));
+    LOG(LL_INFO, ("p: %.2f\tcurrent_power_out %.2f\tpending %.2f", p, power_get_power_out(), pending));
   }
   return p;
 }
@@ -740,6 +680,14 @@ void power_reset_capacity() {
   capacity_out = 0;
 }
 
+float power_get_capacity_in() {
+  return capacity_in;
+}
+
+float power_get_capacity_out() {
+  return capacity_out;
+}
+
 void power_set_out_enabled(bool enabled) {
   power_out_enabled = enabled;
   soyosource_set_out_enabled(enabled);
@@ -772,6 +720,14 @@ int power_get_in_target() {
   return power_in_target;
 }
 
+void power_set_in_hold(int power) {
+  power_in_hold = power;
+}
+
+int power_get_in_hold() {
+  return power_in_hold;
+}
+
 double power_get_last_power_change() {
   return last_power_change;
 }
@@ -786,13 +742,18 @@ static void power_run_test_handler(void *arg) {
 void power_run_test() {
   static int i = 127;
   static float p = 1;
+  const power_driver_t *driver = power_driver_get(power_change_max5389);
+  if(driver == NULL) {
+    LOG(LL_ERROR, ("No max5389 driver to test"));
+    return;
+  }
   if(i == mgos_sys_config_get_power_steps()) {
     p = -1.0;
   } else if(i == 0) {
     p = 1.0;
   }
   LOG(LL_INFO, ("Step: %d", i));
-  power_in_change_max5389(&p);
+  driver->set_target(power_in, driver->get_actual(power_in) + p * mgos_sys_config_get_power_in_lsb(), NULL, NULL);
   i += p;
   mgos_set_timer(1000 /* ms */, 0, power_run_test_handler, NULL);
 }
\ No newline at end of file
@@ -0,0 +1,635 @@
+#include "power_driver.h"
+
+#include "math.h"
+#include "float.h"
+
+#include "checkpoint.h"
+#include "soyosource.h"
+#include "feedback.h"
+#include "record.h"
+
+#include "mgos.h"
+#include "mgos_gpio.h"
+#include "mgos_rpc.h"
+#include "mgos_pwm.h"
+#include "mgos_prometheus_metrics.h"
+
+
+#define PWM_FREQ 25000
+// wiper taps of the MCP4021, stepped once per W of the requested change as before the driver layer
+#define MCP4021_STEPS 63
+#define MCP4021_LSB 1.0
+
+static const power_driver_t *drivers[POWER_DRIVER_MAX];
+static int drivers_count = 0;
+static bool drivers_initialized = false;
+
+static int current_steps_in = 0;
+static bool stepping_in = false;
+static bool steps_restored = false;
+static int requested_steps_in = 0;
+// W per step and number of steps of the stepping in driver
+static float steps_lsb = 0;
+static int steps_max = 0;
+
+static void power_driver_metrics(struct mg_connection *nc, void *data) {
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "requested_steps_in", "Requesgted change of poti for input power",
+        "%d", requested_steps_in);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "current_steps_in", "State of poti for input power",
+        "%d", current_steps_in);
+
+  (void) data;
+}
+
+static inline int power_driver_index(power_state_t direction) {
+  return (direction == power_out) ? 1 : 0;
+}
+
+static void power_driver_no_limits(power_state_t direction, float *min, float *max) {
+  *min = 0;
+  *max = FLT_MAX;
+  (void) direction;
+}
+
+/*
+ * dummy: no hardware, follows the target
+ */
+
+static float dummy_power[2] = { 0, 0 };
+
+static bool power_dummy_init(power_state_t direction) {
+  dummy_power[power_driver_index(direction)] = 0;
+  return true;
+}
+
+static power_change_state_t power_dummy_set_target(power_state_t direction, float target,
+                                                   power_driver_done_cb cb, void *cb_arg) {
+  float total_power = power_get_total_power();
+  power_change_state_t result = power_change_no_change;
+  if(total_power > power_get_optimize_target_max()) {
+    result = power_change_at_min;
+  } else if(total_power > power_get_optimize_target_min()) {
+    result = power_change_at_max;
+  }
+  if(result != power_change_at_min || target == 0) {
+    dummy_power[power_driver_index(direction)] = target;
+  }
+  return result;
+}
+
+static float power_dummy_get_actual(power_state_t direction) {
+  return dummy_power[power_driver_index(direction)];
+}
+
+static const power_driver_t power_driver_dummy = {
+  .type = power_change_dummy,
+  .name = "dummy",
+  .caps = power_driver_cap_in | power_driver_cap_out,
+  .init = power_dummy_init,
+  .set_target = power_dummy_set_target,
+  .get_actual = power_dummy_get_actual,
+  .get_limits = power_driver_no_limits
+};
+
+/*
+ * pwm: duty cycle relative to power.in_max
+ */
+
+static float pwm_power = 0;
+
+static power_change_state_t power_in_set_pwm(float duty) {
+  int pin = mgos_sys_config_get_power_in_power_ud_pin();
+  power_change_state_t result = power_change_invalid;
+  if(duty == 0) {
+    mgos_pwm_set(pin, 0, 0); // can fail if no pwm has been started
+    mgos_gpio_write(pin, false);
+    result = power_change_at_min;
+  } else if(duty == 1.0) {
+    mgos_pwm_set(pin, 0, 0); // can fail if no pwm has been started
+    mgos_gpio_write(pin, true);
+    result = power_change_at_max;
+  } else {
+    // inverted
+    if(!mgos_pwm_set(pin, PWM_FREQ, 1.0 - duty)) {
+      LOG(LL_ERROR, ("Updating PWM to %f failed", duty));
+      return power_change_failed;
+    }
+    result = power_change_ok;
+  }
+  return result;
+}
+
+static bool power_pwm_init(power_state_t direction) {
+  if(mgos_sys_config_get_power_in_max() <= 0) {
+    LOG(LL_ERROR, ("MAX Power setting required for PWM"));
+    return false;
+  }
+  pwm_power = 0;
+  power_in_set_pwm(0);
+  (void) direction;
+  return true;
+}
+
+static power_change_state_t power_pwm_set_target(power_state_t direction, float target,
+                                                 power_driver_done_cb cb, void *cb_arg) {
+  int max_power = mgos_sys_config_get_power_in_max();
+  if(max_power <= 0) {
+    LOG(LL_ERROR, ("MAX Power setting required for PWM"));
+    return power_change_invalid;
+  }
+  float duty = target / max_power;
+  duty = fmin(1.0, fmax( 0.0, duty));
+
+  power_change_state_t result = power_in_set_pwm(duty);
+  if(result == power_change_failed) {
+    return result;
+  }
+  float new_power_in = duty * max_power;
+  current_steps_in = duty * 100;
+
+  LOG(LL_INFO, ("Updating PWM to %f [New: %.2fW, Previous: %.2fW, Asked: %.2f]", duty, new_power_in, pwm_power, target));
+
+  pwm_power = new_power_in;
+  (void) direction;
+  return result;
+}
+
+static float power_pwm_get_actual(power_state_t direction) {
+  (void) direction;
+  return pwm_power;
+}
+
+static void power_pwm_get_limits(power_state_t direction, float *min, float *max) {
+  *min = 0;
+  *max = mgos_sys_config_get_power_in_max();
+  (void) direction;
+}
+
+static const power_driver_t power_driver_pwm = {
+  .type = power_change_pwm,
+  .name = "pwm",
+  .caps = power_driver_cap_in,
+  .init = power_pwm_init,
+  .set_target = power_pwm_set_target,
+  .get_actual = power_pwm_get_actual,
+  .get_limits = power_pwm_get_limits
+};
+
+/*
+ * stepping drivers: position in steps of power.in_lsb, 0 to power.steps,
+ * the MCP4021 in its own taps
+ */
+
+// persistent if the position survives power loss, a volatile one only a warm reset
+static void power_steps_restore(bool persistent, float lsb, int max) {
+  const checkpoint_state_t *checkpoint = checkpoint_get();
+  steps_lsb = lsb;
+  steps_max = max;
+  steps_restored = checkpoint != NULL && (persistent || checkpoint_is_warm());
+  if(steps_restored) {
+    current_steps_in = MAX(0, MIN(steps_max, checkpoint->steps_in));
+    LOG(LL_INFO, ("Restored step %d", current_steps_in));
+  } else {
+    // unknown position, power_off winds it down to 0
+    current_steps_in = steps_max / 2;
+  }
+  requested_steps_in = 0;
+  stepping_in = true;
+}
+
+// digital pots power up at mid-scale
+static bool power_steps_init(power_state_t direction) {
+  power_steps_restore(false, mgos_sys_config_get_power_in_lsb(), mgos_sys_config_get_power_steps());
+  (void) direction;
+  return true;
+}
+
+static bool power_mcp4021_init(power_state_t direction) {
+  power_steps_restore(false, MCP4021_LSB, MCP4021_STEPS);
+  (void) direction;
+  return true;
+}
+
+// the motor leaves the pot where it was
+static bool power_drv8825_init(power_state_t direction) {
+  power_steps_restore(true, mgos_sys_config_get_power_in_lsb(), mgos_sys_config_get_power_steps());
+  (void) direction;
+  return true;
+}
+
+// number of steps to reach target, limited to the available steps
+static power_change_state_t power_steps_plan(float target, int *steps) {
+  *steps = 0;
+  if(steps_lsb <= 0) {
+    LOG(LL_ERROR, ("power.in_lsb required for stepping drivers"));
+    return power_change_invalid;
+  }
+  requested_steps_in = (int) roundf(target / steps_lsb) - current_steps_in;
+  if(requested_steps_in < 0 && current_steps_in == 0) {
+    return power_change_at_min;
+  } else if(requested_steps_in > 0 && current_steps_in == steps_max) {
+    return power_change_at_max;
+  }
+  *steps = requested_steps_in;
+  if(current_steps_in + *steps < 0) {
+    *steps = -current_steps_in;
+    LOG(LL_WARN, ("At min step after stepping %d", *steps));
+  } else if(current_steps_in + *steps > steps_max) {
+    *steps = steps_max - current_steps_in;
+    LOG(LL_WARN, ("At max step after stepping %d", *steps));
+  }
+  return (*steps == 0) ? power_change_no_change : power_change_ok;
+}
+
+static float power_steps_get_actual(power_state_t direction) {
+  (void) direction;
+  return current_steps_in * steps_lsb;
+}
+
+static void power_steps_get_limits(power_state_t direction, float *min, float *max) {
+  *min = 0;
+  *max = steps_max * steps_lsb;
+  (void) direction;
+}
+
+static power_change_state_t power_mcp4021_set_target(power_state_t direction, float target,
+                                                     power_driver_done_cb cb, void *cb_arg) {
+  int steps = 0;
+  power_change_state_t result = power_steps_plan(target, &steps);
+  if(result != power_change_ok) {
+    return result;
+  }
+  int ud = mgos_sys_config_get_power_in_power_ud_pin();
+  int cs = mgos_sys_config_get_power_in_power_cs_pin();
+  int s = abs(steps);
+  // DW NOTE: timings only rough
+  bool udstart = (steps > 0);
+  mgos_gpio_write(ud, udstart);
+  mgos_usleep(2);
+  mgos_gpio_write(cs, false);
+  mgos_usleep(2);
+  while(s > 0) {
+      mgos_gpio_write(ud, !udstart);
+      mgos_usleep(2);
+      mgos_gpio_write(ud, udstart);
+      mgos_usleep(2);
+      s--;
+  }
+  mgos_usleep(2);
+  mgos_gpio_write(cs, true);
+  current_steps_in += steps;
+
+  (void) direction;
+  return power_change_ok;
+}
+
+static const power_driver_t power_driver_mcp4021 = {
+  .type = power_change_mcp4021,
+  .name = "mcp4021",
+  .caps = power_driver_cap_in,
+  .init = power_mcp4021_init,
+  .set_target = power_mcp4021_set_target,
+  .get_actual = power_steps_get_actual,
+  .get_limits = power_steps_get_limits
+};
+
+static power_change_state_t power_max5389_set_target(power_state_t direction, float target,
+                                                     power_driver_done_cb cb, void *cb_arg) {
+  int steps = 0;
+  power_change_state_t result = power_steps_plan(target, &steps);
+  if(result != power_change_ok) {
+    return result;
+  }
+  int ud = mgos_sys_config_get_power_in_power_ud_pin();
+  int dir = mgos_sys_config_get_power_in_power_cs_pin();
+  int s = abs(steps);
+  // asuming CS is enabled
+  // DW NOTE: timings only rough
+  bool udstart = (steps < 0);
+  mgos_gpio_write(dir, udstart);
+  mgos_usleep(1);
+  while(s > 0) {
+      mgos_gpio_write(ud, true);
+      mgos_usleep(1);
+      mgos_gpio_write(ud, false);
+      mgos_usleep(1);
+      s--;
+  }
+  current_steps_in += steps;
+
+  (void) direction;
+  return power_change_ok;
+}
+
+static const power_driver_t power_driver_max5389 = {
+  .type = power_change_max5389,
+  .name = "max5389",
+  .caps = power_driver_cap_in,
+  .init = power_steps_init,
+  .set_target = power_max5389_set_target,
+  .get_actual = power_steps_get_actual,
+  .get_limits = power_steps_get_limits
+};
+
+static power_change_state_t power_drv8825_set_target(power_state_t direction, float target,
+                                                     power_driver_done_cb cb, void *cb_arg) {
+  int steps = 0;
+  power_change_state_t result = power_steps_plan(target, &steps);
+  if(result != power_change_ok) {
+    return result;
+  }
+  int ud = mgos_sys_config_get_power_in_power_ud_pin();
+  int dir = mgos_sys_config_get_power_in_power_cs_pin();
+  int delay = mgos_sys_config_get_power_stepper_delay();
+  int s = abs(steps);
+  // asuming CS is enabled
+  // DW NOTE: timings only rough
+  bool udstart = (steps > 0);
+
+  mgos_gpio_write(dir, udstart);
+  mgos_usleep(100);
+  while(s > 0) {
+      mgos_gpio_write(ud, false);
+      mgos_usleep(delay);
+      mgos_gpio_write(ud, true);
+      mgos_usleep(delay);
+      s--;
+  }
+  current_steps_in += steps;
+
+  (void) direction;
+  return power_change_ok;
+}
+
+static const power_driver_t power_driver_drv8825 = {
+  .type = power_change_drv8825,
+  .name = "drv8825",
+  .caps = power_driver_cap_in,
+  .init = power_drv8825_init,
+  .set_target = power_drv8825_set_target,
+  .get_actual = power_steps_get_actual,
+  .get_limits = power_steps_get_limits
+};
+
+/*
+ * rpc: slave controller, confirmed through the rpc reply
+ */
+
+static float rpc_power = 0;
+static struct {
+  power_driver_done_cb cb;
+  void *cb_arg;
+  intptr_t seq;         // of the request in flight, its reply completes it
+} rpc_pending;
+
+static void power_rpc_done(intptr_t seq, power_change_state_t result) {
+  if(seq != rpc_pending.seq) {
+    // the caller gave up on it, a newer request is in flight or none
+    LOG(LL_WARN, ("Late Power.InChange reply %d ignored", (int) seq));
+    return;
+  }
+  power_driver_done_cb cb = rpc_pending.cb;
+  rpc_pending.cb = NULL;
+  if(cb != NULL) {
+    cb(result, rpc_power, rpc_pending.cb_arg);
+  }
+}
+
+static void power_in_change_rpc_cb(struct mg_rpc *c, void *cb_arg,
+                               struct mg_rpc_frame_info *fi,
+                               struct mg_str result, int error_code,
+                               struct mg_str error_msg) {
+  intptr_t seq = (intptr_t) cb_arg;
+  if(error_code) {
+    LOG(LL_ERROR, ("power_in_change_rpc_cb error: %d %.*s", error_code, error_msg.len, error_msg.p));
+    record_printf(record_rpc_result, "Power.InChange", "!%d", error_code);
+    power_rpc_done(seq, power_change_failed);
+    return;
+  }
+
+  LOG(LL_INFO, ("power_in_change_rpc_cb: %.*s", result.len, result.p));
+  record_data(record_rpc_result, "Power.InChange", result.p, result.len);
+  float power = 0;
+  int state = power_change_ok;
+  if(json_scanf(result.p, result.len, "{power: %f, result: %d}", &power, &state) < 1) {
+    LOG(LL_ERROR, ("power_in_change_rpc_cb: failed to parse result"));
+    power_rpc_done(seq, power_change_unknown);
+    return;
+  }
+  if(state == power_change_invalid || state == power_change_failed) {
+    power_rpc_done(seq, (power_change_state_t) state);
+    return;
+  }
+  // applied by the slave even if the reply is late
+  rpc_power += power;
+  power_rpc_done(seq, (power == 0) ? power_change_no_change : (power_change_state_t) state);
+}
+
+static bool power_rpc_init(power_state_t direction) {
+  rpc_power = 0;
+  rpc_pending.cb = NULL;
+  const char *slave = mgos_sys_config_get_power_in_slave();
+  if(slave == NULL || strlen(slave) == 0) {
+    LOG(LL_ERROR, ("power.in_slave required for rpc driver"));
+    return false;
+  }
+  (void) direction;
+  return true;
+}
+
+static power_change_state_t power_rpc_set_target(power_state_t direction, float target,
+                                                 power_driver_done_cb cb, void *cb_arg) {
+  struct mg_rpc *c = mgos_rpc_get_global();
+  struct mg_rpc_call_opts opts = {
+    .dst = mg_mk_str(mgos_sys_config_get_power_in_slave())
+  };
+  float power = target - rpc_power;
+  rpc_pending.cb = cb;
+  rpc_pending.cb_arg = cb_arg;
+  rpc_pending.seq++;
+  if(!mg_rpc_callf(c, mg_mk_str("Power.InChange"), power_in_change_rpc_cb, (void *) rpc_pending.seq, &opts,
+             "{power: %f}", power)) {
+    LOG(LL_ERROR, ("power_in_change_rpc: calling %.*s failed.", opts.dst.len, opts.dst.p));
+    rpc_pending.cb = NULL;
+    return power_change_failed;
+  }
+  LOG(LL_INFO, ("power_in_change_rpc: called with %.2f.", power));
+  (void) direction;
+  return power_change_unknown;
+}
+
+static float power_rpc_get_actual(power_state_t direction) {
+  (void) direction;
+  return rpc_power;
+}
+
+static const power_driver_t power_driver_rpc = {
+  .type = power_change_rpc,
+  .name = "rpc",
+  .caps = power_driver_cap_in | power_driver_cap_async,
+  .init = power_rpc_init,
+  .set_target = power_rpc_set_target,
+  .get_actual = power_rpc_get_actual,
+  .get_limits = power_driver_no_limits
+};
+
+/*
+ * soyosource: grid tie inverter on uart
+ */
+
+static float soyosource_power = 0;
+
+static bool power_soyosource_init(power_state_t direction) {
+  soyosource_power = 0;
+  feedback_command(0);
+  if(!soyosource_get_enabled()) {
+    LOG(LL_ERROR, ("Soyosource not enabled, check soyosource.uart"));
+    return false;
+  }
+  (void) direction;
+  return true;
+}
+
+static power_change_state_t power_soyosource_set_target(power_state_t direction, float target,
+                                                        power_driver_done_cb cb, void *cb_arg) {
+  if(target > 0) {
+    soyosource_set_enabled(true);
+  }
+  int new_power_out = (int) target;
+  if(new_power_out == (int) soyosource_power) {
+    return power_change_no_change;
+  }
+  int command = (int) feedback_command(new_power_out);
+  soyosource_set_power_out(command);
+  LOG(LL_INFO, ("Changed out power from %.0f to %d [command: %d]", soyosource_power, new_power_out, command));
+  soyosource_power = new_power_out;
+
+  (void) direction;
+  return power_change_ok;
+}
+
+// delivered power tracked from measurements, the requested power if none are fresh
+static float power_soyosource_get_actual(power_state_t direction) {
+  (void) direction;
+  return feedback_get_power_out();
+}
+
+static const power_driver_t power_driver_soyosource = {
+  .type = power_change_soyosource,
+  .name = "soyosource",
+  .caps = power_driver_cap_out | power_driver_cap_readback,
+  .init = power_soyosource_init,
+  .set_target = power_soyosource_set_target,
+  .get_actual = power_soyosource_get_actual,
+  .get_limits = power_driver_no_limits
+};
+
+/*
+ * tps2121: power mux, switches between in and out only
+ */
+
+static float tps2121_power[2] = { 0, 0 };
+
+static bool power_tps2121_init(power_state_t direction) {
+  tps2121_power[power_driver_index(direction)] = 0;
+  return mgos_sys_config_get_power_in_power_ud_pin() != -1;
+}
+
+static power_change_state_t power_tps2121_set_target(power_state_t direction, float target,
+                                                     power_driver_done_cb cb, void *cb_arg) {
+  // TODO: ????
+  int ud = mgos_sys_config_get_power_in_power_ud_pin();
+  power_state_t state = power_get_state();
+  power_change_state_t result = power_change_invalid;
+  switch (state) {
+  case power_out:
+    mgos_gpio_write(ud, true);
+    result = power_change_at_max;
+    break;
+  case power_in:
+    mgos_gpio_write(ud, false);
+    result = power_change_at_min;
+    break;
+  default:
+    result = power_change_no_change;
+  }
+  tps2121_power[power_driver_index(direction)] = target;
+  LOG(LL_INFO, ("Power state: %d, change state: %d, power: %.2f", state, result, target));
+  return result;
+}
+
+static float power_tps2121_get_actual(power_state_t direction) {
+  return tps2121_power[power_driver_index(direction)];
+}
+
+static const power_driver_t power_driver_tps2121 = {
+  .type = power_change_tps2121,
+  .name = "tps2121",
+  .caps = power_driver_cap_in | power_driver_cap_out | power_driver_cap_switch,
+  .init = power_tps2121_init,
+  .set_target = power_tps2121_set_target,
+  .get_actual = power_tps2121_get_actual,
+  .get_limits = power_driver_no_limits
+};
+
+
+bool power_driver_register(const power_driver_t *driver) {
+  if(driver == NULL || driver->set_target == NULL || driver->get_actual == NULL || driver->get_limits == NULL) {
+    LOG(LL_ERROR, ("Incomplete power driver"));
+    return false;
+  }
+  for(int i = 0; i < drivers_count; i++) {
+    if(drivers[i]->type == driver->type) {
+      LOG(LL_INFO, ("Replacing power driver %d (%s) with %s", driver->type, drivers[i]->name, driver->name));
+      drivers[i] = driver;
+      return true;
+    }
+  }
+  if(drivers_count >= POWER_DRIVER_MAX) {
+    LOG(LL_ERROR, ("Too many power drivers, cannot register %s", driver->name));
+    return false;
+  }
+  drivers[drivers_count++] = driver;
+  return true;
+}
+
+const power_driver_t* power_driver_get(power_change_driver_t type) {
+  for(int i = 0; i < drivers_count; i++) {
+    if(drivers[i]->type == type) {
+      return drivers[i];
+    }
+  }
+  return NULL;
+}
+
+bool power_driver_init() {
+  if(drivers_initialized) {
+    return true;
+  }
+  drivers_initialized = true;
+  power_driver_register(&power_driver_dummy);
+  power_driver_register(&power_driver_pwm);
+  power_driver_register(&power_driver_mcp4021);
+  power_driver_register(&power_driver_max5389);
+  power_driver_register(&power_driver_drv8825);
+  power_driver_register(&power_driver_rpc);
+  power_driver_register(&power_driver_soyosource);
+  power_driver_register(&power_driver_tps2121);
+
+  mgos_prometheus_metrics_add_handler(power_driver_metrics, NULL);
+  return true;
+}
+
+int power_driver_get_steps_in() {
+  return current_steps_in;
+}
+
+bool power_driver_is_stepping_in() {
+  return stepping_in;
+}
+
+bool power_driver_steps_restored() {
+  return steps_restored;
+}
@@ -0,0 +1,174 @@
+#include "record.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "mgos.h"
+#include "mgos_net.h"
+#include "mgos_timers.h"
+#include "mgos_prometheus_metrics.h"
+
+#define RECORD_CRONTAB_MAX 16
+
+struct record_crontab {
+  char action[32];
+  mgos_crontab_cb cb;
+  void *userdata;
+};
+
+static struct mbuf buffer = {0};
+static record_listener_t listener = NULL;
+static void *listener_arg = NULL;
+static struct record_crontab crontabs[RECORD_CRONTAB_MAX];
+static int crontab_count = 0;
+
+static int events_recorded = 0;
+static int events_dropped = 0;
+static int bytes_written = 0;
+
+static void record_metrics(struct mg_connection *nc, void *data) {
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "record_events", "Events recorded for replay",
+      "%d", events_recorded);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "record_events_dropped", "Events dropped because the buffer was full",
+      "%d", events_dropped);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "record_bytes_written", "Bytes written to the record file",
+      "%d", bytes_written);
+
+  (void) data;
+}
+
+static void record_rotate(const char *file) {
+  FILE *fp = fopen(file, "r");
+  if(fp == NULL) {
+    return;
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fclose(fp);
+  if(size < mgos_sys_config_get_record_max_size()) {
+    return;
+  }
+  remove(mgos_sys_config_get_record_old_file());
+  rename(file, mgos_sys_config_get_record_old_file());
+  LOG(LL_INFO, ("Rotated %s (%ldb)", file, size));
+}
+
+void record_flush() {
+  if(buffer.len == 0) {
+    return;
+  }
+  const char *file = mgos_sys_config_get_record_file();
+  record_rotate(file);
+  FILE *fp = fopen(file, "a");
+  if(fp == NULL) {
+    LOG(LL_ERROR, ("Failed to open %s", file));
+    mbuf_remove(&buffer, buffer.len);
+    return;
+  }
+  size_t written = fwrite(buffer.buf, 1, buffer.len, fp);
+  fclose(fp);
+  bytes_written += written;
+  // the buffer keeps its size, recording does not allocate
+  mbuf_remove(&buffer, buffer.len);
+}
+
+static void record_timer_cb(void *arg) {
+  record_flush();
+  (void) arg;
+}
+
+static void record_ip_acquired_handler(int ev, void *evd, void *arg) {
+  record_data(record_event, "ip_acquired", NULL, 0);
+  (void) ev;
+  (void) evd;
+  (void) arg;
+}
+
+static void record_crontab_handler(struct mg_str action, struct mg_str payload, void *userdata) {
+  struct record_crontab *c = (struct record_crontab *) userdata;
+  record_data(record_crontab, c->action, payload.p, payload.len);
+  c->cb(action, payload, c->userdata);
+}
+
+bool record_init() {
+  mgos_event_add_handler(MGOS_NET_EV_IP_ACQUIRED, record_ip_acquired_handler, NULL);
+  if(!mgos_sys_config_get_record_enable()) {
+    return false;
+  }
+  mbuf_init(&buffer, mgos_sys_config_get_record_buffer_max());
+  mgos_set_timer(mgos_sys_config_get_record_flush_interval(), MGOS_TIMER_REPEAT, record_timer_cb, NULL);
+  mgos_prometheus_metrics_add_handler(record_metrics, NULL);
+  record_data(record_boot, "boot", NULL, 0);
+  LOG(LL_INFO, ("Recording to %s", mgos_sys_config_get_record_file()));
+  return true;
+}
+
+bool record_enabled() {
+  return mgos_sys_config_get_record_enable();
+}
+
+void record_set_listener(record_listener_t cb, void *arg) {
+  listener = cb;
+  listener_arg = arg;
+}
+
+void record_data(record_type_t type, const char *key, const void *data, size_t len) {
+  if(listener == NULL && !mgos_sys_config_get_record_enable()) {
+    return;
+  }
+  double uptime = mgos_uptime();
+  double now = mg_time();
+  if(listener != NULL) {
+    listener(uptime, now, type, key, (const char *) data, len, listener_arg);
+  }
+  if(!mgos_sys_config_get_record_enable()) {
+    return;
+  }
+  char header[192];
+  int n = snprintf(header, sizeof(header), "%.3f %.3f %c %s %u:", uptime, now, type, key, (unsigned) len);
+  if(n < 0 || n >= (int) sizeof(header)) {
+    events_dropped++;
+    return;
+  }
+  // written by the flush timer only, never from the control path
+  if(buffer.len + n + len + 1 > (size_t) mgos_sys_config_get_record_buffer_max()) {
+    events_dropped++;
+    return;
+  }
+  mbuf_append(&buffer, header, n);
+  mbuf_append(&buffer, data, len);
+  mbuf_append(&buffer, "\n", 1);
+  events_recorded++;
+}
+
+void record_printf(record_type_t type, const char *key, const char *fmt, ...) {
+  if(listener == NULL && !mgos_sys_config_get_record_enable()) {
+    return;
+  }
+  char data[64];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(data, sizeof(data), fmt, ap);
+  va_end(ap);
+  if(n < 0) {
+    return;
+  }
+  record_data(type, key, data, (n < (int) sizeof(data)) ? n : (int) sizeof(data) - 1);
+}
+
+void record_crontab_register_handler(struct mg_str action, mgos_crontab_cb cb, void *userdata) {
+  if(crontab_count >= RECORD_CRONTAB_MAX || action.len >= sizeof(crontabs[0].action)) {
+    LOG(LL_WARN, ("Crontab %.*s not recorded", (int) action.len, action.p));
+    mgos_crontab_register_handler(action, cb, userdata);
+    return;
+  }
+  struct record_crontab *c = &crontabs[crontab_count++];
+  memcpy(c->action, action.p, action.len);
+  c->action[action.len] = '\0';
+  c->cb = cb;
+  c->userdata = userdata;
+  mgos_crontab_register_handler(action, record_crontab_handler, c);
+}
@@ -8,6 +8,11 @@
 #include "battery.h"
 #include "watchdog.h"
 #include "fan.h"
+#include "autotune.h"
+#include "losstable.h"
+#include "energy.h"
+#include "planner.h"
+#include "record.h"
 
 
 static void rpc_log(struct mg_rpc_request_info *ri, struct mg_str args) {
@@ -21,6 +26,10 @@ static void rpc_log(struct mg_rpc_request_info *ri, struct mg_str args) {
        ri->src.len, ri->src.p, ri->method.len, ri->method.p, args.len, args.p));
   }
   // TODO(pim): log to MQTT
+
+  char method[48];
+  snprintf(method, sizeof(method), "%.*s", (int) ri->method.len, ri->method.p);
+  record_data(record_rpc, method, args.p, args.len);
 }
 
 static void rpc_power_get_handler(struct mg_rpc_request_info *ri,
@@ -83,9 +92,9 @@ static void rpc_power_in_change_handler(struct mg_rpc_request_info *ri,
     return;
   }
 
-  power_in_change(&power);
+  power_change_state_t result = power_in_change(&power);
 
-  mg_rpc_send_responsef(ri, "{power: %.2f}", power);
+  mg_rpc_send_responsef(ri, "{power: %.2f, result: %d}", power, result);
   ri = NULL;
 
   (void) cb_arg;
@@ -105,9 +114,9 @@ static void rpc_power_out_change_handler(struct mg_rpc_request_info *ri,
     return;
   }
 
-  power_out_change(&power);
+  power_change_state_t result = power_out_change(&power);
 
-  mg_rpc_send_responsef(ri, "{power: %.2f}", power);
+  mg_rpc_send_responsef(ri, "{power: %.2f, result: %d}", power, result);
   ri = NULL;
 
   (void) cb_arg;
@@ -200,6 +209,78 @@ static void rpc_watchdog_set_measure_lag(struct mg_rpc_request_info *ri,
   (void) fi;
 }
 
+static void rpc_power_get_model(struct mg_rpc_request_info *ri,
+                                    void *cb_arg, struct mg_rpc_frame_info *fi,
+                                    struct mg_str args) {
+  rpc_log(ri, args);
+  const autotune_model_t *in = autotune_get_model(power_in);
+  const autotune_model_t *out = autotune_get_model(power_out);
+  mg_rpc_send_responsef(ri, "{in: {gain: %f, dead_time: %f, damping: %f, samples: %d, active: %f}, "
+                            "out: {gain: %f, dead_time: %f, damping: %f, samples: %d, active: %f}, "
+                            "meter_interval: %f}",
+                        in->gain, in->dead_time, in->damping, in->samples, autotune_get_damping(power_in),
+                        out->gain, out->dead_time, out->damping, out->samples, autotune_get_damping(power_out),
+                        autotune_get_meter_interval());
+
+  (void) cb_arg;
+  (void) fi;
+}
+
+static void rpc_power_reset_model(struct mg_rpc_request_info *ri,
+                                    void *cb_arg, struct mg_rpc_frame_info *fi,
+                                    struct mg_str args) {
+  rpc_log(ri, args);
+  autotune_reset();
+  mg_rpc_send_responsef(ri, "{in_damping: %f, out_damping: %f}",
+                        autotune_get_damping(power_in), autotune_get_damping(power_out));
+
+  (void) cb_arg;
+  (void) fi;
+}
+
+static void rpc_soyosource_get_loss(struct mg_rpc_request_info *ri,
+                                    void *cb_arg, struct mg_rpc_frame_info *fi,
+                                    struct mg_str args) {
+  rpc_log(ri, args);
+  mg_rpc_send_responsef(ri, "%M", losstable_print_json);
+
+  (void) cb_arg;
+  (void) fi;
+}
+
+static void rpc_soyosource_reset_loss(struct mg_rpc_request_info *ri,
+                                    void *cb_arg, struct mg_rpc_frame_info *fi,
+                                    struct mg_str args) {
+  rpc_log(ri, args);
+  losstable_reset();
+  mg_rpc_send_responsef(ri, "%M", losstable_print_json);
+
+  (void) cb_arg;
+  (void) fi;
+}
+
+static void rpc_energy_get(struct mg_rpc_request_info *ri,
+                                    void *cb_arg, struct mg_rpc_frame_info *fi,
+                                    struct mg_str args) {
+  rpc_log(ri, args);
+  mg_rpc_send_responsef(ri, "{totals: %M, efficiency: {day: %f, month: %f, lifetime: %f}}",
+                        energy_print_json, energy_get_efficiency(energy_day),
+                        energy_get_efficiency(energy_month), energy_get_efficiency(energy_lifetime));
+
+  (void) cb_arg;
+  (void) fi;
+}
+
+static void rpc_planner_get(struct mg_rpc_request_info *ri,
+                                    void *cb_arg, struct mg_rpc_frame_info *fi,
+                                    struct mg_str args) {
+  rpc_log(ri, args);
+  mg_rpc_send_responsef(ri, "%M", planner_print_json);
+
+  (void) cb_arg;
+  (void) fi;
+}
+
 static void rpc_fan_speed_handler(struct mg_rpc_request_info *ri,
                                     void *cb_arg, struct mg_rpc_frame_info *fi,
                                     struct mg_str args) {
@@ -240,8 +321,20 @@ void rpc_init() {
                      rpc_power_set_in_target, NULL);
   mg_rpc_add_handler(c, "Power.SetOptimizeTarget", "{min: %d, max: %d}",
                      rpc_power_set_optimize_target, NULL);
+  mg_rpc_add_handler(c, "Power.GetModel", "",
+                     rpc_power_get_model, NULL);
+  mg_rpc_add_handler(c, "Power.ResetModel", "",
+                     rpc_power_reset_model, NULL);
   mg_rpc_add_handler(c, "Watchdog.MeasureLag", "{power: %d}",
                      rpc_watchdog_set_measure_lag, NULL);
+  mg_rpc_add_handler(c, "Soyosource.GetLoss", "",
+                     rpc_soyosource_get_loss, NULL);
+  mg_rpc_add_handler(c, "Soyosource.ResetLoss", "",
+                     rpc_soyosource_reset_loss, NULL);
+  mg_rpc_add_handler(c, "Energy.Get", "",
+                     rpc_energy_get, NULL);
+  mg_rpc_add_handler(c, "Planner.Get", "",
+                     rpc_planner_get, NULL);
   mg_rpc_add_handler(c, "Fan.Speed", "{percent: %d}",
                      rpc_fan_speed_handler, NULL);
                     
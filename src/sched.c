@@ -0,0 +1,145 @@
+#include "sched.h"
+
+#include "histogram.h"
+
+#include "mgos.h"
+#include "mgos_timers.h"
+#include "mgos_prometheus_metrics.h"
+
+#define SCHED_TASKS 24
+
+// upper bounds of the run time buckets in s
+static const double buckets[] = { 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1 };
+static const char *priority_names[] = { "control", "telemetry", "background" };
+
+static struct sched_task {
+  const char *name;
+  int64_t period_us;
+  int64_t budget_us;
+  int64_t due;         // next due uptime in us
+  sched_priority_t priority;
+  sched_fn_t fn;
+  void *arg;
+  int overruns;        // ran longer than the budget
+  int missed;          // periods skipped because the task started too late
+  histogram_t runtime;
+  double lateness_max;
+} tasks[SCHED_TASKS];
+static int task_count = 0;
+static mgos_timer_id timer = MGOS_INVALID_TIMER_ID;
+
+static void sched_metrics(struct mg_connection *nc, void *data) {
+  char labels[48];
+  for(int i = 0; i < task_count; i++) {
+    struct sched_task *t = &tasks[i];
+    snprintf(labels, sizeof(labels), "task=\"%s\"", t->name);
+    histogram_print(nc, "sched_task_runtime_seconds", "Run time of a task in s", labels, &t->runtime);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "sched_task_runtime_max", "Longest run of a task in s",
+        "{task=\"%s\"} %f", t->name, t->runtime.max);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "sched_task_lateness_max", "Longest delay of a run after its due time in s",
+        "{task=\"%s\",priority=\"%s\"} %f", t->name, priority_names[t->priority], t->lateness_max);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "sched_task_overruns", "Task runs longer than the budget",
+        "{task=\"%s\"} %d", t->name, t->overruns);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "sched_task_missed_deadlines", "Periods skipped because a run started too late",
+        "{task=\"%s\"} %d", t->name, t->missed);
+  }
+
+  (void) data;
+}
+
+static void sched_run(struct sched_task *t, int64_t now) {
+  double lateness = (now - t->due) / 1e6;
+  t->lateness_max = MAX(t->lateness_max, lateness);
+  // a whole period late: skip the missed runs instead of catching up
+  int64_t late = now - t->due;
+  if(late >= t->period_us) {
+    int64_t skipped = late / t->period_us;
+    t->missed += skipped;
+    t->due += skipped * t->period_us;
+  }
+  t->due += t->period_us;
+
+  t->fn(t->arg);
+
+  double runtime = (mgos_uptime_micros() - now) / 1e6;
+  histogram_observe(&t->runtime, runtime);
+  if(t->budget_us > 0 && runtime * 1e6 > t->budget_us) {
+    t->overruns++;
+    LOG(LL_WARN, ("Task %s overran: %.1fms, budget %.1fms", t->name, runtime * 1e3, t->budget_us / 1e3));
+  }
+}
+
+static void sched_arm();
+
+// due tasks by priority, then in order of registration
+static void sched_timer_cb(void *arg) {
+  timer = MGOS_INVALID_TIMER_ID;
+  // tasks due at the start, each runs once even if it takes longer than its period
+  int64_t start = mgos_uptime_micros();
+  for(;;) {
+    struct sched_task *next = NULL;
+    for(int i = 0; i < task_count; i++) {
+      if(tasks[i].due <= start && (next == NULL || tasks[i].priority < next->priority)) {
+        next = &tasks[i];
+      }
+    }
+    if(next == NULL) {
+      break;
+    }
+    sched_run(next, mgos_uptime_micros());
+  }
+  sched_arm();
+
+  (void) arg;
+}
+
+static void sched_arm() {
+  if(task_count == 0) {
+    return;
+  }
+  int64_t due = tasks[0].due;
+  for(int i = 1; i < task_count; i++) {
+    due = MIN(due, tasks[i].due);
+  }
+  int64_t delay = due - mgos_uptime_micros();
+  // round up, a timer firing early would spin until the task is due
+  int ms = (delay > 0) ? (int) ((delay + 999) / 1000) : 0;
+  if(timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer(timer);
+  }
+  timer = mgos_set_timer(ms, 0, sched_timer_cb, NULL);
+}
+
+bool sched_init() {
+  mgos_prometheus_metrics_add_handler(sched_metrics, NULL);
+  return true;
+}
+
+int sched_add(const char *name, int period_ms, int phase_ms, sched_priority_t priority,
+              int budget_ms, sched_fn_t fn, void *arg) {
+  if(period_ms <= 0) {
+    return -1;
+  }
+  if(task_count == SCHED_TASKS) {
+    LOG(LL_ERROR, ("Too many tasks, cannot add %s", name));
+    return -1;
+  }
+  struct sched_task *t = &tasks[task_count];
+  memset(t, 0, sizeof(*t));
+  t->name = name;
+  t->period_us = (int64_t) period_ms * 1000;
+  t->budget_us = (int64_t) budget_ms * 1000;
+  t->due = mgos_uptime_micros() + t->period_us + (int64_t) phase_ms * 1000;
+  t->priority = priority;
+  t->fn = fn;
+  t->arg = arg;
+  histogram_init(&t->runtime, buckets, sizeof(buckets) / sizeof(buckets[0]));
+  LOG(LL_INFO, ("Task %s every %dms, phase %dms", name, period_ms, phase_ms));
+  task_count++;
+  sched_arm();
+  return task_count - 1;
+}
@@ -1,36 +1,312 @@
 #include "shelly.h"
 
+#include "battery.h"
+#include "meter.h"
+#include "power.h"
+#include "record.h"
+#include "sched.h"
+
 #include "mgos.h"
-#include "mgos_rpc.h"
+#include "mgos_prometheus_metrics.h"
 
+#define URL_MAX 128
+// s until a request without reply counts as failed
+#define REQUEST_TIMEOUT 10.0
 
+struct shelly_load {
+  int index;
+  const struct mgos_config_shelly *config;
+  char url[URL_MAX];      // of the request in flight, the key of its reply
+  struct mg_connection *connection;   // of the request in flight
+  bool on;                // reported by the relay
+  bool known;             // a reply told the state
+  bool pending;           // request in flight
+  bool status;            // the request in flight polls the status
+  bool requested;         // state asked for by the Switch.Set in flight
+  double request_start;
+  double changed;         // uptime of the last switch, 0 if none
+  float apower;           // W measured by the relay, -1 if unknown
+  int switches;
+  int failures;
+};
 
-void shelly_init() {
+static struct shelly_load loads[SHELLY_LOADS];
+// load indexes by priority, first switched on first
+static int order[SHELLY_LOADS];
+static float surplus = 0;       // filtered export in W
+static double last_switch = 0;
+static double last_status = 0;
+
+static const struct mgos_config_shelly *shelly_get_config(int load) {
+  switch (load) {
+  case 0:
+    return mgos_sys_config_get_shelly();
+  case 1:
+    return mgos_sys_config_get_shelly1();
+  case 2:
+    return mgos_sys_config_get_shelly2();
+  case 3:
+    return mgos_sys_config_get_shelly3();
+  default:
+    return NULL;
+  }
+}
+
+static bool shelly_configured(const struct shelly_load *l) {
+  return l->config->host != NULL && l->config->host[0] != '\0' && l->config->power > 0;
+}
+
+static void shelly_metrics(struct mg_connection *nc, void *data) {
+  for(int i = 0; i < SHELLY_LOADS; i++) {
+    struct shelly_load *l = &loads[i];
+    if(!shelly_configured(l)) {
+      continue;
+    }
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "shelly_load_on", "Relay state reported by the Shelly, -1 if unknown",
+        "{load=\"%d\"} %d", i, l->known ? l->on : -1);
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "shelly_load_power", "Power measured by the Shelly in W, -1 if unknown",
+        "{load=\"%d\"} %f", i, l->apower);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "shelly_load_switches", "Number of relay switches requested",
+        "{load=\"%d\"} %d", i, l->switches);
+    mgos_prometheus_metrics_printf(
+        nc, COUNTER, "shelly_load_failures", "Number of requests without a valid reply",
+        "{load=\"%d\"} %d", i, l->failures);
+  }
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "diversion_surplus", "Filtered export surplus in W",
+      "%f", surplus);
+
+  (void) data;
+}
+
+static void shelly_failed(struct shelly_load *l, const char *reason) {
+  l->pending = false;
+  l->failures++;
+  LOG(LL_WARN, ("Shelly %d %s failed: %s", l->index, l->status ? "status" : "switch", reason));
+}
 
+static void shelly_track(struct shelly_load *l, bool on) {
+  if(l->known && l->on != on) {
+    LOG(LL_INFO, ("Shelly %d reported %s", l->index, on ? "on" : "off"));
+  }
+  l->on = on;
+  l->known = true;
 }
 
-static void shelly_set_state_cb(struct mg_rpc *c, void *cb_arg,
-                               struct mg_rpc_frame_info *fi,
-                               struct mg_str result, int error_code,
-                               struct mg_str error_msg) {
-  if(error_code) {
-    LOG(LL_ERROR, ("shelly_set_state_cb error: %d %.*s", error_code, error_msg.len, error_msg.p)); 
+static void shelly_response_handler(struct mg_connection *nc, int ev, void *ev_data, void *ud) {
+  struct shelly_load *l = (struct shelly_load *) ud;
+  struct http_message *hm = (struct http_message *) ev_data;
+  if(nc != l->connection) {
+    // a request given up on, closing
     return;
-  } 
+  }
+  switch (ev) {
+    case MG_EV_CONNECT:
+      if (*(int *) ev_data != 0) {
+        LOG(LL_ERROR, ("connect() failed[%d]: %s", (*(int *) ev_data), l->url));
+      }
+      break;
+    case MG_EV_HTTP_REPLY: {
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      record_data(record_http, l->url, hm->body.p, hm->body.len);
+      bool output = false;
+      if(l->status) {
+        float apower = -1;
+        if(json_scanf(hm->body.p, hm->body.len, "{output: %B, apower: %f}", &output, &apower) < 1) {
+          shelly_failed(l, "invalid status");
+          break;
+        }
+        l->apower = apower;
+      } else {
+        // the reply tells the state before, the relay is switched
+        if(json_scanf(hm->body.p, hm->body.len, "{was_on: %B}", &output) != 1) {
+          shelly_failed(l, "invalid reply");
+          break;
+        }
+        output = l->requested;
+      }
+      l->pending = false;
+      shelly_track(l, output);
+      break;
+    }
+    case MG_EV_CLOSE:
+      l->connection = NULL;
+      if(l->pending) {
+        shelly_failed(l, "closed");
+      }
+      break;
+    default:
+      break;
+  }
+}
 
-  LOG(LL_INFO, ("shelly_set_state_cb: %.*s", result.len, result.p));  
+// Gen2 RPC over HTTP GET, one request per load at a time
+static bool shelly_request(struct shelly_load *l, bool status, bool on) {
+  if(l->pending) {
+    return false;
+  }
+  const char *host = l->config->host;
+  int id = l->config->id;
+  int n = status
+      ? snprintf(l->url, sizeof(l->url), "http://%s/rpc/Switch.GetStatus?id=%d", host, id)
+      : snprintf(l->url, sizeof(l->url), "http://%s/rpc/Switch.Set?id=%d&on=%s", host, id, on ? "true" : "false");
+  if(n < 0 || n >= (int) sizeof(l->url)) {
+    LOG(LL_ERROR, ("Shelly %d host too long", l->index));
+    return false;
+  }
+  l->pending = true;
+  l->status = status;
+  l->requested = on;
+  l->request_start = mgos_uptime();
+  l->connection = mg_connect_http(mgos_get_mgr(), shelly_response_handler, l, l->url, NULL, NULL);
+  if(l->connection == NULL) {
+    shelly_failed(l, "connect");
+    return false;
+  }
+  return true;
 }
 
-//curl http://shelly1-test.local/rpc/Shelly.SetState -d '{"id": 1, "type": 0, "state": {"state": true}}'
-bool shelly_set_state(const char* destination, int id, bool state) {
-  struct mg_rpc *c = mgos_rpc_get_global();
-  struct mg_rpc_call_opts opts = {
-    .dst = mg_mk_str(destination) 
-  };
-  if(!mg_rpc_callf(c, mg_mk_str("Shelly.SetState"), shelly_set_state_cb, NULL, &opts,
-             "{id: %d, type: 0, state: {state: %B}}", id, state)) {
-    LOG(LL_ERROR, ("shelly_set_state: calling %.*s failed.", opts.dst.len, opts.dst.p));  
-    return false;                          
+bool shelly_set_state(int load, bool state) {
+  if(load < 0 || load >= SHELLY_LOADS || !shelly_configured(&loads[load])) {
+    LOG(LL_ERROR, ("Shelly %d not configured", load));
+    return false;
+  }
+  struct shelly_load *l = &loads[load];
+  if(!shelly_request(l, false, state)) {
+    return false;
   }
+  LOG(LL_INFO, ("Shelly %d switching %s, surplus %.0fW", load, state ? "on" : "off", surplus));
+  record_printf(record_decision, "divert", "%d %d", load, state);
+  l->changed = mgos_uptime();
+  l->switches++;
   return true;
 }
+
+bool shelly_get_state(int load) {
+  return load >= 0 && load < SHELLY_LOADS && loads[load].known && loads[load].on;
+}
+
+static bool shelly_held(const struct shelly_load *l, double now, int min) {
+  return l->changed > 0 && now - l->changed < min;
+}
+
+// the running load switched on last that ran its min time
+static struct shelly_load *shelly_pick_off(double now) {
+  for(int i = SHELLY_LOADS - 1; i >= 0; i--) {
+    struct shelly_load *l = &loads[order[i]];
+    if(shelly_configured(l) && l->on && !shelly_held(l, now, mgos_sys_config_get_diversion_min_on())) {
+      return l;
+    }
+  }
+  return NULL;
+}
+
+// the first load by priority the surplus runs
+static struct shelly_load *shelly_pick_on(double now) {
+  for(int i = 0; i < SHELLY_LOADS; i++) {
+    struct shelly_load *l = &loads[order[i]];
+    if(!shelly_configured(l) || (l->known && l->on) || shelly_held(l, now, mgos_sys_config_get_diversion_min_off())) {
+      continue;
+    }
+    if(l->config->power + mgos_sys_config_get_diversion_on_margin() <= surplus) {
+      return l;
+    }
+  }
+  return NULL;
+}
+
+// the battery takes the surplus first
+static bool shelly_battery_saturated() {
+  if(battery_get_state() == battery_full) {
+    return true;
+  }
+  int in_max = mgos_sys_config_get_power_in_max();
+  return power_get_state() == power_in && in_max > mgos_sys_config_get_power_in_min() &&
+         power_get_power_in() >= in_max - mgos_sys_config_get_power_in_lsb();
+}
+
+static void shelly_divert_cb(void *arg) {
+  double now = mgos_uptime();
+  bool pending = false;
+  for(int i = 0; i < SHELLY_LOADS; i++) {
+    struct shelly_load *l = &loads[i];
+    if(l->pending && now - l->request_start > REQUEST_TIMEOUT) {
+      shelly_failed(l, "timeout");
+      if(l->connection != NULL) {
+        // a late reply must not be taken for the next request
+        l->connection->flags |= MG_F_CLOSE_IMMEDIATELY;
+        l->connection = NULL;
+      }
+    }
+    pending |= l->pending;
+  }
+  if(!mgos_sys_config_get_diversion_enable()) {
+    for(int i = 0; i < SHELLY_LOADS; i++) {
+      if(loads[i].on && !loads[i].pending) {
+        shelly_set_state(i, false);
+      }
+    }
+    return;
+  }
+  if(now - last_status >= mgos_sys_config_get_diversion_status_interval()) {
+    last_status = now;
+    for(int i = 0; i < SHELLY_LOADS; i++) {
+      if(shelly_configured(&loads[i]) && shelly_request(&loads[i], true, false)) {
+        pending = true;
+      }
+    }
+  }
+
+  // the last total power is kept when the meter is lost, it tells nothing
+  bool metered = meter_get_active() >= 0;
+  if(metered) {
+    float filter = mgos_sys_config_get_diversion_filter();
+    surplus = filter * -power_get_total_power() + (1.0 - filter) * surplus;
+  }
+  // one switch at a time, the meter shows it before the next
+  if(pending || now - last_switch < mgos_sys_config_get_feedback_meter_delay()) {
+    return;
+  }
+  struct shelly_load *l = NULL;
+  if(power_get_state() == power_out || surplus < -mgos_sys_config_get_diversion_off_margin()) {
+    l = shelly_pick_off(now);
+    if(l != NULL && shelly_set_state(l->index, false)) {
+      surplus += l->config->power;
+      last_switch = now;
+    }
+  } else if(metered && shelly_battery_saturated()) {
+    l = shelly_pick_on(now);
+    if(l != NULL && shelly_set_state(l->index, true)) {
+      surplus -= l->config->power;
+      last_switch = now;
+    }
+  }
+
+  (void) arg;
+}
+
+void shelly_init() {
+  int n = 0;
+  for(int i = 0; i < SHELLY_LOADS; i++) {
+    struct shelly_load *l = &loads[i];
+    l->index = i;
+    l->config = shelly_get_config(i);
+    l->apower = -1;
+    // insertion by priority, equal ones in configuration order
+    int j = n++;
+    while(j > 0 && loads[order[j - 1]].config->priority > l->config->priority) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = i;
+    if(shelly_configured(l)) {
+      LOG(LL_INFO, ("Shelly %d: %s switch %d, %dW, priority %d",
+                    i, l->config->host, l->config->id, l->config->power, l->config->priority));
+    }
+  }
+  mgos_prometheus_metrics_add_handler(shelly_metrics, NULL);
+  sched_add("shelly", mgos_sys_config_get_diversion_interval(), 450, sched_priority_background, 10, shelly_divert_cb, NULL);
+}
@@ -0,0 +1,199 @@
+#include "shellyem.h"
+
+#include "heap.h"
+#include "latency.h"
+#include "meter.h"
+#include "record.h"
+#include "sched.h"
+
+#include "mgos.h"
+#include "mgos_mongoose.h"
+#include "mgos_prometheus_metrics.h"
+
+#define URL_MAX 128
+#define REQUEST_MAX 256
+// headers and an EM status
+#define REPLY_SIZE 1024
+#define REPLY_LIMIT 2048
+
+static const char *phase_names[] = { "a", "b", "c", "total" };
+
+// fixed for the uptime, the connection is kept and its request resent
+static char url[URL_MAX];
+static char request[REQUEST_MAX];
+static size_t request_len = 0;
+static bool three_phase = true;
+
+static int source = -1;
+static struct mg_connection *connection = NULL;
+static bool pending = false;
+static double request_start = 0;
+
+static float power[4];
+static double last_update = 0;
+static double last_response_time = 0;
+static int request_count = 0;
+static int failure_count = 0;
+static int connection_count = 0;
+
+static void shellyem_metrics(struct mg_connection *nc, void *data) {
+  for(int i = 0; i < 4; i++) {
+    if(!three_phase && i != shellyem_phase_total) {
+      continue;
+    }
+    mgos_prometheus_metrics_printf(
+        nc, GAUGE, "shellyem_power", "Power at the grid connection in W",
+        "{phase=\"%s\"} %f", phase_names[i], power[i]);
+  }
+  mgos_prometheus_metrics_printf(
+      nc, GAUGE, "shellyem_response_time", "Response time in seconds",
+      "%f", last_response_time);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "shellyem_requests", "Requests sent",
+      "%d", request_count);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "shellyem_failures", "Requests without a valid reply",
+      "%d", failure_count);
+  mgos_prometheus_metrics_printf(
+      nc, COUNTER, "shellyem_connections", "Connections opened",
+      "%d", connection_count);
+
+  (void) data;
+}
+
+static void shellyem_failed(const char *reason) {
+  pending = false;
+  failure_count++;
+  LOG(LL_WARN, ("Shelly EM request failed: %s", reason));
+}
+
+static bool shellyem_parse(struct mg_str body) {
+  if(three_phase) {
+    return json_scanf(body.p, body.len, "{a_act_power: %f, b_act_power: %f, c_act_power: %f, total_act_power: %f}",
+                      &power[shellyem_phase_a], &power[shellyem_phase_b], &power[shellyem_phase_c],
+                      &power[shellyem_phase_total]) == 4;
+  }
+  if(json_scanf(body.p, body.len, "{act_power: %f}", &power[shellyem_phase_total]) != 1) {
+    return false;
+  }
+  power[shellyem_phase_a] = power[shellyem_phase_total];
+  return true;
+}
+
+static void shellyem_response_handler(struct mg_connection *nc, int ev, void *ev_data, void *ud) {
+  struct http_message *hm = (struct http_message *) ev_data;
+  switch (ev) {
+    case MG_EV_CONNECT:
+      if (*(int *) ev_data != 0) {
+        LOG(LL_ERROR, ("connect() failed[%d]: %s", (*(int *) ev_data), url));
+        break;
+      }
+      connection_count++;
+      heap_bound_reply(nc, REPLY_SIZE, REPLY_LIMIT);
+      if(request_len == 0 && nc->send_mbuf.len <= sizeof(request)) {
+        memcpy(request, nc->send_mbuf.buf, nc->send_mbuf.len);
+        request_len = nc->send_mbuf.len;
+      }
+      break;
+    case MG_EV_HTTP_REPLY: {
+      double now = mgos_uptime();
+      last_response_time = now - request_start;
+      record_data(record_http, url, hm->body.p, hm->body.len);
+      if(!pending) {
+        break;
+      }
+      if(!shellyem_parse(hm->body)) {
+        LOG(LL_ERROR, ("failed to parse json response: %.*s", (int) hm->body.len, hm->body.p));
+        shellyem_failed("invalid reply");
+        break;
+      }
+      pending = false;
+      // the meter read halfway through the request
+      last_update = mg_time() - last_response_time / 2;
+      latency_mark_at(latency_sample, last_update);
+      latency_mark_at(latency_request, mg_time() - last_response_time);
+      latency_mark(latency_reply);
+      meter_update(source, last_update, power[shellyem_phase_total]);
+      break;
+    }
+    case MG_EV_CLOSE:
+      LOG(LL_DEBUG, ("Shelly EM closed connection"));
+      if(nc == connection) {
+        connection = NULL;
+        if(pending) {
+          shellyem_failed("closed");
+        }
+      }
+      break;
+    default:
+      break;
+  }
+
+  (void) ud;
+}
+
+static void shellyem_poll_cb(void *arg) {
+  double now = mgos_uptime();
+  if(pending) {
+    if(now - request_start < mgos_sys_config_get_shellyem_timeout()) {
+      return;
+    }
+    // a lost reply, the next request goes out on a new connection
+    shellyem_failed("timeout");
+    if(connection != NULL) {
+      connection->flags |= MG_F_CLOSE_IMMEDIATELY;
+      connection = NULL;
+    }
+  }
+  pending = true;
+  request_start = now;
+  request_count++;
+  if(connection == NULL) {
+    connection = mg_connect_http(mgos_get_mgr(), shellyem_response_handler, NULL, url, NULL, NULL);
+    if(connection == NULL) {
+      shellyem_failed("connect");
+    }
+  } else {
+    mg_send(connection, request, request_len);
+  }
+
+  (void) arg;
+}
+
+bool shellyem_init() {
+  const struct mgos_config_shellyem *config = mgos_sys_config_get_shellyem();
+  if(!config->enable) {
+    LOG(LL_INFO, ("Shelly EM disabled."));
+    return false;
+  }
+  if(config->host == NULL || config->host[0] == '\0') {
+    LOG(LL_ERROR, ("Shelly EM host missing"));
+    return false;
+  }
+  three_phase = strcmp(config->type, "em") != 0;
+  int n = snprintf(url, sizeof(url), three_phase ? "http://%s/rpc/EM.GetStatus?id=%d" : "http://%s/rpc/EM1.GetStatus?id=%d",
+                   config->host, config->id);
+  if(n < 0 || n >= (int) sizeof(url)) {
+    LOG(LL_ERROR, ("Cannot create Shelly EM url"));
+    return false;
+  }
+  LOG(LL_INFO, ("url %s", url));
+
+  source = meter_add_source("shellyem", config->priority, config->interval / 1000.0,
+                            mgos_sys_config_get_power_max_lag());
+  if(source < 0) {
+    return false;
+  }
+  mgos_prometheus_metrics_add_handler(shellyem_metrics, NULL);
+  sched_add("shellyem", mgos_sys_config_get_shellyem_interval(), 100, sched_priority_control, 20,
+            shellyem_poll_cb, NULL);
+  return true;
+}
+
+float shellyem_get_power(shellyem_phase_t phase) {
+  return power[phase];
+}
+
+double shellyem_get_last_update() {
+  return last_update;
+}
@@ -1,10 +1,13 @@
 #include "soyosource.h"
 
+#include "losstable.h"
+#include "record.h"
+#include "sched.h"
+
 #include "mgos.h"
 #include "mgos_uart.h"
 #include "mgos_timers.h"
 #include "mgos_prometheus_metrics.h"
-#include "mgos_crontab.h"
 
 static uint8_t soyo_out[8] = { 0x24, 0x56, 0x00, 0x21, 0x00, 0x00, 0x80, 0x08 };
 static bool soyo_enabled = false;
@@ -17,6 +20,7 @@ static float soyo_current = -1.0f;
 static uint16_t soyo_ac_voltage = 0;
 static float soyo_ac_frequency = -1.0f;
 static float soyo_temperature = -1.0f;
+static double soyo_last_update = 0;
 static void soyosource_metrics(struct mg_connection *nc, void *data) {  
   mgos_prometheus_metrics_printf(
       nc, GAUGE, "soyo_current", "|DC Current out (Ampere)",
@@ -55,6 +59,9 @@ static void soyosource_dispatcher_cb(int uart, void *arg) {
     return;
   }
   int len = mgos_uart_read_mbuf(uart, &lb, rx_av);
+  char key[8];
+  snprintf(key, sizeof(key), "%d", uart);
+  record_data(record_uart, key, lb.buf + lb.len - len, len);
 
   if(lb.len < 14) {
     return;
@@ -100,6 +107,8 @@ static void soyosource_dispatcher_cb(int uart, void *arg) {
     soyo_temperature = temperature;
   }
 
+  soyo_last_update = mgos_uptime();
+
   //mbuf_remove(&lb, 14);
   mbuf_clear(&lb);
   LOG(LL_INFO, ("Battery: %d : %.1fV, %.1fA, ~%uV, %.1fHz, %.1fC", 
@@ -127,11 +136,6 @@ static void soyosource_feed_cb(void *arg) {
  } 
 }
 
-static void soyosource_feed_crontab_handler(struct mg_str action,
-                      struct mg_str payload, void *userdata) {
-  soyosource_feed_cb(userdata);
-  (void) payload;
-}
 
 static void soyosource_status_cb(void *arg) {
   if(soyosource_get_enabled()) {
@@ -140,11 +144,6 @@ static void soyosource_status_cb(void *arg) {
   (void) arg;
 }
 
-static void soyosource_status_crontab_handler(struct mg_str action,
-                      struct mg_str payload, void *userdata) {
-  soyosource_status_cb(userdata);
-  (void) payload;
-}
 
 void soyosource_init() {
   int uart = mgos_sys_config_get_soyosource_uart();
@@ -176,13 +175,11 @@ void soyosource_init() {
   mgos_uart_set_dispatcher(uart, soyosource_dispatcher_cb, NULL);
   mgos_uart_set_rx_enabled(uart, true);
 
-  // int feed_interval = mgos_sys_config_get_soyosource_feed_interval();
-  // int status_interval = mgos_sys_config_get_soyosource_status_interval();
-  // mgos_set_timer(feed_interval, MGOS_TIMER_REPEAT, soyosource_feed_cb, soyo_out);
-  // mgos_set_timer(status_interval, MGOS_TIMER_REPEAT, soyosource_status_cb, NULL);
-
-  mgos_crontab_register_handler(mg_mk_str("soyosource.feed"), soyosource_feed_crontab_handler, soyo_out);
-  mgos_crontab_register_handler(mg_mk_str("soyosource.status"), soyosource_status_crontab_handler, NULL);
+  // the limiter mode stops output without a feed within a second
+  sched_add("soyosource.feed", mgos_sys_config_get_soyosource_feed_interval(), 0,
+            sched_priority_control, 5, soyosource_feed_cb, soyo_out);
+  sched_add("soyosource.status", mgos_sys_config_get_soyosource_status_interval(), 250,
+            sched_priority_telemetry, 5, soyosource_status_cb, NULL);
 
   mgos_prometheus_metrics_add_handler(soyosource_metrics, NULL);
   LOG(LL_INFO, ("uart %d enabled: (TX: %d, RX: %d)", uart, ucfg.dev.tx_gpio, ucfg.dev.rx_gpio ));
@@ -213,7 +210,8 @@ void soyosource_set_out_enabled(bool enabled) {
 
 
 void soyosource_set_power_out(int power) {
-  int p = power * (1.0 + mgos_sys_config_get_soyosource_loss());
+  int p = losstable_ac_to_dc(power);
+  losstable_command(power);
   soyo_out[4] = p >> 8;
   soyo_out[5] = p & 0xFF;
   soyo_out[7] = (264 - soyo_out[4] - soyo_out[5]);
@@ -226,7 +224,7 @@ void soyosource_set_power_out(int power) {
 }
 
 int soyosource_get_power_out() {
-  return soyo_voltage * soyo_current * (1.0 - mgos_sys_config_get_soyosource_loss());
+  return losstable_dc_to_ac(soyo_voltage * soyo_current);
 }
 
 
@@ -244,4 +242,12 @@ float soyosource_get_last_voltage() {
 
 float soyosource_get_last_current() {
   return soyo_current;
+}
+
+float soyosource_get_last_temperature() {
+  return soyo_temperature;
+}
+
+double soyosource_get_last_update() {
+  return soyo_last_update;
 }
\ No newline at end of file
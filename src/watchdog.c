@@ -10,10 +10,10 @@
 #include "battery.h"
 #include "power.h"
 #include "awattar.h"
-#include "discovergy.h"
-#include "darksky.h"
 #include "ds18xxx.h"
-#include "fan.h"
+#include "loadmodel.h"
+#include "meter.h"
+#include "record.h"
 
 
 #include <math.h>
@@ -21,35 +21,12 @@
 
 #define PRICE_INVALID -1.0
 
-#define MIN_TEMP 25.0f
-#define MAX_TEMP 31.0f
-#define MIN_FAN_SPEED 10
-
-static const float monthly_radiation[] = { 30, 45, 80, 125, 160, 165, 165, 140, 95, 60, 30, 25 };
-static const float performance_ratio = 0.75;
-static int estimated_yield = 0;
 static float price_avg = 0;
 static float price_sigma = 0;
 static float price_current = 0;
 static float price_limit = DEFAULT_PRICE_LIMIT;
 
-static int estimate_yield(darksky_day_forecast_t forecast) {
-  int peak = mgos_sys_config_get_solar_peak_power();
-  int base = mgos_sys_config_get_power_out_on();
-  const struct tm *t = localtime(&forecast.time);
-  float sunshine =  (forecast.sunset - forecast.sunrise) / 3600.0;
-  sunshine *= (1.0 - forecast.clouds);
-  float r = monthly_radiation[t->tm_mon] / 30000.0 * performance_ratio;
-  float yield = ((peak * r) - (base * sunshine));
-  LOG(LL_INFO, ("Estimated yield: %.0f", yield));
-  return yield;
-}
-
 static void watchdog_metrics(struct mg_connection *nc, void *data) {
-    mgos_prometheus_metrics_printf(
-        nc, GAUGE, "estimated_yield", "Estimated daily yield in Wh",
-        "%d", estimate_yield
-    );
     mgos_prometheus_metrics_printf(
         nc, GAUGE, "awattar_current_price", "Current awattar price in EUR/kWh ",
         "%f", price_current
@@ -66,23 +43,6 @@ static void watchdog_metrics(struct mg_connection *nc, void *data) {
     (void) data;
 }
 
-static void handle_temperature() {
-  float temp = ds18xxx_get_temperature();
-  if(temp == 0) {
-    fan_set_speeds(100);
-    LOG(LL_WARN, ("Temperature is 0. Sensor failed?"));
-    return;
-  }
-  if(temp < MIN_TEMP-1) {
-    fan_set_speeds(0); // turn off later to avoid oscilating fans
-  } else if(temp > MAX_TEMP) {
-    fan_set_speeds(100);
-  } else if(temp > MIN_TEMP)  {
-    int speed = (int) ((temp - MIN_TEMP) / (MAX_TEMP - MIN_TEMP) * 100.0);
-    fan_set_speeds(MAX(MIN_FAN_SPEED, speed));
-  }
-}
-
 static void watchdog_handler(void *data) {
   int num_cells = mgos_sys_config_get_battery_num_cells();
   float battery_max = mgos_sys_config_get_battery_cell_voltage_max() * num_cells;
@@ -114,8 +74,6 @@ static void watchdog_handler(void *data) {
   }
   state = power_get_state();
 
-  handle_temperature();
-
   LOG(LL_INFO, ("power_state: %d battery_voltage: %.2fV temp: %.1fC", state, battery, ds18xxx_get_temperature()));
 
   // mgos_dash_notifyf(
@@ -142,31 +100,53 @@ static void power_out_crontab_handler(struct mg_str action,
   (void) userdata;
 }
 
-static void discovergy_handler(double update, float power, void* cb_arg) {
-  // char time[20];
-  // mgos_strftime(time, 32, "%x %X", update);
-  // LOG(LL_INFO, ("%s: %.2f", time, power));
-  
-  float lag = mg_time() - update;
-  float max_lag = mgos_sys_config_get_power_max_lag();
-  if(max_lag > 0 && lag > max_lag) {
-    LOG(LL_WARN, ("Discovergy data outdated: %f", lag));
-    power_set_state(power_off);
-    return;
-  }
-
-  power_set_total_power(power);
+// the power change of a running lag measurement, 0 if none
+static int measure_power = 0;
+static enum {
+    measure_start,
+    measure_running,
+    measure_done
+} watchdog_measure_state;
+int call_count = 0;
+float start_power = 0;
 
-  (void) cb_arg;
+static void measure_handler(float power) {
+  int p = measure_power;
+  switch (watchdog_measure_state) {
+  case measure_start:
+    call_count = 0;
+    start_power = power;
+    power_set_total_power(power + p);
+    watchdog_measure_state = measure_running;
+    break;
+  case measure_running:
+    if(abs(power) <  abs(start_power + p/2)) {
+      call_count++;
+      power_set_total_power(power + p);
+    } else {
+      start_power = 0;
+      watchdog_measure_state = measure_done;
+      power_set_total_power(power);
+    }
+    break;
+  case measure_done:
+    LOG(LL_INFO, ("Measured call count: %d for power change %d", call_count, p));
+    call_count = 0;
+    measure_power = 0;
+  default:
+    break;
+  }
 }
 
-static void darksky_handler(darksky_day_forecast_t *entries, int length, void *cb_arg) {
-  if(length == 0) {
-    LOG(LL_INFO, ("no weather data available"));
-    return;
+// readings of the active meter source, the meter layer drops outdated ones
+static void meter_handler(double update, float power, void* cb_arg) {
+  if(measure_power != 0) {
+    measure_handler(power);
+  } else {
+    power_set_total_power(power);
   }
-  estimated_yield = estimate_yield(entries[0]);
 
+  (void) update;
   (void) cb_arg;
 }
 
@@ -197,17 +177,38 @@ static void awattar_handler(awattar_pricing_t *entries, int length, void *cb_arg
 
 bool watchdog_init() {
   mgos_prometheus_metrics_add_handler(watchdog_metrics, NULL);
-  discovery_set_update_callback(discovergy_handler, NULL);
-  //darksky_set_update_callback(darksky_handler, NULL);
+  meter_set_update_callback(meter_handler, NULL);
   awattar_set_update_callback(awattar_handler, NULL);
-  mgos_crontab_register_handler(mg_mk_str("watchdog"), watchdog_crontab_handler, NULL);
-  mgos_crontab_register_handler(mg_mk_str("power_out"), power_out_crontab_handler, NULL);
+  record_crontab_register_handler(mg_mk_str("watchdog"), watchdog_crontab_handler, NULL);
+  record_crontab_register_handler(mg_mk_str("power_out"), power_out_crontab_handler, NULL);
 
   power_set_out_enabled(true);
 
   return true;
 }
 
+// the stored energy is needed for the expected load in the pricier slots ahead
+static bool watchdog_keep_for_later(time_t now, float price, int soc) {
+  float usable = battery_get_capacity_wh() * (soc - mgos_sys_config_get_battery_soc_min()) / 100.0;
+  float reserve = 0;
+  awattar_pricing_t *entries = awattar_get_entries();
+  for(int i = 0; i < awattar_get_entries_count(); i++) {
+    if(entries[i].start <= now || entries[i].price <= price) {
+      continue;
+    }
+    float r = loadmodel_get_reserve(entries[i].start, entries[i].end);
+    if(r < 0) {
+      return false;
+    }
+    reserve += r;
+  }
+  if(usable > reserve) {
+    return false;
+  }
+  LOG(LL_INFO, ("Keeping %.0fWh for %.0fWh expected in pricier slots", usable, reserve));
+  return true;
+}
+
 bool watchdog_evaluate_power_out(float limit, float *price) {
   price_limit = limit;
   price_current = 0.0;      
@@ -227,6 +228,9 @@ bool watchdog_evaluate_power_out(float limit, float *price) {
   bool enabled = (price_limit == DEFAULT_PRICE_LIMIT) 
     ? (price_current > (price_avg + price_sigma * battery_factor))
     : (price_current > price_limit);
+  if(enabled && price_limit == DEFAULT_PRICE_LIMIT && watchdog_keep_for_later(now, price_current, battery_soc)) {
+    enabled = false;
+  }
 
   power_set_out_enabled(enabled);
   if(price != NULL) {
@@ -236,43 +240,7 @@ bool watchdog_evaluate_power_out(float limit, float *price) {
 }
 
 
-enum { 
-    measure_start, 
-    measure_running, 
-    measure_done 
-} watchdog_measure_state;
-int call_count = 0;
-float start_power = 0;
-
-static void measure_discovergy_handler(double update, float power, void* cb_arg) {
-  int p = (int) cb_arg;
-  switch (watchdog_measure_state) {
-  case measure_start:
-    call_count = 0;
-    start_power = power;
-    power_set_total_power(power + p);
-    watchdog_measure_state = measure_running;
-    break;
-  case measure_running:
-    if(abs(power) <  abs(start_power + p/2)) {
-      call_count++;
-      power_set_total_power(power + p);
-    } else {
-      start_power = 0;
-      watchdog_measure_state = measure_done;
-      power_set_total_power(power);
-    }
-    break;
-  case measure_done:
-    LOG(LL_INFO, ("Measured call count: %d for power change %d", call_count, p));
-    call_count = 0;
-    discovery_set_update_callback(discovergy_handler, NULL);
-  default:
-    break;
-  }
-}
-
 void watchdog_measure_lag(int power) {
   watchdog_measure_state = measure_start;
-  discovery_set_update_callback(measure_discovergy_handler, power);
+  measure_power = power;
 }
\ No newline at end of file
@@ -0,0 +1,326 @@
+/*
+ * LAN gateway for the cloud APIs the firmware polls. The device talks
+ * plain HTTP to /<route>/<path>, the gateway keeps the TLS connections,
+ * caches minified replies and refreshes hot entries ahead of the device.
+ */
+
+#include "http.h"
+
+#include <curl/curl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_ENTRIES 32
+// stop refreshing an entry nobody asked for in s
+#define CACHE_IDLE 60.0
+#define FETCH_TIMEOUT 10L
+
+// keep the names in sync with src/gateway.c
+struct route {
+  const char *name;
+  const char *upstream;
+  double ttl;         // s a reply is served from the cache
+  double refresh;     // s between fetches ahead of requests, 0 for none
+  CURL *curl;         // reused, keeps the upstream connection
+  int fetches;
+  int errors;
+  double fetch_seconds;
+};
+
+static struct route routes[] = {
+  { "discovergy", "https://api.discovergy.com/public/v1", 5, 2 },
+  { "awattar", "https://api.awattar.de/v1", 900, 0 },
+  { "weatherkit", "https://weatherkit.apple.com/api/v1", 1800, 0 },
+};
+#define ROUTES (int) (sizeof(routes) / sizeof(routes[0]))
+
+struct entry {
+  struct route *route;
+  char path[1024];            // below the route
+  char authorization[512];    // forwarded from the last request
+  char *body;
+  size_t len;
+  double fetched;
+  double requested;
+};
+
+static struct entry cache[CACHE_ENTRIES];
+static int cache_count = 0;
+
+static struct {
+  int hit, miss, stale, error, not_found;
+} counts;
+
+static bool verbose = false;
+
+static void usage() {
+  fprintf(stderr,
+          "usage: gateway [options]\n"
+          "  -l addr         listen address, default 0.0.0.0\n"
+          "  -p port         listen port, default 8080\n"
+          "  -u route=url    upstream base of a route, e.g. a mock\n"
+          "  -t route=s      cache ttl of a route\n"
+          "  -r route=s      refresh interval of a route, 0 to disable\n"
+          "  -v              log requests and fetches\n"
+          "routes:");
+  for(int i = 0; i < ROUTES; i++) {
+    fprintf(stderr, " %s", routes[i].name);
+  }
+  fprintf(stderr, "\n");
+  exit(2);
+}
+
+static struct route *route_find(const char *name, size_t len) {
+  for(int i = 0; i < ROUTES; i++) {
+    if(strlen(routes[i].name) == len && strncmp(routes[i].name, name, len) == 0) {
+      return &routes[i];
+    }
+  }
+  return NULL;
+}
+
+static struct route *route_option(const char *arg, const char **value) {
+  const char *eq = strchr(arg, '=');
+  struct route *r = (eq != NULL) ? route_find(arg, eq - arg) : NULL;
+  if(r == NULL) {
+    fprintf(stderr, "unknown route in %s\n", arg);
+    usage();
+  }
+  *value = eq + 1;
+  return r;
+}
+
+// drops whitespace outside strings
+static size_t json_minify(char *s, size_t len) {
+  size_t out = 0;
+  bool string = false, escape = false;
+  for(size_t i = 0; i < len; i++) {
+    char c = s[i];
+    if(string) {
+      if(escape) {
+        escape = false;
+      } else if(c == '\\') {
+        escape = true;
+      } else if(c == '"') {
+        string = false;
+      }
+    } else if(c == '"') {
+      string = true;
+    } else if(c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+      continue;
+    }
+    s[out++] = c;
+  }
+  return out;
+}
+
+struct buffer {
+  char *data;
+  size_t len;
+};
+
+static size_t fetch_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+  struct buffer *b = userdata;
+  size_t n = size * nmemb;
+  char *data = realloc(b->data, b->len + n + 1);
+  if(data == NULL) {
+    return 0;
+  }
+  memcpy(data + b->len, ptr, n);
+  b->data = data;
+  b->len += n;
+  b->data[b->len] = '\0';
+  return n;
+}
+
+static bool fetch(struct entry *e) {
+  struct route *r = e->route;
+  char url[1536];
+  snprintf(url, sizeof(url), "%s%s", r->upstream, e->path);
+  if(r->curl == NULL) {
+    r->curl = curl_easy_init();
+  }
+  struct buffer b = { NULL, 0 };
+  struct curl_slist *headers = NULL;
+  if(e->authorization[0] != '\0') {
+    char header[560];
+    snprintf(header, sizeof(header), "Authorization: %s", e->authorization);
+    headers = curl_slist_append(headers, header);
+  }
+  curl_easy_setopt(r->curl, CURLOPT_URL, url);
+  curl_easy_setopt(r->curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt(r->curl, CURLOPT_WRITEFUNCTION, fetch_write);
+  curl_easy_setopt(r->curl, CURLOPT_WRITEDATA, &b);
+  curl_easy_setopt(r->curl, CURLOPT_TIMEOUT, FETCH_TIMEOUT);
+  curl_easy_setopt(r->curl, CURLOPT_ACCEPT_ENCODING, "");
+
+  double start = http_now();
+  CURLcode rc = curl_easy_perform(r->curl);
+  long status = 0;
+  curl_easy_getinfo(r->curl, CURLINFO_RESPONSE_CODE, &status);
+  curl_slist_free_all(headers);
+  double seconds = http_now() - start;
+  r->fetches++;
+  r->fetch_seconds += seconds;
+  if(rc != CURLE_OK || status != 200) {
+    r->errors++;
+    fprintf(stderr, "fetch %s failed: %s, status %ld\n", url, curl_easy_strerror(rc), status);
+    free(b.data);
+    return false;
+  }
+  free(e->body);
+  e->len = json_minify(b.data, b.len);
+  e->body = b.data;
+  e->fetched = http_now();
+  if(verbose) {
+    fprintf(stderr, "fetched %s in %.3fs, %zu of %zu bytes\n", url, seconds, e->len, b.len);
+  }
+  return true;
+}
+
+static struct entry *cache_get(struct route *r, const char *path) {
+  for(int i = 0; i < cache_count; i++) {
+    if(cache[i].route == r && strcmp(cache[i].path, path) == 0) {
+      return &cache[i];
+    }
+  }
+  struct entry *e;
+  if(cache_count < CACHE_ENTRIES) {
+    e = &cache[cache_count++];
+  } else {
+    // the least recently requested makes room
+    e = &cache[0];
+    for(int i = 1; i < CACHE_ENTRIES; i++) {
+      if(cache[i].requested < e->requested) {
+        e = &cache[i];
+      }
+    }
+    free(e->body);
+  }
+  memset(e, 0, sizeof(*e));
+  e->route = r;
+  snprintf(e->path, sizeof(e->path), "%s", path);
+  return e;
+}
+
+static char metrics[8192];
+
+static size_t print_metrics() {
+  size_t n = 0;
+  n += snprintf(metrics + n, sizeof(metrics) - n,
+                "# TYPE gateway_requests counter\n"
+                "gateway_requests{result=\"hit\"} %d\n"
+                "gateway_requests{result=\"miss\"} %d\n"
+                "gateway_requests{result=\"stale\"} %d\n"
+                "gateway_requests{result=\"error\"} %d\n"
+                "gateway_requests{result=\"not_found\"} %d\n",
+                counts.hit, counts.miss, counts.stale, counts.error, counts.not_found);
+  for(int i = 0; i < ROUTES && n < sizeof(metrics); i++) {
+    struct route *r = &routes[i];
+    n += snprintf(metrics + n, sizeof(metrics) - n,
+                  "gateway_fetches{route=\"%s\"} %d\n"
+                  "gateway_fetch_errors{route=\"%s\"} %d\n"
+                  "gateway_fetch_seconds{route=\"%s\"} %f\n",
+                  r->name, r->fetches, r->name, r->errors, r->name, r->fetch_seconds);
+  }
+  return (n < sizeof(metrics)) ? n : sizeof(metrics) - 1;
+}
+
+static void handle(const struct http_request *req, struct http_response *res, void *arg) {
+  if(strcmp(req->path, "/metrics") == 0) {
+    res->content_type = "text/plain";
+    res->body = metrics;
+    res->len = print_metrics();
+    return;
+  }
+  const char *name = req->path + 1;
+  size_t len = strcspn(name, "/?");
+  struct route *r = (req->path[0] == '/') ? route_find(name, len) : NULL;
+  if(r == NULL) {
+    counts.not_found++;
+    res->status = 404;
+    return;
+  }
+  struct entry *e = cache_get(r, name + len);
+  double now = http_now();
+  e->requested = now;
+  if(req->authorization[0] != '\0') {
+    snprintf(e->authorization, sizeof(e->authorization), "%s", req->authorization);
+  }
+  const char *result = "hit";
+  if(e->body == NULL || now - e->fetched >= r->ttl) {
+    if(fetch(e)) {
+      counts.miss++;
+      result = "miss";
+    } else if(e->body != NULL) {
+      counts.stale++;
+      result = "stale";
+    } else {
+      counts.error++;
+      res->status = 502;
+      return;
+    }
+  } else {
+    counts.hit++;
+  }
+  res->content_type = "application/json";
+  res->body = e->body;
+  res->len = e->len;
+  snprintf(res->headers, sizeof(res->headers), "X-Cache: %s\r\nAge: %d\r\n", result, (int) (now - e->fetched));
+  if(verbose) {
+    fprintf(stderr, "%s %s %s\n", req->method, req->path, result);
+  }
+
+  (void) arg;
+}
+
+// fetches entries still requested before the device asks again
+static void refresh(void *arg) {
+  double now = http_now();
+  for(int i = 0; i < cache_count; i++) {
+    struct entry *e = &cache[i];
+    double interval = e->route->refresh;
+    if(interval > 0 && e->body != NULL && now - e->requested < CACHE_IDLE && now - e->fetched >= interval) {
+      fetch(e);
+    }
+  }
+
+  (void) arg;
+}
+
+int main(int argc, char **argv) {
+  const char *addr = "0.0.0.0";
+  int port = 8080;
+  const char *value;
+  int opt;
+  while((opt = getopt(argc, argv, "l:p:u:t:r:v")) != -1) {
+    switch(opt) {
+      case 'l': addr = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'u': route_option(optarg, &value)->upstream = value; break;
+      case 't': { struct route *r = route_option(optarg, &value); r->ttl = atof(value); break; }
+      case 'r': { struct route *r = route_option(optarg, &value); r->refresh = atof(value); break; }
+      case 'v': verbose = true; break;
+      default: usage();
+    }
+  }
+  int fd = http_listen(addr, port);
+  if(fd < 0) {
+    return 1;
+  }
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  fprintf(stderr, "gateway listening on %s:%d\n", addr, port);
+  http_serve(fd, handle, refresh, 250, NULL);
+  for(int i = 0; i < ROUTES; i++) {
+    if(routes[i].curl != NULL) {
+      curl_easy_cleanup(routes[i].curl);
+    }
+  }
+  for(int i = 0; i < cache_count; i++) {
+    free(cache[i].body);
+  }
+  curl_global_cleanup();
+  return 0;
+}
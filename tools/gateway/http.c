@@ -0,0 +1,242 @@
+#include "http.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HTTP_CLIENTS 16
+#define HTTP_REQUEST_MAX 4096
+
+struct client {
+  int fd;
+  char buf[HTTP_REQUEST_MAX];
+  size_t len;
+};
+
+static struct client clients[HTTP_CLIENTS];
+static volatile sig_atomic_t stopped = 0;
+
+static void http_stop(int sig) {
+  stopped = 1;
+  (void) sig;
+}
+
+double http_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int http_listen(const char *addr, int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  if(inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+    fprintf(stderr, "invalid listen address %s\n", addr);
+    close(fd);
+    return -1;
+  }
+  if(bind(fd, (struct sockaddr *) &sa, sizeof(sa)) != 0 || listen(fd, 8) != 0) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool http_send(int fd, const char *data, size_t len) {
+  while(len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR) {
+      continue;
+    }
+    if(n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+static const char *http_reason(int status) {
+  switch(status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 431: return "Request Header Fields Too Large";
+    case 502: return "Bad Gateway";
+    default: return "Error";
+  }
+}
+
+static bool http_respond(int fd, const struct http_response *res, bool close) {
+  char head[512];
+  int n = snprintf(head, sizeof(head),
+                   "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%sConnection: %s\r\n\r\n",
+                   res->status, http_reason(res->status), res->content_type ? res->content_type : "text/plain",
+                   res->len, res->headers, close ? "close" : "keep-alive");
+  return http_send(fd, head, n) && http_send(fd, res->body, res->len);
+}
+
+static void http_header(const char *line, size_t len, struct http_request *req) {
+  const char *colon = memchr(line, ':', len);
+  if(colon == NULL) {
+    return;
+  }
+  size_t name = colon - line;
+  const char *value = colon + 1;
+  while(value < line + len && *value == ' ') {
+    value++;
+  }
+  size_t vlen = line + len - value;
+  if(name == 13 && strncasecmp(line, "Authorization", 13) == 0) {
+    snprintf(req->authorization, sizeof(req->authorization), "%.*s", (int) vlen, value);
+  } else if(name == 10 && strncasecmp(line, "Connection", 10) == 0) {
+    req->close = vlen >= 5 && strncasecmp(value, "close", 5) == 0;
+  }
+}
+
+// parses the head ending at end, false if malformed
+static bool http_parse(const char *buf, const char *end, struct http_request *req) {
+  memset(req, 0, sizeof(*req));
+  const char *eol = strstr(buf, "\r\n");
+  char version[16];
+  char line[1100];
+  snprintf(line, sizeof(line), "%.*s", (int) (eol - buf), buf);
+  if(sscanf(line, "%7s %1023s %15s", req->method, req->path, version) != 3) {
+    return false;
+  }
+  req->close = strcmp(version, "HTTP/1.0") == 0;
+  const char *p = eol + 2;
+  while(p < end) {
+    eol = strstr(p, "\r\n");
+    http_header(p, eol - p, req);
+    p = eol + 2;
+  }
+  return true;
+}
+
+// handles all complete requests buffered, false to close the connection
+static bool http_process(struct client *c, http_handler_t handler, void *arg) {
+  for(;;) {
+    c->buf[c->len] = '\0';
+    char *end = strstr(c->buf, "\r\n\r\n");
+    if(end == NULL) {
+      if(c->len == sizeof(c->buf) - 1) {
+        struct http_response res = { .status = 431, .body = "", .len = 0 };
+        http_respond(c->fd, &res, true);
+        return false;
+      }
+      return true;
+    }
+    struct http_request req;
+    struct http_response res = { .status = 200, .body = "", .len = 0 };
+    if(!http_parse(c->buf, end + 2, &req)) {
+      res.status = 400;
+      req.close = true;
+    } else if(strcmp(req.method, "GET") != 0) {
+      res.status = 405;
+      req.close = true;
+    } else {
+      handler(&req, &res, arg);
+    }
+    if(!http_respond(c->fd, &res, req.close) || req.close) {
+      return false;
+    }
+    size_t used = end + 4 - c->buf;
+    memmove(c->buf, c->buf + used, c->len - used);
+    c->len -= used;
+  }
+}
+
+static void http_accept(int fd) {
+  int cfd = accept(fd, NULL, NULL);
+  if(cfd < 0) {
+    return;
+  }
+  for(int i = 0; i < HTTP_CLIENTS; i++) {
+    if(clients[i].fd < 0) {
+      int on = 1;
+      setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      clients[i].fd = cfd;
+      clients[i].len = 0;
+      return;
+    }
+  }
+  close(cfd);
+}
+
+void http_serve(int fd, http_handler_t handler, http_idle_t idle, int idle_ms, void *arg) {
+  signal(SIGINT, http_stop);
+  signal(SIGTERM, http_stop);
+  for(int i = 0; i < HTTP_CLIENTS; i++) {
+    clients[i].fd = -1;
+  }
+  while(!stopped) {
+    struct pollfd fds[HTTP_CLIENTS + 1];
+    int map[HTTP_CLIENTS + 1];
+    int n = 0;
+    fds[n].fd = fd;
+    fds[n].events = POLLIN;
+    map[n++] = -1;
+    for(int i = 0; i < HTTP_CLIENTS; i++) {
+      if(clients[i].fd >= 0) {
+        fds[n].fd = clients[i].fd;
+        fds[n].events = POLLIN;
+        map[n++] = i;
+      }
+    }
+    int ready = poll(fds, n, idle_ms);
+    if(ready < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+    for(int i = 0; ready > 0 && i < n; i++) {
+      if(fds[i].revents == 0) {
+        continue;
+      }
+      if(map[i] < 0) {
+        http_accept(fd);
+        continue;
+      }
+      struct client *c = &clients[map[i]];
+      ssize_t r = recv(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+      if(r > 0) {
+        c->len += r;
+      }
+      if(r <= 0 || !http_process(c, handler, arg)) {
+        close(c->fd);
+        c->fd = -1;
+      }
+    }
+    if(idle != NULL) {
+      idle(arg);
+    }
+  }
+  for(int i = 0; i < HTTP_CLIENTS; i++) {
+    if(clients[i].fd >= 0) {
+      close(clients[i].fd);
+    }
+  }
+  close(fd);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+/*
+ * Minimal HTTP/1.1 server for the LAN side: GET only, keep-alive, one
+ * poll loop serving all clients, the handler answers synchronously.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct http_request {
+  char method[8];
+  char path[1024];
+  char authorization[512];
+  bool close;
+};
+
+struct http_response {
+  int status;
+  const char *content_type;
+  const char *body;     // owned by the handler, sent before the next request
+  size_t len;
+  char headers[256];    // extra header lines, each ending in \r\n
+};
+
+typedef void (*http_handler_t)(const struct http_request *req, struct http_response *res, void *arg);
+typedef void (*http_idle_t)(void *arg);
+
+// listening socket or -1
+int http_listen(const char *addr, int port);
+// runs until a signal stops it, idle is called at least every idle_ms
+void http_serve(int fd, http_handler_t handler, http_idle_t idle, int idle_ms, void *arg);
+
+double http_now(void);
@@ -0,0 +1,182 @@
+/*
+ * Stands in for the upstream APIs of the gateway in tests: a meter reading
+ * of the current time, a day of hourly prices and a weather forecast. Also
+ * answers the Gen2 RPC of Shelly relays the firmware diverts surplus to and
+ * of a Shelly EM or 3EM measuring the same power as the meter reading.
+ */
+
+#include "http.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static char body[8192];
+static int requests = 0;
+static int fail_every = 0;
+
+#define RELAYS 4
+static bool relays[RELAYS];
+static int relay_power = 500;
+
+static void usage() {
+  fprintf(stderr,
+          "usage: mock [options]\n"
+          "  -l addr   listen address, default 127.0.0.1\n"
+          "  -p port   listen port, default 8081\n"
+          "  -f n      fail every nth request with 502\n"
+          "  -w watts  power of a load behind a relay, default 500\n"
+          "paths: /public/v1/last_reading /v1/marketdata /api/v1/weather/...\n"
+          "       /rpc/Switch.Set?id=n&on=true|false /rpc/Switch.GetStatus?id=n\n"
+          "       /rpc/EM.GetStatus?id=0 /rpc/EM1.GetStatus?id=0\n");
+  exit(2);
+}
+
+static double wall_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// W, the load swings between import and export every 10 minutes, relays on add theirs
+static double grid_power(double now) {
+  double power = 400 * sin(now * 2 * M_PI / 600);
+  for(int i = 0; i < RELAYS; i++) {
+    power += relays[i] ? relay_power : 0;
+  }
+  return power;
+}
+
+static size_t meter_reading() {
+  double now = wall_now();
+  return snprintf(body, sizeof(body), "{\"time\": %lld, \"values\": {\"power\": %d}}",
+                  (long long) (now * 1000), (int) (grid_power(now) * 1000));
+}
+
+// 3EM split over the phases, an EM channel sees the total
+static size_t em_status(const char *path) {
+  double power = grid_power(wall_now());
+  if(strncmp(path, "/rpc/EM1.", 9) == 0) {
+    return snprintf(body, sizeof(body),
+                    "{\"id\": 0, \"current\": %.3f, \"voltage\": 230.0, \"act_power\": %.1f, \"aprt_power\": %.1f, \"pf\": 1.0}",
+                    fabs(power) / 230, power, fabs(power));
+  }
+  return snprintf(body, sizeof(body),
+                  "{\"id\": 0, \"a_current\": %.3f, \"a_voltage\": 230.0, \"a_act_power\": %.1f, "
+                  "\"b_current\": %.3f, \"b_voltage\": 230.0, \"b_act_power\": %.1f, "
+                  "\"c_current\": %.3f, \"c_voltage\": 230.0, \"c_act_power\": %.1f, "
+                  "\"n_current\": null, \"total_current\": %.3f, \"total_act_power\": %.1f, \"total_aprt_power\": %.1f}",
+                  fabs(power) * 0.5 / 230, power * 0.5, fabs(power) * 0.3 / 230, power * 0.3,
+                  fabs(power) * 0.2 / 230, power * 0.2, fabs(power) / 230, power, fabs(power));
+}
+
+// cheap at night, expensive in the evening
+static size_t market_data() {
+  long long hour = (long long) wall_now() / 3600 * 3600;
+  size_t n = snprintf(body, sizeof(body), "{\"object\": \"list\", \"data\": [");
+  for(int i = 0; i < 24 && n < sizeof(body); i++) {
+    long long start = hour + i * 3600;
+    double price = 80 + 60 * sin(((start / 3600) % 24 - 12) * 2 * M_PI / 24);
+    n += snprintf(body + n, sizeof(body) - n,
+                  "%s\n  {\"start_timestamp\": %lld, \"end_timestamp\": %lld, \"marketprice\": %.2f, \"unit\": \"Eur/MWh\"}",
+                  (i > 0) ? "," : "", start * 1000, (start + 3600) * 1000, price);
+  }
+  n += snprintf(body + n, sizeof(body) - n, "\n], \"url\": \"/at/v1/marketdata\"}");
+  return n;
+}
+
+static size_t weather() {
+  long long day = (long long) wall_now() / 86400 * 86400;
+  return snprintf(body, sizeof(body),
+                  "{\"daily\": {\"data\": [{\"time\": %lld, \"sunriseTime\": %lld, \"sunsetTime\": %lld, \"cloudCover\": 0.3}]}}",
+                  day, day + 6 * 3600, day + 20 * 3600);
+}
+
+// value of key in the query, NULL if missing
+static const char *query(const char *path, const char *key) {
+  const char *q = strchr(path, '?');
+  size_t len = strlen(key);
+  while(q != NULL) {
+    q++;
+    if(strncmp(q, key, len) == 0 && q[len] == '=') {
+      return q + len + 1;
+    }
+    q = strchr(q, '&');
+  }
+  return NULL;
+}
+
+static size_t relay(const char *path, struct http_response *res) {
+  const char *id = query(path, "id");
+  int i = (id != NULL) ? atoi(id) : -1;
+  if(i < 0 || i >= RELAYS) {
+    res->status = 404;
+    return snprintf(body, sizeof(body), "{\"code\": -105, \"message\": \"Argument 'id', value %d not found!\"}", i);
+  }
+  if(strncmp(path, "/rpc/Switch.Set", 15) == 0) {
+    const char *on = query(path, "on");
+    if(on == NULL) {
+      res->status = 400;
+      return snprintf(body, sizeof(body), "{\"code\": -103, \"message\": \"Missing required argument 'on'!\"}");
+    }
+    bool was_on = relays[i];
+    relays[i] = strncmp(on, "true", 4) == 0;
+    fprintf(stderr, "relay %d %s\n", i, relays[i] ? "on" : "off");
+    return snprintf(body, sizeof(body), "{\"was_on\": %s}", was_on ? "true" : "false");
+  }
+  return snprintf(body, sizeof(body),
+                  "{\"id\": %d, \"source\": \"http\", \"output\": %s, \"apower\": %.1f, \"voltage\": 230.0}",
+                  i, relays[i] ? "true" : "false", relays[i] ? (double) relay_power : 0.0);
+}
+
+static void handle(const struct http_request *req, struct http_response *res, void *arg) {
+  requests++;
+  if(fail_every > 0 && requests % fail_every == 0) {
+    res->status = 502;
+    return;
+  }
+  res->content_type = "application/json";
+  res->body = body;
+  if(strncmp(req->path, "/public/v1/last_reading", 23) == 0) {
+    res->len = meter_reading();
+  } else if(strncmp(req->path, "/v1/marketdata", 14) == 0) {
+    res->len = market_data();
+  } else if(strncmp(req->path, "/api/v1/weather/", 16) == 0) {
+    res->len = weather();
+  } else if(strncmp(req->path, "/rpc/EM.GetStatus", 17) == 0 || strncmp(req->path, "/rpc/EM1.GetStatus", 18) == 0) {
+    res->len = em_status(req->path);
+  } else if(strncmp(req->path, "/rpc/Switch.Set?", 16) == 0 || strncmp(req->path, "/rpc/Switch.GetStatus?", 22) == 0) {
+    res->len = relay(req->path, res);
+  } else {
+    res->status = 404;
+    res->len = 0;
+  }
+
+  (void) arg;
+}
+
+int main(int argc, char **argv) {
+  const char *addr = "127.0.0.1";
+  int port = 8081;
+  int opt;
+  while((opt = getopt(argc, argv, "l:p:f:w:")) != -1) {
+    switch(opt) {
+      case 'l': addr = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'f': fail_every = atoi(optarg); break;
+      case 'w': relay_power = atoi(optarg); break;
+      default: usage();
+    }
+  }
+  int fd = http_listen(addr, port);
+  if(fd < 0) {
+    return 1;
+  }
+  fprintf(stderr, "mock listening on %s:%d\n", addr, port);
+  http_serve(fd, handle, NULL, 1000, NULL);
+  return 0;
+}
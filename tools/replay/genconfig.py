@@ -0,0 +1,194 @@
+#!/usr/bin/env python3
+"""Generates mgos_config.h/.c for the host build from config_schema in mos.yml.
+
+Types follow the mos conventions: objects become nested structs with
+mgos_sys_config_get_<path>() getters, leafs get getters and setters. Untyped
+entries overriding library settings are typed by their value. Model
+overrides under conds are kept as a table and applied at runtime.
+"""
+import re
+import sys
+
+import yaml
+
+CTYPES = {'i': 'int', 'd': 'double', 'f': 'float', 'b': 'int', 's': 'const char *'}
+
+
+def value_type(v):
+    if isinstance(v, bool):
+        return 'b'
+    if isinstance(v, int):
+        return 'i'
+    if isinstance(v, float):
+        return 'd'
+    return 's'
+
+
+class Schema:
+    def __init__(self):
+        self.order = []
+        self.types = {}
+        self.defaults = {}
+        # objects reusing another schema share its struct type, as with mos
+        self.struct = {}
+
+    def add(self, path, t, default=None):
+        if path not in self.types:
+            self.order.append(path)
+        self.types[path] = t
+        if t != 'o':
+            self.defaults[path] = default
+        parent = path.rpartition('.')[0]
+        if parent and parent not in self.types:
+            self.add(parent, 'o')
+
+    def entry(self, e):
+        path = e[0]
+        if len(e) >= 3 and e[1] in ('i', 'd', 'f', 'b', 's'):
+            self.add(path, e[1], e[2])
+        elif len(e) >= 2 and e[1] == 'o':
+            self.add(path, 'o')
+        elif len(e) >= 2 and isinstance(e[1], str) and e[1] in self.types and self.types[e[1]] == 'o':
+            # ["fan1", "fan", {...}] reuses the schema of fan
+            src = e[1]
+            self.add(path, 'o')
+            self.struct[path] = self.struct_name(src)
+            for q in list(self.order):
+                if q.startswith(src + '.'):
+                    self.add(path + q[len(src):], self.types[q], self.defaults.get(q))
+                    if self.types[q] == 'o':
+                        self.struct[path + q[len(src):]] = self.struct_name(q)
+            if len(e) >= 3 and isinstance(e[2], dict):
+                for k, v in e[2].items():
+                    if k != 'title' and path + '.' + k in self.types:
+                        self.defaults[path + '.' + k] = v
+        elif path in self.types:
+            self.defaults[path] = e[1]
+        else:
+            self.add(path, value_type(e[1]), e[1])
+
+    def struct_name(self, path):
+        return self.struct.get(path, path.replace('.', '_'))
+
+
+def c_value(t, v):
+    if t == 's':
+        return 'NULL' if v is None else '"%s"' % str(v).replace('\\', '\\\\').replace('"', '\\"')
+    if t == 'b':
+        return '1' if v else '0'
+    if v is None:
+        return '0'
+    return repr(v) if t in ('d', 'f') else str(int(v))
+
+
+def main():
+    mos, out_h, out_c = sys.argv[1:4]
+    doc = yaml.safe_load(open(mos))
+    schema = Schema()
+    for e in doc.get('config_schema', []):
+        schema.entry(e)
+    models = []
+    for c in doc.get('conds', []):
+        m = re.search(r'build_vars.MODEL\s*==\s*"(\w+)"', c.get('when', ''))
+        entries = c.get('apply', {}).get('config_schema', [])
+        for e in entries:
+            if e[0] not in schema.types:
+                schema.entry([e[0], e[-1]])
+        if m:
+            models.append((m.group(1), [(e[0], e[-1]) for e in entries]))
+
+    objs = [p for p in schema.order if schema.types[p] == 'o' and schema.struct_name(p) == p.replace('.', '_')]
+    h = ['#pragma once', '', '#include <stdbool.h>', '']
+    for o in sorted(objs, key=lambda p: -p.count('.')):
+        h.append('struct mgos_config_%s {' % o.replace('.', '_'))
+        for q in schema.order:
+            if q.rpartition('.')[0] == o:
+                leaf = q.rpartition('.')[2]
+                if schema.types[q] == 'o':
+                    h.append('  struct mgos_config_%s %s;' % (schema.struct_name(q), leaf))
+                else:
+                    h.append('  %s %s;' % (CTYPES[schema.types[q]], leaf))
+        h.append('};')
+    h.append('struct mgos_config {')
+    for q in schema.order:
+        if '.' not in q:
+            if schema.types[q] == 'o':
+                h.append('  struct mgos_config_%s %s;' % (schema.struct_name(q), q))
+            else:
+                h.append('  %s %s;' % (CTYPES[schema.types[q]], q))
+    h.append('};')
+    h.append('')
+    h.append('extern struct mgos_config mgos_sys_config;')
+    h.append('')
+    h.append('void mgos_config_set_defaults(void);')
+    h.append('// applies the conds of a build_vars.MODEL')
+    h.append('bool mgos_config_apply_model(const char *model);')
+    h.append('// sets a value by its dotted path from a string')
+    h.append('bool mgos_config_set(const char *path, const char *value);')
+    h.append('')
+    for p in schema.order:
+        n = p.replace('.', '_')
+        if schema.types[p] == 'o':
+            h.append('static inline const struct mgos_config_%s *mgos_sys_config_get_%s(void) '
+                     '{ return &mgos_sys_config.%s; }' % (schema.struct_name(p), n, p))
+        else:
+            ct = CTYPES[schema.types[p]]
+            h.append('static inline %s mgos_sys_config_get_%s(void) { return mgos_sys_config.%s; }' % (ct, n, p))
+            h.append('static inline void mgos_sys_config_set_%s(%s v) { mgos_sys_config.%s = v; }' % (n, ct, p))
+
+    c = ['#include "mgos_config.h"', '', '#include <stddef.h>', '#include <stdlib.h>', '#include <string.h>', '',
+         'struct mgos_config mgos_sys_config;', '',
+         'static const struct { const char *path; char type; size_t offset; } fields[] = {']
+    leafs = [p for p in schema.order if schema.types[p] != 'o']
+    for p in leafs:
+        c.append('  { "%s", \'%s\', offsetof(struct mgos_config, %s) },' % (p, schema.types[p], p))
+    c.append('};')
+    c.append('')
+    c.append('static const struct { const char *model; const char *path; const char *value; } models[] = {')
+    for name, entries in models:
+        for path, v in entries:
+            t = schema.types[path]
+            s = ('true' if v else 'false') if isinstance(v, bool) else str(v)
+            c.append('  { "%s", "%s", %s },' % (name, path, c_value('s', s)))
+    c.append('};')
+    c.append('''
+bool mgos_config_set(const char *path, const char *value) {
+  for(size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    if(strcmp(fields[i].path, path) != 0) {
+      continue;
+    }
+    char *p = (char *) &mgos_sys_config + fields[i].offset;
+    switch(fields[i].type) {
+      case 'i': *(int *) p = strtol(value, NULL, 0); break;
+      case 'b': *(int *) p = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0); break;
+      case 'd': *(double *) p = strtod(value, NULL); break;
+      case 'f': *(float *) p = strtof(value, NULL); break;
+      case 's': *(const char **) p = strdup(value); break;
+    }
+    return true;
+  }
+  return false;
+}
+
+bool mgos_config_apply_model(const char *model) {
+  bool found = false;
+  for(size_t i = 0; i < sizeof(models) / sizeof(models[0]); i++) {
+    if(strcmp(models[i].model, model) == 0) {
+      mgos_config_set(models[i].path, models[i].value);
+      found = true;
+    }
+  }
+  return found;
+}
+''')
+    c.append('void mgos_config_set_defaults(void) {')
+    c.append('  memset(&mgos_sys_config, 0, sizeof(mgos_sys_config));')
+    for p in leafs:
+        c.append('  mgos_sys_config.%s = %s;' % (p, c_value(schema.types[p], schema.defaults.get(p))))
+    c.append('}')
+    open(out_h, 'w').write('\n'.join(h) + '\n')
+    open(out_c, 'w').write('\n'.join(c) + '\n')
+
+
+if __name__ == '__main__':
+    main()
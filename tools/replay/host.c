@@ -0,0 +1,1040 @@
+/*
+ * Mongoose OS emulation on a virtual clock. Nothing here blocks or reads the
+ * real time, so a replay of the same trace takes the same decisions.
+ */
+
+#include "host.h"
+
+#include <ctype.h>
+
+#define HOST_PINS 64
+#define HOST_UARTS 4
+
+enum cs_log_level cs_log_level = LL_ERROR;
+
+static double now_uptime = 0;
+static double now_time = 0;
+
+struct host_timer {
+  mgos_timer_id id;
+  double due;
+  double interval;
+  bool repeat;
+  bool active;
+  timer_callback cb;
+  void *arg;
+};
+static struct host_timer *timers = NULL;
+static int timer_count = 0;
+static mgos_timer_id next_timer_id = 1;
+static int timers_fired = 0;
+
+struct host_handler {
+  char *name;
+  int ev;
+  void *cb;
+  void *arg;
+  const char *args_fmt;
+};
+static struct host_handler *events = NULL, *crontabs = NULL, *rpcs = NULL, *subs = NULL, *metrics = NULL;
+static int event_count = 0, crontab_count = 0, rpc_count = 0, sub_count = 0, metrics_count = 0;
+
+struct host_call {
+  char *method;
+  mg_result_cb_t cb;
+  void *cb_arg;
+};
+static struct host_call *calls = NULL;
+static int call_count = 0;
+
+struct host_http {
+  char *url;
+  mg_event_handler_t handler;
+  void *user_data;
+  struct mg_connection nc;
+};
+static struct host_http **https = NULL;
+static int http_count = 0;
+
+struct host_sensor {
+  char *key;
+  struct mbuf current;
+  struct mbuf queued[8];
+  int queue_len;
+  int queue_pos;
+};
+static struct host_sensor *sensors = NULL;
+static int sensor_count = 0;
+
+static struct {
+  bool level;
+  bool output;
+} pins[HOST_PINS];
+static float pwm_duty[HOST_PINS];
+
+static struct {
+  mgos_uart_dispatcher_t dispatcher;
+  void *arg;
+  struct mbuf rx;
+} uarts[HOST_UARTS];
+
+static char *present[8];
+static int present_count = 0;
+
+static struct mg_mgr mgr;
+static struct mg_rpc rpc;
+
+static struct host_handler *host_add(struct host_handler **list, int *count, const char *name, int ev, void *cb,
+                                     void *arg) {
+  *list = realloc(*list, (*count + 1) * sizeof(**list));
+  struct host_handler *h = &(*list)[(*count)++];
+  *h = (struct host_handler) { name ? strdup(name) : NULL, ev, cb, arg, NULL };
+  return h;
+}
+
+/* log */
+
+void cs_log_print_prefix(enum cs_log_level level, const char *file, int line) {
+  const char *f = strrchr(file, '/');
+  fprintf(stderr, "%10.3f %d %s:%d ", now_uptime, level, f ? f + 1 : file, line);
+}
+
+void cs_log_printf(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fputc('\n', stderr);
+}
+
+/* mg_str, mbuf */
+
+struct mg_str mg_mk_str(const char *s) {
+  return (struct mg_str) { s, s ? strlen(s) : 0 };
+}
+
+struct mg_str mg_mk_str_n(const char *s, size_t len) {
+  return (struct mg_str) { s, len };
+}
+
+int mg_vcmp(const struct mg_str *str2, const char *str1) {
+  size_t n = strlen(str1);
+  int r = strncmp(str1, str2->p, (n < str2->len) ? n : str2->len);
+  return (r == 0) ? (int) (str2->len - n) : r;
+}
+
+int mg_strcmp(const struct mg_str str1, const struct mg_str str2) {
+  size_t n = (str1.len < str2.len) ? str1.len : str2.len;
+  int r = memcmp(str1.p, str2.p, n);
+  return (r == 0) ? (int) str1.len - (int) str2.len : r;
+}
+
+int mg_ncasecmp(const char *s1, const char *s2, size_t len) {
+  return strncasecmp(s1, s2, len);
+}
+
+void mbuf_init(struct mbuf *mb, size_t initial_size) {
+  mb->len = 0;
+  mb->size = initial_size;
+  mb->buf = initial_size ? malloc(initial_size) : NULL;
+}
+
+void mbuf_free(struct mbuf *mb) {
+  free(mb->buf);
+  mb->buf = NULL;
+  mb->len = mb->size = 0;
+}
+
+size_t mbuf_append(struct mbuf *mb, const void *data, size_t data_size) {
+  if(mb->len + data_size > mb->size) {
+    size_t size = (mb->len + data_size) * 3 / 2 + 1;
+    mb->buf = realloc(mb->buf, size);
+    mb->size = size;
+  }
+  if(data_size > 0) {
+    memcpy(mb->buf + mb->len, data, data_size);
+  }
+  mb->len += data_size;
+  return data_size;
+}
+
+void mbuf_remove(struct mbuf *mb, size_t n) {
+  if(n > mb->len) {
+    n = mb->len;
+  }
+  memmove(mb->buf, mb->buf + n, mb->len - n);
+  mb->len -= n;
+}
+
+void mbuf_resize(struct mbuf *mb, size_t new_size) {
+  if(new_size < mb->len) {
+    return;
+  }
+  mb->buf = realloc(mb->buf, new_size);
+  mb->size = new_size;
+}
+
+void mbuf_clear(struct mbuf *mb) {
+  mb->len = 0;
+}
+
+void mbuf_trim(struct mbuf *mb) {
+  if(mb->len == 0) {
+    mbuf_free(mb);
+  }
+}
+
+/* clock and timers */
+
+double mgos_uptime(void) {
+  return now_uptime;
+}
+
+int64_t mgos_uptime_micros(void) {
+  return (int64_t) (now_uptime * 1e6);
+}
+
+double mg_time(void) {
+  return now_time;
+}
+
+time_t time(time_t *t) {
+  time_t now = (time_t) now_time;
+  if(t != NULL) {
+    *t = now;
+  }
+  return now;
+}
+
+void host_set_time(double uptime, double time) {
+  now_uptime = uptime;
+  now_time = time;
+}
+
+mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb, void *cb_arg) {
+  timers = realloc(timers, (timer_count + 1) * sizeof(*timers));
+  double interval = (msecs > 0 ? msecs : 1) / 1000.0;
+  timers[timer_count] = (struct host_timer) {
+    .id = next_timer_id++,
+    .due = now_uptime + ((flags & MGOS_TIMER_RUN_NOW) ? 0 : interval),
+    .interval = interval,
+    .repeat = (flags & MGOS_TIMER_REPEAT) != 0,
+    .active = true,
+    .cb = cb,
+    .arg = cb_arg
+  };
+  return timers[timer_count++].id;
+}
+
+void mgos_clear_timer(mgos_timer_id id) {
+  for(int i = 0; i < timer_count; i++) {
+    if(timers[i].id == id) {
+      timers[i].active = false;
+    }
+  }
+}
+
+void host_advance(double uptime) {
+  double offset = now_time - now_uptime;
+  while(true) {
+    int next = -1;
+    for(int i = 0; i < timer_count; i++) {
+      if(timers[i].active && timers[i].due <= uptime && (next == -1 || timers[i].due < timers[next].due)) {
+        next = i;
+      }
+    }
+    if(next == -1) {
+      break;
+    }
+    struct host_timer t = timers[next];
+    if(t.repeat) {
+      timers[next].due += t.interval;
+    } else {
+      timers[next].active = false;
+    }
+    host_set_time(t.due, t.due + offset);
+    timers_fired++;
+    t.cb(t.arg);
+  }
+  // drop expired one-shot timers
+  int n = 0;
+  for(int i = 0; i < timer_count; i++) {
+    if(timers[i].active) {
+      timers[n++] = timers[i];
+    }
+  }
+  timer_count = n;
+  host_set_time(uptime, uptime + offset);
+}
+
+int host_timers_fired(void) {
+  return timers_fired;
+}
+
+void mgos_usleep(uint32_t usecs) {
+  (void) usecs;
+}
+
+void mgos_msleep(uint32_t msecs) {
+  (void) msecs;
+}
+
+bool mgos_invoke_cb(void (*cb)(void *arg), void *arg, bool from_isr) {
+  cb(arg);
+  (void) from_isr;
+  return true;
+}
+
+size_t mgos_strftime(char *s, int size, char *fmt, int time) {
+  time_t t = time;
+  struct tm tm;
+  localtime_r(&t, &tm);
+  return strftime(s, size, fmt, &tm);
+}
+
+size_t mgos_get_heap_size(void) {
+  return 0;
+}
+
+size_t mgos_get_free_heap_size(void) {
+  return 0;
+}
+
+size_t mgos_get_min_free_heap_size(void) {
+  return 0;
+}
+
+void mgos_system_restart(void) {
+  LOG(LL_WARN, ("Restart requested"));
+}
+
+bool save_cfg(const struct mgos_config *cfg, char **msg) {
+  (void) cfg;
+  (void) msg;
+  return true;
+}
+
+/* events */
+
+bool mgos_event_add_handler(int ev, mgos_event_handler_t cb, void *userdata) {
+  host_add(&events, &event_count, NULL, ev, (void *) cb, userdata);
+  return true;
+}
+
+int mgos_event_trigger(int ev, void *ev_data) {
+  int n = 0;
+  for(int i = 0; i < event_count; i++) {
+    if(events[i].ev == ev) {
+      ((mgos_event_handler_t) events[i].cb)(ev, ev_data, events[i].arg);
+      n++;
+    }
+  }
+  return n;
+}
+
+bool host_event(const char *name) {
+  if(strcmp(name, "ip_acquired") == 0) {
+    return mgos_event_trigger(MGOS_NET_EV_IP_ACQUIRED, NULL) > 0;
+  }
+  return false;
+}
+
+/* crontab */
+
+void mgos_crontab_register_handler(struct mg_str action, mgos_crontab_cb cb, void *userdata) {
+  char name[64];
+  snprintf(name, sizeof(name), "%.*s", (int) action.len, action.p);
+  host_add(&crontabs, &crontab_count, name, 0, (void *) cb, userdata);
+}
+
+bool host_crontab(const char *action, const char *payload, size_t len) {
+  bool found = false;
+  for(int i = 0; i < crontab_count; i++) {
+    if(strcmp(crontabs[i].name, action) == 0) {
+      ((mgos_crontab_cb) crontabs[i].cb)(mg_mk_str(crontabs[i].name), mg_mk_str_n(payload, len), crontabs[i].arg);
+      found = true;
+    }
+  }
+  return found;
+}
+
+/* rpc */
+
+struct mg_rpc *mgos_rpc_get_global(void) {
+  return &rpc;
+}
+
+void mg_rpc_add_handler(struct mg_rpc *c, const char *method, const char *args_fmt, mg_handler_cb_t cb,
+                        void *cb_arg) {
+  host_add(&rpcs, &rpc_count, method, 0, (void *) cb, cb_arg)->args_fmt = args_fmt;
+  (void) c;
+}
+
+bool host_rpc_request(const char *method, const char *args, size_t len) {
+  for(int i = 0; i < rpc_count; i++) {
+    if(strcmp(rpcs[i].name, method) == 0) {
+      struct mg_rpc_request_info *ri = calloc(1, sizeof(*ri));
+      struct mg_rpc_frame_info fi = { "replay" };
+      ri->rpc = &rpc;
+      ri->method = mg_mk_str(rpcs[i].name);
+      ri->args_fmt = rpcs[i].args_fmt;
+      ((mg_handler_cb_t) rpcs[i].cb)(ri, rpcs[i].arg, &fi, mg_mk_str_n(args, len));
+      return true;
+    }
+  }
+  return false;
+}
+
+bool mg_rpc_send_responsef(struct mg_rpc_request_info *ri, const char *result_json_fmt, ...) {
+  if(cs_log_level >= LL_DEBUG && result_json_fmt != NULL) {
+    va_list ap;
+    va_start(ap, result_json_fmt);
+    char *s = json_vasprintf(result_json_fmt, ap);
+    va_end(ap);
+    LOG(LL_DEBUG, ("%.*s -> %s", (int) ri->method.len, ri->method.p, s));
+    free(s);
+  }
+  free(ri);
+  return true;
+}
+
+bool mg_rpc_send_errorf(struct mg_rpc_request_info *ri, int error_code, const char *error_msg_fmt, ...) {
+  LOG(LL_DEBUG, ("%.*s -> error %d", (int) ri->method.len, ri->method.p, error_code));
+  free(ri);
+  (void) error_msg_fmt;
+  return true;
+}
+
+bool mg_rpc_callf(struct mg_rpc *c, const struct mg_str method, mg_result_cb_t cb, void *cb_arg,
+                  const struct mg_rpc_call_opts *opts, const char *args_jsonf, ...) {
+  if(cb != NULL) {
+    calls = realloc(calls, (call_count + 1) * sizeof(*calls));
+    char *name = malloc(method.len + 1);
+    memcpy(name, method.p, method.len);
+    name[method.len] = '\0';
+    calls[call_count++] = (struct host_call) { name, cb, cb_arg };
+  }
+  (void) c;
+  (void) opts;
+  (void) args_jsonf;
+  return true;
+}
+
+bool host_rpc_result(const char *method, const char *data, size_t len) {
+  for(int i = 0; i < call_count; i++) {
+    if(strcmp(calls[i].method, method) != 0) {
+      continue;
+    }
+    struct host_call call = calls[i];
+    memmove(&calls[i], &calls[i + 1], (call_count - i - 1) * sizeof(*calls));
+    call_count--;
+    struct mg_rpc_frame_info fi = { "replay" };
+    if(len > 0 && data[0] == '!') {
+      char code[16];
+      snprintf(code, sizeof(code), "%.*s", (int) len - 1, data + 1);
+      call.cb(&rpc, call.cb_arg, &fi, mg_mk_str_n(NULL, 0), atoi(code), mg_mk_str("replayed error"));
+    } else {
+      call.cb(&rpc, call.cb_arg, &fi, mg_mk_str_n(data, len), 0, mg_mk_str_n(NULL, 0));
+    }
+    free(call.method);
+    return true;
+  }
+  return false;
+}
+
+/* http */
+
+struct mg_mgr *mgos_get_mgr(void) {
+  return &mgr;
+}
+
+// scheme, host and path, queries carry ids that differ between configs
+static size_t host_url_base(const char *url) {
+  return strcspn(url, "?");
+}
+
+struct mg_connection *mg_connect_http(struct mg_mgr *m, mg_event_handler_t event_handler, void *user_data,
+                                      const char *url, const char *extra_headers, const char *post_data) {
+  struct host_http *h = calloc(1, sizeof(*h));
+  h->url = strdup(url);
+  h->handler = event_handler;
+  h->user_data = user_data;
+  // what was sent, replayed by clients that reuse the connection
+  mbuf_append(&h->nc.send_mbuf, "GET ", 4);
+  mbuf_append(&h->nc.send_mbuf, url, strlen(url));
+  https = realloc(https, (http_count + 1) * sizeof(*https));
+  https[http_count++] = h;
+  int connected = 0;
+  event_handler(&h->nc, MG_EV_CONNECT, &connected, user_data);
+  mbuf_clear(&h->nc.send_mbuf);
+  (void) m;
+  (void) extra_headers;
+  (void) post_data;
+  return &h->nc;
+}
+
+bool host_http_reply(const char *url, const char *body, size_t len) {
+  size_t n = host_url_base(url);
+  for(int i = http_count - 1; i >= 0; i--) {
+    struct host_http *h = https[i];
+    if(host_url_base(h->url) != n || strncmp(h->url, url, n) != 0) {
+      continue;
+    }
+    struct http_message hm;
+    memset(&hm, 0, sizeof(hm));
+    hm.resp_code = 200;
+    hm.body = mg_mk_str_n(body, len);
+    hm.message = hm.body;
+    mbuf_append(&h->nc.recv_mbuf, body, len);
+    h->handler(&h->nc, MG_EV_HTTP_REPLY, &hm, h->user_data);
+    mbuf_clear(&h->nc.recv_mbuf);
+    return true;
+  }
+  return false;
+}
+
+void mg_send(struct mg_connection *nc, const void *buf, int len) {
+  (void) nc;
+  (void) buf;
+  (void) len;
+}
+
+int mg_printf(struct mg_connection *nc, const char *fmt, ...) {
+  (void) nc;
+  (void) fmt;
+  return 0;
+}
+
+double mg_set_timer(struct mg_connection *c, double timestamp) {
+  (void) c;
+  (void) timestamp;
+  return 0;
+}
+
+void mg_basic_auth_header(const struct mg_str user, const struct mg_str pass, struct mbuf *buf) {
+  static const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  struct mbuf plain;
+  mbuf_init(&plain, 0);
+  mbuf_append(&plain, user.p, user.len);
+  mbuf_append(&plain, ":", 1);
+  mbuf_append(&plain, pass.p, pass.len);
+  mbuf_append(buf, "Authorization: Basic ", 21);
+  for(size_t i = 0; i < plain.len; i += 3) {
+    uint32_t v = (uint8_t) plain.buf[i] << 16;
+    if(i + 1 < plain.len) v |= (uint8_t) plain.buf[i + 1] << 8;
+    if(i + 2 < plain.len) v |= (uint8_t) plain.buf[i + 2];
+    char out[4] = { b64[(v >> 18) & 63], b64[(v >> 12) & 63], b64[(v >> 6) & 63], b64[v & 63] };
+    if(i + 1 >= plain.len) out[2] = '=';
+    if(i + 2 >= plain.len) out[3] = '=';
+    mbuf_append(buf, out, 4);
+  }
+  mbuf_append(buf, "\r\n", 2);
+  mbuf_free(&plain);
+}
+
+/* mqtt */
+
+void mgos_mqtt_sub(const char *topic, sub_handler_t handler, void *ud) {
+  host_add(&subs, &sub_count, topic, 0, (void *) handler, ud);
+}
+
+bool host_mqtt_message(const char *topic, const char *msg, size_t len) {
+  bool found = false;
+  for(int i = 0; i < sub_count; i++) {
+    size_t n = strlen(subs[i].name);
+    bool match = strcmp(subs[i].name, topic) == 0
+      || (n > 0 && subs[i].name[n - 1] == '#' && strncmp(subs[i].name, topic, n - 1) == 0);
+    if(match) {
+      ((sub_handler_t) subs[i].cb)(NULL, topic, strlen(topic), msg, len, subs[i].arg);
+      found = true;
+    }
+  }
+  return found;
+}
+
+bool mgos_mqtt_pub(const char *topic, const void *message, size_t len, int qos, bool retain) {
+  LOG(LL_DEBUG, ("mqtt %s: %.*s", topic, (int) len, (const char *) message));
+  (void) qos;
+  (void) retain;
+  return true;
+}
+
+bool mgos_mqtt_pubf(const char *topic, int qos, bool retain, const char *json_fmt, ...) {
+  va_list ap;
+  va_start(ap, json_fmt);
+  char *s = json_vasprintf(json_fmt, ap);
+  va_end(ap);
+  bool result = mgos_mqtt_pub(topic, s, strlen(s), qos, retain);
+  free(s);
+  return result;
+}
+
+bool mgos_mqtt_global_is_connected(void) {
+  return true;
+}
+
+/* prometheus, dash, location */
+
+void mgos_prometheus_metrics_add_handler(mgos_prometheus_metrics_fn_t handler, void *user_data) {
+  host_add(&metrics, &metrics_count, NULL, 0, (void *) handler, user_data);
+}
+
+static FILE *metrics_fp = NULL;
+
+void mgos_prometheus_metrics_printf(struct mg_connection *nc, enum mgos_prometheus_metrics_type_t type,
+                                    const char *name, const char *descr, const char *fmt, ...) {
+  static const char *types[] = { "counter", "gauge", "histogram", "summary", "untyped" };
+  if(metrics_fp == NULL) {
+    return;
+  }
+  fprintf(metrics_fp, "# HELP %s %s\n# TYPE %s %s\n%s", name, descr, name, types[type], name);
+  if(fmt[0] != '{') {
+    fputc(' ', metrics_fp);
+  }
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(metrics_fp, fmt, ap);
+  va_end(ap);
+  fputc('\n', metrics_fp);
+  (void) nc;
+}
+
+void host_print_metrics(FILE *fp) {
+  metrics_fp = fp;
+  for(int i = 0; i < metrics_count; i++) {
+    ((mgos_prometheus_metrics_fn_t) metrics[i].cb)(NULL, metrics[i].arg);
+  }
+  metrics_fp = NULL;
+}
+
+void mgos_dash_notifyf(const char *name, const char *json_fmt, ...) {
+  (void) name;
+  (void) json_fmt;
+}
+
+bool mgos_location_get(struct mgos_location_lat_lon *loc) {
+  loc->lat = mgos_sys_config_get_device_location_lat();
+  loc->lon = mgos_sys_config_get_device_location_lon();
+  return true;
+}
+
+/* gpio, pwm */
+
+static bool host_pin(int pin) {
+  return pin >= 0 && pin < HOST_PINS;
+}
+
+bool mgos_gpio_set_mode(int pin, enum mgos_gpio_mode mode) {
+  if(host_pin(pin)) {
+    pins[pin].output = (mode != MGOS_GPIO_MODE_INPUT);
+  }
+  return host_pin(pin);
+}
+
+bool mgos_gpio_set_pull(int pin, enum mgos_gpio_pull_type pull) {
+  if(host_pin(pin) && !pins[pin].output) {
+    pins[pin].level = (pull == MGOS_GPIO_PULL_UP);
+  }
+  return host_pin(pin);
+}
+
+bool mgos_gpio_setup_input(int pin, enum mgos_gpio_pull_type pull) {
+  return mgos_gpio_set_mode(pin, MGOS_GPIO_MODE_INPUT) && mgos_gpio_set_pull(pin, pull);
+}
+
+bool mgos_gpio_setup_output(int pin, bool level) {
+  mgos_gpio_write(pin, level);
+  return mgos_gpio_set_mode(pin, MGOS_GPIO_MODE_OUTPUT);
+}
+
+bool mgos_gpio_read(int pin) {
+  return host_pin(pin) && pins[pin].level;
+}
+
+void mgos_gpio_write(int pin, bool level) {
+  if(host_pin(pin)) {
+    pins[pin].level = level;
+  }
+}
+
+bool mgos_gpio_toggle(int pin) {
+  mgos_gpio_write(pin, !mgos_gpio_read(pin));
+  return mgos_gpio_read(pin);
+}
+
+bool mgos_gpio_read_out(int pin) {
+  return mgos_gpio_read(pin);
+}
+
+bool mgos_gpio_set_int_handler(int pin, enum mgos_gpio_int_mode mode, mgos_gpio_int_handler_f cb, void *arg) {
+  (void) mode;
+  (void) cb;
+  (void) arg;
+  return host_pin(pin);
+}
+
+bool mgos_gpio_set_int_handler_isr(int pin, enum mgos_gpio_int_mode mode, mgos_gpio_int_handler_f cb, void *arg) {
+  return mgos_gpio_set_int_handler(pin, mode, cb, arg);
+}
+
+bool mgos_gpio_enable_int(int pin) {
+  return host_pin(pin);
+}
+
+bool mgos_gpio_disable_int(int pin) {
+  return host_pin(pin);
+}
+
+void mgos_gpio_clear_int(int pin) {
+  (void) pin;
+}
+
+bool mgos_pwm_set(int pin, int freq, float duty) {
+  if(host_pin(pin)) {
+    pwm_duty[pin] = duty;
+  }
+  (void) freq;
+  return host_pin(pin);
+}
+
+/* sensors */
+
+void host_set_present(const char *device, bool present_) {
+  for(int i = 0; i < present_count; i++) {
+    if(strcmp(present[i], device) == 0) {
+      if(!present_) {
+        free(present[i]);
+        present[i] = present[--present_count];
+      }
+      return;
+    }
+  }
+  if(present_ && present_count < (int) (sizeof(present) / sizeof(present[0]))) {
+    present[present_count++] = strdup(device);
+  }
+}
+
+static bool host_present(const char *device) {
+  for(int i = 0; i < present_count; i++) {
+    if(strcmp(present[i], device) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static struct host_sensor *host_sensor(const char *key) {
+  for(int i = 0; i < sensor_count; i++) {
+    if(strcmp(sensors[i].key, key) == 0) {
+      return &sensors[i];
+    }
+  }
+  sensors = realloc(sensors, (sensor_count + 1) * sizeof(*sensors));
+  struct host_sensor *s = &sensors[sensor_count++];
+  memset(s, 0, sizeof(*s));
+  s->key = strdup(key);
+  return s;
+}
+
+void host_sensor_queue(const char *key, const char *data, size_t len) {
+  struct host_sensor *s = host_sensor(key);
+  if(s->queue_len == (int) (sizeof(s->queued) / sizeof(s->queued[0]))) {
+    // nobody reads, drop the oldest value
+    struct mbuf first = s->queued[0];
+    memmove(&s->queued[0], &s->queued[1], (s->queue_len - 1) * sizeof(s->queued[0]));
+    s->queued[s->queue_len - 1] = first;
+    s->queue_len--;
+    s->queue_pos = MAX(0, s->queue_pos - 1);
+  }
+  struct mbuf *mb = &s->queued[s->queue_len++];
+  mbuf_clear(mb);
+  mbuf_append(mb, data, len);
+}
+
+void host_sensor_settle(void) {
+  for(int i = 0; i < sensor_count; i++) {
+    struct host_sensor *s = &sensors[i];
+    if(s->queue_len > 0) {
+      struct mbuf *last = &s->queued[s->queue_len - 1];
+      mbuf_clear(&s->current);
+      mbuf_append(&s->current, last->buf, last->len);
+    }
+    s->queue_len = 0;
+    s->queue_pos = 0;
+  }
+}
+
+static const struct mbuf *host_sensor_read(const char *key) {
+  struct host_sensor *s = host_sensor(key);
+  if(s->queue_pos < s->queue_len) {
+    struct mbuf *v = &s->queued[s->queue_pos++];
+    mbuf_clear(&s->current);
+    mbuf_append(&s->current, v->buf, v->len);
+  }
+  return (s->current.len > 0) ? &s->current : NULL;
+}
+
+static bool host_sensor_float(const char *key, float *value) {
+  const struct mbuf *v = host_sensor_read(key);
+  if(v == NULL) {
+    return false;
+  }
+  char s[32];
+  snprintf(s, sizeof(s), "%.*s", (int) v->len, v->buf);
+  *value = strtof(s, NULL);
+  return true;
+}
+
+struct mgos_i2c *mgos_i2c_get_global(void) {
+  return (struct mgos_i2c *) &mgr;
+}
+
+int mgos_i2c_read_reg_w(struct mgos_i2c *conn, uint16_t addr, uint8_t reg) {
+  (void) conn;
+  (void) addr;
+  (void) reg;
+  return -1;
+}
+
+bool mgos_i2c_write_reg_w(struct mgos_i2c *conn, uint16_t addr, uint8_t reg, uint16_t value) {
+  (void) conn;
+  (void) addr;
+  (void) reg;
+  (void) value;
+  return true;
+}
+
+struct mgos_ads1x1x *mgos_ads1x1x_create(struct mgos_i2c *i2c, uint8_t i2caddr, enum mgos_ads1x1x_type type) {
+  (void) i2c;
+  (void) i2caddr;
+  (void) type;
+  return host_present("ads1115") ? (struct mgos_ads1x1x *) &mgr : NULL;
+}
+
+bool mgos_ads1x1x_set_fsr(struct mgos_ads1x1x *dev, enum mgos_ads1x1x_fsr fsr) {
+  (void) fsr;
+  return dev != NULL;
+}
+
+bool mgos_ads1x1x_set_dr(struct mgos_ads1x1x *dev, enum mgos_ads1x1x_dr dr) {
+  (void) dr;
+  return dev != NULL;
+}
+
+bool mgos_ads1x1x_read(struct mgos_ads1x1x *dev, uint8_t chan, int16_t *result) {
+  char key[24];
+  float v;
+  snprintf(key, sizeof(key), "ads1115.%d", chan);
+  if(dev == NULL || !host_sensor_float(key, &v)) {
+    return false;
+  }
+  *result = (int16_t) v;
+  return true;
+}
+
+bool mgos_ads1x1x_read_diff(struct mgos_ads1x1x *dev, uint8_t chanP, uint8_t chanN, int16_t *result) {
+  char key[24];
+  float v;
+  snprintf(key, sizeof(key), "ads1115.%d-%d", chanP, chanN);
+  if(dev == NULL || !host_sensor_float(key, &v)) {
+    return false;
+  }
+  *result = (int16_t) v;
+  return true;
+}
+
+struct mgos_ina219 *mgos_ina219_create(struct mgos_i2c *i2c, uint8_t i2caddr) {
+  (void) i2c;
+  (void) i2caddr;
+  return host_present("ina219") ? (struct mgos_ina219 *) &mgr : NULL;
+}
+
+static float ina219_shunt = 0.1f;
+
+bool mgos_ina219_set_shunt_resistance(struct mgos_ina219 *sensor, float ohms) {
+  ina219_shunt = ohms;
+  return sensor != NULL;
+}
+
+bool mgos_ina219_get_shunt_resistance(struct mgos_ina219 *sensor, float *ohms) {
+  *ohms = ina219_shunt;
+  return sensor != NULL;
+}
+
+bool mgos_ina219_get_bus_voltage(struct mgos_ina219 *sensor, float *volts) {
+  return sensor != NULL && host_sensor_float("ina219.bus_voltage", volts);
+}
+
+bool mgos_ina219_get_shunt_voltage(struct mgos_ina219 *sensor, float *volts) {
+  float current;
+  if(sensor == NULL || !host_sensor_float("ina219.current", &current)) {
+    return false;
+  }
+  *volts = current * ina219_shunt;
+  return true;
+}
+
+bool mgos_ina219_get_current(struct mgos_ina219 *sensor, float *ampere) {
+  return sensor != NULL && host_sensor_float("ina219.current", ampere);
+}
+
+/* uart */
+
+void mgos_uart_config_set_defaults(int uart_no, struct mgos_uart_config *cfg) {
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->baud_rate = 115200;
+  cfg->num_data_bits = 8;
+  cfg->stop_bits = MGOS_UART_STOP_BITS_1;
+  cfg->dev.rx_gpio = -1;
+  cfg->dev.tx_gpio = -1;
+  (void) uart_no;
+}
+
+bool mgos_uart_configure(int uart_no, const struct mgos_uart_config *cfg) {
+  (void) cfg;
+  return uart_no >= 0 && uart_no < HOST_UARTS;
+}
+
+size_t mgos_uart_read_avail(int uart_no) {
+  return (uart_no >= 0 && uart_no < HOST_UARTS) ? uarts[uart_no].rx.len : 0;
+}
+
+size_t mgos_uart_read(int uart_no, void *buf, size_t len) {
+  size_t n = mgos_uart_read_avail(uart_no);
+  n = (n < len) ? n : len;
+  if(n > 0) {
+    memcpy(buf, uarts[uart_no].rx.buf, n);
+    mbuf_remove(&uarts[uart_no].rx, n);
+  }
+  return n;
+}
+
+size_t mgos_uart_read_mbuf(int uart_no, struct mbuf *mb, size_t len) {
+  size_t n = mgos_uart_read_avail(uart_no);
+  n = (n < len) ? n : len;
+  if(n > 0) {
+    mbuf_append(mb, uarts[uart_no].rx.buf, n);
+    mbuf_remove(&uarts[uart_no].rx, n);
+  }
+  return n;
+}
+
+size_t mgos_uart_write(int uart_no, const void *buf, size_t len) {
+  (void) uart_no;
+  (void) buf;
+  return len;
+}
+
+void mgos_uart_flush(int uart_no) {
+  (void) uart_no;
+}
+
+void mgos_uart_set_dispatcher(int uart_no, mgos_uart_dispatcher_t cb, void *arg) {
+  if(uart_no >= 0 && uart_no < HOST_UARTS) {
+    uarts[uart_no].dispatcher = cb;
+    uarts[uart_no].arg = arg;
+  }
+}
+
+void mgos_uart_set_rx_enabled(int uart_no, bool enabled) {
+  (void) uart_no;
+  (void) enabled;
+}
+
+bool mgos_uart_is_rx_enabled(int uart_no) {
+  return uart_no >= 0 && uart_no < HOST_UARTS;
+}
+
+bool host_uart_rx(int uart, const char *data, size_t len) {
+  if(uart < 0 || uart >= HOST_UARTS || uarts[uart].dispatcher == NULL) {
+    return false;
+  }
+  mbuf_append(&uarts[uart].rx, data, len);
+  uarts[uart].dispatcher(uart, uarts[uart].arg);
+  return true;
+}
+
+/* onewire */
+
+struct mgos_onewire *mgos_onewire_create(int pin) {
+  (void) pin;
+  return host_present("onewire") ? (struct mgos_onewire *) &mgr : NULL;
+}
+
+bool mgos_onewire_reset(struct mgos_onewire *ow) {
+  return ow != NULL;
+}
+
+void mgos_onewire_select(struct mgos_onewire *ow, const uint8_t *rom) {
+  (void) ow;
+  (void) rom;
+}
+
+void mgos_onewire_skip(struct mgos_onewire *ow) {
+  (void) ow;
+}
+
+void mgos_onewire_write(struct mgos_onewire *ow, const uint8_t data) {
+  (void) ow;
+  (void) data;
+}
+
+void mgos_onewire_write_bytes(struct mgos_onewire *ow, const uint8_t *buf, uint16_t len) {
+  (void) ow;
+  (void) buf;
+  (void) len;
+}
+
+void mgos_onewire_read_bytes(struct mgos_onewire *ow, uint8_t *buf, uint16_t len) {
+  const struct mbuf *v = host_sensor_read("onewire");
+  memset(buf, 0xff, len);
+  if(ow != NULL && v != NULL) {
+    memcpy(buf, v->buf, (v->len < len) ? v->len : len);
+  }
+}
+
+uint8_t mgos_onewire_read(struct mgos_onewire *ow) {
+  uint8_t b;
+  mgos_onewire_read_bytes(ow, &b, 1);
+  return b;
+}
+
+bool mgos_onewire_read_bit(struct mgos_onewire *ow) {
+  return mgos_onewire_read(ow) & 1;
+}
+
+static bool onewire_searched = false;
+
+bool mgos_onewire_next(struct mgos_onewire *ow, uint8_t *rom, int mode) {
+  // a single DS18B20
+  static const uint8_t ds18b20[8] = { 0x28, 1, 2, 3, 4, 5, 6, 0 };
+  if(ow == NULL || onewire_searched) {
+    return false;
+  }
+  memcpy(rom, ds18b20, 7);
+  rom[7] = mgos_onewire_crc8(rom, 7);
+  onewire_searched = true;
+  (void) mode;
+  return true;
+}
+
+void mgos_onewire_search_clean(struct mgos_onewire *ow) {
+  onewire_searched = false;
+  (void) ow;
+}
+
+uint8_t mgos_onewire_crc8(const uint8_t *data, int len) {
+  uint8_t crc = 0;
+  while(len-- > 0) {
+    uint8_t b = *data++;
+    for(int i = 0; i < 8; i++) {
+      uint8_t mix = (crc ^ b) & 0x01;
+      crc >>= 1;
+      if(mix) {
+        crc ^= 0x8C;
+      }
+      b >>= 1;
+    }
+  }
+  return crc;
+}
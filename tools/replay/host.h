@@ -0,0 +1,30 @@
+#pragma once
+
+#include "mgos_host.h"
+
+/*
+ * Controls of the emulated device for the replay driver: the virtual clock
+ * and inputs delivered to the handlers the firmware registered.
+ */
+
+void host_set_time(double uptime, double time);
+// fires timers due until uptime, the wall clock follows at the same offset
+void host_advance(double uptime);
+int host_timers_fired(void);
+
+void host_set_present(const char *device, bool present);
+
+// values read by the next sensor reads, in order
+void host_sensor_queue(const char *key, const char *data, size_t len);
+// drops values queued but not read, the last one stays current
+void host_sensor_settle(void);
+
+bool host_event(const char *name);
+bool host_http_reply(const char *url, const char *body, size_t len);
+bool host_mqtt_message(const char *topic, const char *msg, size_t len);
+bool host_rpc_request(const char *method, const char *args, size_t len);
+bool host_rpc_result(const char *method, const char *data, size_t len);
+bool host_crontab(const char *action, const char *payload, size_t len);
+bool host_uart_rx(int uart, const char *data, size_t len);
+
+void host_print_metrics(FILE *fp);
@@ -0,0 +1,3 @@
+#pragma once
+
+#include "../mgos_host.h"
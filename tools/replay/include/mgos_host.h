@@ -0,0 +1,365 @@
+#pragma once
+
+/*
+ * Host emulation of the Mongoose OS APIs used by the firmware, just enough
+ * to run src/ against a recorded trace on a virtual clock.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mgos_config.h"
+
+#define CS_P_UNIX 1
+#define CS_P_ESP8266 3
+#define CS_P_ESP32 15
+#define CS_PLATFORM CS_P_UNIX
+
+#define IRAM
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/* log */
+enum cs_log_level { LL_NONE = -1, LL_ERROR = 0, LL_WARN, LL_INFO, LL_DEBUG, LL_VERBOSE_DEBUG };
+extern enum cs_log_level cs_log_level;
+void cs_log_print_prefix(enum cs_log_level level, const char *file, int line);
+void cs_log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define LOG(l, x)                                   \
+  do {                                              \
+    if((l) <= cs_log_level) {                       \
+      cs_log_print_prefix(l, __FILE__, __LINE__);   \
+      cs_log_printf x;                              \
+    }                                               \
+  } while(0)
+
+/* mg_str, mbuf */
+struct mg_str {
+  const char *p;
+  size_t len;
+};
+struct mg_str mg_mk_str(const char *s);
+struct mg_str mg_mk_str_n(const char *s, size_t len);
+int mg_vcmp(const struct mg_str *str2, const char *str1);
+int mg_strcmp(const struct mg_str str1, const struct mg_str str2);
+
+struct mbuf {
+  char *buf;
+  size_t len;
+  size_t size;
+};
+void mbuf_init(struct mbuf *mb, size_t initial_size);
+void mbuf_free(struct mbuf *mb);
+size_t mbuf_append(struct mbuf *mb, const void *data, size_t data_size);
+void mbuf_remove(struct mbuf *mb, size_t data_size);
+void mbuf_clear(struct mbuf *mb);
+void mbuf_trim(struct mbuf *mb);
+void mbuf_resize(struct mbuf *mb, size_t new_size);
+
+/* frozen json */
+enum json_token_type {
+  JSON_TYPE_INVALID = 0,
+  JSON_TYPE_STRING,
+  JSON_TYPE_NUMBER,
+  JSON_TYPE_TRUE,
+  JSON_TYPE_FALSE,
+  JSON_TYPE_NULL,
+  JSON_TYPE_OBJECT_START,
+  JSON_TYPE_OBJECT_END,
+  JSON_TYPE_ARRAY_START,
+  JSON_TYPE_ARRAY_END
+};
+struct json_token {
+  const char *ptr;
+  int len;
+  enum json_token_type type;
+};
+struct json_out {
+  int (*printer)(struct json_out *, const char *str, size_t len);
+  union {
+    struct {
+      char *buf;
+      size_t size;
+      size_t len;
+    } buf;
+    void *data;
+    FILE *fp;
+  } u;
+};
+int json_printer_buf(struct json_out *out, const char *buf, size_t len);
+int json_printer_file(struct json_out *out, const char *buf, size_t len);
+int json_printer_mbuf(struct json_out *out, const char *buf, size_t len);
+#define JSON_OUT_BUF(buf, len) { json_printer_buf, { { buf, len, 0 } } }
+#define JSON_OUT_FILE(fp) { json_printer_file, { { (char *) fp, 0, 0 } } }
+#define JSON_OUT_MBUF(mb) { json_printer_mbuf, { { (char *) mb, 0, 0 } } }
+typedef void (*json_scanner_t)(const char *str, int len, void *user_data);
+typedef int (*json_printf_callback_t)(struct json_out *, va_list *ap);
+int json_scanf(const char *str, int len, const char *fmt, ...);
+int json_vscanf(const char *str, int len, const char *fmt, va_list ap);
+int json_scanf_array_elem(const char *s, int len, const char *path, int index, struct json_token *token);
+int json_printf(struct json_out *out, const char *fmt, ...);
+int json_vprintf(struct json_out *out, const char *fmt, va_list ap);
+int json_printf_array(struct json_out *out, va_list *ap);
+char *json_asprintf(const char *fmt, ...);
+char *json_vasprintf(const char *fmt, va_list ap);
+int json_fprintf(const char *file_name, const char *fmt, ...);
+char *json_fread(const char *file_name);
+
+/* mongoose */
+struct mg_mgr {
+  int unused;
+};
+struct mg_connection {
+  struct mbuf recv_mbuf;
+  struct mbuf send_mbuf;
+  size_t recv_mbuf_limit;
+  unsigned long flags;
+  void *user_data;
+};
+#define MG_F_SEND_AND_CLOSE (1 << 10)
+#define MG_F_CLOSE_IMMEDIATELY (1 << 11)
+#define MG_EV_POLL 0
+#define MG_EV_ACCEPT 1
+#define MG_EV_CONNECT 2
+#define MG_EV_RECV 3
+#define MG_EV_SEND 4
+#define MG_EV_CLOSE 5
+#define MG_EV_TIMER 6
+#define MG_EV_HTTP_REQUEST 100
+#define MG_EV_HTTP_REPLY 101
+#define MG_EV_HTTP_CHUNK 102
+#define MG_EV_WEBSOCKET_HANDSHAKE_DONE 112
+#define MG_EV_WEBSOCKET_FRAME 113
+#define WEBSOCKET_OP_TEXT 1
+struct http_message {
+  struct mg_str message;
+  struct mg_str body;
+  struct mg_str method;
+  struct mg_str uri;
+  struct mg_str proto;
+  int resp_code;
+  struct mg_str resp_status_msg;
+  struct mg_str query_string;
+};
+struct websocket_message {
+  unsigned char *data;
+  size_t size;
+  unsigned char flags;
+};
+typedef void (*mg_event_handler_t)(struct mg_connection *nc, int ev, void *ev_data, void *user_data);
+struct mg_connection *mg_connect_http(struct mg_mgr *mgr, mg_event_handler_t event_handler, void *user_data,
+                                      const char *url, const char *extra_headers, const char *post_data);
+void mg_send(struct mg_connection *nc, const void *buf, int len);
+int mg_printf(struct mg_connection *nc, const char *fmt, ...);
+void mg_basic_auth_header(const struct mg_str user, const struct mg_str pass, struct mbuf *buf);
+double mg_time(void);
+double mg_set_timer(struct mg_connection *c, double timestamp);
+int mg_ncasecmp(const char *s1, const char *s2, size_t len);
+struct mg_mgr *mgos_get_mgr(void);
+
+/* system, timers, events */
+enum mgos_app_init_result { MGOS_APP_INIT_SUCCESS = 0, MGOS_APP_INIT_ERROR = -2 };
+enum mgos_app_init_result mgos_app_init(void);
+double mgos_uptime(void);
+int64_t mgos_uptime_micros(void);
+typedef uintptr_t mgos_timer_id;
+#define MGOS_INVALID_TIMER_ID 0
+#define MGOS_TIMER_REPEAT 1
+#define MGOS_TIMER_RUN_NOW 2
+typedef void (*timer_callback)(void *param);
+mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb, void *cb_arg);
+void mgos_clear_timer(mgos_timer_id id);
+void mgos_usleep(uint32_t usecs);
+void mgos_msleep(uint32_t msecs);
+bool mgos_invoke_cb(void (*cb)(void *arg), void *arg, bool from_isr);
+size_t mgos_strftime(char *s, int size, char *fmt, int time);
+size_t mgos_get_heap_size(void);
+size_t mgos_get_free_heap_size(void);
+size_t mgos_get_min_free_heap_size(void);
+void mgos_system_restart(void);
+bool save_cfg(const struct mgos_config *cfg, char **msg);
+
+typedef void (*mgos_event_handler_t)(int ev, void *ev_data, void *userdata);
+bool mgos_event_add_handler(int ev, mgos_event_handler_t cb, void *userdata);
+int mgos_event_trigger(int ev, void *ev_data);
+#define MGOS_NET_EV_IP_ACQUIRED 0x4e4503
+#define MGOS_EVENT_TIME_CHANGED 0x53590a
+#define MGOS_EVENT_REBOOT 0x535902
+
+/* gpio, pwm */
+enum mgos_gpio_mode { MGOS_GPIO_MODE_INPUT, MGOS_GPIO_MODE_OUTPUT, MGOS_GPIO_MODE_OUTPUT_OD };
+enum mgos_gpio_pull_type { MGOS_GPIO_PULL_NONE, MGOS_GPIO_PULL_UP, MGOS_GPIO_PULL_DOWN };
+enum mgos_gpio_int_mode {
+  MGOS_GPIO_INT_NONE,
+  MGOS_GPIO_INT_EDGE_POS,
+  MGOS_GPIO_INT_EDGE_NEG,
+  MGOS_GPIO_INT_EDGE_ANY,
+  MGOS_GPIO_INT_LEVEL_HI,
+  MGOS_GPIO_INT_LEVEL_LO
+};
+typedef void (*mgos_gpio_int_handler_f)(int pin, void *arg);
+bool mgos_gpio_set_mode(int pin, enum mgos_gpio_mode mode);
+bool mgos_gpio_set_pull(int pin, enum mgos_gpio_pull_type pull);
+bool mgos_gpio_setup_input(int pin, enum mgos_gpio_pull_type pull);
+bool mgos_gpio_setup_output(int pin, bool level);
+bool mgos_gpio_read(int pin);
+void mgos_gpio_write(int pin, bool level);
+bool mgos_gpio_toggle(int pin);
+bool mgos_gpio_read_out(int pin);
+bool mgos_gpio_set_int_handler(int pin, enum mgos_gpio_int_mode mode, mgos_gpio_int_handler_f cb, void *arg);
+bool mgos_gpio_set_int_handler_isr(int pin, enum mgos_gpio_int_mode mode, mgos_gpio_int_handler_f cb, void *arg);
+bool mgos_gpio_enable_int(int pin);
+bool mgos_gpio_disable_int(int pin);
+void mgos_gpio_clear_int(int pin);
+bool mgos_pwm_set(int pin, int freq, float duty);
+
+/* rpc */
+struct mg_rpc {
+  int unused;
+};
+struct mg_rpc_request_info {
+  struct mg_rpc *rpc;
+  struct mg_str id;
+  struct mg_str src;
+  struct mg_str tag;
+  struct mg_str method;
+  const char *args_fmt;
+};
+struct mg_rpc_frame_info {
+  const char *channel_type;
+};
+struct mg_rpc_call_opts {
+  struct mg_str dst;
+  struct mg_str tag;
+};
+typedef void (*mg_handler_cb_t)(struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi,
+                                struct mg_str args);
+typedef void (*mg_result_cb_t)(struct mg_rpc *c, void *cb_arg, struct mg_rpc_frame_info *fi, struct mg_str result,
+                               int error_code, struct mg_str error_msg);
+struct mg_rpc *mgos_rpc_get_global(void);
+void mg_rpc_add_handler(struct mg_rpc *c, const char *method, const char *args_fmt, mg_handler_cb_t cb,
+                        void *cb_arg);
+bool mg_rpc_send_responsef(struct mg_rpc_request_info *ri, const char *result_json_fmt, ...);
+bool mg_rpc_send_errorf(struct mg_rpc_request_info *ri, int error_code, const char *error_msg_fmt, ...);
+bool mg_rpc_callf(struct mg_rpc *c, const struct mg_str method, mg_result_cb_t cb, void *cb_arg,
+                  const struct mg_rpc_call_opts *opts, const char *args_jsonf, ...);
+
+/* prometheus, crontab, dash, location */
+enum mgos_prometheus_metrics_type_t { COUNTER, GAUGE, HISTOGRAM, SUMMARY, UNTYPED };
+typedef void (*mgos_prometheus_metrics_fn_t)(struct mg_connection *nc, void *user_data);
+void mgos_prometheus_metrics_add_handler(mgos_prometheus_metrics_fn_t handler, void *user_data);
+void mgos_prometheus_metrics_printf(struct mg_connection *nc, enum mgos_prometheus_metrics_type_t type,
+                                    const char *name, const char *descr, const char *fmt, ...);
+
+typedef void (*mgos_crontab_cb)(struct mg_str action, struct mg_str payload, void *userdata);
+void mgos_crontab_register_handler(struct mg_str action, mgos_crontab_cb cb, void *userdata);
+
+void mgos_dash_notifyf(const char *name, const char *json_fmt, ...);
+
+struct mgos_location_lat_lon {
+  double lat;
+  double lon;
+};
+bool mgos_location_get(struct mgos_location_lat_lon *loc);
+
+/* mqtt */
+typedef void (*sub_handler_t)(struct mg_connection *nc, const char *topic, int topic_len, const char *msg,
+                              int msg_len, void *ud);
+void mgos_mqtt_sub(const char *topic, sub_handler_t handler, void *ud);
+bool mgos_mqtt_pub(const char *topic, const void *message, size_t len, int qos, bool retain);
+bool mgos_mqtt_pubf(const char *topic, int qos, bool retain, const char *json_fmt, ...);
+bool mgos_mqtt_global_is_connected(void);
+
+/* i2c and devices */
+struct mgos_i2c;
+struct mgos_i2c *mgos_i2c_get_global(void);
+int mgos_i2c_read_reg_w(struct mgos_i2c *conn, uint16_t addr, uint8_t reg);
+bool mgos_i2c_write_reg_w(struct mgos_i2c *conn, uint16_t addr, uint8_t reg, uint16_t value);
+
+enum mgos_ads1x1x_type { ADC_ADS1013, ADC_ADS1014, ADC_ADS1015, ADC_ADS1113, ADC_ADS1114, ADC_ADS1115 };
+enum mgos_ads1x1x_fsr {
+  MGOS_ADS1X1X_FSR_6144,
+  MGOS_ADS1X1X_FSR_4096,
+  MGOS_ADS1X1X_FSR_2048,
+  MGOS_ADS1X1X_FSR_1024,
+  MGOS_ADS1X1X_FSR_512,
+  MGOS_ADS1X1X_FSR_256
+};
+enum mgos_ads1x1x_dr {
+  MGOS_ADS1X1X_SPS_MIN,
+  MGOS_ADS1X1X_SPS_8,
+  MGOS_ADS1X1X_SPS_16,
+  MGOS_ADS1X1X_SPS_32,
+  MGOS_ADS1X1X_SPS_64,
+  MGOS_ADS1X1X_SPS_128,
+  MGOS_ADS1X1X_SPS_250,
+  MGOS_ADS1X1X_SPS_475,
+  MGOS_ADS1X1X_SPS_860,
+  MGOS_ADS1X1X_SPS_MAX
+};
+struct mgos_ads1x1x;
+struct mgos_ads1x1x *mgos_ads1x1x_create(struct mgos_i2c *i2c, uint8_t i2caddr, enum mgos_ads1x1x_type type);
+bool mgos_ads1x1x_set_fsr(struct mgos_ads1x1x *dev, enum mgos_ads1x1x_fsr fsr);
+bool mgos_ads1x1x_set_dr(struct mgos_ads1x1x *dev, enum mgos_ads1x1x_dr dr);
+bool mgos_ads1x1x_read(struct mgos_ads1x1x *dev, uint8_t chan, int16_t *result);
+bool mgos_ads1x1x_read_diff(struct mgos_ads1x1x *dev, uint8_t chanP, uint8_t chanN, int16_t *result);
+
+struct mgos_ina219;
+struct mgos_ina219 *mgos_ina219_create(struct mgos_i2c *i2c, uint8_t i2caddr);
+bool mgos_ina219_set_shunt_resistance(struct mgos_ina219 *sensor, float ohms);
+bool mgos_ina219_get_shunt_resistance(struct mgos_ina219 *sensor, float *ohms);
+bool mgos_ina219_get_bus_voltage(struct mgos_ina219 *sensor, float *volts);
+bool mgos_ina219_get_shunt_voltage(struct mgos_ina219 *sensor, float *volts);
+bool mgos_ina219_get_current(struct mgos_ina219 *sensor, float *ampere);
+
+/* uart */
+enum mgos_uart_parity { MGOS_UART_PARITY_NONE, MGOS_UART_PARITY_EVEN, MGOS_UART_PARITY_ODD };
+enum mgos_uart_stop_bits { MGOS_UART_STOP_BITS_1 = 1, MGOS_UART_STOP_BITS_2, MGOS_UART_STOP_BITS_1_5 };
+struct mgos_uart_config {
+  int baud_rate;
+  int num_data_bits;
+  enum mgos_uart_parity parity;
+  enum mgos_uart_stop_bits stop_bits;
+  int rx_buf_size;
+  int tx_buf_size;
+  struct {
+    int rx_gpio;
+    int tx_gpio;
+    bool hd;
+  } dev;
+};
+typedef void (*mgos_uart_dispatcher_t)(int uart_no, void *arg);
+void mgos_uart_config_set_defaults(int uart_no, struct mgos_uart_config *cfg);
+bool mgos_uart_configure(int uart_no, const struct mgos_uart_config *cfg);
+size_t mgos_uart_read_avail(int uart_no);
+size_t mgos_uart_read(int uart_no, void *buf, size_t len);
+size_t mgos_uart_read_mbuf(int uart_no, struct mbuf *mb, size_t len);
+size_t mgos_uart_write(int uart_no, const void *buf, size_t len);
+void mgos_uart_flush(int uart_no);
+void mgos_uart_set_dispatcher(int uart_no, mgos_uart_dispatcher_t cb, void *arg);
+void mgos_uart_set_rx_enabled(int uart_no, bool enabled);
+bool mgos_uart_is_rx_enabled(int uart_no);
+
+/* onewire */
+struct mgos_onewire;
+struct mgos_onewire *mgos_onewire_create(int pin);
+bool mgos_onewire_reset(struct mgos_onewire *ow);
+void mgos_onewire_select(struct mgos_onewire *ow, const uint8_t *rom);
+void mgos_onewire_skip(struct mgos_onewire *ow);
+void mgos_onewire_write(struct mgos_onewire *ow, const uint8_t data);
+void mgos_onewire_write_bytes(struct mgos_onewire *ow, const uint8_t *buf, uint16_t len);
+uint8_t mgos_onewire_read(struct mgos_onewire *ow);
+void mgos_onewire_read_bytes(struct mgos_onewire *ow, uint8_t *buf, uint16_t len);
+bool mgos_onewire_read_bit(struct mgos_onewire *ow);
+bool mgos_onewire_next(struct mgos_onewire *ow, uint8_t *rom, int mode);
+void mgos_onewire_search_clean(struct mgos_onewire *ow);
+uint8_t mgos_onewire_crc8(const uint8_t *rom, int len);
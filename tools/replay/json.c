@@ -0,0 +1,499 @@
+/*
+ * Subset of frozen's json_scanf/json_printf semantics the firmware relies on:
+ * templates with bare keys, %B %Q %M %T and scanf/printf conversions.
+ */
+
+#include "mgos_host.h"
+
+#include <ctype.h>
+
+static const char *json_skip_ws(const char *p, const char *end) {
+  while(p < end && isspace((unsigned char) *p)) {
+    p++;
+  }
+  return p;
+}
+
+static const char *json_skip_string(const char *p, const char *end) {
+  for(p++; p < end && *p != '"'; p++) {
+    if(*p == '\\') {
+      p++;
+    }
+  }
+  return (p < end) ? p + 1 : NULL;
+}
+
+// parses the value at p into tok, returns the end of the value or NULL
+static const char *json_parse_value(const char *p, const char *end, struct json_token *tok) {
+  p = json_skip_ws(p, end);
+  if(p >= end) {
+    return NULL;
+  }
+  const char *start = p;
+  if(*p == '"') {
+    const char *e = json_skip_string(p, end);
+    if(e == NULL) {
+      return NULL;
+    }
+    *tok = (struct json_token) { start + 1, (int) (e - start - 2), JSON_TYPE_STRING };
+    return e;
+  }
+  if(*p == '{' || *p == '[') {
+    int depth = 0;
+    for(; p < end; p++) {
+      if(*p == '"') {
+        p = json_skip_string(p, end);
+        if(p == NULL) {
+          return NULL;
+        }
+        p--;
+      } else if(*p == '{' || *p == '[') {
+        depth++;
+      } else if(*p == '}' || *p == ']') {
+        if(--depth == 0) {
+          p++;
+          break;
+        }
+      }
+    }
+    if(depth != 0) {
+      return NULL;
+    }
+    *tok = (struct json_token) { start, (int) (p - start),
+                                 (*start == '{') ? JSON_TYPE_OBJECT_END : JSON_TYPE_ARRAY_END };
+    return p;
+  }
+  while(p < end && !strchr(",}] \t\r\n", *p)) {
+    p++;
+  }
+  enum json_token_type type = JSON_TYPE_NUMBER;
+  if(p - start == 4 && strncmp(start, "true", 4) == 0) {
+    type = JSON_TYPE_TRUE;
+  } else if(p - start == 5 && strncmp(start, "false", 5) == 0) {
+    type = JSON_TYPE_FALSE;
+  } else if(p - start == 4 && strncmp(start, "null", 4) == 0) {
+    type = JSON_TYPE_NULL;
+  }
+  *tok = (struct json_token) { start, (int) (p - start), type };
+  return p;
+}
+
+// finds key in the object tok
+static bool json_find_key(const struct json_token *obj, const char *key, size_t key_len,
+                          struct json_token *tok) {
+  const char *p = obj->ptr + 1, *end = obj->ptr + obj->len - 1;
+  while(true) {
+    p = json_skip_ws(p, end);
+    if(p >= end || *p != '"') {
+      return false;
+    }
+    const char *k = p + 1;
+    p = json_skip_string(p, end);
+    if(p == NULL) {
+      return false;
+    }
+    size_t k_len = p - k - 1;
+    p = json_skip_ws(p, end);
+    if(p >= end || *p != ':') {
+      return false;
+    }
+    p = json_parse_value(p + 1, end, tok);
+    if(p == NULL) {
+      return false;
+    }
+    if(k_len == key_len && strncmp(k, key, key_len) == 0) {
+      return true;
+    }
+    p = json_skip_ws(p, end);
+    if(p < end && *p == ',') {
+      p++;
+    }
+  }
+}
+
+// path is a dotted list of keys, "" for the root value
+static bool json_find_path(const char *s, int len, const char *path, struct json_token *tok) {
+  if(json_parse_value(s, s + len, tok) == NULL) {
+    return false;
+  }
+  while(*path != '\0') {
+    if(*path == '.') {
+      path++;
+    }
+    size_t n = strcspn(path, ".");
+    if(tok->type != JSON_TYPE_OBJECT_END || !json_find_key(tok, path, n, tok)) {
+      return false;
+    }
+    path += n;
+  }
+  return true;
+}
+
+static char *json_unescape(const char *p, int len) {
+  char *s = malloc(len + 1), *d = s;
+  for(int i = 0; i < len; i++) {
+    if(p[i] == '\\' && i + 1 < len) {
+      i++;
+      switch(p[i]) {
+        case 'n': *d++ = '\n'; break;
+        case 't': *d++ = '\t'; break;
+        case 'r': *d++ = '\r'; break;
+        case 'b': *d++ = '\b'; break;
+        case 'f': *d++ = '\f'; break;
+        default: *d++ = p[i]; break;
+      }
+    } else {
+      *d++ = p[i];
+    }
+  }
+  *d = '\0';
+  return s;
+}
+
+int json_vscanf(const char *str, int len, const char *fmt, va_list ap) {
+  char path[256] = "";
+  char key[64] = "";
+  int count = 0;
+  const char *f = fmt;
+  while(*f != '\0') {
+    if(*f == '{') {
+      if(key[0] != '\0') {
+        strncat(path, ".", sizeof(path) - strlen(path) - 1);
+        strncat(path, key, sizeof(path) - strlen(path) - 1);
+      }
+      key[0] = '\0';
+      f++;
+    } else if(*f == '}') {
+      char *dot = strrchr(path, '.');
+      if(dot != NULL) {
+        *dot = '\0';
+      }
+      key[0] = '\0';
+      f++;
+    } else if(*f == '"' || isalpha((unsigned char) *f) || *f == '_') {
+      bool quoted = (*f == '"');
+      if(quoted) {
+        f++;
+      }
+      size_t n = quoted ? strcspn(f, "\"") : strcspn(f, ": \t\r\n");
+      snprintf(key, sizeof(key), "%.*s", (int) n, f);
+      f += n + (quoted ? 1 : 0);
+    } else if(*f == '%') {
+      char spec[16];
+      size_t n = 1;
+      while(f[n] != '\0' && !isalpha((unsigned char) f[n])) {
+        n++;
+      }
+      while(f[n] == 'l' || f[n] == 'h' || f[n] == 'z' || f[n] == 'q') {
+        n++;
+      }
+      n++;
+      snprintf(spec, sizeof(spec), "%.*s", (int) n, f);
+      char conv = f[n - 1];
+      f += n;
+
+      char full[320];
+      snprintf(full, sizeof(full), "%s.%s", path, key);
+      struct json_token tok;
+      bool found = json_find_path(str, len, full, &tok);
+      void *target = va_arg(ap, void *);
+      if(conv == 'M') {
+        void *user_data = va_arg(ap, void *);
+        if(found) {
+          ((json_scanner_t) target)(tok.ptr, tok.len, user_data);
+          count++;
+        }
+        continue;
+      }
+      if(!found) {
+        continue;
+      }
+      switch(conv) {
+        case 'B':
+          if(tok.type == JSON_TYPE_TRUE || tok.type == JSON_TYPE_FALSE) {
+            *(bool *) target = (tok.type == JSON_TYPE_TRUE);
+            count++;
+          }
+          break;
+        case 'Q':
+          *(char **) target = (tok.type == JSON_TYPE_NULL) ? NULL : json_unescape(tok.ptr, tok.len);
+          count++;
+          break;
+        case 'T':
+          *(struct json_token *) target = tok;
+          count++;
+          break;
+        default: {
+          char value[64];
+          snprintf(value, sizeof(value), "%.*s", tok.len, tok.ptr);
+          if(sscanf(value, spec, target) == 1) {
+            count++;
+          }
+          break;
+        }
+      }
+    } else {
+      if(*f == ',') {
+        key[0] = '\0';
+      }
+      f++;
+    }
+  }
+  return count;
+}
+
+int json_scanf(const char *str, int len, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int count = json_vscanf(str, len, fmt, ap);
+  va_end(ap);
+  return count;
+}
+
+int json_scanf_array_elem(const char *s, int len, const char *path, int index, struct json_token *token) {
+  struct json_token arr;
+  if(!json_find_path(s, len, path, &arr) || arr.type != JSON_TYPE_ARRAY_END) {
+    return -1;
+  }
+  const char *p = arr.ptr + 1, *end = arr.ptr + arr.len - 1;
+  for(int i = 0; i <= index; i++) {
+    p = json_skip_ws(p, end);
+    if(p >= end) {
+      return -1;
+    }
+    p = json_parse_value(p, end, token);
+    if(p == NULL) {
+      return -1;
+    }
+    p = json_skip_ws(p, end);
+    if(p < end && *p == ',') {
+      p++;
+    }
+  }
+  return token->len;
+}
+
+int json_printer_buf(struct json_out *out, const char *buf, size_t len) {
+  size_t avail = out->u.buf.size - out->u.buf.len;
+  size_t n = (len < avail) ? len : avail;
+  memcpy(out->u.buf.buf + out->u.buf.len, buf, n);
+  out->u.buf.len += n;
+  if(out->u.buf.size > 0) {
+    size_t idx = (out->u.buf.len < out->u.buf.size) ? out->u.buf.len : out->u.buf.size - 1;
+    out->u.buf.buf[idx] = '\0';
+  }
+  return len;
+}
+
+int json_printer_file(struct json_out *out, const char *buf, size_t len) {
+  return fwrite(buf, 1, len, (FILE *) out->u.buf.buf);
+}
+
+int json_printer_mbuf(struct json_out *out, const char *buf, size_t len) {
+  mbuf_append((struct mbuf *) out->u.buf.buf, buf, len);
+  return len;
+}
+
+static int json_print_quoted(struct json_out *out, const char *s, size_t n) {
+  int len = out->printer(out, "\"", 1);
+  for(size_t i = 0; i < n; i++) {
+    const char *esc = NULL;
+    switch(s[i]) {
+      case '"': esc = "\\\""; break;
+      case '\\': esc = "\\\\"; break;
+      case '\n': esc = "\\n"; break;
+      case '\r': esc = "\\r"; break;
+      case '\t': esc = "\\t"; break;
+    }
+    len += (esc != NULL) ? out->printer(out, esc, 2) : out->printer(out, s + i, 1);
+  }
+  return len + out->printer(out, "\"", 1);
+}
+
+// prints a single printf conversion, consuming its arguments from ap
+static int json_print_conversion(struct json_out *out, const char *spec, size_t n, va_list *ap) {
+  char f[24];
+  snprintf(f, sizeof(f), "%.*s", (int) n, spec);
+  char conv = f[n - 1];
+  int stars[2], num_stars = 0;
+  for(const char *p = f; *p != '\0'; p++) {
+    if(*p == '*' && num_stars < 2) {
+      stars[num_stars++] = va_arg(*ap, int);
+    }
+  }
+  bool ll = strstr(f, "ll") != NULL || strchr(f, 'q') != NULL || strchr(f, 'j') != NULL;
+  bool l = !ll && strchr(f, 'l') != NULL;
+  bool z = strchr(f, 'z') != NULL || strchr(f, 't') != NULL;
+  char buf[512];
+  int len = 0;
+#define JSON_PRINT_ARG(type)                                                                    \
+  do {                                                                                          \
+    type v = va_arg(*ap, type);                                                                 \
+    if(num_stars == 2) len = snprintf(buf, sizeof(buf), f, stars[0], stars[1], v);              \
+    else if(num_stars == 1) len = snprintf(buf, sizeof(buf), f, stars[0], v);                   \
+    else len = snprintf(buf, sizeof(buf), f, v);                                                \
+  } while(0)
+  switch(conv) {
+    case 'd':
+    case 'i':
+    case 'c':
+      if(ll) JSON_PRINT_ARG(long long);
+      else if(l) JSON_PRINT_ARG(long);
+      else if(z) JSON_PRINT_ARG(ssize_t);
+      else JSON_PRINT_ARG(int);
+      break;
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'o':
+      if(ll) JSON_PRINT_ARG(unsigned long long);
+      else if(l) JSON_PRINT_ARG(unsigned long);
+      else if(z) JSON_PRINT_ARG(size_t);
+      else JSON_PRINT_ARG(unsigned int);
+      break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+      JSON_PRINT_ARG(double);
+      break;
+    case 's':
+      JSON_PRINT_ARG(const char *);
+      break;
+    case 'p':
+      JSON_PRINT_ARG(void *);
+      break;
+    default:
+      len = snprintf(buf, sizeof(buf), "%s", f);
+      break;
+  }
+#undef JSON_PRINT_ARG
+  if(len < 0) {
+    return 0;
+  }
+  return out->printer(out, buf, ((size_t) len < sizeof(buf)) ? (size_t) len : sizeof(buf) - 1);
+}
+
+static int json_vprintf_ap(struct json_out *out, const char *fmt, va_list *ap) {
+  int len = 0;
+  const char *f = fmt;
+  while(*f != '\0') {
+    if(strchr(":, \r\n\t[]{}\"", *f) != NULL) {
+      len += out->printer(out, f, 1);
+      f++;
+    } else if(*f == '%') {
+      if(f[1] == '%') {
+        len += out->printer(out, "%", 1);
+        f += 2;
+      } else if(f[1] == 'B') {
+        bool b = va_arg(*ap, int);
+        len += b ? out->printer(out, "true", 4) : out->printer(out, "false", 5);
+        f += 2;
+      } else if(f[1] == 'Q' || strncmp(f, "%.*Q", 4) == 0) {
+        int n = -1;
+        if(f[1] == '.') {
+          n = va_arg(*ap, int);
+          f += 4;
+        } else {
+          f += 2;
+        }
+        const char *s = va_arg(*ap, const char *);
+        if(s == NULL) {
+          len += out->printer(out, "null", 4);
+        } else {
+          len += json_print_quoted(out, s, (n < 0) ? strlen(s) : (size_t) n);
+        }
+      } else if(f[1] == 'M') {
+        json_printf_callback_t cb = va_arg(*ap, json_printf_callback_t);
+        len += cb(out, ap);
+        f += 2;
+      } else {
+        size_t n = 1;
+        while(f[n] != '\0' && strchr("-+ #0123456789.*hlLqjzt", f[n]) != NULL) {
+          n++;
+        }
+        if(f[n] == '\0') {
+          break;
+        }
+        n++;
+        len += json_print_conversion(out, f, n, ap);
+        f += n;
+      }
+    } else {
+      // bare words become quoted keys or strings
+      size_t n = strcspn(f, ":, \r\n\t[]{}\"%");
+      len += out->printer(out, "\"", 1);
+      len += out->printer(out, f, n);
+      len += out->printer(out, "\"", 1);
+      f += n;
+    }
+  }
+  return len;
+}
+
+int json_vprintf(struct json_out *out, const char *fmt, va_list ap) {
+  va_list cp;
+  va_copy(cp, ap);
+  int len = json_vprintf_ap(out, fmt, &cp);
+  va_end(cp);
+  return len;
+}
+
+int json_printf(struct json_out *out, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int len = json_vprintf(out, fmt, ap);
+  va_end(ap);
+  return len;
+}
+
+char *json_vasprintf(const char *fmt, va_list ap) {
+  struct mbuf mb;
+  mbuf_init(&mb, 64);
+  struct json_out out = JSON_OUT_MBUF(&mb);
+  json_vprintf(&out, fmt, ap);
+  mbuf_append(&mb, "", 1);
+  return mb.buf;
+}
+
+char *json_asprintf(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  char *s = json_vasprintf(fmt, ap);
+  va_end(ap);
+  return s;
+}
+
+int json_fprintf(const char *file_name, const char *fmt, ...) {
+  FILE *fp = fopen(file_name, "wb");
+  if(fp == NULL) {
+    return -1;
+  }
+  struct json_out out = JSON_OUT_FILE(fp);
+  va_list ap;
+  va_start(ap, fmt);
+  int len = json_vprintf(&out, fmt, ap);
+  va_end(ap);
+  fputc('\n', fp);
+  fclose(fp);
+  return len;
+}
+
+char *json_fread(const char *file_name) {
+  FILE *fp = fopen(file_name, "rb");
+  if(fp == NULL) {
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *data = malloc(size + 1);
+  if(data != NULL) {
+    size_t n = fread(data, 1, size, fp);
+    data[n] = '\0';
+  }
+  fclose(fp);
+  return data;
+}
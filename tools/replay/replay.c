@@ -0,0 +1,439 @@
+/*
+ * Replays a trace recorded with record.enable through the firmware on a
+ * virtual clock and reports the outcome, to compare settings offline.
+ */
+
+#include "host.h"
+
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "power.h"
+#include "record.h"
+
+struct event {
+  double uptime;
+  double time;
+  char type;
+  char key[128];
+  const char *data;
+  size_t len;
+};
+
+struct decision {
+  char key[16];
+  char data[64];
+};
+
+static struct event *events = NULL;
+static int event_count = 0;
+
+static struct decision *recorded = NULL, *replayed = NULL;
+static int recorded_count = 0, replayed_count = 0;
+
+static bool print_decisions = false;
+static bool counterfactual = false;
+
+// actuators as recorded, to shift meter readings by what the replay does differently
+static float recorded_in = 0, recorded_out = 0;
+
+static struct {
+  double last_time;
+  float last_power;
+  double import_wh;
+  double export_wh;
+  double tracking_error_ws;
+  double duration;
+  int readings;
+} meter;
+
+static int switches = 0;
+static int unmatched = 0;
+static int reboots = 0;
+
+static void usage() {
+  fprintf(stderr,
+          "usage: replay [options] trace...\n"
+          "  -m model      apply the conds of build_vars.MODEL\n"
+          "  -c key=value  override a config value, repeatable\n"
+          "  -p device     emulate ads1115, ina219 or onewire, default from the trace\n"
+          "  -x            shift meter readings by the replayed power in/out (what-if)\n"
+          "  -d            print decisions\n"
+          "  -M            print metrics at the end\n"
+          "  -w dir        working directory for files, default a new temp dir\n"
+          "  -o file       record the replay to file\n"
+          "  -v            log more, repeatable\n");
+  exit(2);
+}
+
+static char *read_file(const char *path, size_t *len) {
+  FILE *fp = fopen(path, "rb");
+  if(fp == NULL) {
+    perror(path);
+    exit(1);
+  }
+  struct mbuf mb;
+  mbuf_init(&mb, 4096);
+  char buf[4096];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    mbuf_append(&mb, buf, n);
+  }
+  fclose(fp);
+  *len = mb.len;
+  return mb.buf;
+}
+
+static void parse_trace(const char *path) {
+  size_t len;
+  const char *p = read_file(path, &len);
+  const char *end = p + len;
+  while(p < end) {
+    struct event ev;
+    unsigned data_len;
+    int n = 0;
+    if(sscanf(p, "%lf %lf %c %127s %u:%n", &ev.uptime, &ev.time, &ev.type, ev.key, &data_len, &n) != 5 ||
+       n == 0 || p + n + data_len > end) {
+      fprintf(stderr, "%s: invalid event at byte %ld, skipping rest\n", path, (long) (len - (end - p)));
+      return;
+    }
+    ev.data = p + n;
+    ev.len = data_len;
+    p += n + data_len;
+    if(p < end && *p == '\n') {
+      p++;
+    }
+    events = realloc(events, (event_count + 1) * sizeof(*events));
+    events[event_count++] = ev;
+  }
+}
+
+static void add_decision(struct decision **list, int *count, const char *key, const char *data, size_t len) {
+  *list = realloc(*list, (*count + 1) * sizeof(**list));
+  struct decision *d = &(*list)[(*count)++];
+  snprintf(d->key, sizeof(d->key), "%s", key);
+  snprintf(d->data, sizeof(d->data), "%.*s", (int) len, data);
+}
+
+static void decision_listener(double uptime, double time, record_type_t type, const char *key, const char *data,
+                              size_t len, void *arg) {
+  if(type != record_decision) {
+    return;
+  }
+  if(strcmp(key, "state") == 0 && (replayed_count == 0 || strcmp(replayed[replayed_count - 1].key, "state") != 0 ||
+                                   strncmp(replayed[replayed_count - 1].data, data, len) != 0)) {
+    switches++;
+  }
+  add_decision(&replayed, &replayed_count, key, data, len);
+  if(print_decisions) {
+    printf("%.3f %.3f %s %.*s\n", uptime, time, key, (int) len, data);
+  }
+  (void) arg;
+}
+
+static void meter_update(double time, float power) {
+  if(meter.last_time > 0 && time > meter.last_time) {
+    double dt = time - meter.last_time;
+    float p = meter.last_power;
+    if(p > 0) {
+      meter.import_wh += p * dt / 3600.0;
+    } else {
+      meter.export_wh -= p * dt / 3600.0;
+    }
+    float min = power_get_optimize_target_min(), max = power_get_optimize_target_max();
+    float error = (p < min) ? min - p : (p > max) ? p - max : 0;
+    meter.tracking_error_ws += error * dt;
+    meter.duration += dt;
+  }
+  meter.last_time = time;
+  meter.last_power = power;
+  meter.readings++;
+}
+
+// difference in total power caused by the replay acting differently
+static float meter_shift() {
+  return (power_get_power_in() - recorded_in) - (power_get_power_out() - recorded_out);
+}
+
+static void dispatch_http(const struct event *ev) {
+  long long t;
+  int power;
+  const char *data = ev->data;
+  size_t len = ev->len;
+  char body[128];
+  bool is_meter = json_scanf(ev->data, ev->len, "{time: %lld, values: {power: %d}}", &t, &power) == 2;
+  if(is_meter && counterfactual) {
+    power += (int) (meter_shift() * 1000);
+    len = snprintf(body, sizeof(body), "{\"time\":%lld,\"values\":{\"power\":%d}}", t, power);
+    data = body;
+  }
+  if(!host_http_reply(ev->key, data, len)) {
+    unmatched++;
+  }
+  if(is_meter) {
+    meter_update(ev->time, power / 1000.0f);
+  }
+}
+
+static void dispatch_mqtt(const struct event *ev) {
+  const char *command = mgos_sys_config_get_mqtt_bridge_command_topic();
+  bool is_meter = command == NULL || strcmp(ev->key, command) != 0;
+  char msg[128];
+  snprintf(msg, sizeof(msg), "%.*s", (int) ev->len, ev->data);
+  // a number or {power: W, time: t}
+  float power = 0;
+  double time = 0;
+  bool is_json = strchr(msg, '{') != NULL;
+  if(is_json) {
+    json_scanf(msg, strlen(msg), "{power: %f, time: %lf}", &power, &time);
+  } else {
+    power = strtof(msg, NULL);
+  }
+  size_t len = ev->len;
+  const char *data = ev->data;
+  if(is_meter && counterfactual) {
+    power += meter_shift();
+    if(is_json) {
+      len = snprintf(msg, sizeof(msg), "{\"power\": %f, \"time\": %.3f}", power, time);
+    } else {
+      len = snprintf(msg, sizeof(msg), "%f", power);
+    }
+    data = msg;
+  }
+  if(!host_mqtt_message(ev->key, data, len)) {
+    unmatched++;
+  }
+  if(is_meter) {
+    meter_update(ev->time, power);
+  }
+}
+
+static void dispatch(const struct event *ev) {
+  bool ok = true;
+  switch(ev->type) {
+    case record_boot:
+      if(ev != &events[0]) {
+        reboots++;
+      }
+      break;
+    case record_event:
+      ok = host_event(ev->key);
+      break;
+    case record_http:
+      dispatch_http(ev);
+      break;
+    case record_mqtt:
+      dispatch_mqtt(ev);
+      break;
+    case record_rpc:
+      ok = host_rpc_request(ev->key, ev->data, ev->len);
+      break;
+    case record_rpc_result:
+      ok = host_rpc_result(ev->key, ev->data, ev->len);
+      break;
+    case record_crontab:
+      ok = host_crontab(ev->key, ev->data, ev->len);
+      break;
+    case record_uart:
+      ok = host_uart_rx(atoi(ev->key), ev->data, ev->len);
+      break;
+    case record_decision: {
+      add_decision(&recorded, &recorded_count, ev->key, ev->data, ev->len);
+      // target, actual and result of a power change
+      char data[64];
+      float target, actual;
+      snprintf(data, sizeof(data), "%.*s", (int) ev->len, ev->data);
+      if(sscanf(data, "%f %f", &target, &actual) == 2) {
+        if(strcmp(ev->key, "in") == 0) {
+          recorded_in = actual;
+        } else if(strcmp(ev->key, "out") == 0) {
+          recorded_out = actual;
+        }
+      }
+      break;
+    }
+    default:
+      ok = false;
+      break;
+  }
+  if(!ok) {
+    unmatched++;
+    LOG(LL_WARN, ("Unmatched event %c %s", ev->type, ev->key));
+  }
+}
+
+static void detect_devices() {
+  for(int i = 0; i < event_count; i++) {
+    if(events[i].type != record_sensor) {
+      continue;
+    }
+    if(strncmp(events[i].key, "ads1115.", 8) == 0) {
+      host_set_present("ads1115", true);
+    } else if(strncmp(events[i].key, "ina219.", 7) == 0) {
+      host_set_present("ina219", true);
+    } else if(strcmp(events[i].key, "onewire") == 0) {
+      host_set_present("onewire", true);
+    }
+  }
+}
+
+static int compare_decisions() {
+  int mismatches = abs(recorded_count - replayed_count);
+  int n = (recorded_count < replayed_count) ? recorded_count : replayed_count;
+  int first = (recorded_count != replayed_count) ? n : -1;
+  for(int i = 0; i < n; i++) {
+    if(strcmp(recorded[i].key, replayed[i].key) != 0 || strcmp(recorded[i].data, replayed[i].data) != 0) {
+      mismatches++;
+      if(first == -1 || i < first) {
+        first = i;
+      }
+    }
+  }
+  if(first >= 0 && first < n) {
+    fprintf(stderr, "first mismatch at decision %d: recorded %s %s, replayed %s %s\n", first, recorded[first].key,
+            recorded[first].data, replayed[first].key, replayed[first].data);
+  }
+  return mismatches;
+}
+
+int main(int argc, char **argv) {
+  const char *model = NULL, *workdir = NULL, *output = NULL;
+  const char *overrides[64];
+  const char *devices[8];
+  int override_count = 0, device_count = 0;
+  bool print_metrics = false;
+  int opt;
+  while((opt = getopt(argc, argv, "m:c:p:xdMw:o:v")) != -1) {
+    switch(opt) {
+      case 'm': model = optarg; break;
+      case 'c': if(override_count < 64) overrides[override_count++] = optarg; break;
+      case 'p': if(device_count < 8) devices[device_count++] = optarg; break;
+      case 'x': counterfactual = true; break;
+      case 'd': print_decisions = true; break;
+      case 'M': print_metrics = true; break;
+      case 'w': workdir = optarg; break;
+      case 'o': output = optarg; break;
+      case 'v': cs_log_level++; break;
+      default: usage();
+    }
+  }
+  if(optind >= argc) {
+    usage();
+  }
+  for(int i = optind; i < argc; i++) {
+    parse_trace(argv[i]);
+  }
+  if(event_count == 0) {
+    fprintf(stderr, "no events\n");
+    return 1;
+  }
+
+  mgos_config_set_defaults();
+  if(model != NULL && !mgos_config_apply_model(model)) {
+    fprintf(stderr, "unknown model %s\n", model);
+    return 2;
+  }
+  mgos_config_set("record.enable", "false");
+  char output_path[PATH_MAX];
+  if(output != NULL) {
+    if(realpath(".", output_path) == NULL) {
+      return 1;
+    }
+    if(output[0] == '/') {
+      snprintf(output_path, sizeof(output_path), "%s", output);
+    } else {
+      strncat(output_path, "/", sizeof(output_path) - strlen(output_path) - 1);
+      strncat(output_path, output, sizeof(output_path) - strlen(output_path) - 1);
+    }
+    remove(output_path);
+    mgos_config_set("record.enable", "true");
+    mgos_config_set("record.file", output_path);
+    mgos_config_set("record.max_size", "2147483647");
+    mgos_config_set("record.buffer_max", "2147483647");
+  }
+  for(int i = 0; i < override_count; i++) {
+    char key[128];
+    const char *eq = strchr(overrides[i], '=');
+    if(eq == NULL) {
+      usage();
+    }
+    snprintf(key, sizeof(key), "%.*s", (int) (eq - overrides[i]), overrides[i]);
+    if(!mgos_config_set(key, eq + 1)) {
+      fprintf(stderr, "unknown config key %s\n", key);
+      return 2;
+    }
+  }
+
+  // same local time as the device, e.g. for price windows
+  const char *tz = mgos_sys_config_get_sys_tz_spec();
+  setenv("TZ", (tz != NULL && tz[0] == '\'') ? tz + 1 : (tz ? tz : "UTC"), 1);
+  tzset();
+
+  char tmp[] = "/tmp/replay.XXXXXX";
+  if(workdir == NULL && (workdir = mkdtemp(tmp)) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  if(chdir(workdir) != 0) {
+    perror(workdir);
+    return 1;
+  }
+
+  detect_devices();
+  for(int i = 0; i < device_count; i++) {
+    host_set_present(devices[i], true);
+  }
+
+  host_set_time(events[0].uptime, events[0].time);
+  record_set_listener(decision_listener, NULL);
+  mgos_app_init();
+
+  int queued = 0;
+  for(int i = 0; i < event_count; i++) {
+    const struct event *ev = &events[i];
+    if(ev->type == record_sensor) {
+      // read by the timer firing at the time it was recorded, not by earlier ones
+      if(i >= queued) {
+        host_advance(ev->uptime - 0.0005);
+        for(queued = i; queued < event_count && events[queued].type == record_sensor &&
+            events[queued].uptime <= ev->uptime; queued++) {
+          host_sensor_queue(events[queued].key, events[queued].data, events[queued].len);
+        }
+      }
+      host_advance(ev->uptime);
+      host_set_time(ev->uptime, ev->time);
+      continue;
+    }
+    host_advance(ev->uptime);
+    host_set_time(ev->uptime, ev->time);
+    host_sensor_settle();
+    // reads done while handling the event are recorded right after it
+    for(queued = i + 1; queued < event_count && events[queued].type == record_sensor &&
+        events[queued].uptime <= ev->uptime; queued++) {
+      host_sensor_queue(events[queued].key, events[queued].data, events[queued].len);
+    }
+    dispatch(ev);
+  }
+  record_flush();
+
+  int mismatches = compare_decisions();
+  printf("events %d\n", event_count);
+  printf("unmatched_events %d\n", unmatched);
+  printf("reboots %d\n", reboots);
+  printf("timers_fired %d\n", host_timers_fired());
+  printf("duration_s %.1f\n", events[event_count - 1].uptime - events[0].uptime);
+  printf("meter_readings %d\n", meter.readings);
+  printf("import_wh %.3f\n", meter.import_wh);
+  printf("export_wh %.3f\n", meter.export_wh);
+  printf("tracking_error_w %.3f\n", (meter.duration > 0) ? meter.tracking_error_ws / meter.duration : 0);
+  printf("switches %d\n", switches);
+  printf("decisions %d\n", replayed_count);
+  printf("decisions_recorded %d\n", recorded_count);
+  printf("decision_mismatches %d\n", mismatches);
+  if(print_metrics) {
+    host_print_metrics(stdout);
+  }
+  return 0;
+}